@@ -7,52 +7,154 @@
 #include <linux/module.h>
 
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/cpumask.h>
 #include <linux/time.h>
-#include <linux/smp_lock.h>
+#include <linux/timekeeping.h>
 #include <linux/types.h>
 #include <linux/errno.h>
 #include <linux/miscdevice.h>
 #include <linux/proc_fs.h>
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/eventfd.h>
+#include <linux/version.h>
 
-#include <asm/system.h>
+#include "backfire.h"
 
 #define BACKFIRE_MINOR MISC_DYNAMIC_MINOR
 
-static spinlock_t backfire_state_lock = SPIN_LOCK_UNLOCKED;
+static DEFINE_SPINLOCK(backfire_state_lock);
+static DEFINE_SPINLOCK(backfire_ctx_lock); /* eventfd in file->private_data */
 static int backfire_open_cnt; /* #times opened */
 static int backfire_open_mode; /* special open modes */
-static struct timeval sendtime; /* when the most recent signal was sent */
+static struct timespec64 sendtime; /* when the most recent signal was sent */
+static struct backfire_page *backfire_page; /* mmap()ed by the callers */
 #define BACKFIRE_WRITE 1 /* opened for writing (exclusive) */
 #define BACKFIRE_EXCL 2 /* opened with O_EXCL */
 
+/*
+ * The caller may already poll the page, so the timestamp has to be
+ * visible before the new count.
+ */
+static void backfire_stamp(void)
+{
+	backfire_page->fire_ns = ktime_get_ns();
+	smp_wmb();
+	WRITE_ONCE(backfire_page->count, backfire_page->count + 1);
+}
+
+static void backfire_eventfd(struct eventfd_ctx *ctx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
 /*
  * These are the file operation function for user access to /dev/backfire
  */
 static ssize_t
-backfire_read(struct file *file, char *buf, size_t count, loff_t *ppos)
+backfire_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
-	return snprintf(buf, count, "%d,%d\n", (int) sendtime.tv_sec,
-		(int) sendtime.tv_usec);
+	char tmp[32];
+	int len;
+
+	len = snprintf(tmp, sizeof(tmp), "%d,%d\n", (int) sendtime.tv_sec,
+		(int) (sendtime.tv_nsec / NSEC_PER_USEC));
+	if (len > count)
+		len = count;
+	if (copy_to_user(buf, tmp, len))
+		return -EFAULT;
+	return len;
 }
 
 static ssize_t
-backfire_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
+backfire_write(struct file *file, const char __user *buf, size_t count,
+	       loff_t *ppos)
 {
+	struct eventfd_ctx *ctx;
+	char cmd[16];
+	size_t len = min(count, sizeof(cmd) - 1);
 	int signo;
-	struct pid *pid;
 
-	if (sscanf(buf, "%d", &signo) >= 1) {
+	if (copy_from_user(cmd, buf, len))
+		return -EFAULT;
+	cmd[len] = '\0';
+
+	if (cmd[0] == BACKFIRE_CMD_MMAP) {
+		backfire_stamp();
+	} else if (cmd[0] == BACKFIRE_CMD_EVENTFD) {
+		/* the ioctl may replace and put the context meanwhile */
+		spin_lock(&backfire_ctx_lock);
+		ctx = file->private_data;
+		if (ctx) {
+			backfire_stamp();
+			backfire_eventfd(ctx);
+		}
+		spin_unlock(&backfire_ctx_lock);
+		if (!ctx)
+			return -EINVAL;
+	} else if (sscanf(cmd, "%d", &signo) >= 1) {
 		if (signo > 0 && signo < 32) {
-			pid = get_pid(task_pid(current));
-			do_gettimeofday(&sendtime);
-			kill_pid(pid, signo, 1);
+			ktime_get_real_ts64(&sendtime);
+			backfire_stamp();
+			kill_pid(task_pid(current), signo, 1);
 		} else
 			printk(KERN_ERR "Invalid signal no. %d\n", signo);
 	}
-	return strlen(buf);
+	return count;
+}
+
+static long
+backfire_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	int fd;
+
+	if (cmd != BACKFIRE_SET_EVENTFD)
+		return -ENOTTY;
+	if (get_user(fd, (int __user *) arg))
+		return -EFAULT;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock(&backfire_ctx_lock);
+	old = file->private_data;
+	file->private_data = ctx;
+	spin_unlock(&backfire_ctx_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/* The page is read-only for user space, it is written by the driver */
+static int
+backfire_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	/* or mprotect() could make the mapping writable later */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(backfire_page) >> PAGE_SHIFT,
+			       PAGE_SIZE, vma->vm_page_prot);
 }
 
 static int
@@ -74,12 +176,17 @@ backfire_open(struct inode *inode, struct file *file)
 
 	spin_unlock(&backfire_state_lock);
 
+	file->private_data = NULL;
+
 	return 0;
 }
 
 static int
 backfire_release(struct inode *inode, struct file *file)
 {
+	if (file->private_data)
+		eventfd_ctx_put(file->private_data);
+
 	spin_lock(&backfire_state_lock);
 
 	backfire_open_cnt--;
@@ -94,12 +201,13 @@ backfire_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
-static struct file_operations backfire_fops = {
+static const struct file_operations backfire_fops = {
 	.owner		= THIS_MODULE,
-	.llseek		= no_llseek,
 	.open		= backfire_open,
 	.read		= backfire_read,
 	.write		= backfire_write,
+	.unlocked_ioctl	= backfire_ioctl,
+	.mmap		= backfire_mmap,
 	.release	= backfire_release,
 };
 
@@ -113,10 +221,15 @@ static int __init backfire_init(void)
 {
 	int ret;
 
+	backfire_page = (struct backfire_page *) get_zeroed_page(GFP_KERNEL);
+	if (!backfire_page)
+		return -ENOMEM;
+
 	ret = misc_register(&backfire_dev);
-	if (ret)
+	if (ret) {
 		printk(KERN_ERR "backfire: can't register dynamic misc device\n");
-	else
+		free_page((unsigned long) backfire_page);
+	} else
 		printk(KERN_INFO "backfire driver misc device %d\n",
 			backfire_dev.minor);
 	return ret;
@@ -125,6 +238,7 @@ static int __init backfire_init(void)
 static void __exit backfire_exit(void)
 {
 	misc_deregister(&backfire_dev);
+	free_page((unsigned long) backfire_page);
 }
 
 module_init(backfire_init);
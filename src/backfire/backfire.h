@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * backfire.h - interface between the backfire driver and sendme
+ *
+ * Writing a signal number to /dev/backfire sends that signal back to
+ * the writer. Besides, the driver offers two notifications without a
+ * signal frame: a read-only page to be mmap()ed, whose count the caller
+ * polls, and an eventfd registered with BACKFIRE_SET_EVENTFD. Every
+ * request is stamped into the page first, whichever way it is answered.
+ */
+#ifndef __BACKFIRE_H
+#define __BACKFIRE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* write() commands besides a signal number */
+#define BACKFIRE_CMD_MMAP	'm'	/* only update the page */
+#define BACKFIRE_CMD_EVENTFD	'e'	/* signal the registered eventfd */
+
+/* argument is the eventfd, -1 unregisters it */
+#define BACKFIRE_SET_EVENTFD	_IOW('b', 1, int)
+
+struct backfire_page {
+	__u64 count;		/* incremented after fire_ns is written */
+	__u64 fire_ns;		/* CLOCK_MONOTONIC of the last request */
+};
+
+#endif	/* __BACKFIRE_H */
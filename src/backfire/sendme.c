@@ -31,12 +31,15 @@
 #include <errno.h>
 #include "rt-utils.h"
 #include "rt-get_cpu.h"
+#include "backfire.h"
 
 #include <utmpx.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
 
 #define SIGTEST SIGHUP
 
@@ -52,8 +55,42 @@ static int tracelimit;
 static int priority;
 static int shutdown;
 static int max_cycles;
-static volatile struct timeval after;
+static volatile unsigned long long after;
 static int interval = 1000;
+static int use_nsecs;
+
+/* the ways the driver answers a request, measured one after the other */
+enum {
+	PATH_SIGNAL,
+	PATH_MMAP,
+	PATH_EVENTFD,
+	NR_PATHS
+};
+
+static struct path {
+	const char *name;
+	int enabled;
+	/* [0]: call to driver stamp, [1]: driver stamp to user space */
+	unsigned long long min[2], max[2], cur[2];
+	double sum[2];
+} paths[NR_PATHS] = {
+	[PATH_SIGNAL]	= { .name = "signal" },
+	[PATH_MMAP]	= { .name = "mmap" },
+	[PATH_EVENTFD]	= { .name = "eventfd" },
+};
+
+static volatile struct backfire_page *page;
+static int efd = -1;
+/* the page stamps are monotonic, a read() of the device gives real time */
+static clockid_t clock_id = CLOCK_MONOTONIC;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(clock_id, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 static int kernvar(int mode, const char *name, char *value, size_t sizeofvalue)
 {
@@ -90,10 +127,7 @@ static int kernvar(int mode, const char *name, char *value, size_t sizeofvalue)
 
 void signalhandler(int signo)
 {
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-	after = tv;
+	after = now_ns();
 	if (signo == SIGINT || signo == SIGTERM)
 		shutdown = 1;
 }
@@ -115,13 +149,39 @@ static void display_help(void)
 	"-b USEC  --breaktrace=USEC send break trace command when latency > USEC\n"
 	"-i INTV  --interval=INTV   base interval of thread in us default=1000\n"
 	"-l LOOPS --loops=LOOPS     number of loops: default=0(endless)\n"
+	"-m LIST  --mode=LIST       notification paths to measure, any of\n"
+	"                           signal,mmap,eventfd: default=all\n"
+	"-N       --nsecs           print results in ns instead of us (default us),\n"
+	"                           needs the mmap or eventfd path\n"
 	"-p PRIO  --prio=PRIO       priority\n");
 	exit(1);
 }
 
+static int parse_mode(char *list)
+{
+	char *tok, *save;
+	int i;
+
+	for (i = 0; i < NR_PATHS; i++)
+		paths[i].enabled = 0;
+
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < NR_PATHS; i++)
+			if (!strcmp(tok, paths[i].name))
+				break;
+		if (i == NR_PATHS)
+			return 1;
+		paths[i].enabled = 1;
+	}
+	return 0;
+}
+
 static void process_options (int argc, char *argv[])
 {
 	int error = 0;
+	int mode = 0;
+	int i;
 	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
 
 	for (;;) {
@@ -132,11 +192,13 @@ static void process_options (int argc, char *argv[])
 			{"breaktrace", required_argument, NULL, 'b'},
 			{"interval", required_argument, NULL, 'i'},
 			{"loops", required_argument, NULL, 'l'},
+			{"mode", required_argument, NULL, 'm'},
+			{"nsecs", no_argument, NULL, 'N'},
 			{"priority", required_argument, NULL, 'p'},
 			{"help", no_argument, NULL, '?'},
 			{NULL, 0, NULL, 0}
 		};
-		int c = getopt_long (argc, argv, "a::b:i:l:p:",
+		int c = getopt_long (argc, argv, "a::b:i:l:m:Np:",
 			long_options, &option_index);
 		if (c == -1)
 			break;
@@ -154,6 +216,12 @@ static void process_options (int argc, char *argv[])
 		case 'b': tracelimit = atoi(optarg); break;
 		case 'i': interval = atoi(optarg); break;
 		case 'l': max_cycles = atoi(optarg); break;
+		case 'm':
+			mode = 1;
+			if (parse_mode(optarg))
+				error = 1;
+			break;
+		case 'N': use_nsecs = 1; break;
 		case 'p': priority = atoi(optarg); break;
 		case '?': error = 1; break;
 		}
@@ -172,10 +240,130 @@ static void process_options (int argc, char *argv[])
 	if (priority < 0 || priority > 99)
 		error = 1;
 
+	for (i = 0; i < NR_PATHS; i++) {
+		if (!mode)
+			paths[i].enabled = 1;
+		paths[i].min[0] = paths[i].min[1] = ULLONG_MAX;
+	}
+
+	/* without the page the driver stamp is only read() in us */
+	if (use_nsecs && !paths[PATH_MMAP].enabled &&
+	    !paths[PATH_EVENTFD].enabled) {
+		fprintf(stderr, "ERROR: -N needs the mmap or eventfd path\n");
+		error = 1;
+	}
+
 	if (error)
 		display_help ();
 }
 
+/*
+ * The page and the eventfd, which only the newer driver offers. Every
+ * path takes the driver stamp from the page. With -m signal alone the
+ * page is not mapped, and the stamp is read() from the device as before.
+ */
+static int setup_paths(int path)
+{
+	if (!paths[PATH_MMAP].enabled && !paths[PATH_EVENTFD].enabled) {
+		clock_id = CLOCK_REALTIME;
+		return 0;
+	}
+
+	page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+		    path, 0);
+	if (page == MAP_FAILED) {
+		fprintf(stderr, "ERROR: Could not map the backfire page, "
+			"the driver may be too old: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (paths[PATH_EVENTFD].enabled) {
+		efd = eventfd(0, 0);
+		if (efd < 0 || ioctl(path, BACKFIRE_SET_EVENTFD, &efd)) {
+			fprintf(stderr, "ERROR: Could not register eventfd: "
+				"%s\n", strerror(errno));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * One request over path p, stamp of the driver in *fire and the time
+ * user space noticed the answer in *seen. 0 on success.
+ */
+static int fire(int path, int p, unsigned long long *fire,
+		unsigned long long *seen)
+{
+	char cmd[32];
+	uint64_t count, val;
+	unsigned long sec, usec;
+	ssize_t len;
+
+	count = page ? page->count : 0;
+	switch (p) {
+	case PATH_SIGNAL:
+		sprintf(cmd, "%d", SIGTEST);
+		after = 0;
+		if (write(path, cmd, strlen(cmd)) < 0)
+			return 1;
+		while (after == 0);
+		*seen = after;
+		if (page)
+			break;
+		/* the send time of the driver as sec,usec */
+		len = read(path, cmd, sizeof(cmd) - 1);
+		if (len <= 0)
+			return 1;
+		cmd[len] = '\0';
+		if (sscanf(cmd, "%lu,%lu", &sec, &usec) != 2)
+			return 1;
+		*fire = sec * 1000000000ULL + usec * 1000ULL;
+		return 0;
+	case PATH_MMAP:
+		cmd[0] = BACKFIRE_CMD_MMAP;
+		if (write(path, cmd, 1) < 0)
+			return 1;
+		/* the new count is written after the stamp */
+		while (page->count == count);
+		*seen = now_ns();
+		break;
+	case PATH_EVENTFD:
+		cmd[0] = BACKFIRE_CMD_EVENTFD;
+		if (write(path, cmd, 1) < 0)
+			return 1;
+		if (read(efd, &val, sizeof(val)) != sizeof(val))
+			return 1;
+		*seen = now_ns();
+		break;
+	}
+	__sync_synchronize();
+	*fire = page->fire_ns;
+
+	return page->count == count;
+}
+
+static void update(struct path *p, int i, unsigned long long diff)
+{
+	if (!use_nsecs)
+		diff /= 1000;
+	p->cur[i] = diff;
+	if (diff < p->min[i])
+		p->min[i] = diff;
+	if (diff > p->max[i])
+		p->max[i] = diff;
+	p->sum[i] += (double) diff;
+}
+
+static void print_path(struct path *p, unsigned int diffno)
+{
+	printf("%-8s To:   Min %4llu, Cur %4llu, Avg %4d, Max %4llu  "
+	       "From: Min %4llu, Cur %4llu, Avg %4d, Max %4llu\n", p->name,
+	       p->min[0], p->cur[0], (int) ((p->sum[0] / diffno) + 0.5),
+	       p->max[0], p->min[1], p->cur[1],
+	       (int) ((p->sum[1] / diffno) + 0.5), p->max[1]);
+}
+
 int main(int argc, char *argv[])
 {
 	int path;
@@ -229,71 +417,69 @@ int main(int argc, char *argv[])
 	if (fcntl(path, F_SETLK, &fl) == -1) {
 		fprintf(stderr, "ERRROR: backfire device locked\n");
 		retval = 1;
+	} else if (setup_paths(path)) {
+		retval = 1;
 	} else {
-		char sigtest[8];
-		char timestamp[32];
-		struct timeval before, sendtime, diff;
+		unsigned long long before, sendtime, seen, limit;
 		unsigned int diffno = 0;
-		unsigned int mindiff1 = UINT_MAX, maxdiff1 = 0;
-		unsigned int mindiff2 = UINT_MAX, maxdiff2 = 0;
-		double sumdiff1 = 0.0, sumdiff2 = 0.0;
+		int i, lines, over;
 
 		if (tracelimit)
 			kernvar(O_WRONLY, "tracing_enabled", "1", 1);
 
-		sprintf(sigtest, "%d", SIGTEST);
 		signal(SIGTEST, signalhandler);
 		signal(SIGINT, signalhandler);
 		signal(SIGTERM, signalhandler);
 
+		limit = use_nsecs ? tracelimit * 1000ULL : tracelimit;
+		lines = 1;
+		for (i = 0; i < NR_PATHS; i++)
+			lines += paths[i].enabled;
+
 		while (1) {
 			struct timespec ts;
 
 			ts.tv_sec = interval / USEC_PER_SEC;
 			ts.tv_nsec = (interval % USEC_PER_SEC) * 1000;
 
-			gettimeofday(&before, NULL);
-			write(path, sigtest, strlen(sigtest));
-			while (after.tv_sec == 0);
-			read(path, timestamp, sizeof(timestamp));
-			if (sscanf(timestamp, "%lu,%lu\n", &sendtime.tv_sec,
-			    &sendtime.tv_usec) != 2)
+			over = 0;
+			for (i = 0; i < NR_PATHS; i++) {
+				if (!paths[i].enabled)
+					continue;
+				before = now_ns();
+				/* the read() stamp only has us resolution */
+				if (!page)
+					before -= before % 1000;
+				if (fire(path, i, &sendtime, &seen))
+					break;
+				update(&paths[i], 0, sendtime - before);
+				update(&paths[i], 1, seen - sendtime);
+				if (tracelimit && paths[i].cur[1] > limit)
+					over = 1;
+			}
+			if (i < NR_PATHS) {
+				fprintf(stderr, "ERROR: request over the %s "
+					"path failed\n", paths[i].name);
+				retval = 1;
 				break;
+			}
+
 			diffno++;
 			if(max_cycles && diffno >= max_cycles)
 				shutdown = 1;
 
 			printf("Samples: %8d\n", diffno);
-			timersub(&sendtime, &before, &diff);
-			if (diff.tv_usec < mindiff1)
-				mindiff1 = diff.tv_usec;
-			if (diff.tv_usec > maxdiff1)
-				maxdiff1 = diff.tv_usec;
-			sumdiff1 += (double) diff.tv_usec;
-			printf("To:   Min %4d, Cur %4d, Avg %4d, Max %4d\n",
-				mindiff1, (int) diff.tv_usec,
-				(int) ((sumdiff1 / diffno) + 0.5),
-				maxdiff1);
-
-			timersub(&after, &sendtime, &diff);
-			if (diff.tv_usec < mindiff2)
-				mindiff2 = diff.tv_usec;
-			if (diff.tv_usec > maxdiff2)
-				maxdiff2 = diff.tv_usec;
-			sumdiff2 += (double) diff.tv_usec;
-			printf("From: Min %4d, Cur %4d, Avg %4d, Max %4d\n",
-				mindiff2, (int) diff.tv_usec,
-				(int) ((sumdiff2 / diffno) + 0.5),
-				maxdiff2);
-			after.tv_sec = 0;
-			if ((tracelimit && diff.tv_usec > tracelimit) ||
-			    shutdown) {
+			for (i = 0; i < NR_PATHS; i++)
+				if (paths[i].enabled)
+					print_path(&paths[i], diffno);
+
+			if (over || shutdown) {
 				if (tracelimit)
 					stop_tracing();
 				break;
 			}
 			nanosleep(&ts, NULL);
-			printf("\033[3A");
+			printf("\033[%dA", lines);
 		}
 	}
 
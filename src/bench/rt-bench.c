@@ -0,0 +1,649 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * rt-bench - cost of the measurement code of the rt-tests themselves
+ *
+ * The microbenchmarks run the per sample routines of the library, the
+ * per loop insert_bucket() of oslat and the per block accounting of
+ * queuelat in a loop on prepared input and report the time, cycles and
+ * LLC misses per call. The self-check then
+ * runs cyclictest for a fixed number of loops with the instrumentation
+ * options one at a time, checks that every loop was done and reports the
+ * CPU time it spent per loop, so a change that makes the measurement
+ * itself heavier shows up as a number.
+ *
+ * A run can be saved with --save and later ones compared against it
+ * with --compare, which fails when a benchmark got slower than the
+ * tolerance allows.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "rt-utils.h"
+#include "rt-error.h"
+#include "rt-histogram.h"
+#include "rt-perf.h"
+
+#include "../oslat/oslat_buckets.h"
+#include "../queuelat/queuelat_buckets.h"
+
+#define NR_VALUES	4096	/* input arrays, a power of two */
+#define MAX_RESULTS	32
+
+struct result {
+	const char *name;
+	const char *unit;
+	unsigned long iterations;
+	double ns;
+	double cycles;		/* < 0 if not available */
+	double llc_misses;	/* < 0 if not available */
+};
+
+struct check {
+	const char *name;
+	const char *options;
+	unsigned long loops;
+	unsigned long done;
+	double cpu_ns;		/* per loop */
+	int status;
+};
+
+static struct result results[MAX_RESULTS];
+static int nr_results;
+
+static struct check checks[] = {
+	{ "cyclictest",		"" },
+	{ "cyclictest-hist",	"-h 1000" },
+	{ "cyclictest-spike",	"--spike=1" },
+	{ "cyclictest-perf",	"--perf" },
+};
+
+static unsigned long iterations = 1000000;
+static unsigned long loops = 10000;
+static int interval = 100;
+static int use_tracemark;
+static int skip_selfcheck;
+static char *tooldir = ".";
+static char *savefile;
+static char *comparefile;
+static int tolerance = 25;
+static char jsonfile[MAX_PATH];
+
+static struct perf_counters perf;
+static uint64_t values_us[NR_VALUES], values_ns[NR_VALUES];
+static struct timespec stamps[NR_VALUES];
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Mostly small latencies with a long tail, like a real run */
+static void prepare_input(void)
+{
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	struct timespec ts = { 1000, 0 };
+	int i;
+
+	for (i = 0; i < NR_VALUES; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		values_ns[i] = (x & 0x3ff) << ((x >> 10) % 14);
+		values_us[i] = values_ns[i] / 1000;
+
+		ts.tv_nsec += 50000 + (x >> 40) % 1000;
+		tsnorm(&ts);
+		stamps[i] = ts;
+	}
+}
+
+static void bench_hist(unsigned long n, struct histogram *h, uint64_t *v)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		hist_sample(h, v[i & (NR_VALUES - 1)]);
+}
+
+static struct histogram hist_us, hist_ns;
+
+static void bench_hist_us(unsigned long n)
+{
+	bench_hist(n, &hist_us, values_us);
+}
+
+static void bench_hist_ns(unsigned long n)
+{
+	bench_hist(n, &hist_ns, values_ns);
+}
+
+#define OSLAT_MHZ	2000
+#define OSLAT_BUCKETS	32
+
+static uint64_t obuckets[OSLAT_BUCKETS];
+
+/* insert_bucket() of oslat without the trace check, on a cycle delta */
+static void bench_oslat_insert_bucket(unsigned long n)
+{
+	uint64_t us_mult = ((1ULL << TSC_SCALE_SHIFT) + OSLAT_MHZ - 1) / OSLAT_MHZ;
+	uint64_t min = UINT64_MAX, max = 0, overflow_sum = 0, v, index;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		v = values_ns[i & (NR_VALUES - 1)];
+		max = v > max ? v : max;
+		min = v < min ? v : min;
+		index = oslat_bucket_index(v, 0, us_mult, OSLAT_MHZ);
+		oslat_bucket_add(obuckets, OSLAT_BUCKETS - 1, &overflow_sum,
+				 index);
+	}
+	sink = min + max + overflow_sum;
+}
+
+static unsigned long long qbuckets[NR_BUCKETS + 1];
+
+/* account() of queuelat, once per memmove block, on a ns delta */
+static void bench_queuelat_account(unsigned long n)
+{
+	unsigned long long count = 0;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		account_bucket(qbuckets, &count, values_ns[i & (NR_VALUES - 1)]);
+	sink = count;
+}
+
+static void bench_calcdiff(unsigned long n)
+{
+	unsigned long i;
+	int64_t sum = 0;
+
+	for (i = 0; i < n; i++)
+		sum += calcdiff_ns(stamps[(i + 1) & (NR_VALUES - 1)],
+				   stamps[i & (NR_VALUES - 1)]);
+	sink = sum;
+}
+
+/* next += interval of the timer threads */
+static void bench_tsnorm(unsigned long n)
+{
+	struct timespec ts = { 0, 0 };
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		ts.tv_nsec += 1000000 + (i & 0xff);
+		tsnorm(&ts);
+	}
+	sink = ts.tv_sec + ts.tv_nsec;
+}
+
+static void bench_status(unsigned long n)
+{
+	char buf[256];
+	unsigned long i;
+	int len = 0;
+
+	for (i = 0; i < n; i++)
+		len += snprintf(buf, sizeof(buf),
+				"T:%2d (%5d) P:%2d I:%ld C:%7lu Min:%7ld "
+				"Act:%8ld Avg:%8ld Max:%8ld\n", 0, 4711, 99,
+				1000L, i, 1L, (long)values_us[i & 0xff],
+				3L, 9999L);
+	sink = len;
+}
+
+static void bench_hist_json(unsigned long n)
+{
+	unsigned long i;
+	FILE *f;
+
+	f = fopen("/dev/null", "w");
+	if (!f)
+		return;
+	for (i = 0; i < n; i++)
+		hist_print_json(f, &hist_us, 4);
+	fclose(f);
+}
+
+static struct perf_counters sampled;
+
+static void bench_perf_sample(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		perf_counters_sample(&sampled);
+}
+
+/* the annotation the hot loops carry when no trace is taken */
+static void bench_tracemark_off(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		TRACEMARK("bench %lu", i);
+}
+
+static void bench_tracemark(unsigned long n)
+{
+	static const char mark[] = "rt-bench: hit latency threshold";
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		tracemark_write(mark, sizeof(mark) - 1);
+}
+
+static void run_bench(const char *name, const char *unit,
+		      void (*fn)(unsigned long), unsigned long n)
+{
+	uint64_t before[PERF_NR_COUNTERS], after[PERF_NR_COUNTERS];
+	struct result *r;
+	uint64_t t;
+
+	if (nr_results == MAX_RESULTS)
+		return;
+	r = &results[nr_results++];
+
+	/* caches and branch predictors warm, pages faulted in */
+	fn(n / 10 + 1);
+
+	perf_counters_read(&perf, before);
+	t = now_ns();
+	fn(n);
+	t = now_ns() - t;
+	perf_counters_read(&perf, after);
+
+	r->name = name;
+	r->unit = unit;
+	r->iterations = n;
+	r->ns = (double)t / n;
+	r->cycles = perf.mask & (1U << PERF_CYCLES) ?
+		(double)(after[PERF_CYCLES] - before[PERF_CYCLES]) / n : -1;
+	r->llc_misses = perf.mask & (1U << PERF_LLC_MISSES) ?
+		(double)(after[PERF_LLC_MISSES] - before[PERF_LLC_MISSES]) / n :
+		-1;
+}
+
+static void run_benches(void)
+{
+	if (hist_init(&hist_us, HIST_DIGITS_DEFAULT, HIST_RANGE_BITS_US) ||
+	    hist_alloc(&hist_us) ||
+	    hist_init(&hist_ns, HIST_DIGITS_DEFAULT, HIST_RANGE_BITS_NS) ||
+	    hist_alloc(&hist_ns))
+		fatal("Could not allocate the histograms\n");
+
+	run_bench("hist_sample_us", "sample", bench_hist_us, iterations);
+	run_bench("hist_sample_ns", "sample", bench_hist_ns, iterations);
+	run_bench("oslat_insert_bucket", "sample", bench_oslat_insert_bucket,
+		  iterations);
+	run_bench("queuelat_account", "sample", bench_queuelat_account,
+		  iterations);
+	run_bench("calcdiff_ns", "sample", bench_calcdiff, iterations);
+	run_bench("tsnorm", "sample", bench_tsnorm, iterations);
+	run_bench("status_line", "call", bench_status, iterations / 10);
+	run_bench("hist_print_json", "call", bench_hist_json,
+		  iterations / 10000 + 1);
+	if (!perf_counters_open(&sampled)) {
+		run_bench("perf_counters_sample", "sample", bench_perf_sample,
+			  iterations / 10);
+		perf_counters_close(&sampled);
+	}
+	run_bench("tracemark_off", "sample", bench_tracemark_off, iterations);
+	if (use_tracemark) {
+		if (tracemark_open(TRACEMARK_QUIET))
+			warn("No trace_marker, skipping tracemark_write\n");
+		else
+			run_bench("tracemark_write", "call", bench_tracemark,
+				  iterations / 100);
+		tracemark_close();
+	}
+
+	hist_free(&hist_us);
+	hist_free(&hist_ns);
+}
+
+/* The cycles of the first thread in the JSON output of cyclictest */
+static unsigned long json_cycles(const char *path)
+{
+	unsigned long cycles = 0;
+	char line[512];
+	FILE *f;
+	char *p;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		p = strstr(line, "\"cycles\":");
+		if (p && sscanf(p + 9, "%lu", &cycles) == 1)
+			break;
+	}
+	fclose(f);
+
+	return cycles;
+}
+
+static void run_check(struct check *c)
+{
+	char cmd[MAX_PATH], loopsarg[32], intervalarg[32], json[MAX_PATH];
+	char opts[64], *argv[16], *tok, *save;
+	struct rusage ru;
+	int argc = 0;
+	pid_t pid;
+
+	snprintf(cmd, sizeof(cmd), "%s/cyclictest", tooldir);
+	snprintf(loopsarg, sizeof(loopsarg), "-l%lu", loops);
+	snprintf(intervalarg, sizeof(intervalarg), "-i%d", interval);
+	snprintf(json, sizeof(json), "--json=/tmp/rt-bench-%d.json", getpid());
+	snprintf(opts, sizeof(opts), "%s", c->options);
+
+	argv[argc++] = cmd;
+	argv[argc++] = "-q";
+	argv[argc++] = loopsarg;
+	argv[argc++] = intervalarg;
+	for (tok = strtok_r(opts, " ", &save); tok;
+	     tok = strtok_r(NULL, " ", &save))
+		argv[argc++] = tok;
+	argv[argc++] = json;
+	argv[argc] = NULL;
+
+	c->loops = loops;
+	pid = fork();
+	if (pid < 0)
+		fatal("fork: %s\n", strerror(errno));
+	if (pid == 0) {
+		/* the summary of cyclictest is not what we report */
+		if (!freopen("/dev/null", "w", stdout))
+			_exit(127);
+		execv(cmd, argv);
+		fprintf(stderr, "Could not execute %s: %s\n", cmd,
+			strerror(errno));
+		_exit(127);
+	}
+
+	if (wait4(pid, &c->status, 0, &ru) < 0)
+		fatal("wait4: %s\n", strerror(errno));
+
+	c->done = json_cycles(json + 7);
+	unlink(json + 7);
+	c->cpu_ns = ((ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 +
+		     (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3) /
+		    (c->done ? c->done : 1);
+}
+
+static int check_failed(struct check *c)
+{
+	return !WIFEXITED(c->status) || WEXITSTATUS(c->status) ||
+		c->done != c->loops;
+}
+
+static void print_value(double v, const char *fmt)
+{
+	if (v < 0)
+		printf("%12s", "-");
+	else
+		printf(fmt, v);
+}
+
+static int print_results(void)
+{
+	unsigned int i;
+	int ret = 0;
+
+	printf("%-22s %-20s %12s %12s\n", "benchmark", "time", "cycles",
+	       "llc-misses");
+	for (i = 0; i < nr_results; i++) {
+		printf("%-22s %10.2f ns/%-6s", results[i].name, results[i].ns,
+		       results[i].unit);
+		print_value(results[i].cycles, " %11.2f");
+		print_value(results[i].llc_misses, " %11.4f");
+		printf("\n");
+	}
+
+	if (skip_selfcheck)
+		return 0;
+
+	printf("\n%-22s %12s %12s\n", "self-check", "loops", "cpu ns/loop");
+	for (i = 0; i < ARRAY_SIZE(checks); i++) {
+		printf("%-22s %5lu/%-6lu %12.0f  %s\n", checks[i].name,
+		       checks[i].done, checks[i].loops, checks[i].cpu_ns,
+		       check_failed(&checks[i]) ? "FAILED" : "ok");
+		if (check_failed(&checks[i]))
+			ret = 1;
+	}
+
+	return ret;
+}
+
+static void save_results(void)
+{
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(savefile, "w");
+	if (!f)
+		fatal("Cannot write '%s': %s\n", savefile, strerror(errno));
+	for (i = 0; i < nr_results; i++)
+		fprintf(f, "%s %.3f\n", results[i].name, results[i].ns);
+	for (i = 0; i < ARRAY_SIZE(checks) && !skip_selfcheck; i++)
+		fprintf(f, "%s %.3f\n", checks[i].name, checks[i].cpu_ns);
+	fclose(f);
+}
+
+static double current(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_results; i++)
+		if (!strcmp(results[i].name, name))
+			return results[i].ns;
+	for (i = 0; i < ARRAY_SIZE(checks) && !skip_selfcheck; i++)
+		if (!strcmp(checks[i].name, name))
+			return checks[i].cpu_ns;
+	return -1;
+}
+
+/* 1 if anything that was measured before got slower than allowed */
+static int compare_results(void)
+{
+	char name[64];
+	double base, now;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(comparefile, "r");
+	if (!f)
+		fatal("Cannot open '%s': %s\n", comparefile, strerror(errno));
+
+	printf("\n%-22s %12s %12s %8s\n", "compared to", "baseline", "now",
+	       "change");
+	while (fscanf(f, "%63s %lf", name, &base) == 2) {
+		now = current(name);
+		if (now < 0 || base <= 0)
+			continue;
+		printf("%-22s %12.2f %12.2f %+7.1f%%%s\n", name, base, now,
+		       (now - base) * 100 / base,
+		       now > base * (100 + tolerance) / 100 ?
+		       "  REGRESSION" : "");
+		if (now > base * (100 + tolerance) / 100)
+			ret = 1;
+	}
+	fclose(f);
+
+	return ret;
+}
+
+static void write_json_value(FILE *f, const char *key, double v, int last)
+{
+	if (v < 0)
+		fprintf(f, "      \"%s\": null%s\n", key, last ? "" : ",");
+	else
+		fprintf(f, "      \"%s\": %.4f%s\n", key, v, last ? "" : ",");
+}
+
+static void write_stats(FILE *f, void *data)
+{
+	unsigned int i;
+
+	fprintf(f, "  \"bench\": {\n");
+	for (i = 0; i < nr_results; i++) {
+		fprintf(f, "    \"%s\": {\n", results[i].name);
+		fprintf(f, "      \"unit\": \"%s\",\n", results[i].unit);
+		fprintf(f, "      \"iterations\": %lu,\n",
+			results[i].iterations);
+		write_json_value(f, "ns", results[i].ns, 0);
+		write_json_value(f, "cycles", results[i].cycles, 0);
+		write_json_value(f, "llc_misses", results[i].llc_misses, 1);
+		fprintf(f, "    }%s\n", i == nr_results - 1 ? "" : ",");
+	}
+	fprintf(f, "  },\n");
+
+	fprintf(f, "  \"selfcheck\": {\n");
+	for (i = 0; i < ARRAY_SIZE(checks) && !skip_selfcheck; i++) {
+		fprintf(f, "    \"%s\": {\n", checks[i].name);
+		fprintf(f, "      \"options\": \"%s\",\n", checks[i].options);
+		fprintf(f, "      \"loops\": %lu,\n", checks[i].loops);
+		fprintf(f, "      \"done\": %lu,\n", checks[i].done);
+		fprintf(f, "      \"cpu_ns_per_loop\": %.0f,\n", checks[i].cpu_ns);
+		fprintf(f, "      \"ok\": %d\n", !check_failed(&checks[i]));
+		fprintf(f, "    }%s\n", i == ARRAY_SIZE(checks) - 1 ? "" : ",");
+	}
+	fprintf(f, "  }\n");
+}
+
+static void usage(int error)
+{
+	printf("rt-bench V %1.2f\n", VERSION);
+	printf("Usage:\n"
+	       "rt-bench <options>\n\n"
+	       "         --compare=FILE    fail if a result is slower than in FILE by\n"
+	       "                           more than the tolerance\n"
+	       "-h       --help            print this help message\n"
+	       "-i INTV  --interval=INTV   interval of the self-check runs in us, default 100\n"
+	       "-n NUM   --iterations=NUM  samples per microbenchmark, default 1000000\n"
+	       "         --json=FILENAME   write the results into FILENAME, JSON formatted\n"
+	       "-l LOOPS --loops=LOOPS     loops of every self-check run, default 10000\n"
+	       "         --no-selfcheck    run the microbenchmarks only\n"
+	       "         --save=FILE       save the results as baseline for --compare\n"
+	       "         --tolerance=PCT   allowed slowdown against the baseline, default 25\n"
+	       "         --tools=DIR       where cyclictest is, default .\n"
+	       "         --tracemark       include writes to trace_marker\n"
+	       );
+	exit(error);
+}
+
+enum option_values {
+	OPT_COMPARE = 1, OPT_HELP, OPT_INTERVAL, OPT_ITERATIONS, OPT_JSON,
+	OPT_LOOPS, OPT_NOSELFCHECK, OPT_SAVE, OPT_TOLERANCE, OPT_TOOLS,
+	OPT_TRACEMARK
+};
+
+static void process_options(int argc, char *argv[])
+{
+	for (;;) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{"compare",	required_argument,	NULL, OPT_COMPARE},
+			{"help",	no_argument,		NULL, OPT_HELP},
+			{"interval",	required_argument,	NULL, OPT_INTERVAL},
+			{"iterations",	required_argument,	NULL, OPT_ITERATIONS},
+			{"json",	required_argument,	NULL, OPT_JSON},
+			{"loops",	required_argument,	NULL, OPT_LOOPS},
+			{"no-selfcheck", no_argument,		NULL, OPT_NOSELFCHECK},
+			{"save",	required_argument,	NULL, OPT_SAVE},
+			{"tolerance",	required_argument,	NULL, OPT_TOLERANCE},
+			{"tools",	required_argument,	NULL, OPT_TOOLS},
+			{"tracemark",	no_argument,		NULL, OPT_TRACEMARK},
+			{NULL, 0, NULL, 0},
+		};
+		int c = getopt_long(argc, argv, "hi:l:n:", long_options,
+				    &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case OPT_COMPARE:
+			comparefile = optarg;
+			break;
+		case 'h':
+		case OPT_HELP:
+			usage(0);
+			break;
+		case 'i':
+		case OPT_INTERVAL:
+			interval = atoi(optarg);
+			break;
+		case 'n':
+		case OPT_ITERATIONS:
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_JSON:
+			strncpy(jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
+		case 'l':
+		case OPT_LOOPS:
+			loops = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_NOSELFCHECK:
+			skip_selfcheck = 1;
+			break;
+		case OPT_SAVE:
+			savefile = optarg;
+			break;
+		case OPT_TOLERANCE:
+			tolerance = atoi(optarg);
+			break;
+		case OPT_TOOLS:
+			tooldir = optarg;
+			break;
+		case OPT_TRACEMARK:
+			use_tracemark = 1;
+			break;
+		default:
+			usage(1);
+		}
+	}
+
+	if (iterations < 100 || !loops || interval <= 0 || tolerance < 0)
+		usage(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	int ret;
+
+	rt_init(argc, argv);
+	process_options(argc, argv);
+
+	/* counters are per thread, without a PMU only the time is shown */
+	perf_counters_open(&perf);
+	prepare_input();
+	run_benches();
+	perf_counters_close(&perf);
+
+	for (i = 0; i < ARRAY_SIZE(checks) && !skip_selfcheck; i++)
+		run_check(&checks[i]);
+
+	ret = print_results();
+	if (comparefile)
+		ret |= compare_results();
+	if (savefile)
+		save_results();
+	if (strlen(jsonfile) != 0)
+		rt_write_json(jsonfile, ret, write_stats, NULL);
+
+	return ret;
+}
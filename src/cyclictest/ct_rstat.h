@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Layout of the cyclictest running status shared memory segment
+ *
+ * cyclictest creates /dev/shm/cyclictest<pid> with a struct
+ * ct_rstat_header at offset 0, followed at header_size by num_threads
+ * slots of thread_size bytes each. Both sizes are multiples of the cache
+ * line, so no slot shares a line with the header or another slot. Every
+ * measurement thread updates its own slot after each cycle. A reader maps
+ * the segment and copies a slot:
+ *
+ *	do {
+ *		seq = slot->seq;		(acquire)
+ *		if (seq & 1)
+ *			continue;
+ *		copy the slot
+ *	} while (slot->seq != seq);		(acquire)
+ *
+ * When histograms are enabled, hist_offset points to hist_nbuckets
+ * unsigned longs holding the live log-linear histogram of the thread,
+ * see rt-histogram.h. These counters are not covered by the seqlock.
+ *
+ * At text_offset there is a NUL terminated text snapshot of the status
+ * which is rewritten on SIGUSR2, as used by older snapshot readers.
+ * New fields may only be appended; readers must honour header_size and
+ * thread_size.
+ */
+#ifndef _CT_RSTAT_H
+#define _CT_RSTAT_H
+
+#include <stdint.h>
+
+#define CT_RSTAT_MAGIC		"CTRSTAT"
+#define CT_RSTAT_VERSION	1
+
+#define CT_RSTAT_FLAG_NSECS	0x1	/* latencies are in ns */
+
+struct ct_rstat_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t thread_size;
+	uint32_t num_threads;
+	uint32_t flags;
+	int32_t pid;
+	uint64_t text_offset;
+	uint64_t text_size;
+};
+
+struct ct_rstat_thread {
+	uint32_t seq;		/* odd while the slot is being updated */
+	int32_t tid;
+	int32_t prio;
+	int32_t cpu;
+	uint64_t interval;
+	uint64_t cycles;
+	int64_t min;
+	int64_t max;
+	int64_t act;
+	double sum;		/* avg = sum / cycles */
+	uint64_t smi_count;
+	uint64_t hist_offset;	/* 0 without histogram */
+	uint32_t hist_sub_bits;
+	uint32_t hist_nbuckets;
+} __attribute__((aligned(64)));
+
+/* The header padded to the alignment of the slots */
+#define CT_RSTAT_ALIGN		__alignof__(struct ct_rstat_thread)
+#define CT_RSTAT_HEADER_SIZE						\
+	((sizeof(struct ct_rstat_header) + CT_RSTAT_ALIGN - 1) &	\
+	 ~(CT_RSTAT_ALIGN - 1))
+
+#endif	/* _CT_RSTAT_H */
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * On-disk format of the cyclictest --stream sample file
+ *
+ * The file starts with a struct ct_stream_header followed by any number
+ * of blocks. Every block holds consecutive samples of one measurement
+ * thread: a struct ct_stream_block followed by 'size' bytes of payload.
+ * Each sample in the payload is four LEB128 varints:
+ *
+ *   cycle delta, zigzag timestamp delta (ns), latency, SMI count delta
+ *
+ * Deltas are relative to the previous sample of the block, the first
+ * sample of a block is relative to the cycle and ts of the block
+ * header. A cycle delta larger than one means samples were dropped.
+ * All fixed size fields are stored in host byte order.
+ */
+#ifndef _CT_STREAM_H
+#define _CT_STREAM_H
+
+#include <stdint.h>
+
+#define CT_STREAM_MAGIC		"CTSTREAM"
+#define CT_STREAM_VERSION	1
+#define CT_STREAM_BLOCK_MAGIC	0x4b4c4243	/* "CBLK" */
+
+#define CT_STREAM_FLAG_NSECS	0x1		/* latencies are in ns */
+
+/* Samples per block and the worst case encoded size of one sample */
+#define CT_STREAM_BLOCK_SAMPLES	4096
+#define CT_STREAM_SAMPLE_MAX	40
+
+struct ct_stream_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t num_threads;
+	uint32_t interval;	/* base interval in us */
+};
+
+struct ct_stream_block {
+	uint32_t magic;
+	uint32_t tnum;
+	int32_t cpu;
+	int32_t node;
+	uint32_t count;		/* samples in this block */
+	uint32_t size;		/* payload bytes following the header */
+	uint64_t cycle;
+	uint64_t ts;
+};
+
+static inline uint64_t ct_zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t ct_unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline unsigned int ct_put_varint(uint8_t *p, uint64_t v)
+{
+	unsigned int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+
+	return n;
+}
+
+/* Returns the number of bytes consumed, 0 on a truncated varint */
+static inline unsigned int ct_get_varint(const uint8_t *p, const uint8_t *end,
+					 uint64_t *v)
+{
+	unsigned int n = 0, shift = 0;
+	uint64_t val = 0;
+
+	while (p + n < end && shift < 64) {
+		uint8_t b = p[n++];
+
+		val |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = val;
+			return n;
+		}
+		shift += 7;
+	}
+
+	return 0;
+}
+
+#endif	/* _CT_STREAM_H */
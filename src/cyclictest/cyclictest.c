@@ -22,6 +22,7 @@
 #include <time.h>
 #include <errno.h>
 #include <limits.h>
+#include <semaphore.h>
 #include <linux/unistd.h>
 
 #include <sys/prctl.h>
@@ -33,11 +34,19 @@
 #include <sys/utsname.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include "rt_numa.h"
+#include "ct_stream.h"
+#include "ct_rstat.h"
 
 #include "rt-utils.h"
 #include "rt-numa.h"
+#include "rt-perf.h"
 #include "rt-error.h"
+#include "rt-histogram.h"
+#include "rt-tsc.h"
+#include "rt-uring.h"
+#include "rt-export.h"
 
 #include <bionic.h>
 
@@ -92,12 +101,17 @@ extern int clock_nanosleep(clockid_t __clock_id, int __flags,
 #define MODE_CLOCK_NANOSLEEP	1
 #define MODE_SYS_ITIMER		2
 #define MODE_SYS_NANOSLEEP	3
+#define MODE_TIMERFD		4
+#define MODE_IO_URING		5
 #define MODE_SYS_OFFSET		2
 
 #define TIMER_RELTIME		0
 
 /* Must be power of 2 ! */
 #define VALBUF_SIZE		16384
+#define STREAM_RING_SIZE	16384
+
+#define CACHELINE_SIZE		64
 
 #define KVARS			32
 #define KVARNAMELEN		32
@@ -130,6 +144,41 @@ struct thread_param {
 	int msr_fd;
 };
 
+/* One sample as handed from a measurement thread to the stream thread */
+struct stream_sample {
+	uint64_t cycle;
+	uint64_t ts;		/* wakeup time in ns */
+	uint64_t latency;
+	uint32_t smi;
+};
+
+/* Payload of the TRACEMARK_ID_CYCLICTEST mark at the -b threshold */
+struct ct_trace_record {
+	uint64_t latency;
+	uint32_t threshold;
+	uint32_t tid;
+};
+
+/*
+ * Single producer, single consumer ring. The measurement thread only
+ * writes head, the stream thread only writes tail; each index lives on
+ * its own cache line so neither side bounces the other's line.
+ */
+struct stream_ring {
+	uint64_t head __attribute__((aligned(CACHELINE_SIZE)));
+	uint64_t tail __attribute__((aligned(CACHELINE_SIZE)));
+	struct stream_sample buf[STREAM_RING_SIZE] __attribute__((aligned(CACHELINE_SIZE)));
+};
+
+/* Info to store when the diff is greater than the trigger */
+struct thread_trigger {
+	int cpu;
+	int tnum;	/* thread number */
+	int64_t  ts;	/* time-stamp */
+	int diff;
+	uint64_t perf[PERF_NR_COUNTERS];	/* with --perf */
+};
+
 /* Struct for statistics */
 struct thread_stat {
 	unsigned long cycles;
@@ -140,7 +189,7 @@ struct thread_stat {
 	double avg;
 	long *values;
 	long *smis;
-	long *hist_array;
+	struct histogram hist;
 	long *outliers;
 	pthread_t thread;
 	int threadstarted;
@@ -151,39 +200,37 @@ struct thread_stat {
 	long hist_overflow;
 	long num_outliers;
 	unsigned long smi_count;
+	struct stream_ring *ring;
+	unsigned long stream_drops;
+	struct thread_trigger *triggers;	/* only written by the owner */
+	unsigned long spikes;
+	struct ct_rstat_thread *rstat;		/* slot in the rstat segment */
+	struct perf_counters perf;		/* with --perf */
+	struct export_stat export;		/* with --export */
 };
 
-static pthread_mutex_t trigger_lock = PTHREAD_MUTEX_INITIALIZER;
-
 static int trigger = 0;	/* Record spikes > trigger, 0 means don't record */
-static int trigger_list_size = 1024;	/* Number of list nodes */
+static int trigger_list_size = 1024;	/* Number of spikes per thread */
 
-/* Info to store when the diff is greater than the trigger */
-struct thread_trigger {
-	int cpu;
-	int tnum;	/* thread number */
-	int64_t  ts;	/* time-stamp */
-	int diff;
-	struct thread_trigger *next;
-};
-
-struct thread_trigger *head = NULL;
-struct thread_trigger *tail = NULL;
-struct thread_trigger *current = NULL;
-static int spikes;	/* count of the number of spikes */
-
-static int trigger_init();
-static void trigger_print();
-static void trigger_update(struct thread_param *par, int diff, int64_t ts);
+static int trigger_init(struct thread_stat *stat, int cpu);
+static void trigger_print(void);
+static inline void trigger_update(struct thread_param *par, int diff, int64_t ts);
 
 static int shutdown;
 static int tracelimit = 0;
+static int use_perf;
+static uint64_t break_thread_perf[PERF_NR_COUNTERS];
 static int trace_marker = 0;
 static int verbose = 0;
 static int oscope_reduction = 1;
 static int lockall = 0;
 static int histogram = 0;
 static int histofall = 0;
+static int hist_digits = HIST_DIGITS_DEFAULT;
+static int use_percentiles = 0;
+
+/* Percentiles shown in the live display with --percentiles */
+static const double live_percentiles[] = { 99, 99.99, 99.9999 };
 static int duration = 0;
 static int use_nsecs = 0;
 static int refresh_on_max;
@@ -195,6 +242,10 @@ static int use_fifo = 0;
 static pthread_t fifo_threadid;
 static int laptop = 0;
 static int use_histfile = 0;
+static int use_stream = 0;
+static int use_export;
+static int stream_stop;
+static pthread_t stream_threadid;
 
 #ifdef ARCH_HAS_SMI_COUNTER
 static int smi = 0;
@@ -205,6 +256,31 @@ static int smi = 0;
 static pthread_cond_t refresh_on_max_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t refresh_on_max_lock = PTHREAD_MUTEX_INITIALIZER;
 
+#define DEFAULT_REFRESH		10	/* ms */
+
+static int refresh = DEFAULT_REFRESH;
+static int batch_output;
+static int main_suspend;
+static sem_t main_wakeup;	/* posted on shutdown with --mainsuspend */
+
+/*
+ * --tsc: wakeups are timestamped with the cycle counter. The expected
+ * counter value of the next wakeup is derived from an anchor pair of
+ * (counter, clock) readings which is refreshed every TSC_RESYNC_NS so
+ * that calibration error and clock slewing cannot accumulate.
+ */
+#define TSC_CALIBRATE_MS	200
+#define TSC_RESYNC_NS		10000000ULL
+static int use_tsc;
+static struct tsc_scale tsc_scale;
+static uint64_t tsc_lat_mult;	/* cycles to latency units, us or ns */
+static int loadavg_fd = -1;
+
+/* Screen updates go here, an in-memory stream with --batch */
+static FILE *display;
+static char *display_buf;
+static size_t display_size;
+
 static pthread_mutex_t break_thread_id_lock = PTHREAD_MUTEX_INITIALIZER;
 static pid_t break_thread_id = 0;
 static uint64_t break_thread_value = 0;
@@ -219,12 +295,13 @@ static struct timespec globalt;
 static char fifopath[MAX_PATH];
 static char histfile[MAX_PATH];
 static char jsonfile[MAX_PATH];
+static char streamfile[MAX_PATH];
+static char exportspec[MAX_PATH];
 
 static struct thread_param **parameters;
 static struct thread_stat **statistics;
 
 static void print_stat(FILE *fp, struct thread_param *par, int index, int verbose, int quiet);
-static void rstat_print_stat(struct thread_param *par, int index, int verbose, int quiet);
 static void rstat_setup(void);
 
 static int latency_target_fd = -1;
@@ -232,6 +309,9 @@ static int32_t latency_target_value = 0;
 
 static int rstat_ftruncate(int fd, off_t len);
 static int rstat_fd = -1;
+static void *rstat_base;
+static size_t rstat_size;
+static FILE *rstat_text;
 /* strlen("/cyclictest") + digits in max pid len + '\0' */
 #define SHM_BUF_SIZE 19
 static char shm_name[SHM_BUF_SIZE];
@@ -486,6 +566,56 @@ static int has_smi_counter(void)
 }
 #endif
 
+/* Queue a sample for the stream thread, never blocks */
+static inline void stream_push(struct thread_stat *stat,
+			       const struct stream_sample *sample)
+{
+	struct stream_ring *ring = stat->ring;
+	uint64_t head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= STREAM_RING_SIZE) {
+		stat->stream_drops++;
+		return;
+	}
+	ring->buf[head & (STREAM_RING_SIZE - 1)] = *sample;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Publish the current statistics in the thread's rstat slot. This is a
+ * seqlock write side: readers retry while seq is odd or has changed.
+ */
+static inline void rstat_update(struct thread_stat *stat)
+{
+	struct ct_rstat_thread *slot = stat->rstat;
+	uint32_t seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->cycles = stat->cycles;
+	slot->min = stat->min;
+	slot->max = stat->max;
+	slot->act = stat->act;
+	slot->sum = stat->avg;
+	slot->smi_count = stat->smi_count;
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void rstat_init_slot(struct thread_param *par)
+{
+	struct ct_rstat_thread *slot = par->stats->rstat;
+	uint32_t seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->tid = par->stats->tid;
+	slot->prio = par->prio;
+	slot->cpu = par->cpu;
+	slot->interval = par->interval;
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	rstat_update(par->stats);
+}
+
 /*
  * timer thread
  *
@@ -498,6 +628,30 @@ static int has_smi_counter(void)
  * - CLOCK_REALTIME
  *
  */
+/* Read the cycle counter and the clock as one pair */
+static void tsc_anchor(clockid_t clock, uint64_t *tsc, uint64_t *ns)
+{
+	struct timespec ts;
+	uint64_t a, b;
+
+	frc(&a);
+	clock_gettime(clock, &ts);
+	frc(&b);
+	*tsc = a + (b - a) / 2;
+	*ns = (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Counter value at the absolute clock time ts */
+static inline uint64_t tsc_expected(const struct timespec *ts,
+				    uint64_t tsc_base, uint64_t ns_base)
+{
+	uint64_t ns = (uint64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+
+	if (ns < ns_base)
+		return tsc_base - ns_to_tsc(&tsc_scale, ns_base - ns);
+	return tsc_base + ns_to_tsc(&tsc_scale, ns - ns_base);
+}
+
 static void *timerthread(void *param)
 {
 	struct thread_param *par = param;
@@ -513,6 +667,13 @@ static void *timerthread(void *param)
 	cpu_set_t mask;
 	pthread_t thread;
 	unsigned long smi_now, smi_old = 0;
+	uint64_t tsc_now = 0, tsc_next = 0, tsc_base = 0, ns_base = 0;
+	unsigned long tsc_resync = 0, tsc_countdown = 0;
+	struct __kernel_timespec kts;
+	struct rt_uring ring;
+	unsigned int uring_flags = 0;
+	uint64_t expirations = 1;
+	int tfd = -1, err;
 
 	memset(&stop, 0, sizeof(stop));
 
@@ -533,6 +694,8 @@ static void *timerthread(void *param)
 	interval.tv_nsec = (par->interval % USEC_PER_SEC) * 1000;
 
 	stat->tid = gettid();
+	if (stat->rstat)
+		rstat_init_slot(par);
 
 	sigemptyset(&sigset);
 	sigaddset(&sigset, par->signal);
@@ -546,6 +709,25 @@ static void *timerthread(void *param)
 		tspec.it_interval = interval;
 	}
 
+	if (par->mode == MODE_TIMERFD) {
+		tfd = timerfd_create(par->clock, TFD_CLOEXEC);
+		if (tfd < 0)
+			fatal("timerthread%d: timerfd_create failed: %s\n",
+			      par->tnum, strerror(errno));
+		tspec.it_interval = interval;
+	}
+
+	if (par->mode == MODE_IO_URING) {
+		err = rt_uring_init(&ring, 2);
+		if (err)
+			fatal("timerthread%d: io_uring_setup failed: %s\n",
+			      par->tnum, strerror(-err));
+		if (par->clock == CLOCK_REALTIME)
+			uring_flags |= IORING_TIMEOUT_REALTIME;
+		if (par->timermode == TIMER_ABSTIME)
+			uring_flags |= IORING_TIMEOUT_ABS;
+	}
+
 	memset(&schedp, 0, sizeof(schedp));
 	schedp.sched_priority = par->prio;
 	if (setscheduler(0, par->policy, &schedp))
@@ -563,6 +745,11 @@ static void *timerthread(void *param)
 				par->cpu, errno);
 	}
 
+	/* Counted from here, the setup above is not part of any cycle */
+	if (use_perf && perf_counters_open(&stat->perf))
+		warn("thread %d: no performance counters: %s\n", par->tnum,
+		     strerror(errno));
+
 	/* Get current time */
 	if (aligned || secaligned) {
 		pthread_barrier_wait(&globalt_barr);
@@ -608,6 +795,21 @@ static void *timerthread(void *param)
 		timer_settime(timer, par->timermode, &tspec, NULL);
 	}
 
+	if (par->mode == MODE_TIMERFD) {
+		if (par->timermode == TIMER_ABSTIME) {
+			tspec.it_value = next;
+		} else {
+			/* the period starts when the timer is armed */
+			clock_gettime(par->clock, &now);
+			next.tv_sec = now.tv_sec + interval.tv_sec;
+			next.tv_nsec = now.tv_nsec + interval.tv_nsec;
+			tsnorm(&next);
+			tspec.it_value = interval;
+		}
+		timerfd_settime(tfd, par->timermode == TIMER_ABSTIME ?
+				TFD_TIMER_ABSTIME : 0, &tspec, NULL);
+	}
+
 	if (par->mode == MODE_SYS_ITIMER) {
 		itimer.it_interval.tv_sec = interval.tv_sec;
 		itimer.it_interval.tv_usec = interval.tv_nsec / 1000;
@@ -615,6 +817,13 @@ static void *timerthread(void *param)
 		setitimer(ITIMER_REAL, &itimer, NULL);
 	}
 
+	if (use_tsc) {
+		tsc_resync = TSC_RESYNC_NS / (par->interval * 1000ULL) + 1;
+		tsc_countdown = tsc_resync;
+		tsc_anchor(par->clock, &tsc_base, &ns_base);
+		tsc_next = tsc_expected(&next, tsc_base, ns_base);
+	}
+
 	stat->threadstarted++;
 
 	while (!shutdown) {
@@ -677,13 +886,55 @@ static void *timerthread(void *param)
 			next.tv_nsec = now.tv_nsec + interval.tv_nsec;
 			tsnorm(&next);
 			break;
+
+		case MODE_TIMERFD:
+			if (read(tfd, &expirations, sizeof(expirations)) !=
+			    sizeof(expirations)) {
+				if (errno != EINTR)
+					warn("timerfd read failed. errno: %d\n",
+					     errno);
+				goto out;
+			}
+			break;
+
+		case MODE_IO_URING:
+			if (par->timermode == TIMER_ABSTIME) {
+				kts.tv_sec = next.tv_sec;
+				kts.tv_nsec = next.tv_nsec;
+			} else {
+				ret = clock_gettime(par->clock, &now);
+				if (ret != 0) {
+					if (ret != EINTR)
+						warn("clock_gettime() failed: %s", strerror(errno));
+					goto out;
+				}
+				kts.tv_sec = interval.tv_sec;
+				kts.tv_nsec = interval.tv_nsec;
+			}
+			ret = rt_uring_timeout(&ring, &kts, uring_flags);
+			if (ret != 0) {
+				if (ret != -EINTR)
+					warn("io_uring timeout failed: %s\n",
+					     strerror(-ret));
+				goto out;
+			}
+			if (par->timermode != TIMER_ABSTIME) {
+				next.tv_sec = now.tv_sec + interval.tv_sec;
+				next.tv_nsec = now.tv_nsec + interval.tv_nsec;
+				tsnorm(&next);
+			}
+			break;
 		}
-		ret = clock_gettime(par->clock, &now);
-		if (ret != 0) {
-			if (ret != EINTR)
-				warn("clock_gettime() failed. errno: %d\n",
-				     errno);
-			goto out;
+		if (use_tsc) {
+			frc(&tsc_now);
+		} else {
+			ret = clock_gettime(par->clock, &now);
+			if (ret != 0) {
+				if (ret != EINTR)
+					warn("clock_gettime() failed. errno: %d\n",
+					     errno);
+				goto out;
+			}
 		}
 
 		if (smi) {
@@ -697,7 +948,16 @@ static void *timerthread(void *param)
 			smi_old = smi_now;
 		}
 
-		if (use_nsecs)
+		if (use_perf)
+			perf_counters_sample(&stat->perf);
+
+		if (use_tsc) {
+			diff = tsc_now > tsc_next ?
+				tsc_mul_shift(tsc_now - tsc_next, tsc_lat_mult) : 0;
+			now = next;
+			now.tv_nsec += use_nsecs ? diff : diff * 1000;
+			tsnorm(&now);
+		} else if (use_nsecs)
 			diff = calcdiff_ns(now, next);
 		else
 			diff = calcdiff(now, next);
@@ -705,11 +965,17 @@ static void *timerthread(void *param)
 			stat->min = diff;
 		if (diff > stat->max) {
 			stat->max = diff;
+			if (use_perf)
+				perf_counters_max(&stat->perf);
 			if (refresh_on_max)
 				pthread_cond_signal(&refresh_on_max_cond);
 		}
 		stat->avg += (double) diff;
 
+		if (use_perf && (trigger || tracelimit) &&
+		    diff > (trigger ? trigger : tracelimit))
+			perf_counters_spike(&stat->perf);
+
 		if (trigger && (diff > trigger))
 			trigger_update(par, diff, calctime(now));
 
@@ -721,15 +987,39 @@ static void *timerthread(void *param)
 			shutdown++;
 			pthread_mutex_lock(&break_thread_id_lock);
 			if (break_thread_id == 0) {
+				struct ct_trace_record rec = {
+					.latency = diff,
+					.threshold = tracelimit,
+					.tid = stat->tid,
+				};
+
 				break_thread_id = stat->tid;
-				tracemark("hit latency threshold (%llu > %d)",
-					  (unsigned long long) diff, tracelimit);
+				/* text only for kernels without trace_marker_raw */
+				if (tracemark_raw(TRACEMARK_ID_CYCLICTEST, &rec,
+						  sizeof(rec)))
+					tracemark_printf("hit latency threshold (%llu > %d)",
+							 (unsigned long long) diff,
+							 tracelimit);
+				tracemark_stop();
 				break_thread_value = diff;
+				memcpy(break_thread_perf, stat->perf.delta,
+				       sizeof(break_thread_perf));
 			}
 			pthread_mutex_unlock(&break_thread_id_lock);
 		}
 		stat->act = diff;
 
+		if (stat->ring) {
+			struct stream_sample sample = {
+				.cycle = stat->cycles,
+				.ts = (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec,
+				.latency = diff,
+				.smi = diff_smi,
+			};
+
+			stream_push(stat, &sample);
+		}
+
 		if (par->bufmsk) {
 			stat->values[stat->cycles & par->bufmsk] = diff;
 			if (smi)
@@ -737,18 +1027,23 @@ static void *timerthread(void *param)
 		}
 
 		/* Update the histogram */
+		if (stat->hist.buckets)
+			hist_sample(&stat->hist, diff);
 		if (histogram) {
 			if (diff >= histogram) {
 				stat->hist_overflow++;
 				if (stat->num_outliers < histogram)
 					stat->outliers[stat->num_outliers++] = stat->cycles;
-			} else {
-				stat->hist_array[diff]++;
 			}
 		}
 
 		stat->cycles++;
 
+		if (stat->rstat)
+			rstat_update(stat);
+		if (use_export)
+			export_stat_update(&stat->export, diff);
+
 		next.tv_sec += interval.tv_sec;
 		next.tv_nsec += interval.tv_nsec;
 		if (par->mode == MODE_CYCLIC) {
@@ -756,6 +1051,10 @@ static void *timerthread(void *param)
 			next.tv_sec += overrun_count * interval.tv_sec;
 			next.tv_nsec += overrun_count * interval.tv_nsec;
 		}
+		if (par->mode == MODE_TIMERFD && expirations > 1) {
+			next.tv_sec += (expirations - 1) * interval.tv_sec;
+			next.tv_nsec += (expirations - 1) * interval.tv_nsec;
+		}
 		tsnorm(&next);
 
 		while (tsgreater(&now, &next)) {
@@ -764,11 +1063,23 @@ static void *timerthread(void *param)
 			tsnorm(&next);
 		}
 
+		if (use_tsc) {
+			/* a countdown, no division per cycle */
+			if (!--tsc_countdown) {
+				tsc_countdown = tsc_resync;
+				tsc_anchor(par->clock, &tsc_base, &ns_base);
+			}
+			tsc_next = tsc_expected(&next, tsc_base, ns_base);
+		}
+
 		if (par->max_cycles && par->max_cycles == stat->cycles)
 			break;
 	}
 
 out:
+	if (use_perf)
+		perf_counters_close(&stat->perf);
+
 	if (refresh_on_max) {
 		pthread_mutex_lock(&refresh_on_max_lock);
 		/* We could reach here with both shutdown and allstopped unset (0).
@@ -780,9 +1091,18 @@ out:
 		pthread_mutex_unlock(&refresh_on_max_lock);
 	}
 
+	if (main_suspend)
+		sem_post(&main_wakeup);
+
 	if (par->mode == MODE_CYCLIC)
 		timer_delete(timer);
 
+	if (par->mode == MODE_TIMERFD)
+		close(tfd);
+
+	if (par->mode == MODE_IO_URING)
+		rt_uring_exit(&ring);
+
 	if (par->mode == MODE_SYS_ITIMER) {
 		itimer.it_value.tv_sec = 0;
 		itimer.it_value.tv_usec = 0;
@@ -817,6 +1137,8 @@ static void display_help(int error)
 	       "                           on CPU 4, and thread #5 on CPU 5.\n"
 	       "-A USEC  --aligned=USEC    align thread wakeups to a specific offset\n"
 	       "-b USEC  --breaktrace=USEC send break trace command when latency > USEC\n"
+	       "         --batch           collect each screen refresh in a buffer and print it\n"
+	       "                           with a single write()\n"
 	       "-c CLOCK --clock=CLOCK     select clock\n"
 	       "                           0 = CLOCK_MONOTONIC (default)\n"
 	       "                           1 = CLOCK_REALTIME\n"
@@ -824,13 +1146,19 @@ static void display_help(int error)
 	       "-D       --duration=TIME   specify a length for the test run.\n"
 	       "                           Append 'm', 'h', or 'd' to specify minutes, hours or days.\n"
 	       "	 --latency=PM_QOS  write PM_QOS to /dev/cpu_dma_latency\n"
+	       "	 --export=SPEC     serve live stats in OpenMetrics format on the Unix\n"
+	       "			   socket unix:PATH or on localhost:PORT\n"
 	       "-F       --fifo=<path>     create a named pipe at path and write stats to it\n"
 	       "-h       --histogram=US    dump a latency histogram to stdout after the run\n"
 	       "                           US is the max latency time to be tracked in microseconds\n"
+	       "                           larger latencies are kept in log-linear buckets\n"
 	       "			   This option runs all threads at the same priority.\n"
 	       "-H       --histofall=US    same as -h except with an additional summary column\n"
 	       "	 --histfile=<path> dump the latency histogram to <path> instead of stdout\n"
+	       "	 --histdigits=N    significant decimal digits kept per histogram bucket\n"
+	       "			   1-4, default=3\n"
 	       "-i INTV  --interval=INTV   base interval of thread in us default=1000\n"
+	       "	 --io_uring        use io_uring timeout requests instead of clock_nanosleep\n"
 	       "         --json=FILENAME   write final results into FILENAME, JSON formatted\n"
 	       "-l LOOPS --loops=LOOPS     number of loops: default=0(endless)\n"
 	       "	 --laptop	   Save battery when running cyclictest\n"
@@ -839,16 +1167,28 @@ static void display_help(int error)
 	       "         --mainaffinity=CPUSET\n"
 	       "			   Run the main thread on CPU #N. This only affects\n"
 	       "                           the main thread and not the measurement threads\n"
+	       "         --mainsuspend     let the main thread sleep without any wakeup until\n"
+	       "                           the run ends, implies -q\n"
 	       "-m       --mlockall        lock current and future memory allocations\n"
 	       "-M       --refresh_on_max  delay updating the screen until a new max\n"
 	       "			   latency is hit. Useful for low bandwidth.\n"
 	       "-N       --nsecs           print results in ns instead of us (default us)\n"
 	       "-o RED   --oscope=RED      oscilloscope mode, reduce verbose output by RED\n"
 	       "-p PRIO  --priority=PRIO   priority of highest prio thread\n"
+	       "         --perf            count cycles, instructions, LLC and dTLB misses and\n"
+	       "                           context switches of every cycle, report them for\n"
+	       "                           the cycles over --spike or -b and in the JSON\n"
+	       "	 --percentiles     show P99, P99.99 and P99.9999 latencies while running\n"
+	       "			   and add percentiles to the JSON output\n"
+	       "         --placement=POL   order the CPUs of -a, or of all allowed CPUs, by\n"
+	       "                           topology: rr (default), core, nosmt, llc or\n"
+	       "                           cross-node\n"
 	       "	 --policy=NAME     policy of measurement thread, where NAME may be one\n"
 	       "                           of: other, normal, batch, idle, fifo or rr.\n"
 	       "	 --priospread      spread priority levels starting at specified value\n"
 	       "-q       --quiet           print a summary only on exit\n"
+	       "         --refresh[=MS]    update the screen every MS milliseconds, default=10,\n"
+	       "                           without MS the same as --refresh_on_max\n"
 	       "-r       --relative        use relative timer instead of absolute\n"
 	       "-R       --resolution      check clock resolution, calling clock_gettime() many\n"
 	       "                           times.  List of clock_gettime() values will be\n"
@@ -860,16 +1200,21 @@ static void display_help(int error)
 	       "                           of all threads\n"
 	       "	--spike=<trigger>  record all spikes > trigger\n"
 	       "	--spike-nodes=[num of nodes]\n"
-	       "			   These are the maximum number of spikes we can record.\n"
+	       "			   These are the maximum number of spikes we can record\n"
+	       "			   per thread.\n"
 	       "			   The default is 1024 if not specified\n"
 #ifdef ARCH_HAS_SMI_COUNTER
                "         --smi             Enable SMI counting\n"
 #endif
+	       "	 --stream=<path>   write every sample as a binary record to <path>\n"
+	       "	 --timerfd         use a timerfd instead of clock_nanosleep\n"
 	       "-t       --threads         one thread per available processor\n"
 	       "-t [NUM] --threads=NUM     number of threads:\n"
 	       "                           without NUM, threads = max_cpus\n"
 	       "                           without -t default = 1\n"
 	       "         --tracemark       write a trace mark when -b latency is exceeded\n"
+	       "	 --tsc             timestamp wakeups with the calibrated cycle counter\n"
+	       "			   instead of clock_gettime()\n"
 	       "-u       --unbuffered      force unbuffered output for live processing\n"
 	       "-v       --verbose         output values on stdout for statistics\n"
 	       "                           format: n:c:v n=tasknum c=count v=value in us\n"
@@ -894,6 +1239,8 @@ static int interval = DEFAULT_INTERVAL;
 static int distance = -1;
 static struct bitmask *affinity_mask = NULL;
 static struct bitmask *main_affinity_mask = NULL;
+static int placement = -1;
+static struct cpu_plan *cpu_plan;
 static int smp = 0;
 static int setaffinity = AFFINITY_UNSPECIFIED;
 
@@ -946,7 +1293,7 @@ static char *policyname(int policy)
 enum option_values {
 	OPT_AFFINITY=1, OPT_BREAKTRACE, OPT_CLOCK,
 	OPT_DISTANCE, OPT_DURATION, OPT_LATENCY,
-	OPT_FIFO, OPT_HISTOGRAM, OPT_HISTOFALL, OPT_HISTFILE,
+	OPT_FIFO, OPT_HISTOGRAM, OPT_HISTOFALL, OPT_HISTFILE, OPT_HISTDIGITS,
 	OPT_INTERVAL, OPT_JSON, OPT_MAINAFFINITY, OPT_LOOPS, OPT_MLOCKALL,
 	OPT_REFRESH, OPT_NANOSLEEP, OPT_NSECS, OPT_OSCOPE, OPT_PRIORITY,
 	OPT_QUIET, OPT_PRIOSPREAD, OPT_RELATIVE, OPT_RESOLUTION,
@@ -954,7 +1301,9 @@ enum option_values {
 	OPT_TRIGGER_NODES, OPT_UNBUFFERED, OPT_NUMA, OPT_VERBOSE,
 	OPT_DBGCYCLIC, OPT_POLICY, OPT_HELP, OPT_NUMOPTS,
 	OPT_ALIGNED, OPT_SECALIGNED, OPT_LAPTOP, OPT_SMI,
-	OPT_TRACEMARK, OPT_POSIX_TIMERS,
+	OPT_TRACEMARK, OPT_POSIX_TIMERS, OPT_STREAM, OPT_PERCENTILES,
+	OPT_REFRESH_INTERVAL, OPT_BATCH, OPT_MAINSUSPEND, OPT_TSC,
+	OPT_TIMERFD, OPT_IO_URING, OPT_PLACEMENT, OPT_PERF, OPT_EXPORT,
 };
 
 /* Process commandline options */
@@ -972,24 +1321,31 @@ static void process_options(int argc, char *argv[], int max_cpus)
 		static struct option long_options[] = {
 			{"affinity",         optional_argument, NULL, OPT_AFFINITY},
 			{"aligned",          optional_argument, NULL, OPT_ALIGNED },
+			{"batch",            no_argument,       NULL, OPT_BATCH },
 			{"breaktrace",       required_argument, NULL, OPT_BREAKTRACE },
 			{"clock",            required_argument, NULL, OPT_CLOCK },
 			{"distance",         required_argument, NULL, OPT_DISTANCE },
 			{"duration",         required_argument, NULL, OPT_DURATION },
 			{"latency",          required_argument, NULL, OPT_LATENCY },
+			{"export",           required_argument, NULL, OPT_EXPORT },
 			{"fifo",             required_argument, NULL, OPT_FIFO },
 			{"histogram",        required_argument, NULL, OPT_HISTOGRAM },
 			{"histofall",        required_argument, NULL, OPT_HISTOFALL },
 			{"histfile",	     required_argument, NULL, OPT_HISTFILE },
+			{"histdigits",	     required_argument, NULL, OPT_HISTDIGITS },
 			{"interval",         required_argument, NULL, OPT_INTERVAL },
+			{"io_uring",         no_argument,       NULL, OPT_IO_URING },
 			{"json",             required_argument, NULL, OPT_JSON },
 			{"laptop",	     no_argument,	NULL, OPT_LAPTOP },
 			{"loops",            required_argument, NULL, OPT_LOOPS },
 			{"mainaffinity",     required_argument, NULL, OPT_MAINAFFINITY},
+			{"mainsuspend",      no_argument,       NULL, OPT_MAINSUSPEND },
 			{"mlockall",         no_argument,       NULL, OPT_MLOCKALL },
+			{"refresh",          optional_argument, NULL, OPT_REFRESH_INTERVAL },
 			{"refresh_on_max",   no_argument,       NULL, OPT_REFRESH },
 			{"nsecs",            no_argument,       NULL, OPT_NSECS },
 			{"oscope",           required_argument, NULL, OPT_OSCOPE },
+			{"percentiles",      no_argument,       NULL, OPT_PERCENTILES },
 			{"priority",         required_argument, NULL, OPT_PRIORITY },
 			{"quiet",            no_argument,       NULL, OPT_QUIET },
 			{"priospread",       no_argument,       NULL, OPT_PRIOSPREAD },
@@ -1001,11 +1357,16 @@ static void process_options(int argc, char *argv[], int max_cpus)
 			{"smp",              no_argument,       NULL, OPT_SMP },
 			{"spike",	     required_argument, NULL, OPT_TRIGGER },
 			{"spike-nodes",	     required_argument, NULL, OPT_TRIGGER_NODES },
+			{"stream",	     required_argument, NULL, OPT_STREAM },
 			{"threads",          optional_argument, NULL, OPT_THREADS },
+			{"timerfd",          no_argument,       NULL, OPT_TIMERFD },
 			{"tracemark",	     no_argument,	NULL, OPT_TRACEMARK },
+			{"tsc",              no_argument,       NULL, OPT_TSC },
 			{"unbuffered",       no_argument,       NULL, OPT_UNBUFFERED },
 			{"verbose",          no_argument,       NULL, OPT_VERBOSE },
 			{"dbg_cyclictest",   no_argument,       NULL, OPT_DBGCYCLIC },
+			{"perf",             no_argument,       NULL, OPT_PERF },
+			{"placement",        required_argument, NULL, OPT_PLACEMENT },
 			{"policy",           required_argument, NULL, OPT_POLICY },
 			{"help",             no_argument,       NULL, OPT_HELP },
 			{"posix_timers",     no_argument,	NULL, OPT_POSIX_TIMERS },
@@ -1081,6 +1442,8 @@ static void process_options(int argc, char *argv[], int max_cpus)
 			use_histfile = 1;
 			strncpy(histfile, optarg, strnlen(optarg, MAX_PATH-1));
 			break;
+		case OPT_HISTDIGITS:
+			hist_digits = atoi(optarg); break;
 		case 'i':
 		case OPT_INTERVAL:
 			interval = atoi(optarg); break;
@@ -1160,6 +1523,27 @@ static void process_options(int argc, char *argv[], int max_cpus)
 			else
 				num_threads = -1; /* update after parsing */
 			break;
+		case OPT_PERCENTILES:
+			use_percentiles = 1; break;
+		case OPT_REFRESH_INTERVAL:
+			/* plain --refresh used to abbreviate --refresh_on_max */
+			if (!optarg)
+				refresh_on_max = 1;
+			else
+				refresh = atoi(optarg);
+			break;
+		case OPT_BATCH:
+			batch_output = 1; break;
+		case OPT_MAINSUSPEND:
+			main_suspend = 1; break;
+		case OPT_STREAM:
+			use_stream = 1;
+			strncpy(streamfile, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
+		case OPT_EXPORT:
+			use_export = 1;
+			strncpy(exportspec, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
 		case OPT_TRIGGER:
 			trigger = atoi(optarg);
 			break;
@@ -1175,6 +1559,10 @@ static void process_options(int argc, char *argv[], int max_cpus)
 		case 'x':
 		case OPT_POSIX_TIMERS:
 			use_nanosleep = MODE_CYCLIC; break;
+		case OPT_TIMERFD:
+			use_nanosleep = MODE_TIMERFD; break;
+		case OPT_IO_URING:
+			use_nanosleep = MODE_IO_URING; break;
 		case '?':
 		case OPT_HELP:
 			display_help(0); break;
@@ -1189,6 +1577,17 @@ static void process_options(int argc, char *argv[], int max_cpus)
 			if (latency_target_value < 0)
 				latency_target_value = 0;
 			break;
+		case OPT_PERF:
+			use_perf = 1;
+			break;
+		case OPT_PLACEMENT:
+			placement = cpu_plan_policy(optarg);
+			if (placement < 0) {
+				warn("invalid placement '%s', use one of "
+				     CPU_PLAN_POLICIES "\n", optarg);
+				error = 1;
+			}
+			break;
 		case OPT_POLICY:
 			handlepolicy(optarg); break;
 		case OPT_DBGCYCLIC:
@@ -1204,12 +1603,19 @@ static void process_options(int argc, char *argv[], int max_cpus)
 			break;
 		case OPT_TRACEMARK:
 			trace_marker = 1; break;
+		case OPT_TSC:
+#ifdef FRC_MISSING
+			fatal("--tsc is not available on your arch\n");
+#else
+			use_tsc = 1;
+#endif
+			break;
 		}
 	}
 
-	if ((use_system == MODE_SYS_OFFSET) && (use_nanosleep == MODE_CYCLIC)) {
+	if ((use_system == MODE_SYS_OFFSET) && (use_nanosleep != MODE_CLOCK_NANOSLEEP)) {
 		warn("The system option requires clock_nanosleep\n");
-		warn("and is not compatible with posix_timers\n");
+		warn("and is not compatible with posix_timers, timerfd or io_uring\n");
 		warn("Using clock_nanosleep\n");
 		use_nanosleep = MODE_CLOCK_NANOSLEEP;
 	}
@@ -1226,6 +1632,15 @@ static void process_options(int argc, char *argv[], int max_cpus)
 			warn("-a ignored due to smp mode\n");
 	}
 
+	if (placement >= 0) {
+		cpu_plan = cpu_plan_create(placement, affinity_mask);
+		if (!cpu_plan) {
+			warn("no CPU left for placement %s\n",
+			     cpu_plan_name(placement));
+			error = 1;
+		}
+	}
+
 	if (smi) {
 		if (setaffinity == AFFINITY_UNSPECIFIED)
 			fatal("SMI counter relies on thread affinity\n");
@@ -1252,6 +1667,9 @@ static void process_options(int argc, char *argv[], int max_cpus)
 	if (histogram > HIST_MAX)
 		histogram = HIST_MAX;
 
+	if (hist_digits < HIST_DIGITS_MIN || hist_digits > HIST_DIGITS_MAX)
+		error = 1;
+
 	if (histogram && distance != -1)
 		warn("distance is ignored and set to 0, if histogram enabled\n");
 	if (distance == -1)
@@ -1260,8 +1678,27 @@ static void process_options(int argc, char *argv[], int max_cpus)
 	if (priority < 0 || priority > 99)
 		error = 1;
 
+	if (refresh < 1)
+		error = 1;
+
+	if (main_suspend) {
+		if (refresh_on_max || verbose) {
+			warn("--mainsuspend is not compatible with -M and -v\n");
+			error = 1;
+		}
+		quiet = 1;
+	}
+
+	if (use_tsc && ((use_nanosleep != MODE_CLOCK_NANOSLEEP &&
+			 use_nanosleep != MODE_IO_URING) || use_system ||
+			timermode != TIMER_ABSTIME)) {
+		warn("--tsc requires absolute clock_nanosleep or io_uring wakeups\n");
+		error = 1;
+	}
+
 	if (num_threads == -1)
-		num_threads = get_available_cpus(affinity_mask);
+		num_threads = cpu_plan ? cpu_plan->nr_cpus :
+			get_available_cpus(affinity_mask);
 
 	if (priospread && priority == 0) {
 		fprintf(stderr, "defaulting realtime priority to %d\n",
@@ -1325,23 +1762,27 @@ static void sighand(int sig)
 		int i;
 		int oldquiet = quiet;
 
-		if (rstat_fd == -1) {
-			fprintf(stderr, "ERROR: rstat_fd not valid\n");
+		if (!rstat_text) {
+			fprintf(stderr, "ERROR: rstat segment not valid\n");
 			return;
 		}
-		rstat_ftruncate(rstat_fd, 0);
+		rewind(rstat_text);
 		quiet = 0;
-		dprintf(rstat_fd, "#---------------------------\n");
-		dprintf(rstat_fd, "# cyclictest current status:\n");
+		fprintf(rstat_text, "#---------------------------\n");
+		fprintf(rstat_text, "# cyclictest current status:\n");
 		for (i = 0; i < num_threads; i++)
-			rstat_print_stat(parameters[i], i, 0, 0);
-		dprintf(rstat_fd, "#---------------------------\n");
+			print_stat(rstat_text, parameters[i], i, 0, 0);
+		fprintf(rstat_text, "#---------------------------\n");
+		fputc('\0', rstat_text);
+		fflush(rstat_text);
 		quiet = oldquiet;
 		return;
 	}
 	shutdown = 1;
 	if (refresh_on_max)
 		pthread_cond_signal(&refresh_on_max_cond);
+	if (main_suspend)
+		sem_post(&main_wakeup);
 }
 
 static void print_tids(struct thread_param *par[], int nthreads)
@@ -1374,13 +1815,23 @@ static void print_hist(struct thread_param *par[], int nthreads)
 	}
 
 	fprintf(fd, "# Histogram\n");
-	for (i = 0; i < histogram; i++) {
+	for (i = 0; i < par[0]->stats->hist.nbuckets; i++) {
 		unsigned long long int allthreads = 0;
+		uint64_t low = hist_bucket_low(&par[0]->stats->hist, i);
+
+		/* beyond the requested range only print the tail that was hit */
+		if (low >= histogram) {
+			for (j = 0; j < nthreads; j++)
+				if (par[j]->stats->hist.buckets[i])
+					break;
+			if (j == nthreads)
+				continue;
+		}
 
-		fprintf(fd, "%06d ", i);
+		fprintf(fd, "%06llu ", (unsigned long long)low);
 
 		for (j = 0; j < nthreads; j++) {
-			unsigned long curr_latency=par[j]->stats->hist_array[i];
+			unsigned long curr_latency=par[j]->stats->hist.buckets[i];
 			fprintf(fd, "%06lu", curr_latency);
 			if (j < nthreads - 1)
 				fprintf(fd, "\t");
@@ -1469,6 +1920,18 @@ static void print_stat(FILE *fp, struct thread_param *par, int index, int verbos
 				stat->act, stat->cycles ?
 				(long)(stat->avg/stat->cycles) : 0, stat->max);
 
+			if (use_percentiles) {
+				uint64_t pct[ARRAY_SIZE(live_percentiles)];
+				unsigned int j;
+
+				hist_tail_percentiles(&stat->hist, stat->cycles,
+						      stat->max, live_percentiles,
+						      pct, ARRAY_SIZE(pct));
+				for (j = 0; j < ARRAY_SIZE(pct); j++)
+					fprintf(fp, " P%g:%llu", live_percentiles[j],
+						(unsigned long long)pct[j]);
+			}
+
 			if (smi)
 				fprintf(fp, " SMI:%8ld", stat->smi_count);
 
@@ -1505,63 +1968,32 @@ static void print_stat(FILE *fp, struct thread_param *par, int index, int verbos
 	}
 }
 
-static void rstat_print_stat(struct thread_param *par, int index, int verbose, int quiet)
+/* Hand one composed screen update to the terminal in a single write() */
+static void display_flush(void)
 {
-	struct thread_stat *stat = par->stats;
-	int fd = rstat_fd;
-
-	if (!verbose) {
-		if (quiet != 1) {
-			char *fmt;
-			if (use_nsecs)
-				fmt = "T:%2d (%5d) P:%2d I:%ld C:%7lu "
-				        "Min:%7ld Act:%8ld Avg:%8ld Max:%8ld";
-			else
-				fmt = "T:%2d (%5d) P:%2d I:%ld C:%7lu "
-				        "Min:%7ld Act:%5ld Avg:%5ld Max:%8ld";
-
-			dprintf(fd, fmt, index, stat->tid, par->prio,
-				par->interval, stat->cycles, stat->min,
-				stat->act, stat->cycles ?
-				(long)(stat->avg/stat->cycles) : 0, stat->max);
-
-			if (smi)
-				dprintf(fd, " SMI:%8ld", stat->smi_count);
-
-			dprintf(fd, "\n");
-		}
-	} else {
-		while (stat->cycles != stat->cyclesread) {
-			unsigned long diff_smi;
-			long diff = stat->values
-			    [stat->cyclesread & par->bufmsk];
+	const char *p = display_buf;
+	size_t len;
 
-			if (smi)
-				diff_smi = stat->smis
-				[stat->cyclesread & par->bufmsk];
+	if (display == stdout)
+		return;
 
-			if (diff > stat->redmax) {
-				stat->redmax = diff;
-				stat->cycleofmax = stat->cyclesread;
-			}
-			if (++stat->reduce == oscope_reduction) {
-				if (!smi)
-					dprintf(fd, "%8d:%8lu:%8ld\n", index,
-						stat->cycleofmax, stat->redmax);
-				else
-					dprintf(fd, "%8d:%8lu:%8ld%8ld\n",
-						index, stat->cycleofmax,
-						stat->redmax, diff_smi);
+	fflush(stdout);
+	fflush(display);
+	len = ftell(display);
+	while (len) {
+		ssize_t n = write(STDOUT_FILENO, p, len);
 
-				stat->reduce = 0;
-				stat->redmax = 0;
-			}
-			stat->cyclesread++;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
 		}
+		p += n;
+		len -= n;
 	}
+	rewind(display);
 }
 
-
 /*
  * thread that creates a named fifo and hands out run stats when someone
  * reads from the fifo.
@@ -1595,58 +2027,195 @@ static void *fifothread(void *param)
 	return NULL;
 }
 
-static int trigger_init()
+/*
+ * Encode up to CT_STREAM_BLOCK_SAMPLES queued samples of one thread as
+ * a block of the stream file, see ct_stream.h. Returns the number of
+ * samples written.
+ */
+static unsigned int stream_write_block(FILE *fp, struct thread_param *par,
+				       uint8_t *payload)
 {
+	struct stream_ring *ring = par->stats->ring;
+	struct ct_stream_block blk;
+	struct stream_sample *sample;
+	uint64_t head, tail, cycle, ts;
+	unsigned int size = 0;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return 0;
+	if (head - tail > CT_STREAM_BLOCK_SAMPLES)
+		head = tail + CT_STREAM_BLOCK_SAMPLES;
+
+	sample = &ring->buf[tail & (STREAM_RING_SIZE - 1)];
+	blk.magic = CT_STREAM_BLOCK_MAGIC;
+	blk.tnum = par->tnum;
+	blk.cpu = par->cpu;
+	blk.node = par->node;
+	blk.count = head - tail;
+	blk.cycle = cycle = sample->cycle;
+	blk.ts = ts = sample->ts;
+
+	for (; tail != head; tail++) {
+		sample = &ring->buf[tail & (STREAM_RING_SIZE - 1)];
+		size += ct_put_varint(payload + size, sample->cycle - cycle);
+		size += ct_put_varint(payload + size,
+				      ct_zigzag((int64_t)(sample->ts - ts)));
+		size += ct_put_varint(payload + size, sample->latency);
+		size += ct_put_varint(payload + size, sample->smi);
+		cycle = sample->cycle;
+		ts = sample->ts;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	blk.size = size;
+	if (fwrite(&blk, sizeof(blk), 1, fp) != 1 ||
+	    fwrite(payload, size, 1, fp) != 1)
+		warn("short write to stream file %s\n", streamfile);
+
+	return blk.count;
+}
+
+static void stream_drain(FILE *fp, struct thread_param *par, uint8_t *payload)
+{
+	while (stream_write_block(fp, par, payload) == CT_STREAM_BLOCK_SAMPLES)
+		;
+}
+
+/*
+ * Low priority thread that empties the per thread sample rings into
+ * the stream file. The measurement threads never wait for it; if it
+ * falls behind, samples are dropped and counted.
+ */
+static void *streamthread(void *param)
+{
+	struct ct_stream_header hdr;
+	uint8_t *payload;
+	FILE *fp;
 	int i;
-	int size = trigger_list_size;
-	struct thread_trigger *trig = NULL;
-	for(i=0; i<size; i++) {
-		trig = malloc(sizeof(struct thread_trigger));
-		if (trig != NULL) {
-			if  (head == NULL) {
-				head = trig;
-				tail = trig;
-			} else {
-				tail->next = trig;
-				tail = trig;
-			}
-			trig->tnum = i;
-			trig->next = NULL;
-		} else {
-			return -1;
-		}
+
+	payload = malloc(CT_STREAM_BLOCK_SAMPLES * CT_STREAM_SAMPLE_MAX);
+	if (!payload) {
+		fprintf(stderr, "Error allocating stream buffer\n");
+		return NULL;
 	}
-	current = head;
+
+	fp = fopen(streamfile, "w");
+	if (!fp) {
+		fprintf(stderr, "Error opening stream file %s: %s\n",
+			streamfile, strerror(errno));
+		free(payload);
+		return NULL;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CT_STREAM_MAGIC, sizeof(hdr.magic));
+	hdr.version = CT_STREAM_VERSION;
+	hdr.flags = use_nsecs ? CT_STREAM_FLAG_NSECS : 0;
+	hdr.num_threads = num_threads;
+	hdr.interval = parameters[0]->interval;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		warn("short write to stream file %s\n", streamfile);
+
+	while (!stream_stop) {
+		for (i = 0; i < num_threads; i++)
+			stream_drain(fp, parameters[i], payload);
+		usleep(10000);
+	}
+
+	/* the measurement threads are gone, collect what is left */
+	for (i = 0; i < num_threads; i++)
+		stream_drain(fp, parameters[i], payload);
+
+	fclose(fp);
+	free(payload);
+	return NULL;
+}
+
+/*
+ * Every measurement thread logs its spikes into its own preallocated
+ * array, so recording a spike never takes a lock or touches memory of
+ * another CPU. The logs are only merged at exit in trigger_print().
+ */
+static int trigger_init(struct thread_stat *stat, int cpu)
+{
+	size_t size = trigger_list_size * sizeof(struct thread_trigger);
+
+	stat->triggers = cpu_local_alloc(size, cpu);
+	if (!stat->triggers)
+		return -1;
+	memset(stat->triggers, 0, size);
+
 	return 0;
 }
 
-static void trigger_print()
+static int trigger_cmp(const void *a, const void *b)
 {
-	struct thread_trigger *trig = head;
-	char *fmt = "T:%2d Spike:%8ld: TS: %12ld\n";
+	const struct thread_trigger *ta = a, *tb = b;
+
+	if (ta->ts != tb->ts)
+		return ta->ts < tb->ts ? -1 : 1;
+	return ta->tnum - tb->tnum;
+}
 
-	if (current == head)
+static void trigger_print(void)
+{
+	struct thread_trigger *all;
+	char *fmt = "T:%2d Spike:%8ld: TS: %12ld";
+	unsigned long spikes = 0;
+	int i, n = 0;
+
+	for (i = 0; i < num_threads; i++)
+		spikes += statistics[i]->spikes;
+	if (!spikes)
 		return;
+
+	all = calloc((size_t)num_threads * trigger_list_size, sizeof(*all));
+	if (!all) {
+		fprintf(stderr, "failed to allocate spike list\n");
+		return;
+	}
+	for (i = 0; i < num_threads; i++) {
+		struct thread_stat *stat = statistics[i];
+		int logged = stat->spikes < trigger_list_size ?
+			stat->spikes : trigger_list_size;
+
+		memcpy(&all[n], stat->triggers, logged * sizeof(*all));
+		n += logged;
+	}
+	qsort(all, n, sizeof(*all), trigger_cmp);
+
 	printf("\n");
-	while (trig->next != current) {
-		fprintf(stdout, fmt,  trig->tnum, trig->diff, trig->ts);
-		trig = trig->next;
+	for (i = 0; i < n; i++) {
+		fprintf(stdout, fmt, all[i].tnum, (long)all[i].diff, (long)all[i].ts);
+		if (use_perf) {
+			fprintf(stdout, " ");
+			perf_counters_print(stdout, &statistics[all[i].tnum]->perf,
+					    all[i].perf);
+		}
+		fprintf(stdout, "\n");
 	}
-		fprintf(stdout, fmt,  trig->tnum, trig->diff, trig->ts);
-		printf("spikes = %d\n\n", spikes);
+	printf("spikes = %lu\n\n", spikes);
+
+	free(all);
 }
 
-static void trigger_update(struct thread_param *par, int diff, int64_t ts)
+static inline void trigger_update(struct thread_param *par, int diff, int64_t ts)
 {
-	pthread_mutex_lock(&trigger_lock);
-	if (current != NULL) {
-		current->tnum = par->tnum;
-		current->ts = ts;
-		current->diff = diff;
-		current = current->next;
-	}
-	spikes++;
-	pthread_mutex_unlock(&trigger_lock);
+	struct thread_stat *stat = par->stats;
+
+	if (stat->spikes < trigger_list_size) {
+		struct thread_trigger *trig = &stat->triggers[stat->spikes];
+
+		trig->cpu = par->cpu;
+		trig->tnum = par->tnum;
+		trig->ts = ts;
+		trig->diff = diff;
+		if (use_perf)
+			memcpy(trig->perf, stat->perf.delta, sizeof(trig->perf));
+	}
+	stat->spikes++;
 }
 
 /* Running status shared memory open */
@@ -1689,12 +2258,12 @@ static int rstat_ftruncate(int fd, off_t len)
 	return err;
 }
 
-static void *rstat_mmap(int fd)
+static void *rstat_mmap(int fd, size_t size)
 {
 	void *mptr;
 
 	errno = 0;
-	mptr = mmap(0, _SC_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	mptr = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
 
 	if (mptr == (void*)-1)
 		fprintf(stderr, "ERROR: mmap, %s\n", strerror(errno));
@@ -1702,43 +2271,118 @@ static void *rstat_mmap(int fd)
 	return mptr;
 }
 
-static int rstat_mlock(void *mptr)
+static int rstat_mlock(void *mptr, size_t size)
 {
 	int err;
 
 	errno = 0;
-	err = mlock(mptr, _SC_PAGE_SIZE);
+	err = mlock(mptr, size);
 	if (err == -1)
 		fprintf(stderr, "ERROR, mlock %s\n", strerror(errno));
 
 	return err;
 }
 
+static size_t rstat_page_align(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (size + page - 1) & ~(page - 1);
+}
+
+/* Histogram of thread i inside the rstat segment, or NULL */
+static struct ct_rstat_thread *rstat_slot(void *base, int i)
+{
+	return (struct ct_rstat_thread *)((char *)base + CT_RSTAT_HEADER_SIZE) + i;
+}
+
+static unsigned long *rstat_hist(int i)
+{
+	struct ct_rstat_thread *slot;
+
+	if (!rstat_base)
+		return NULL;
+
+	slot = rstat_slot(rstat_base, i);
+	if (!slot->hist_offset)
+		return NULL;
+
+	return (unsigned long *)((char *)rstat_base + slot->hist_offset);
+}
+
+/*
+ * Create the running status segment, see ct_rstat.h for the layout:
+ * header, one slot per thread, the SIGUSR2 text area and, if enabled,
+ * one page aligned histogram per thread.
+ */
 static void rstat_setup(void)
 {
-	int res;
+	struct ct_rstat_header *hdr;
+	struct ct_rstat_thread *slot;
+	struct histogram geom;
+	size_t text_offset, text_size, hist_offset, hist_bytes = 0;
+	int sfd, res, i;
 	void *mptr = NULL;
 
-	int sfd = rstat_shm_open();
+	if ((histogram || use_percentiles || use_export) &&
+	    !hist_init(&geom, hist_digits, use_nsecs ?
+		       HIST_RANGE_BITS_NS : HIST_RANGE_BITS_US))
+		hist_bytes = rstat_page_align(hist_size(&geom));
+
+	text_offset = rstat_page_align(CT_RSTAT_HEADER_SIZE +
+				       num_threads * sizeof(*slot));
+	text_size = rstat_page_align(num_threads * 160 + 256);
+	hist_offset = text_offset + text_size;
+	rstat_size = hist_offset + num_threads * hist_bytes;
+
+	sfd = rstat_shm_open();
 	if (sfd < 0)
 		goto rstat_err;
 
-	res = rstat_ftruncate(sfd, _SC_PAGE_SIZE);
+	res = rstat_ftruncate(sfd, rstat_size);
 	if (res)
 		goto rstat_err1;
 
-	mptr = rstat_mmap(sfd);
+	mptr = rstat_mmap(sfd, rstat_size);
 	if (mptr == MAP_FAILED)
 		goto rstat_err1;
 
-	res = rstat_mlock(mptr);
+	res = rstat_mlock(mptr, rstat_size);
 	if (res)
 		goto rstat_err2;
 
+	rstat_text = fmemopen((char *)mptr + text_offset, text_size, "w");
+	if (!rstat_text)
+		goto rstat_err2;
+
+	hdr = mptr;
+	slot = rstat_slot(mptr, 0);
+	for (i = 0; i < num_threads; i++) {
+		slot[i].cpu = -1;
+		if (hist_bytes) {
+			slot[i].hist_offset = hist_offset + i * hist_bytes;
+			slot[i].hist_sub_bits = geom.sub_bits;
+			slot[i].hist_nbuckets = geom.nbuckets;
+		}
+	}
+
+	hdr->version = CT_RSTAT_VERSION;
+	hdr->header_size = CT_RSTAT_HEADER_SIZE;
+	hdr->thread_size = sizeof(*slot);
+	hdr->num_threads = num_threads;
+	hdr->flags = use_nsecs ? CT_RSTAT_FLAG_NSECS : 0;
+	hdr->pid = getpid();
+	hdr->text_offset = text_offset;
+	hdr->text_size = text_size;
+	/* the magic goes last, it tells readers the header is complete */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(hdr->magic, CT_RSTAT_MAGIC, sizeof(hdr->magic));
+
+	rstat_base = mptr;
 	return;
 
 rstat_err2:
-	munmap(mptr, _SC_PAGE_SIZE);
+	munmap(mptr, rstat_size);
 rstat_err1:
 	close(sfd);
 	shm_unlink(shm_name);
@@ -1750,7 +2394,7 @@ rstat_err:
 static void write_stats(FILE *f, void *data)
 {
 	struct thread_param **par = parameters;
-	unsigned int i, j, comma;
+	unsigned int i;
 	struct thread_stat *s;
 
 	fprintf(f, "  \"num_threads\": %d,\n", num_threads);
@@ -1759,22 +2403,28 @@ static void write_stats(FILE *f, void *data)
 	for (i = 0; i < num_threads; i++) {
 		fprintf(f, "    \"%u\": {\n", i);
 
-		fprintf(f, "      \"histogram\": {");
 		s = par[i]->stats;
-		for (j = 0, comma = 0; j < histogram; j++) {
-			if (s->hist_array[j] == 0)
-				continue;
-			fprintf(f, "%s", comma ? ",\n" : "\n");
-			fprintf(f, "        \"%u\": %ld", j, s->hist_array[j]);
-			comma = 1;
+		if (s->hist.buckets) {
+			fprintf(f, "      \"histogram\": ");
+			hist_print_json(f, &s->hist, 6);
+			fprintf(f, ",\n");
+		} else {
+			fprintf(f, "      \"histogram\": {},\n");
+		}
+		if (use_percentiles) {
+			fprintf(f, "      \"percentiles\": ");
+			hist_print_percentiles_json(f, &s->hist, s->max, 6);
+			fprintf(f, ",\n");
 		}
-		if (comma)
-			fprintf(f, "\n");
-		fprintf(f, "      },\n");
 		fprintf(f, "      \"cycles\": %ld,\n", s->cycles);
 		fprintf(f, "      \"min\": %ld,\n", s->min);
 		fprintf(f, "      \"max\": %ld,\n", s->max);
 		fprintf(f, "      \"avg\": %.2f,\n", s->avg/s->cycles);
+		if (use_perf && s->perf.mask) {
+			fprintf(f, "      \"perf\": ");
+			perf_counters_json(f, &s->perf, 6);
+			fprintf(f, ",\n");
+		}
 		fprintf(f, "      \"cpu\": %d,\n", par[i]->cpu);
 		fprintf(f, "      \"node\": %d\n", par[i]->node);
 		fprintf(f, "    }%s\n", i == num_threads - 1 ? "" : ",");
@@ -1805,8 +2455,12 @@ int main(int argc, char **argv)
 	int status;
 
 	rt_init(argc, argv);
+	display = stdout;
 	process_options(argc, argv, max_cpus);
 
+	if (main_suspend)
+		sem_init(&main_wakeup, 0, 0);
+
 	if (check_privs())
 		exit(EXIT_FAILURE);
 
@@ -1825,15 +2479,6 @@ int main(int argc, char **argv)
 				numa_bitmask_weight(affinity_mask));
 	}
 
-	if (trigger) {
-		int retval;
-		retval = trigger_init();
-		if (retval != 0) {
-			fprintf(stderr, "trigger_init() failed\n");
-			exit(EXIT_FAILURE);
-		}
-	}
-
 	/* lock all memory (prevent swapping) */
 	if (lockall)
 		if (mlockall(MCL_CURRENT|MCL_FUTURE) == -1) {
@@ -1845,11 +2490,23 @@ int main(int argc, char **argv)
 	set_latency_target();
 
 	if (tracelimit && trace_marker)
-		enable_trace_mark();
+		tracemark_open(0);
 
 	if (check_timer())
 		warn("High resolution timers not available\n");
 
+	if (use_tsc) {
+		if (!tsc_is_stable())
+			warn("cycle counter is not invariant, --tsc results may be skewed\n");
+		if (tsc_calibrate(&tsc_scale, clocksources[clocksel],
+				  TSC_CALIBRATE_MS))
+			fatal("failed to calibrate the cycle counter\n");
+		tsc_lat_mult = use_nsecs ? tsc_scale.ns_mult :
+			tsc_scale.ns_mult / 1000;
+		if (verbose)
+			printf("Cycle counter: %.3f MHz\n", tsc_scale.hz / 1e6);
+	}
+
 	if (check_clock_resolution) {
 		int clock;
 		uint64_t diff;
@@ -1965,6 +2622,9 @@ int main(int argc, char **argv)
 	if (!statistics)
 		goto outpar;
 
+	if (use_export)
+		export_init("cyclictest", use_nsecs ? "ns" : "us");
+
 	for (i = 0; i < num_threads; i++) {
 		pthread_attr_t attr;
 		int node;
@@ -1988,6 +2648,13 @@ int main(int argc, char **argv)
 		default: cpu = -1;
 		}
 
+		/* --placement reorders the CPUs -a would hand out */
+		if (cpu_plan) {
+			cpu = cpu_plan_cpu(cpu_plan, i);
+			if (verbose)
+				printf("Thread %d placed on cpu %d.\n", i, cpu);
+		}
+
 		node = -1;
 		if (numa) {
 			void *stack;
@@ -2017,47 +2684,84 @@ int main(int argc, char **argv)
 				      i, stack+stksize);
 		}
 
+		/*
+		 * The per thread buffers are on the node of the CPU whenever
+		 * the thread is pinned, with or without --numa.
+		 */
+
 		/* allocate the thread's parameter block  */
-		parameters[i] = par = threadalloc(sizeof(struct thread_param), node);
+		parameters[i] = par = cpu_local_alloc(sizeof(struct thread_param), cpu);
 		if (par == NULL)
 			fatal("error allocating thread_param struct for thread %d\n", i);
 		memset(par, 0, sizeof(struct thread_param));
+		/* the cleanup frees by par->cpu */
+		par->cpu = cpu;
 
 		/* allocate the thread's statistics block */
-		statistics[i] = stat = threadalloc(sizeof(struct thread_stat), node);
+		statistics[i] = stat = cpu_local_alloc(sizeof(struct thread_stat), cpu);
 		if (stat == NULL)
 			fatal("error allocating thread status struct for thread %d\n", i);
 		memset(stat, 0, sizeof(struct thread_stat));
 
 		/* allocate the histogram if requested */
+		if (histogram || use_percentiles || use_export) {
+			if (hist_init(&stat->hist, hist_digits, use_nsecs ?
+				      HIST_RANGE_BITS_NS : HIST_RANGE_BITS_US))
+				fatal("invalid histogram geometry\n");
+			/* export the live histogram through the rstat segment */
+			stat->hist.buckets = rstat_hist(i);
+			if (stat->hist.buckets && cpu_local_node(cpu) != -1)
+				rt_numa_move_to_node(stat->hist.buckets,
+						     hist_size(&stat->hist),
+						     cpu_local_node(cpu));
+			else if (!stat->hist.buckets)
+				stat->hist.buckets = cpu_local_alloc(hist_size(&stat->hist), cpu);
+			if (stat->hist.buckets == NULL)
+				fatal("failed to allocate histogram on node %d\n",
+				      cpu_local_node(cpu));
+			memset(stat->hist.buckets, 0, hist_size(&stat->hist));
+		}
 		if (histogram) {
 			int bufsize = histogram * sizeof(long);
 
-			stat->hist_array = threadalloc(bufsize, node);
-			stat->outliers = threadalloc(bufsize, node);
-			if (stat->hist_array == NULL || stat->outliers == NULL)
+			stat->outliers = cpu_local_alloc(bufsize, cpu);
+			if (stat->outliers == NULL)
 				fatal("failed to allocate histogram of size %d on node %d\n",
 				      histogram, i);
-			memset(stat->hist_array, 0, bufsize);
 			memset(stat->outliers, 0, bufsize);
 		}
 
 		if (verbose) {
 			int bufsize = VALBUF_SIZE * sizeof(long);
-			stat->values = threadalloc(bufsize, node);
+			stat->values = cpu_local_alloc(bufsize, cpu);
 			if (!stat->values)
 				goto outall;
 			memset(stat->values, 0, bufsize);
 			par->bufmsk = VALBUF_SIZE - 1;
 			if (smi) {
 				int bufsize = VALBUF_SIZE * sizeof(long);
-				stat->smis = threadalloc(bufsize, node);
+				stat->smis = cpu_local_alloc(bufsize, cpu);
 				if (!stat->smis)
 					goto outall;
 				memset(stat->smis, 0, bufsize);
 			}
 		}
 
+		if (rstat_base)
+			stat->rstat = rstat_slot(rstat_base, i);
+
+		if (trigger && trigger_init(stat, cpu)) {
+			fprintf(stderr, "trigger_init() failed\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (use_stream) {
+			stat->ring = cpu_local_alloc(sizeof(struct stream_ring), cpu);
+			if (!stat->ring)
+				goto outall;
+			memset(stat->ring, 0, sizeof(struct stream_ring));
+		}
+
 		par->prio = priority;
 		if (priority && (policy == SCHED_FIFO || policy == SCHED_RR))
 			par->policy = policy;
@@ -2081,13 +2785,17 @@ int main(int argc, char **argv)
 		par->stats = stat;
 		par->node = node;
 		par->tnum = i;
-		par->cpu = cpu;
 
 		stat->min = 1000000;
 		stat->max = 0;
 		stat->avg = 0.0;
 		stat->threadstarted = 1;
 		stat->smi_count = 0;
+		if (use_export && (cpu < 0 ?
+		    export_add(&stat->export, &stat->hist, "thread=\"%d\"", i) :
+		    export_add(&stat->export, &stat->hist,
+			       "thread=\"%d\",cpu=\"%d\"", i, cpu)))
+			fatal("failed to export thread %d\n", i);
 		status = pthread_create(&stat->thread, &attr, timerthread, par);
 		if (status)
 			fatal("failed to create thread %d: %s\n", i, strerror(status));
@@ -2098,10 +2806,37 @@ int main(int argc, char **argv)
 		if (status)
 			fatal("failed to create fifo thread: %s\n", strerror(status));
 	}
+	if (use_stream) {
+		status = pthread_create(&stream_threadid, NULL, streamthread, NULL);
+		if (status)
+			fatal("failed to create stream thread: %s\n", strerror(status));
+	}
+	if (use_export && export_start(exportspec))
+		fatal("failed to export stats on %s: %s\n", exportspec,
+		      strerror(errno));
 
-	while (!shutdown) {
+	if (main_suspend) {
+		int allstopped = 0;
+
+		/* every thread posts once on exit, signals post on shutdown */
+		while (!shutdown && allstopped < num_threads) {
+			if (sem_wait(&main_wakeup) == 0)
+				allstopped++;
+		}
+	}
+
+	if (!main_suspend && !verbose && !quiet)
+		loadavg_fd = open("/proc/loadavg", O_RDONLY);
+
+	if (!main_suspend && batch_output) {
+		display = open_memstream(&display_buf, &display_size);
+		if (!display)
+			fatal("failed to allocate display buffer\n");
+	}
+
+	while (!shutdown && !main_suspend) {
 		char lavg[256];
-		int fd, len, allstopped = 0;
+		int len, allstopped = 0;
 		static char *policystr = NULL;
 		static char *slash = NULL;
 		static char *policystr2;
@@ -2117,26 +2852,30 @@ int main(int argc, char **argv)
 				slash = policystr2 = "";
 		}
 		if (!verbose && !quiet) {
-			fd = open("/proc/loadavg", O_RDONLY, 0666);
-			len = read(fd, &lavg, 255);
-			close(fd);
-			lavg[len-1] = 0x0;
-			printf("policy: %s%s%s: loadavg: %s          \n\n",
-			       policystr, slash, policystr2, lavg);
+			len = -1;
+			if (loadavg_fd >= 0)
+				len = pread(loadavg_fd, lavg, sizeof(lavg) - 1, 0);
+			if (len > 0)
+				lavg[len-1] = 0x0;
+			else
+				strcpy(lavg, "n/a");
+			fprintf(display, "policy: %s%s%s: loadavg: %s          \n\n",
+				policystr, slash, policystr2, lavg);
 		}
 
 		for (i = 0; i < num_threads; i++) {
 
-			print_stat(stdout, parameters[i], i, verbose, quiet);
+			print_stat(display, parameters[i], i, verbose, quiet);
 			if (max_cycles && statistics[i]->cycles >= max_cycles)
 				allstopped++;
 		}
+		display_flush();
 
-		usleep(10000);
+		usleep(refresh * 1000);
 		if (shutdown || allstopped)
 			break;
 		if (!verbose && !quiet)
-			printf("\033[%dA", num_threads + 2);
+			fprintf(display, "\033[%dA", num_threads + 2);
 
 		if (refresh_on_max) {
 			pthread_mutex_lock(&refresh_on_max_lock);
@@ -2152,6 +2891,16 @@ int main(int argc, char **argv)
 	shutdown = 1;
 	usleep(50000);
 
+	if (display != stdout) {
+		/* emit a pending cursor move before leaving the status area */
+		display_flush();
+		fclose(display);
+		free(display_buf);
+		display = stdout;
+	}
+	if (loadavg_fd >= 0)
+		close(loadavg_fd);
+
 	if (!verbose && !quiet && refresh_on_max)
 		printf("\033[%dB", num_threads + 2);
 
@@ -2169,18 +2918,43 @@ int main(int argc, char **argv)
 				print_stat(stdout, parameters[i], i, 0, 0);
 		}
 		if (statistics[i]->values)
-			threadfree(statistics[i]->values, VALBUF_SIZE*sizeof(long), parameters[i]->node);
+			cpu_local_free(statistics[i]->values, VALBUF_SIZE*sizeof(long), parameters[i]->cpu);
+	}
+
+	if (use_export)
+		export_stop();
+
+	if (use_stream) {
+		stream_stop = 1;
+		if (stream_threadid)
+			pthread_join(stream_threadid, NULL);
+		for (i = 0; i < num_threads; i++) {
+			if (statistics[i]->stream_drops)
+				warn("thread %d: %lu samples dropped from stream\n",
+				     i, statistics[i]->stream_drops);
+			if (statistics[i]->ring)
+				cpu_local_free(statistics[i]->ring, sizeof(struct stream_ring),
+					       parameters[i]->cpu);
+		}
 	}
 
-	if (trigger)
+	if (trigger) {
 		trigger_print();
+		for (i = 0; i < num_threads; i++)
+			cpu_local_free(statistics[i]->triggers,
+				       trigger_list_size * sizeof(struct thread_trigger),
+				       parameters[i]->cpu);
+	}
 
 	if (histogram) {
 		print_hist(parameters, num_threads);
-		for (i = 0; i < num_threads; i++) {
-			threadfree(statistics[i]->hist_array, histogram*sizeof(long), parameters[i]->node);
-			threadfree(statistics[i]->outliers, histogram*sizeof(long), parameters[i]->node);
-		}
+		for (i = 0; i < num_threads; i++)
+			cpu_local_free(statistics[i]->outliers, histogram*sizeof(long), parameters[i]->cpu);
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		if (statistics[i]->hist.buckets && !rstat_hist(i))
+			cpu_local_free(statistics[i]->hist.buckets, hist_size(&statistics[i]->hist), parameters[i]->cpu);
 	}
 
 	if (tracelimit) {
@@ -2188,6 +2962,14 @@ int main(int argc, char **argv)
 		if (break_thread_id) {
 			printf("# Break thread: %d\n", break_thread_id);
 			printf("# Break value: %llu\n", (unsigned long long)break_thread_value);
+			for (i = 0; use_perf && i < num_threads; i++) {
+				if (statistics[i]->tid != break_thread_id)
+					continue;
+				printf("# Break perf: ");
+				perf_counters_print(stdout, &statistics[i]->perf,
+						    break_thread_perf);
+				printf("\n");
+			}
 		}
 	}
 
@@ -2195,18 +2977,18 @@ int main(int argc, char **argv)
 	for (i=0; i < num_threads; i++) {
 		if (!statistics[i])
 			continue;
-		threadfree(statistics[i], sizeof(struct thread_stat), parameters[i]->node);
+		cpu_local_free(statistics[i], sizeof(struct thread_stat), parameters[i]->cpu);
 	}
 
  outpar:
 	for (i = 0; i < num_threads; i++) {
 		if (!parameters[i])
 			continue;
-		threadfree(parameters[i], sizeof(struct thread_param), parameters[i]->node);
+		cpu_local_free(parameters[i], sizeof(struct thread_param), parameters[i]->cpu);
 	}
  out:
 	/* close any tracer file descriptors */
-	disable_trace_mark();
+	tracemark_close();
 
 	/* unlock everything */
 	if (lockall)
@@ -2218,10 +3000,15 @@ int main(int argc, char **argv)
 
 	if (affinity_mask)
 		rt_bitmask_free(affinity_mask);
+	cpu_plan_free(cpu_plan);
 
 	/* Remove running status shared memory file if it exists */
 	if (rstat_fd >= 0)
 		shm_unlink(shm_name);
+	if (rstat_text)
+		fclose(rstat_text);
+	if (rstat_base)
+		munmap(rstat_base, rstat_size);
 
 	exit(ret);
 }
@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Offline analyzer for cyclictest --stream sample files
+ *
+ * Rebuilds per thread statistics, histograms and percentiles from a
+ * recorded run and optionally writes them in the same JSON layout as
+ * cyclictest --json.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "rt-utils.h"
+#include "rt-error.h"
+#include "rt-histogram.h"
+#include "ct_stream.h"
+
+struct thread_result {
+	unsigned long cycles;
+	unsigned long lost;
+	unsigned long smi_count;
+	uint64_t min;
+	uint64_t max;
+	double avg;
+	uint64_t next_cycle;
+	int cpu;
+	int node;
+	int seen;
+	struct histogram hist;
+};
+
+static struct ct_stream_header header;
+static struct thread_result *results;
+static int hist_digits = HIST_DIGITS_DEFAULT;
+static int histogram;
+static char jsonfile[MAX_PATH];
+
+static void display_help(int error)
+{
+	printf("cyclictest_analyze V %1.2f\n", VERSION);
+	printf("Usage:\n"
+	       "cyclictest_analyze <options> FILE\n\n"
+	       "Analyze a sample file written by cyclictest --stream\n\n"
+	       "-h       --histogram       print the non-empty histogram buckets\n"
+	       "	 --histdigits=N    significant decimal digits kept per histogram bucket\n"
+	       "			   1-4, default=3\n"
+	       "         --json=FILENAME   write results into FILENAME, JSON formatted\n"
+	       "         --help            print this message\n"
+		);
+	if (error)
+		exit(EXIT_FAILURE);
+	exit(EXIT_SUCCESS);
+}
+
+enum option_values {
+	OPT_HISTOGRAM = 1, OPT_HISTDIGITS, OPT_JSON, OPT_HELP,
+};
+
+static void process_options(int argc, char *argv[])
+{
+	for (;;) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{"histogram",	no_argument,		NULL, OPT_HISTOGRAM },
+			{"histdigits",	required_argument,	NULL, OPT_HISTDIGITS },
+			{"json",	required_argument,	NULL, OPT_JSON },
+			{"help",	no_argument,		NULL, OPT_HELP },
+			{NULL, 0, NULL, 0 },
+		};
+		int c = getopt_long(argc, argv, "h", long_options,
+				    &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'h':
+		case OPT_HISTOGRAM:
+			histogram = 1;
+			break;
+		case OPT_HISTDIGITS:
+			hist_digits = atoi(optarg);
+			break;
+		case OPT_JSON:
+			strncpy(jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
+		case OPT_HELP:
+			display_help(0);
+			break;
+		default:
+			display_help(1);
+			break;
+		}
+	}
+
+	if (hist_digits < HIST_DIGITS_MIN || hist_digits > HIST_DIGITS_MAX)
+		display_help(1);
+
+	if (optind != argc - 1)
+		display_help(1);
+}
+
+static void read_header(FILE *fp)
+{
+	unsigned int i;
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    memcmp(header.magic, CT_STREAM_MAGIC, sizeof(header.magic)))
+		fatal("not a cyclictest stream file\n");
+	if (header.version != CT_STREAM_VERSION)
+		fatal("unsupported stream file version %u\n", header.version);
+	if (header.num_threads == 0)
+		fatal("stream file contains no threads\n");
+
+	results = calloc(header.num_threads, sizeof(*results));
+	if (!results)
+		fatal("failed to allocate thread results\n");
+
+	for (i = 0; i < header.num_threads; i++) {
+		struct thread_result *res = &results[i];
+
+		if (hist_init(&res->hist, hist_digits,
+			      header.flags & CT_STREAM_FLAG_NSECS ?
+			      HIST_RANGE_BITS_NS : HIST_RANGE_BITS_US) ||
+		    hist_alloc(&res->hist))
+			fatal("failed to allocate histogram for thread %u\n", i);
+		res->min = UINT64_MAX;
+		res->cpu = -1;
+		res->node = -1;
+	}
+}
+
+static void decode_block(const struct ct_stream_block *blk,
+			 const uint8_t *payload)
+{
+	struct thread_result *res = &results[blk->tnum];
+	const uint8_t *p = payload, *end = payload + blk->size;
+	uint64_t cycle = blk->cycle, ts = blk->ts;
+	uint64_t field[4], lat;
+	unsigned int i, j, n;
+
+	if (!res->seen) {
+		res->seen = 1;
+		res->next_cycle = cycle;
+	}
+	res->cpu = blk->cpu;
+	res->node = blk->node;
+
+	for (i = 0; i < blk->count; i++) {
+		/* cycle delta, timestamp delta, latency, smi delta */
+		for (j = 0; j < ARRAY_SIZE(field); j++) {
+			n = ct_get_varint(p, end, &field[j]);
+			if (!n)
+				fatal("corrupt block for thread %u\n", blk->tnum);
+			p += n;
+		}
+		cycle += field[0];
+		ts += ct_unzigzag(field[1]);
+		lat = field[2];
+
+		if (cycle > res->next_cycle)
+			res->lost += cycle - res->next_cycle;
+		res->next_cycle = cycle + 1;
+
+		res->cycles++;
+		res->smi_count += field[3];
+		res->avg += (double) lat;
+		if (lat < res->min)
+			res->min = lat;
+		if (lat > res->max)
+			res->max = lat;
+		hist_sample(&res->hist, lat);
+	}
+}
+
+static void read_blocks(FILE *fp)
+{
+	uint8_t *payload;
+	struct ct_stream_block blk;
+
+	payload = malloc(CT_STREAM_BLOCK_SAMPLES * CT_STREAM_SAMPLE_MAX);
+	if (!payload)
+		fatal("failed to allocate block buffer\n");
+
+	while (fread(&blk, sizeof(blk), 1, fp) == 1) {
+		if (blk.magic != CT_STREAM_BLOCK_MAGIC ||
+		    blk.tnum >= header.num_threads ||
+		    blk.count > CT_STREAM_BLOCK_SAMPLES ||
+		    blk.size > CT_STREAM_BLOCK_SAMPLES * CT_STREAM_SAMPLE_MAX)
+			fatal("corrupt block header\n");
+		if (fread(payload, blk.size, 1, fp) != 1) {
+			warn("truncated block for thread %u\n", blk.tnum);
+			break;
+		}
+		decode_block(&blk, payload);
+	}
+
+	free(payload);
+}
+
+static void print_results(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < header.num_threads; i++) {
+		struct thread_result *res = &results[i];
+
+		printf("T:%2u C:%7lu Min:%7llu Avg:%7ld Max:%8llu",
+		       i, res->cycles,
+		       res->cycles ? (unsigned long long)res->min : 0,
+		       res->cycles ? (long)(res->avg / res->cycles) : 0,
+		       (unsigned long long)res->max);
+		for (j = 0; j < hist_json_npercentiles; j++) {
+			uint64_t val = hist_percentile(&res->hist,
+						       hist_json_percentiles[j]);
+
+			if (val > res->max)
+				val = res->max;
+			printf(" P%g:%llu", hist_json_percentiles[j],
+			       (unsigned long long)val);
+		}
+		if (res->lost)
+			printf(" Lost:%lu", res->lost);
+		if (res->smi_count)
+			printf(" SMI:%lu", res->smi_count);
+		printf("\n");
+	}
+
+	if (!histogram)
+		return;
+
+	printf("# Histogram\n");
+	for (j = 0; j < results[0].hist.nbuckets; j++) {
+		for (i = 0; i < header.num_threads; i++)
+			if (results[i].hist.buckets[j])
+				break;
+		if (i == header.num_threads)
+			continue;
+
+		printf("%06llu", (unsigned long long)
+		       hist_bucket_low(&results[0].hist, j));
+		for (i = 0; i < header.num_threads; i++)
+			printf("%s%06lu", i ? "\t" : " ",
+			       results[i].hist.buckets[j]);
+		printf("\n");
+	}
+}
+
+static void write_stats(FILE *f, void *data)
+{
+	struct thread_result *res;
+	unsigned int i;
+
+	fprintf(f, "  \"num_threads\": %u,\n", header.num_threads);
+	fprintf(f, "  \"resolution_in_ns\": %u,\n",
+		header.flags & CT_STREAM_FLAG_NSECS ? 1 : 0);
+	fprintf(f, "  \"thread\": {\n");
+	for (i = 0; i < header.num_threads; i++) {
+		res = &results[i];
+		fprintf(f, "    \"%u\": {\n", i);
+		fprintf(f, "      \"histogram\": ");
+		hist_print_json(f, &res->hist, 6);
+		fprintf(f, ",\n");
+		fprintf(f, "      \"percentiles\": ");
+		hist_print_percentiles_json(f, &res->hist, res->max, 6);
+		fprintf(f, ",\n");
+		fprintf(f, "      \"cycles\": %lu,\n", res->cycles);
+		fprintf(f, "      \"lost\": %lu,\n", res->lost);
+		fprintf(f, "      \"min\": %llu,\n",
+			res->cycles ? (unsigned long long)res->min : 0);
+		fprintf(f, "      \"max\": %llu,\n", (unsigned long long)res->max);
+		fprintf(f, "      \"avg\": %.2f,\n",
+			res->cycles ? res->avg / res->cycles : 0.0);
+		fprintf(f, "      \"cpu\": %d,\n", res->cpu);
+		fprintf(f, "      \"node\": %d\n", res->node);
+		fprintf(f, "    }%s\n", i == header.num_threads - 1 ? "" : ",");
+	}
+	fprintf(f, "  }\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	FILE *fp;
+
+	rt_init(argc, argv);
+	process_options(argc, argv);
+
+	fp = fopen(argv[optind], "r");
+	if (!fp)
+		err_exit(errno, "Failed to open '%s'\n", argv[optind]);
+
+	read_header(fp);
+	read_blocks(fp);
+	fclose(fp);
+
+	print_results();
+
+	if (strlen(jsonfile) != 0)
+		rt_write_json(jsonfile, 0, write_stats, NULL);
+
+	for (i = 0; i < header.num_threads; i++)
+		hist_free(&results[i].hist);
+	free(results);
+
+	return EXIT_SUCCESS;
+}
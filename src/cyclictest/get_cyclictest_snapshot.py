@@ -9,6 +9,8 @@ import argparse
 import re
 import glob
 import sys
+import mmap
+import struct
 
 parser = argparse.ArgumentParser(description='Get a snapshot of running instances of cyclictest')
 parser.add_argument('-l', '--list', action='store_true', help='list the main pid(s) of running instances of cyclictest')
@@ -16,6 +18,54 @@ parser.add_argument('-s', '--snapshot', nargs='*', metavar='pid', help='take a s
 parser.add_argument('-p', '--print', nargs='*', metavar='pid', help='print the snapshots')
 args = parser.parse_args()
 
+# Layout of the running status segment, see src/cyclictest/ct_rstat.h
+RSTAT_MAGIC = b'CTRSTAT\0'
+RSTAT_HEADER = struct.Struct('=8sIIIIIiQQ')
+RSTAT_THREAD = struct.Struct('=IiiiQQqqqdQQII')
+RSTAT_FLAG_NSECS = 0x1
+
+
+def read_rstat(shm_file):
+    """ Return the status of a cyclictest instance as text. Binary
+        segments are read slot by slot under their seqlock, older
+        instances only provide the text written on SIGUSR2. """
+    with open(shm_file, 'rb') as f:
+        try:
+            m = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+        except ValueError:
+            return ''
+    with m:
+        if m[:len(RSTAT_MAGIC)] != RSTAT_MAGIC:
+            return m[:].split(b'\0', 1)[0].decode()
+
+        (_, _, header_size, thread_size, num_threads, flags, _,
+         _, _) = RSTAT_HEADER.unpack_from(m, 0)
+        # the field widths of print_stat() in cyclictest.c
+        width = 8 if flags & RSTAT_FLAG_NSECS else 5
+        fmt = 'T:%%2d (%%5d) P:%%2d I:%%d C:%%7d Min:%%7d Act:%%%dd Avg:%%%dd Max:%%8d' % \
+              (width, width)
+        lines = ['#---------------------------',
+                 '# cyclictest current status:']
+        for i in range(num_threads):
+            off = header_size + i * thread_size
+            while True:
+                seq = struct.unpack_from('=I', m, off)[0]
+                if seq & 1:
+                    continue
+                slot = RSTAT_THREAD.unpack_from(m, off)
+                if struct.unpack_from('=I', m, off)[0] == seq:
+                    break
+            (_, tid, prio, _, interval, cycles, tmin, tmax, act,
+             tsum, smi, _, _, _) = slot
+            avg = int(tsum / cycles) if cycles else 0
+            line = fmt % (i, tid, prio, interval, cycles, tmin, act, avg, tmax)
+            if smi:
+                line += ' SMI:%8d' % smi
+            lines.append(line)
+        lines.append('#---------------------------')
+        return '\n'.join(lines) + '\n'
+
+
 class Snapshot:
     """ Class for getting a snapshot of a running cyclictest instance """
 
@@ -66,16 +116,12 @@ class Snapshot:
             if not self.shm_files:
                 Snapshot.print_warning()
             for shm_file in self.shm_files:
-                with open(shm_file, 'r') as f:
-                    data = f.read()
-                print(data)
+                print(read_rstat(shm_file))
         else:
             for spid in spids:
                 if spid in self.pids:
                     shm_file = '/dev/shm/cyclictest' + spid
-                    with open(shm_file, 'r') as f:
-                        data = f.read()
-                    print(data)
+                    print(read_rstat(shm_file))
                 else:
                     Snapshot.print_warning()
 
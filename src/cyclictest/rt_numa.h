@@ -16,23 +16,7 @@
 static int numa = 0;
 
 #include <numa.h>
-
-static void *
-threadalloc(size_t size, int node)
-{
-	if (node == -1)
-		return malloc(size);
-	return numa_alloc_onnode(size, node);
-}
-
-static void
-threadfree(void *ptr, size_t size, int node)
-{
-	if (node == -1)
-		free(ptr);
-	else
-		numa_free(ptr, size);
-}
+#include <numaif.h>
 
 static void rt_numa_set_numa_run_on_node(int node, int cpu)
 {
@@ -54,6 +38,23 @@ static void *rt_numa_numa_alloc_onnode(size_t size, int node, int cpu)
 	return stack;
 }
 
+/*
+ * Bind a range to node and migrate the pages already faulted in, which
+ * numa_tonode_memory() leaves where they are. With mlockall() in effect
+ * every new mapping is populated at once.
+ */
+static void rt_numa_move_to_node(void *start, size_t size, int node)
+{
+	struct bitmask *nodes = numa_allocate_nodemask();
+
+	numa_bitmask_setbit(nodes, node);
+	if (mbind(start, size, MPOL_BIND, nodes->maskp, nodes->size + 1,
+		  MPOL_MF_MOVE))
+		warn("Could not move memory to NUMA node %d: %s\n",
+				node, strerror(errno));
+	numa_bitmask_free(nodes);
+}
+
 /*
  * Use new bit mask CPU affinity behavior
  */
@@ -30,12 +30,38 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <sched.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "rt-utils.h"
+#include "rt-histogram.h"
+#include "rt-tsc.h"
+#include "rt-uring.h"
+#include "rt-numa.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY		60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY		0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY	5
+#endif
 
 static unsigned int datasize = 100;
 static unsigned int loops = 100;
 static unsigned int num_groups = 10;
 static unsigned int num_fds = 20;
 static unsigned int fifo = 0;
+static unsigned int batch = 16;
 
 /*
  * 0 means thread mode and others mean process (default)
@@ -47,20 +73,73 @@ static unsigned int process_mode = PROCESS_MODE;
 
 static int use_pipes = 0;
 
+/*
+ * --placement puts every group on one CPU or one node of the --affinity
+ * set. Workers pin themselves before touching any memory, so their
+ * buffers are node local, and their contexts are allocated on the node.
+ * The topology policies of rt-numa pick the CPU of every group instead
+ * of plain round robin.
+ */
+#define PLACE_NONE	0
+#define PLACE_CPU	1
+#define PLACE_NODE	2
+#define PLACE_PLAN	3
+
+struct placement {
+	cpu_set_t cpus;
+	int node;		/* -1 for no node */
+};
+
+static int placement = PLACE_NONE;
+static int plan_policy;
+static char *affinity;
+static struct placement *placements;	/* per group, NULL without pinning */
+
+/* with --epoll a receiver multiplexes up to epoll_fds fds */
+static unsigned int epoll_fds;
+
 struct sender_context {
 	unsigned int num_fds;
 	int ready_out;
 	int wakefd;
+	const struct placement *place;
 	int out_fds[0];
 };
 
 struct receiver_context {
-	unsigned int num_packets;
-	int in_fds[2];
+	unsigned int num_packets;	/* per fd */
 	int ready_out;
 	int wakefd;
+	struct latency_stats *lat;
+	const struct placement *place;
+	unsigned int num_fds;
+	int in_fds[0];			/* num_fds pairs */
+};
+
+/*
+ * With --latency every message carries the time it was sent in its
+ * first 8 bytes and receivers account the difference to the time they
+ * read it. The statistics of all receivers live in one shared mapping,
+ * so forked receivers update them in place.
+ */
+#define LAT_OFF		0
+#define LAT_MONOTONIC	1
+#define LAT_TSC		2
+
+struct latency_stats {
+	struct histogram hist;	/* ns */
+	uint64_t min;
+	uint64_t max;
+	uint64_t count;
+	double sum;
 };
 
+static int latency_mode = LAT_OFF;
+static struct tsc_scale tsc_scale;
+static struct latency_stats *lat_stats;
+static size_t lat_map_size;
+static char *jsonfile;
+
 
 typedef union {
 	pthread_t threadid;
@@ -102,6 +181,24 @@ static void print_usage_exit(int error)
 	       "-s       --datasize=SIZE   message size\n"
 	       "-T       --threads         use POSIX threads\n"
 	       "-P       --process         use fork (default)\n"
+	       "         --transport=NAME  how messages are moved:\n"
+	       "                           rw       write() and read() (default)\n"
+	       "                           mmsg     sendmmsg() and recvmmsg()\n"
+	       "                           splice   vmsplice() and splice(), implies -p\n"
+	       "                           zerocopy MSG_ZEROCOPY over TCP loopback\n"
+	       "                           io_uring batched send and read requests\n"
+	       "         --batch=NUM       messages per sendmmsg()/recvmmsg() and zerocopy\n"
+	       "                           sends between reaping completions, default 16\n"
+	       "         --latency[=CLOCK] measure the latency of every message, CLOCK is\n"
+	       "                           monotonic (default) or tsc\n"
+	       "         --json=FILENAME   write the results into FILENAME, JSON formatted\n"
+	       "         --affinity=CPUSET run the groups on the CPUs in CPUSET\n"
+	       "         --placement=MODE  put every group on one cpu or one node of the\n"
+	       "                           CPUs, round robin, with node local contexts;\n"
+	       "                           core, nosmt, llc or cross-node pick the CPU of\n"
+	       "                           every group by topology\n"
+	       "         --epoll[=NUM]     one receiver multiplexes NUM fds of its group\n"
+	       "                           with epoll, default all of them\n"
 	       );
 	exit(error);
 }
@@ -118,6 +215,38 @@ static void fdpair(int fds[2])
 	barf("Creating fdpair");
 }
 
+static void seqpacket_pair(int fds[2])
+{
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds))
+		barf("Creating fdpair");
+}
+
+/* MSG_ZEROCOPY is only supported on TCP and UDP sockets */
+static void tcp_pair(int fds[2])
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(addr);
+	int lfd, one = 1;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(lfd, 1) || getsockname(lfd, (struct sockaddr *)&addr, &len))
+		barf("Creating TCP listener");
+	fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[1] < 0 || connect(fds[1], (struct sockaddr *)&addr, len))
+		barf("Connecting TCP pair");
+	fds[0] = accept(lfd, NULL, NULL);
+	if (fds[0] < 0)
+		barf("Accepting TCP pair");
+	close(lfd);
+
+	setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
 /* Block until we're ready to go */
 static void ready(int ready_out, int wakefd)
 {
@@ -133,46 +262,476 @@ static void ready(int ready_out, int wakefd)
 		barf("poll");
 }
 
+static inline uint64_t timestamp(void)
+{
+	struct timespec ts;
+	uint64_t t;
+
+	if (latency_mode == LAT_TSC) {
+		frc(&t);
+		return t;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void stamp(char *data)
+{
+	uint64_t now;
+
+	if (!latency_mode)
+		return;
+	now = timestamp();
+	memcpy(data, &now, sizeof(now));
+}
+
+static inline void account_latency(struct latency_stats *st, const char *data)
+{
+	uint64_t sent, now, lat;
+
+	if (!latency_mode)
+		return;
+	now = timestamp();
+	memcpy(&sent, data, sizeof(sent));
+	/* counters of different CPUs may be slightly apart */
+	lat = now > sent ? now - sent : 0;
+	if (latency_mode == LAT_TSC)
+		lat = tsc_to_ns(&tsc_scale, lat);
+
+	hist_sample(&st->hist, lat);
+	if (lat < st->min)
+		st->min = lat;
+	if (lat > st->max)
+		st->max = lat;
+	st->count++;
+	st->sum += lat;
+}
+
+/* Node of the contexts of a group, -1 without a placement */
+static int place_node(const struct placement *place)
+{
+	return place ? place->node : -1;
+}
+
+static void place_worker(const struct placement *place)
+{
+	if (place && sched_setaffinity(0, sizeof(place->cpus), &place->cpus))
+		barf("sched_setaffinity()");
+}
+
 static void reset_worker_signals(void)
 {
 	signal(SIGTERM, SIG_DFL);
 	signal(SIGINT, SIG_DFL);
 }
 
-/* Sender sprays loops messages down each file descriptor */
-static void *sender(struct sender_context *ctx)
+/*
+ * Transports
+ *
+ * rw is the classic one write() and one read() per message. The others
+ * move the same messages with fewer system calls or copies, so the run
+ * time reflects more of the scheduler and less of the syscall overhead:
+ *
+ * mmsg		sendmmsg()/recvmmsg() of up to --batch messages on
+ *		SOCK_SEQPACKET pairs, which keep the message boundaries.
+ * splice	the sender vmsplice()s its buffer into the pipe, the receiver
+ *		splice()s it to /dev/null without copying it to user space.
+ * zerocopy	send(MSG_ZEROCOPY) on TCP loopback pairs, reaping the
+ *		completions from the error queue. Loopback copies anyway on
+ *		delivery, but the pinning and notification cost is real.
+ * io_uring	one IORING_OP_SEND or IORING_OP_WRITE per fd, the sends to
+ *		all fds of a loop submitted with a single io_uring_enter().
+ *
+ * splice and zerocopy hand the sender's buffer to the kernel by
+ * reference, so they cannot carry the --latency timestamps.
+ */
+struct transport {
+	const char *name;
+	int pipes;		/* 1 pipes only, -1 sockets only, 0 both */
+	int stamps;		/* receivers read the timestamps */
+	void (*pair)(int fds[2]);
+	void (*send)(struct sender_context *ctx, char *data);
+	void (*recv)(struct receiver_context *ctx);
+};
+
+static void write_all(int fd, const char *data, size_t size)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < size) {
+		ret = write(fd, data + done, size - done);
+		if (ret < 0)
+			barf("SENDER: write");
+		done += ret;
+	}
+}
+
+static void read_all(int fd, char *data, size_t size)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < size) {
+		ret = read(fd, data + done, size - done);
+		if (ret < 0)
+			barf("SERVER: read");
+		done += ret;
+	}
+}
+
+static void send_rw(struct sender_context *ctx, char *data)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < loops; i++) {
+		for (j = 0; j < ctx->num_fds; j++) {
+			stamp(data);
+			write_all(ctx->out_fds[j], data, datasize);
+		}
+	}
+}
+
+static void recv_rw(struct receiver_context *ctx)
 {
 	char data[datasize];
+	unsigned int i;
+
+	for (i = 0; i < ctx->num_packets; i++) {
+		read_all(ctx->in_fds[0], data, datasize);
+		account_latency(ctx->lat, data);
+	}
+}
+
+static void send_mmsg(struct sender_context *ctx, char *data)
+{
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	unsigned int i, j, k, n, sent;
+	char *bufs;
+	int ret;
+
+	/* one buffer per message of a batch, for the timestamps */
+	msgs = calloc(batch, sizeof(*msgs));
+	iovs = calloc(batch, sizeof(*iovs));
+	bufs = malloc((size_t)batch * datasize);
+	if (!msgs || !iovs || !bufs)
+		barf("SENDER: malloc");
+	for (i = 0; i < batch; i++) {
+		memcpy(bufs + (size_t)i * datasize, data, datasize);
+		iovs[i].iov_base = bufs + (size_t)i * datasize;
+		iovs[i].iov_len = datasize;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < loops; i += n) {
+		n = loops - i < batch ? loops - i : batch;
+		for (j = 0; j < ctx->num_fds; j++) {
+			for (k = 0; k < n; k++)
+				stamp(iovs[k].iov_base);
+			for (sent = 0; sent < n; sent += ret) {
+				ret = sendmmsg(ctx->out_fds[j], msgs + sent,
+					       n - sent, 0);
+				if (ret < 0)
+					barf("SENDER: sendmmsg");
+			}
+		}
+	}
+	free(bufs);
+	free(iovs);
+	free(msgs);
+}
+
+static void recv_mmsg(struct receiver_context *ctx)
+{
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	unsigned int i, k, n;
+	char *bufs;
+	int ret;
+
+	msgs = calloc(batch, sizeof(*msgs));
+	iovs = calloc(batch, sizeof(*iovs));
+	bufs = malloc((size_t)batch * datasize);
+	if (!msgs || !iovs || !bufs)
+		barf("SERVER: malloc");
+	for (i = 0; i < batch; i++) {
+		iovs[i].iov_base = bufs + (size_t)i * datasize;
+		iovs[i].iov_len = datasize;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < ctx->num_packets; i += ret) {
+		n = ctx->num_packets - i < batch ? ctx->num_packets - i : batch;
+		ret = recvmmsg(ctx->in_fds[0], msgs, n, MSG_WAITFORONE, NULL);
+		if (ret < 0)
+			barf("SERVER: recvmmsg");
+		for (k = 0; k < ret; k++)
+			account_latency(ctx->lat, iovs[k].iov_base);
+	}
+	free(bufs);
+	free(iovs);
+	free(msgs);
+}
+
+static void send_splice(struct sender_context *ctx, char *data)
+{
+	struct iovec iov;
 	unsigned int i, j;
+	size_t done;
+	ssize_t ret;
 
-	reset_worker_signals();
-	ready(ctx->ready_out, ctx->wakefd);
-	memset(&data, '-', datasize);
+	/* data never changes, so the pipe may keep referencing it */
+	for (i = 0; i < loops; i++) {
+		for (j = 0; j < ctx->num_fds; j++) {
+			for (done = 0; done < datasize; done += ret) {
+				iov.iov_base = data + done;
+				iov.iov_len = datasize - done;
+				ret = vmsplice(ctx->out_fds[j], &iov, 1, 0);
+				if (ret < 0)
+					barf("SENDER: vmsplice");
+			}
+		}
+	}
+}
 
-	/* Now pump to every receiver. */
+static void recv_splice(struct receiver_context *ctx)
+{
+	unsigned long long left = (unsigned long long)ctx->num_packets * datasize;
+	ssize_t ret;
+	int devnull;
+
+	devnull = open("/dev/null", O_WRONLY);
+	if (devnull < 0)
+		barf("SERVER: open /dev/null");
+
+	while (left) {
+		ret = splice(ctx->in_fds[0], NULL, devnull, NULL,
+			     left < INT_MAX ? left : INT_MAX, SPLICE_F_MOVE);
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EPIPE;
+			barf("SERVER: splice");
+		}
+		left -= ret;
+	}
+	close(devnull);
+}
+
+/*
+ * Read the pending completions from the error queue of fd. All senders
+ * of a group share the sockets, so which sends they complete does not
+ * matter, only that the queue and the optmem it accounts stay short.
+ */
+static void zerocopy_reap(int fd, int wait)
+{
+	struct pollfd pollfd = { .fd = fd, .events = 0 };
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct msghdr msg;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+
+	/* another sender may reap first, do not wait for good */
+	if (wait && poll(&pollfd, 1, 10) < 0)
+		barf("SENDER: poll");
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN)
+				return;
+			barf("SENDER: recvmsg MSG_ERRQUEUE");
+		}
+
+		cm = CMSG_FIRSTHDR(&msg);
+		if (!cm)
+			continue;
+		serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno) {
+			errno = serr->ee_errno;
+			barf("SENDER: zerocopy completion");
+		}
+	}
+}
+
+static void send_zerocopy(struct sender_context *ctx, char *data)
+{
+	unsigned int i, j, sends = 0;
+	size_t done;
+	ssize_t ret;
+	int one = 1;
+
+	for (j = 0; j < ctx->num_fds; j++)
+		if (setsockopt(ctx->out_fds[j], SOL_SOCKET, SO_ZEROCOPY,
+			       &one, sizeof(one)))
+			barf("SENDER: SO_ZEROCOPY");
+
+	/*
+	 * data never changes, so the pages may stay pinned by the kernel
+	 * until the last completion without waiting for it.
+	 */
 	for (i = 0; i < loops; i++) {
 		for (j = 0; j < ctx->num_fds; j++) {
-			int ret, done = 0;
+			int fd = ctx->out_fds[j];
+
+			for (done = 0; done < datasize; done += ret) {
+				ret = send(fd, data + done, datasize - done,
+					   MSG_ZEROCOPY);
+				if (ret < 0 && errno == ENOBUFS) {
+					/* out of optmem for notifications */
+					zerocopy_reap(fd, 1);
+					ret = 0;
+					continue;
+				}
+				if (ret < 0)
+					barf("SENDER: send MSG_ZEROCOPY");
+			}
+		}
+		sends += ctx->num_fds;
+		if (sends >= batch) {
+			for (j = 0; j < ctx->num_fds; j++)
+				zerocopy_reap(ctx->out_fds[j], 0);
+			sends = 0;
+		}
+	}
+}
 
-again:
-			ret = write(ctx->out_fds[j], data + done, sizeof(data)-done);
-			if (ret < 0)
-				barf("SENDER: write");
-			done += ret;
-			if (done < sizeof(data))
-				goto again;
+static void send_uring(struct sender_context *ctx, char *data)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	struct rt_uring ring;
+	unsigned int i, j;
+	char *bufs, *buf;
+	int ret;
+
+	ret = rt_uring_init(&ring, ctx->num_fds);
+	if (ret) {
+		errno = -ret;
+		barf("SENDER: io_uring_setup");
+	}
+
+	/* the requests of a loop are in flight together, one buffer each */
+	bufs = malloc((size_t)ctx->num_fds * datasize);
+	if (!bufs)
+		barf("SENDER: malloc");
+	for (j = 0; j < ctx->num_fds; j++)
+		memcpy(bufs + (size_t)j * datasize, data, datasize);
+
+	for (i = 0; i < loops; i++) {
+		for (j = 0; j < ctx->num_fds; j++) {
+			sqe = rt_uring_get_sqe(&ring);
+			if (!sqe) {
+				errno = EBUSY;
+				barf("SENDER: io_uring sqe");
+			}
+			buf = bufs + (size_t)j * datasize;
+			stamp(buf);
+			sqe->opcode = use_pipes ? IORING_OP_WRITE : IORING_OP_SEND;
+			sqe->fd = ctx->out_fds[j];
+			if (use_pipes)
+				sqe->off = -1ULL;	/* current position */
+			sqe->addr = (unsigned long)buf;
+			sqe->len = datasize;
+			sqe->user_data = j;
+		}
+		for (j = 0; j < ctx->num_fds; j++) {
+			ret = rt_uring_submit_and_wait(&ring, &cqe);
+			if (!ret && cqe.res < 0)
+				ret = cqe.res;
+			if (ret) {
+				errno = -ret;
+				barf("SENDER: io_uring send");
+			}
+			/* finish short writes synchronously */
+			if ((unsigned int)cqe.res < datasize) {
+				buf = bufs + (size_t)cqe.user_data * datasize;
+				write_all(ctx->out_fds[cqe.user_data],
+					  buf + cqe.res, datasize - cqe.res);
+			}
 		}
 	}
+	free(bufs);
+	rt_uring_exit(&ring);
+}
+
+static void recv_uring(struct receiver_context *ctx)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	struct rt_uring ring;
+	char data[datasize];
+	unsigned int i, done;
+	int ret;
+
+	ret = rt_uring_init(&ring, 1);
+	if (ret) {
+		errno = -ret;
+		barf("SERVER: io_uring_setup");
+	}
+
+	for (i = 0; i < ctx->num_packets; i++) {
+		for (done = 0; done < datasize; done += cqe.res) {
+			sqe = rt_uring_get_sqe(&ring);
+			sqe->opcode = use_pipes ? IORING_OP_READ : IORING_OP_RECV;
+			sqe->fd = ctx->in_fds[0];
+			if (use_pipes)
+				sqe->off = -1ULL;
+			sqe->addr = (unsigned long)(data + done);
+			sqe->len = datasize - done;
+			ret = rt_uring_submit_and_wait(&ring, &cqe);
+			if (!ret && cqe.res <= 0)
+				ret = cqe.res ? cqe.res : -EPIPE;
+			if (ret) {
+				errno = -ret;
+				barf("SERVER: io_uring read");
+			}
+		}
+		account_latency(ctx->lat, data);
+	}
+	rt_uring_exit(&ring);
+}
+
+static const struct transport transports[] = {
+	{ "rw",		0,	1,	fdpair,		send_rw,	recv_rw },
+	{ "mmsg",	-1,	1,	seqpacket_pair,	send_mmsg,	recv_mmsg },
+	{ "splice",	1,	0,	fdpair,		send_splice,	recv_splice },
+	{ "zerocopy",	-1,	0,	tcp_pair,	send_zerocopy,	recv_rw },
+	{ "io_uring",	0,	1,	fdpair,		send_uring,	recv_uring },
+};
+
+static const struct transport *transport = &transports[0];
+
+/* Sender sprays loops messages down each file descriptor */
+static void *sender(struct sender_context *ctx)
+{
+	char data[datasize];
+
+	place_worker(ctx->place);
+	reset_worker_signals();
+	ready(ctx->ready_out, ctx->wakefd);
+	memset(&data, '-', datasize);
+
+	/* Now pump to every receiver. */
+	transport->send(ctx, data);
 
 	return NULL;
 }
 
 
+static size_t receiver_size(unsigned int num_fds)
+{
+	return sizeof(struct receiver_context) + 2 * num_fds * sizeof(int);
+}
+
 /* One receiver per fd */
 static void *receiver(struct receiver_context* ctx)
 {
-	unsigned int i;
-
+	place_worker(ctx->place);
 	reset_worker_signals();
 	if (process_mode == PROCESS_MODE)
 		close(ctx->in_fds[1]);
@@ -181,24 +740,103 @@ static void *receiver(struct receiver_context* ctx)
 	ready(ctx->ready_out, ctx->wakefd);
 
 	/* Receive them all */
-	for (i = 0; i < ctx->num_packets; i++) {
-		char data[datasize];
-		int ret, done = 0;
+	transport->recv(ctx);
 
-again:
-		ret = read(ctx->in_fds[0], data + done, datasize - done);
-		if (ret < 0)
-			barf("SERVER: read");
-		done += ret;
-		if (done < datasize)
-			goto again;
-	}
 	if (ctx) {
-		free(ctx);
+		node_local_free(ctx, receiver_size(1), place_node(ctx->place));
 	}
 	return NULL;
 }
 
+/*
+ * One receiver for several fds, event loop style. Whatever the
+ * transport, messages are read() from the non-blocking fds as they
+ * become readable and reassembled per fd.
+ */
+static void *epoll_receiver(struct receiver_context *ctx)
+{
+	unsigned long long left = (unsigned long long)ctx->num_packets * ctx->num_fds;
+	unsigned int k, nr_open = ctx->num_fds;
+	struct epoll_event ev, *events;
+	unsigned int *done;
+	char *bufs, *buf;
+	int epfd, fd, n, e;
+	ssize_t ret;
+
+	place_worker(ctx->place);
+	reset_worker_signals();
+	if (process_mode == PROCESS_MODE)
+		for (k = 0; k < ctx->num_fds; k++)
+			close(ctx->in_fds[2 * k + 1]);
+
+	events = calloc(ctx->num_fds, sizeof(*events));
+	done = calloc(ctx->num_fds, sizeof(*done));
+	bufs = malloc((size_t)ctx->num_fds * datasize);
+	if (!events || !done || !bufs)
+		barf("SERVER: malloc");
+
+	epfd = epoll_create1(0);
+	if (epfd < 0)
+		barf("SERVER: epoll_create1");
+	for (k = 0; k < ctx->num_fds; k++) {
+		fd = ctx->in_fds[2 * k];
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK))
+			barf("SERVER: O_NONBLOCK");
+		ev.events = EPOLLIN;
+		ev.data.u32 = k;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+			barf("SERVER: epoll_ctl");
+	}
+
+	/* Wait for start... */
+	ready(ctx->ready_out, ctx->wakefd);
+
+	while (left) {
+		if (!nr_open) {
+			errno = EPIPE;
+			barf("SERVER: read");
+		}
+		n = epoll_wait(epfd, events, ctx->num_fds, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			barf("SERVER: epoll_wait");
+		}
+		for (e = 0; e < n; e++) {
+			k = events[e].data.u32;
+			fd = ctx->in_fds[2 * k];
+			buf = bufs + (size_t)k * datasize;
+			for (;;) {
+				ret = read(fd, buf + done[k], datasize - done[k]);
+				if (ret < 0) {
+					if (errno == EAGAIN)
+						break;
+					barf("SERVER: read");
+				}
+				if (ret == 0) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+					nr_open--;
+					break;
+				}
+				done[k] += ret;
+				if (done[k] < datasize)
+					continue;
+				account_latency(ctx->lat, buf);
+				done[k] = 0;
+				left--;
+			}
+		}
+	}
+
+	close(epfd);
+	free(bufs);
+	free(done);
+	free(events);
+	node_local_free(ctx, receiver_size(ctx->num_fds),
+			place_node(ctx->place));
+	return NULL;
+}
+
 static int create_worker(childinfo_t *child, void *ctx, void *(*func)(void *))
 {
 	pthread_attr_t attr;
@@ -283,16 +921,28 @@ unsigned int reap_workers(childinfo_t *child, unsigned int totchld, unsigned int
 	return rc;
 }
 
+static unsigned int receivers_per_group(void)
+{
+	if (!epoll_fds)
+		return num_fds;
+	return (num_fds + epoll_fds - 1) / epoll_fds;
+}
+
 /* One group of senders and receivers */
 static unsigned int group(childinfo_t *child,
 			  unsigned int tab_offset,
+			  unsigned int gnum,
 			  unsigned int num_fds,
 			  int ready_out,
 			  int wakefd)
 {
-	unsigned int i;
-	struct sender_context* snd_ctx = malloc (sizeof(struct sender_context)
-			+num_fds*sizeof(int));
+	const struct placement *place = placements ? &placements[gnum] : NULL;
+	unsigned int nr_rx = receivers_per_group();
+	unsigned int per_rx = epoll_fds ? epoll_fds : 1;
+	unsigned int i, k, r, n;
+	struct sender_context* snd_ctx =
+		node_local_alloc(sizeof(struct sender_context)
+				 + num_fds*sizeof(int), place_node(place));
 	int err;
 
 	if (!snd_ctx) {
@@ -301,45 +951,55 @@ static unsigned int group(childinfo_t *child,
 	}
 
 
-	for (i = 0; i < num_fds; i++) {
+	for (r = 0, i = 0; r < nr_rx; r++) {
 		int fds[2];
-		struct receiver_context* ctx = malloc (sizeof(*ctx));
+		struct receiver_context* ctx;
 
+		n = num_fds - i < per_rx ? num_fds - i : per_rx;
+		ctx = node_local_alloc(receiver_size(n), place_node(place));
 		if (!ctx) {
 			sneeze("malloc() [receiver ctx]");
-			return (i > 0 ? i-1 : 0);
+			return (r > 0 ? r-1 : 0);
 		}
 
-
-		/* Create the pipe between client and server */
-		fdpair(fds);
-
 		ctx->num_packets = num_fds*loops;
-		ctx->in_fds[0] = fds[0];
-		ctx->in_fds[1] = fds[1];
 		ctx->ready_out = ready_out;
 		ctx->wakefd = wakefd;
+		ctx->lat = lat_stats ? &lat_stats[gnum * num_fds + i] : NULL;
+		ctx->place = place;
+		ctx->num_fds = n;
 
-		err = create_worker(&child[tab_offset+i], ctx,
+		for (k = 0; k < n; k++, i++) {
+			/* Create the pipe between client and server */
+			transport->pair(fds);
+
+			ctx->in_fds[2 * k] = fds[0];
+			ctx->in_fds[2 * k + 1] = fds[1];
+			snd_ctx->out_fds[i] = fds[1];
+		}
+
+		err = create_worker(&child[tab_offset+r], ctx,
+				    epoll_fds ? (void *)(void *)epoll_receiver :
 				    (void *)(void *)receiver);
 		if(err) {
-			return (i > 0 ? i-1 : 0);
+			return (r > 0 ? r-1 : 0);
 		}
-		snd_ctx->out_fds[i] = fds[1];
 		if (process_mode == PROCESS_MODE)
-			close(fds[0]);
+			for (k = 0; k < n; k++)
+				close(ctx->in_fds[2 * k]);
 	}
 
 	snd_ctx->ready_out = ready_out;
 	snd_ctx->wakefd = wakefd;
 	snd_ctx->num_fds = num_fds;
+	snd_ctx->place = place;
 
 	/* Now we have all the fds, fork the senders */
 	for (i = 0; i < num_fds; i++) {
-		err = create_worker(&child[tab_offset+num_fds+i], snd_ctx,
+		err = create_worker(&child[tab_offset+nr_rx+i], snd_ctx,
 				    (void *)(void *)sender);
 		if(err) {
-			return (num_fds+i)-1;
+			return (nr_rx+i)-1;
 		}
 	}
 
@@ -349,7 +1009,26 @@ static unsigned int group(childinfo_t *child,
 			close(snd_ctx->out_fds[i]);
 
 	/* Return number of children to reap */
-	return num_fds * 2;
+	return num_fds + nr_rx;
+}
+
+enum option_values {
+	OPT_TRANSPORT = 256, OPT_BATCH, OPT_LATENCY, OPT_JSON, OPT_AFFINITY,
+	OPT_PLACEMENT, OPT_EPOLL,
+};
+
+static void set_transport(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+		if (!strcmp(name, transports[i].name)) {
+			transport = &transports[i];
+			return;
+		}
+	}
+	fprintf(stderr, "hackbench: unknown transport '%s'\n", name);
+	print_usage_exit(1);
 }
 
 static void process_options(int argc, char *argv[])
@@ -367,6 +1046,13 @@ static void process_options(int argc, char *argv[])
 			{"datasize",	required_argument,	NULL, 's'},
 			{"threads",	no_argument,		NULL, 'T'},
 			{"processes",	no_argument,		NULL, 'P'},
+			{"transport",	required_argument,	NULL, OPT_TRANSPORT},
+			{"batch",	required_argument,	NULL, OPT_BATCH},
+			{"latency",	optional_argument,	NULL, OPT_LATENCY},
+			{"json",	required_argument,	NULL, OPT_JSON},
+			{"affinity",	required_argument,	NULL, OPT_AFFINITY},
+			{"placement",	required_argument,	NULL, OPT_PLACEMENT},
+			{"epoll",	optional_argument,	NULL, OPT_EPOLL},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -414,10 +1100,296 @@ static void process_options(int argc, char *argv[])
 		case 'P':
 			process_mode = PROCESS_MODE;
 			break;
+		case OPT_TRANSPORT:
+			set_transport(optarg);
+			break;
+		case OPT_BATCH:
+			if (!(argv[optind] && (batch = atoi(optarg)) > 0)) {
+				fprintf(stderr, "%s: --batch requires an integer > 0\n", argv[0]);
+				print_usage_exit(1);
+			}
+			break;
+		case OPT_LATENCY:
+			if (!optarg || !strcmp(optarg, "monotonic")) {
+				latency_mode = LAT_MONOTONIC;
+			} else if (!strcmp(optarg, "tsc")) {
+#ifdef FRC_MISSING
+				fprintf(stderr, "%s: no cycle counter for --latency=tsc\n", argv[0]);
+				print_usage_exit(1);
+#endif
+				latency_mode = LAT_TSC;
+			} else {
+				fprintf(stderr, "%s: --latency clock must be monotonic or tsc\n", argv[0]);
+				print_usage_exit(1);
+			}
+			break;
+		case OPT_JSON:
+			jsonfile = optarg;
+			break;
+		case OPT_AFFINITY:
+			affinity = optarg;
+			break;
+		case OPT_PLACEMENT:
+			if (!strcmp(optarg, "cpu")) {
+				placement = PLACE_CPU;
+			} else if (!strcmp(optarg, "node")) {
+				placement = PLACE_NODE;
+			} else if ((plan_policy = cpu_plan_policy(optarg)) >= 0) {
+				placement = PLACE_PLAN;
+			} else {
+				fprintf(stderr, "%s: --placement must be cpu, node or one of "
+					CPU_PLAN_POLICIES "\n", argv[0]);
+				print_usage_exit(1);
+			}
+			break;
+		case OPT_EPOLL:
+			epoll_fds = UINT_MAX;
+			if (optarg && (int)(epoll_fds = atoi(optarg)) <= 0) {
+				fprintf(stderr, "%s: --epoll requires an integer > 0\n", argv[0]);
+				print_usage_exit(1);
+			}
+			break;
 		default:
 			print_usage_exit(1);
 		}
 	}
+
+	if (epoll_fds > num_fds)
+		epoll_fds = num_fds;
+
+	if (latency_mode && !transport->stamps) {
+		fprintf(stderr, "%s: --latency does not work with the %s transport\n",
+			argv[0], transport->name);
+		print_usage_exit(1);
+	}
+	/* larger writes of the senders sharing a fd may interleave */
+	if (latency_mode && (datasize < sizeof(uint64_t) || datasize > PIPE_BUF)) {
+		fprintf(stderr, "%s: --latency needs a --datasize of %zu to %d bytes\n",
+			argv[0], sizeof(uint64_t), PIPE_BUF);
+		print_usage_exit(1);
+	}
+
+	if (transport->pipes > 0)
+		use_pipes = 1;
+	if (transport->pipes < 0 && use_pipes) {
+		fprintf(stderr, "%s: transport %s does not work with --pipe\n",
+			argv[0], transport->name);
+		print_usage_exit(1);
+	}
+}
+
+/* Assign the CPUs, and the node, of every group */
+static void placement_init(void)
+{
+	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	int cpu, node, nr_nodes = 0, *nodes = NULL;
+	struct bitmask *mask;
+	struct placement *pl;
+	struct cpu_plan *plan = NULL;
+	unsigned int g;
+	int numa = numa_initialize();
+
+	if (max_cpus > CPU_SETSIZE)
+		max_cpus = CPU_SETSIZE;
+
+	if (affinity) {
+		if (parse_cpumask(affinity, max_cpus, &mask) || !mask) {
+			fprintf(stderr, "hackbench: no usable CPU in '%s'\n", affinity);
+			exit(1);
+		}
+	} else {
+		mask = numa_allocate_cpumask();
+		numa_sched_getaffinity(0, mask);
+	}
+
+	if (placement == PLACE_NODE) {
+		if (!numa) {
+			fprintf(stderr, "hackbench: NUMA is not available\n");
+			exit(1);
+		}
+		/* the nodes with CPUs in the set */
+		nodes = calloc(numa_max_node() + 1, sizeof(*nodes));
+		if (!nodes)
+			barf("placement_init:malloc()");
+		for (node = 0; node <= numa_max_node(); node++) {
+			for (cpu = 0; cpu < max_cpus; cpu++) {
+				if (numa_bitmask_isbitset(mask, cpu) &&
+				    numa_node_of_cpu(cpu) == node) {
+					nodes[nr_nodes++] = node;
+					break;
+				}
+			}
+		}
+	}
+
+	if (placement == PLACE_PLAN) {
+		plan = cpu_plan_create(plan_policy, mask);
+		if (!plan) {
+			fprintf(stderr, "hackbench: no CPU left for placement %s\n",
+				cpu_plan_name(plan_policy));
+			exit(1);
+		}
+	}
+
+	placements = calloc(num_groups, sizeof(*placements));
+	if (!placements)
+		barf("placement_init:malloc()");
+
+	for (g = 0; g < num_groups; g++) {
+		pl = &placements[g];
+		CPU_ZERO(&pl->cpus);
+		pl->node = -1;
+
+		switch (placement) {
+		case PLACE_CPU:
+			cpu = cpu_for_thread_sp(g, max_cpus, mask);
+			CPU_SET(cpu, &pl->cpus);
+			if (numa)
+				pl->node = numa_node_of_cpu(cpu);
+			break;
+		case PLACE_PLAN:
+			cpu = cpu_plan_cpu(plan, g);
+			CPU_SET(cpu, &pl->cpus);
+			if (numa)
+				pl->node = numa_node_of_cpu(cpu);
+			break;
+		case PLACE_NODE:
+			pl->node = nodes[g % nr_nodes];
+			for (cpu = 0; cpu < max_cpus; cpu++)
+				if (numa_bitmask_isbitset(mask, cpu) &&
+				    numa_node_of_cpu(cpu) == pl->node)
+					CPU_SET(cpu, &pl->cpus);
+			break;
+		default:
+			for (cpu = 0; cpu < max_cpus; cpu++)
+				if (numa_bitmask_isbitset(mask, cpu))
+					CPU_SET(cpu, &pl->cpus);
+			break;
+		}
+	}
+
+	free(nodes);
+	cpu_plan_free(plan);
+	numa_bitmask_free(mask);
+}
+
+/* Statistics of all receivers in a mapping shared with forked children */
+static void latency_init(void)
+{
+	unsigned int i, n = num_groups * num_fds;
+	struct histogram tmpl;
+	size_t hdr;
+	char *map;
+
+	if (hist_init(&tmpl, HIST_DIGITS_DEFAULT, HIST_RANGE_BITS_NS))
+		barf("hist_init()");
+
+	hdr = n * sizeof(*lat_stats);
+	lat_map_size = hdr + n * hist_size(&tmpl);
+	map = mmap(NULL, lat_map_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		barf("mmap() [latency statistics]");
+
+	lat_stats = (struct latency_stats *)map;
+	for (i = 0; i < n; i++) {
+		lat_stats[i].hist = tmpl;
+		lat_stats[i].hist.buckets =
+			(unsigned long *)(map + hdr + i * hist_size(&tmpl));
+		lat_stats[i].min = UINT64_MAX;
+	}
+
+	if (latency_mode == LAT_TSC) {
+		if (!tsc_is_stable())
+			fprintf(stderr, "cycle counter is not invariant, "
+				"--latency=tsc results may be skewed\n");
+		if (tsc_calibrate(&tsc_scale, CLOCK_MONOTONIC, 100))
+			barf("calibrating the cycle counter");
+	}
+}
+
+static struct latency_stats lat_total;
+
+/* Merge the receivers, called after reap_workers() */
+static void latency_report(void)
+{
+	unsigned int i, j, n = num_groups * num_fds;
+	uint64_t pct[hist_json_npercentiles];
+	struct latency_stats *st;
+
+	lat_total.hist = lat_stats[0].hist;
+	if (hist_alloc(&lat_total.hist))
+		barf("hist_alloc()");
+	lat_total.min = UINT64_MAX;
+
+	for (i = 0; i < n; i++) {
+		st = &lat_stats[i];
+		hist_merge(&lat_total.hist, &st->hist);
+		if (st->min < lat_total.min)
+			lat_total.min = st->min;
+		if (st->max > lat_total.max)
+			lat_total.max = st->max;
+		lat_total.count += st->count;
+		lat_total.sum += st->sum;
+	}
+
+	if (!lat_total.count) {
+		printf("No latency samples\n");
+		return;
+	}
+
+	printf("Latency (ns): Messages:%llu Min:%llu Avg:%llu Max:%llu\n",
+	       (unsigned long long)lat_total.count,
+	       (unsigned long long)lat_total.min,
+	       (unsigned long long)(lat_total.sum / lat_total.count),
+	       (unsigned long long)lat_total.max);
+	hist_tail_percentiles(&lat_total.hist, lat_total.count, lat_total.max,
+			      hist_json_percentiles, pct,
+			      hist_json_npercentiles);
+	printf("Percentiles (ns):");
+	for (j = 0; j < hist_json_npercentiles; j++)
+		printf(" P%g:%llu", hist_json_percentiles[j],
+		       (unsigned long long)pct[j]);
+	printf("\n");
+}
+
+static struct timeval run_time;
+static int run_complete;
+
+static void write_stats(FILE *f, void *data)
+{
+	fprintf(f, "  \"groups\": %u,\n", num_groups);
+	fprintf(f, "  \"fds\": %u,\n", num_fds);
+	fprintf(f, "  \"loops\": %u,\n", loops);
+	fprintf(f, "  \"datasize\": %u,\n", datasize);
+	fprintf(f, "  \"mode\": \"%s\",\n",
+		process_mode == THREAD_MODE ? "threaded" : "process");
+	fprintf(f, "  \"pipe\": %s,\n", use_pipes ? "true" : "false");
+	fprintf(f, "  \"transport\": \"%s\",\n", transport->name);
+	if (latency_mode && lat_total.count) {
+		fprintf(f, "  \"latency\": {\n");
+		fprintf(f, "    \"clock\": \"%s\",\n",
+			latency_mode == LAT_TSC ? "tsc" : "monotonic");
+		fprintf(f, "    \"messages\": %llu,\n",
+			(unsigned long long)lat_total.count);
+		fprintf(f, "    \"min\": %llu,\n", (unsigned long long)lat_total.min);
+		fprintf(f, "    \"avg\": %.2f,\n", lat_total.sum / lat_total.count);
+		fprintf(f, "    \"max\": %llu,\n", (unsigned long long)lat_total.max);
+		fprintf(f, "    \"percentiles\": ");
+		hist_print_percentiles_json(f, &lat_total.hist, lat_total.max,
+					    4);
+		fprintf(f, ",\n");
+		fprintf(f, "    \"histogram\": ");
+		hist_print_json(f, &lat_total.hist, 4);
+		fprintf(f, "\n");
+		fprintf(f, "  },\n");
+	}
+	if (run_complete)
+		fprintf(f, "  \"time\": %lu.%06lu\n",
+			(unsigned long)run_time.tv_sec,
+			(unsigned long)run_time.tv_usec);
+	else
+		fprintf(f, "  \"time\": null\n");
 }
 
 void sigcatcher(int sig) {
@@ -437,18 +1409,28 @@ int main(int argc, char *argv[])
 	int timer_started = 0;
 	struct sched_param sp;
 
+	rt_init(argc, argv);
 	process_options (argc, argv);
 
 	printf("Running in %s mode with %d groups using %d file descriptors each (== %d tasks)\n",
 	       (process_mode == THREAD_MODE ? "threaded" : "process"),
-	       num_groups, 2*num_fds, num_groups*(num_fds*2));
+	       num_groups, 2*num_fds, num_groups*(num_fds + receivers_per_group()));
 	printf("Each sender will pass %d messages of %d bytes\n", loops, datasize);
+	if (transport != &transports[0])
+		printf("Messages are passed with the %s transport\n", transport->name);
+	if (epoll_fds)
+		printf("Each receiver multiplexes up to %d fds with epoll\n", epoll_fds);
 	fflush(NULL);
 
 	child_tab = calloc(num_fds * 2 * num_groups, sizeof(childinfo_t));
 	if (!child_tab)
 		barf("main:malloc()");
 
+	if (latency_mode)
+		latency_init();
+	if (affinity || placement != PLACE_NONE)
+		placement_init();
+
 	fdpair(readyfds);
 	fdpair(wakefds);
 
@@ -460,9 +1442,10 @@ int main(int argc, char *argv[])
 	if (setjmp(jmpbuf) == 0) {
 		total_children = 0;
 		for (i = 0; i < num_groups; i++) {
-			int c = group(child_tab, total_children, num_fds, readyfds[1], wakefds[0]);
-			if( c != (num_fds*2) ) {
-				fprintf(stderr, "%i children started.  Expected %i\n", c, num_fds*2);
+			int c = group(child_tab, total_children, i, num_fds, readyfds[1], wakefds[0]);
+			if( c != (num_fds + receivers_per_group()) ) {
+				fprintf(stderr, "%i children started.  Expected %i\n", c,
+					num_fds + receivers_per_group());
 				reap_workers(child_tab, total_children + c, 1);
 				barf("Creating workers");
 			}
@@ -506,9 +1489,21 @@ int main(int argc, char *argv[])
 	if (timer_started) {
 		timersub(&stop, &start, &diff);
 		printf("Time: %lu.%03lu\n", diff.tv_sec, diff.tv_usec/1000);
+		run_time = diff;
+		run_complete = !signal_caught;
 	}
 	else
 		fprintf(stderr, "No measurements available\n");
+
+	if (latency_mode && timer_started)
+		latency_report();
+	if (jsonfile)
+		rt_write_json(jsonfile, run_complete ? 0 : 1, write_stats, NULL);
+
+	if (lat_stats) {
+		hist_free(&lat_total.hist);
+		munmap(lat_stats, lat_map_size);
+	}
 	free(child_tab);
 	exit(0);
 }
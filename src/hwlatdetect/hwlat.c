@@ -0,0 +1,585 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * hwlat - hardware latency detector running in user space
+ *
+ * Works like the hwlat tracer of the kernel, but on all CPUs of the list
+ * at the same time: every window each thread busy reads the counter for
+ * width and takes any gap between two reads, or between two rounds of
+ * the loop, above the threshold as time the CPU was taken away, e.g.
+ * by an SMI. Unlike the tracer interrupts stay enabled unless
+ * --irqs-off works on this system, so run it on isolated CPUs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <numa.h>
+
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <sys/io.h>
+#endif
+
+#include "rt-utils.h"
+#include "rt-numa.h"
+#include "rt-error.h"
+#include "rt-tsc.h"
+
+struct hwlat_sample {
+	uint64_t ts;			/* CLOCK_REALTIME in ns */
+	uint64_t inner, outer;		/* largest gaps of the width, in ns */
+	unsigned int count;		/* gaps over the threshold */
+};
+
+struct hwlat_thread {
+	int cpu;
+	pthread_t thread_id;
+	int irqs_off;			/* interrupts really were disabled */
+	unsigned long windows;
+	uint64_t max;			/* ns */
+	struct hwlat_sample *samples;
+	unsigned int nr_samples, max_samples;
+};
+
+static struct {
+	char *cpu_list;
+	int duration;
+	int threshold;			/* us */
+	int hardlimit;			/* us */
+	int window;			/* us */
+	int width;			/* us */
+	int priority;
+	int irqs_off;
+	int quiet;
+	int watch;
+	char jsonfile[MAX_PATH];
+	struct tsc_scale scale;
+	volatile int stop;
+	int nr_threads;
+	struct hwlat_thread *threads;
+} g = {
+	.duration = 120,
+	.threshold = 10,
+	.window = 1000000,
+	.width = 500000,
+};
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline void irq_disable(void)
+{
+	__asm__ __volatile__("cli" ::: "memory");
+}
+
+static inline void irq_enable(void)
+{
+	__asm__ __volatile__("sti" ::: "memory");
+}
+
+static sigjmp_buf irq_probe_env;
+
+static void irq_probe_fault(int sig)
+{
+	siglongjmp(irq_probe_env, 1);
+}
+
+/*
+ * iopl(3) used to allow cli/sti in user space, current kernels only
+ * emulate the I/O permission and let cli fault. Try it once, before any
+ * sampling thread exists: the SIGSEGV handler is process wide, and the
+ * threads inherit the I/O privilege level.
+ */
+static int irqs_off_usable(void)
+{
+	struct sigaction sa, old;
+	volatile int ok = 0;
+
+	if (iopl(3))
+		return 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = irq_probe_fault;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old);
+	if (!sigsetjmp(irq_probe_env, 1)) {
+		irq_disable();
+		irq_enable();
+		ok = 1;
+	}
+	sigaction(SIGSEGV, &old, NULL);
+
+	return ok;
+}
+#else
+static inline void irq_disable(void) { }
+static inline void irq_enable(void) { }
+static int irqs_off_usable(void)
+{
+	return 0;
+}
+#endif
+
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void print_sample(FILE *f, int cpu, struct hwlat_sample *s)
+{
+	fprintf(f, "cpu: %d, ts: %llu.%09llu, inner:%llu, outer:%llu\n", cpu,
+		(unsigned long long)(s->ts / NSEC_PER_SEC),
+		(unsigned long long)(s->ts % NSEC_PER_SEC),
+		(unsigned long long)(s->inner / 1000),
+		(unsigned long long)(s->outer / 1000));
+}
+
+static void add_sample(struct hwlat_thread *t, struct hwlat_sample *s)
+{
+	struct hwlat_sample *p;
+
+	if (t->nr_samples == t->max_samples) {
+		p = realloc(t->samples, (t->max_samples * 2 + 64) * sizeof(*p));
+		if (!p)
+			return;
+		t->samples = p;
+		t->max_samples = t->max_samples * 2 + 64;
+	}
+	t->samples[t->nr_samples++] = *s;
+
+	if (g.watch) {
+		pthread_mutex_lock(&watch_lock);
+		print_sample(stdout, t->cpu, s);
+		pthread_mutex_unlock(&watch_lock);
+	}
+}
+
+/*
+ * One width of sampling. inner is the gap between two reads in a row,
+ * outer the one from the end of a round to the start of the next.
+ */
+static void sample_width(struct hwlat_thread *t, uint64_t width,
+			 uint64_t thresh)
+{
+	uint64_t start, t1 = 0, t2 = 0, last = 0, diff, at = 0;
+	uint64_t inner = 0, outer = 0, max = 0;
+	struct hwlat_sample s;
+	unsigned int count = 0;
+	uint64_t rt;
+
+	if (t->irqs_off)
+		irq_disable();
+
+	rt = realtime_ns();
+	frc(&start);
+	do {
+		frc(&t1);
+		frc(&t2);
+
+		if (last) {
+			diff = t1 - last;
+			if (diff > thresh) {
+				count++;
+				if (diff > outer)
+					outer = diff;
+				/* the sample is stamped with its largest gap */
+				if (diff > max) {
+					max = diff;
+					at = last;
+				}
+			}
+		}
+
+		diff = t2 - t1;
+		if (diff > thresh) {
+			count++;
+			if (diff > inner)
+				inner = diff;
+			if (diff > max) {
+				max = diff;
+				at = t1;
+			}
+		}
+		last = t2;
+	} while (t2 - start < width);
+
+	if (t->irqs_off)
+		irq_enable();
+
+	t->windows++;
+	if (!count)
+		return;
+
+	s.ts = rt + tsc_to_ns(&g.scale, at - start);
+	s.inner = tsc_to_ns(&g.scale, inner);
+	s.outer = tsc_to_ns(&g.scale, outer);
+	s.count = count;
+	if (s.inner > t->max)
+		t->max = s.inner;
+	if (s.outer > t->max)
+		t->max = s.outer;
+	add_sample(t, &s);
+}
+
+static void *hwlat_thread(void *arg)
+{
+	struct hwlat_thread *t = arg;
+	uint64_t width = ns_to_tsc(&g.scale, g.width * 1000ULL);
+	uint64_t thresh = ns_to_tsc(&g.scale, g.threshold * 1000ULL);
+	struct sched_param param;
+	struct timespec rest;
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	CPU_SET(t->cpu, &mask);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask))
+		fatal("Could not run on CPU %d\n", t->cpu);
+
+	if (g.priority) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = g.priority;
+		if (sched_setscheduler(0, SCHED_FIFO, &param))
+			fatal("Could not set SCHED_FIFO priority %d\n",
+			      g.priority);
+	}
+
+	rest.tv_sec = (g.window - g.width) / USEC_PER_SEC;
+	rest.tv_nsec = ((g.window - g.width) % USEC_PER_SEC) * 1000;
+
+	while (!g.stop) {
+		sample_width(t, width, thresh);
+		if (rest.tv_sec || rest.tv_nsec)
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &rest, NULL);
+	}
+
+	return NULL;
+}
+
+static void handle_stop(int sig)
+{
+	g.stop = 1;
+}
+
+static void usage(int error)
+{
+	printf("hwlat V %1.2f\n", VERSION);
+	printf("Usage:\n"
+	       "hwlat <options>\n\n"
+	       "Look for gaps in busy counter reads on all CPUs of the list at once.\n\n"
+	       "-c, --cpu-list=LIST    CPUs to sample on, e.g. '1,3,5,7-15', default all\n"
+	       "-D, --duration=TIME    Specify test duration, e.g., 60, 20m, 2H\n"
+	       "                       (m/M: minutes, h/H: hours, d/D: days), default 120s\n"
+	       "    --hardlimit=US     fail if a gap is above US, default the threshold\n"
+	       "-h, --help             Display this help\n"
+	       "    --irqs-off         disable interrupts while sampling if the kernel\n"
+	       "                       still allows cli after iopl(3), root only\n"
+	       "    --json=FILENAME    write final results into FILENAME, JSON formatted\n"
+	       "-p, --priority=PRIO    SCHED_FIFO priority of the sampling threads\n"
+	       "-q, --quiet            print a summary only on exit\n"
+	       "    --threshold=US     gaps above US are recorded, default 10\n"
+	       "    --watch            print the samples as they arrive\n"
+	       "    --width=US         time to sample each window, default 500000\n"
+	       "    --window=US        time between the starts of sampling, default 1000000\n"
+	       );
+	exit(error);
+}
+
+enum option_value {
+	OPT_CPU_LIST = 1, OPT_DURATION, OPT_HARDLIMIT, OPT_HELP, OPT_IRQS_OFF,
+	OPT_JSON, OPT_PRIORITY, OPT_QUIET, OPT_THRESHOLD, OPT_WATCH,
+	OPT_WIDTH, OPT_WINDOW
+};
+
+static int positive(const char *name, char *arg)
+{
+	int val = strtol(arg, NULL, 10);
+
+	if (val <= 0) {
+		printf("Parameter --%s needs to be positive\n", name);
+		exit(1);
+	}
+	return val;
+}
+
+static void parse_options(int argc, char *argv[])
+{
+	while (1) {
+		int option_index = 0;
+		static struct option options[] = {
+			{ "cpu-list",	required_argument,	NULL, OPT_CPU_LIST },
+			{ "duration",	required_argument,	NULL, OPT_DURATION },
+			{ "hardlimit",	required_argument,	NULL, OPT_HARDLIMIT },
+			{ "help",	no_argument,		NULL, OPT_HELP },
+			{ "irqs-off",	no_argument,		NULL, OPT_IRQS_OFF },
+			{ "json",	required_argument,	NULL, OPT_JSON },
+			{ "priority",	required_argument,	NULL, OPT_PRIORITY },
+			{ "quiet",	no_argument,		NULL, OPT_QUIET },
+			{ "threshold",	required_argument,	NULL, OPT_THRESHOLD },
+			{ "watch",	no_argument,		NULL, OPT_WATCH },
+			{ "width",	required_argument,	NULL, OPT_WIDTH },
+			{ "window",	required_argument,	NULL, OPT_WINDOW },
+			{ NULL, 0, NULL, 0 },
+		};
+		int c = getopt_long(argc, argv, "c:D:hp:q", options,
+				    &option_index);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case OPT_CPU_LIST:
+		case 'c':
+			g.cpu_list = strdup(optarg);
+			break;
+		case OPT_DURATION:
+		case 'D':
+			g.duration = parse_time_string(optarg);
+			if (!g.duration) {
+				printf("Illegal duration: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_HARDLIMIT:
+			g.hardlimit = positive("hardlimit", optarg);
+			break;
+		case OPT_IRQS_OFF:
+			g.irqs_off = 1;
+			break;
+		case OPT_JSON:
+			strncpy(g.jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
+		case OPT_PRIORITY:
+		case 'p':
+			g.priority = strtol(optarg, NULL, 10);
+			if (g.priority < 1 || g.priority > 99) {
+				printf("Illegal RT priority: %s (should be: 1-99)\n",
+				       optarg);
+				exit(1);
+			}
+			break;
+		case OPT_QUIET:
+		case 'q':
+			g.quiet = 1;
+			break;
+		case OPT_THRESHOLD:
+			g.threshold = positive("threshold", optarg);
+			break;
+		case OPT_WATCH:
+			g.watch = 1;
+			break;
+		case OPT_WIDTH:
+			g.width = positive("width", optarg);
+			break;
+		case OPT_WINDOW:
+			g.window = positive("window", optarg);
+			break;
+		case OPT_HELP:
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+			break;
+		}
+	}
+
+	if (g.width > g.window) {
+		printf("The width (%dus) must not exceed the window (%dus)\n",
+		       g.width, g.window);
+		exit(1);
+	}
+	if (!g.hardlimit)
+		g.hardlimit = g.threshold;
+}
+
+static uint64_t max_latency(unsigned int *nr_samples)
+{
+	uint64_t max = 0;
+	int i;
+
+	*nr_samples = 0;
+	for (i = 0; i < g.nr_threads; i++) {
+		*nr_samples += g.threads[i].nr_samples;
+		if (g.threads[i].max > max)
+			max = g.threads[i].max;
+	}
+	return max;
+}
+
+static void write_summary(void)
+{
+	unsigned int nr_samples, i;
+	uint64_t max;
+	int j;
+
+	max = max_latency(&nr_samples);
+
+	printf("test finished\n");
+	if (max / 1000 == 0)
+		printf("Max Latency: Below threshold\n");
+	else
+		printf("Max Latency: %lluus\n", (unsigned long long)max / 1000);
+	printf("Samples recorded: %u\n", nr_samples);
+
+	for (j = 0; j < g.nr_threads; j++) {
+		struct hwlat_thread *t = &g.threads[j];
+
+		printf("CPU %d: windows %lu, samples %u, max %lluus%s\n",
+		       t->cpu, t->windows, t->nr_samples,
+		       (unsigned long long)t->max / 1000,
+		       g.irqs_off && !t->irqs_off ? " (irqs on)" : "");
+	}
+
+	if (g.quiet || g.watch)
+		return;
+	for (j = 0; j < g.nr_threads; j++)
+		for (i = 0; i < g.threads[j].nr_samples; i++)
+			print_sample(stdout, g.threads[j].cpu,
+				     &g.threads[j].samples[i]);
+}
+
+static void write_summary_json(FILE *f, void *data)
+{
+	unsigned int nr_samples, i;
+	struct hwlat_sample *s;
+	struct hwlat_thread *t;
+	uint64_t max;
+	int j;
+
+	max = max_latency(&nr_samples);
+
+	fprintf(f, "  \"threshold\": %d,\n", g.threshold);
+	fprintf(f, "  \"window\": %d,\n", g.window);
+	fprintf(f, "  \"width\": %d,\n", g.width);
+	fprintf(f, "  \"tsc_hz\": %llu,\n", (unsigned long long)g.scale.hz);
+	fprintf(f, "  \"max_latency\": %llu,\n", (unsigned long long)max / 1000);
+	fprintf(f, "  \"num_samples\": %u,\n", nr_samples);
+	fprintf(f, "  \"thread\": {\n");
+	for (j = 0; j < g.nr_threads; j++) {
+		t = &g.threads[j];
+		fprintf(f, "    \"%d\": {\n", j);
+		fprintf(f, "      \"cpu\": %d,\n", t->cpu);
+		fprintf(f, "      \"irqs_off\": %d,\n", t->irqs_off);
+		fprintf(f, "      \"windows\": %lu,\n", t->windows);
+		fprintf(f, "      \"max_latency\": %llu,\n",
+			(unsigned long long)t->max / 1000);
+		fprintf(f, "      \"samples\": [");
+		for (i = 0; i < t->nr_samples; i++) {
+			s = &t->samples[i];
+			fprintf(f, "%s\n        { \"timestamp\": \"%llu.%09llu\", "
+				"\"inner\": %llu, \"outer\": %llu, "
+				"\"count\": %u }", i ? "," : "",
+				(unsigned long long)(s->ts / NSEC_PER_SEC),
+				(unsigned long long)(s->ts % NSEC_PER_SEC),
+				(unsigned long long)(s->inner / 1000),
+				(unsigned long long)(s->outer / 1000),
+				s->count);
+		}
+		fprintf(f, "%s]\n", t->nr_samples ? "\n      " : "");
+		fprintf(f, "    }%s\n", j == g.nr_threads - 1 ? "" : ",");
+	}
+	fprintf(f, "  }\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct bitmask *cpu_set;
+	struct cpu_plan *plan;
+	unsigned int nr_samples;
+	uint64_t max;
+	int irqs_off;
+	int i, ret;
+
+#ifdef FRC_MISSING
+	printf("This architecture is not yet supported. "
+	       "Please implement frc() function first for %s.\n", argv[0]);
+	exit(1);
+#endif
+	if (numa_available() == -1) {
+		printf("ERROR: Could not initialize libnuma\n");
+		exit(1);
+	}
+
+	rt_init(argc, argv);
+	parse_options(argc, argv);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		fatal("mlockall failed: %s\n", strerror(errno));
+
+	if (!tsc_is_stable())
+		warn("the counter may not run at a constant rate\n");
+	if (tsc_calibrate(&g.scale, CLOCK_MONOTONIC, 100))
+		fatal("Could not calibrate the counter\n");
+
+	cpu_set = numa_parse_cpustring_all(g.cpu_list ? g.cpu_list : "all");
+	if (!cpu_set)
+		fatal("hwlat: cannot parse the cpu list\n");
+	plan = cpu_plan_create(CPU_PLAN_RR, cpu_set);
+	numa_bitmask_free(cpu_set);
+	if (!plan)
+		fatal("hwlat: no CPU to run on\n");
+
+	g.nr_threads = plan->nr_cpus;
+	g.threads = calloc(g.nr_threads, sizeof(*g.threads));
+	if (!g.threads)
+		fatal("Could not allocate memory\n");
+	irqs_off = g.irqs_off && irqs_off_usable();
+	for (i = 0; i < g.nr_threads; i++) {
+		g.threads[i].cpu = plan->cpus[i];
+		g.threads[i].irqs_off = irqs_off;
+	}
+	cpu_plan_free(plan);
+
+	signal(SIGALRM, handle_stop);
+	signal(SIGINT, handle_stop);
+	signal(SIGTERM, handle_stop);
+
+	if (!g.quiet) {
+		printf("hwlat:  test duration %d seconds\n", g.duration);
+		printf("   detector: tsc, %d CPUs in parallel\n", g.nr_threads);
+		printf("   parameters:\n");
+		printf("        Latency threshold: %dus\n", g.threshold);
+		printf("        Sample window:     %dus\n", g.window);
+		printf("        Sample width:      %dus\n", g.width);
+		printf("     Non-sampling period:  %dus\n", g.window - g.width);
+		printf("        Output File:       %s\n",
+		       g.jsonfile[0] ? g.jsonfile : "None");
+		printf("\nStarting test\n");
+	}
+
+	for (i = 0; i < g.nr_threads; i++) {
+		ret = pthread_create(&g.threads[i].thread_id, NULL,
+				     hwlat_thread, &g.threads[i]);
+		if (ret)
+			fatal("Could not create thread: %s\n", strerror(ret));
+	}
+
+	alarm(g.duration);
+	for (i = 0; i < g.nr_threads; i++)
+		pthread_join(g.threads[i].thread_id, NULL);
+
+	write_summary();
+
+	max = max_latency(&nr_samples);
+	ret = max / 1000 > (uint64_t)g.hardlimit;
+
+	if (strlen(g.jsonfile) != 0)
+		rt_write_json(g.jsonfile, ret, write_summary_json, NULL);
+
+	for (i = 0; i < g.nr_threads; i++)
+		free(g.threads[i].samples);
+	free(g.threads);
+
+	return ret;
+}
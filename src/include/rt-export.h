@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * rt-export.h - live OpenMetrics endpoint for long running tests
+ *
+ * A tool registers one series per measurement thread, made of a
+ * struct export_stat which only that thread writes and optionally its
+ * live histogram, then starts the exporter. The exporter is a
+ * SCHED_OTHER thread at nice 19 which answers every connection on a
+ * Unix socket or on a TCP port of 127.0.0.1 with the current values in
+ * the OpenMetrics text format, as HTTP response if the client sent a
+ * request, e.g. a Prometheus scrape or curl --unix-socket, and as plain
+ * text otherwise.
+ *
+ * The measurement side takes no lock: export_stat_update() is the write
+ * side of a seqlock, the exporter retries its copy while the sequence
+ * count is odd or has changed. Histogram buckets are read as they are,
+ * they only ever grow. Tools whose sampling loop cannot afford even that
+ * register a read callback instead, which the exporter calls to collect
+ * the values from the thread's own counters.
+ */
+#ifndef __RT_EXPORT_H
+#define __RT_EXPORT_H
+
+#include <stdint.h>
+
+#include "rt-histogram.h"
+
+struct export_stat {
+	uint32_t seq;		/* odd while the values are being updated */
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t last;
+	uint64_t sum;
+};
+
+static inline void export_stat_update(struct export_stat *s, uint64_t v)
+{
+	uint32_t seq = s->seq;
+
+	__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (v < s->min || !s->count)
+		s->min = v;
+	if (v > s->max)
+		s->max = v;
+	s->last = v;
+	s->sum += v;
+	s->count++;
+	__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Metric names are <tool>_latency_<unit>, <tool>_latency_min_<unit>
+ * etc. Must be called before any other export function.
+ */
+void export_init(const char *tool, const char *unit);
+
+/*
+ * Add a series labelled by the printf style fmt, e.g. "thread=\"%d\"".
+ * hist may be NULL, the latency is then exported as summary. Both
+ * pointers have to stay valid until export_stop().
+ */
+int export_add(struct export_stat *stat, const struct histogram *hist,
+	       const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+typedef void (*export_read_fn)(void *arg, struct export_stat *snap);
+
+/*
+ * Add a series whose values read() fills in when the exporter renders
+ * them, with a linear histogram: buckets[i] counts the values up to
+ * first + i, the last bucket all values above. There is no last sample
+ * gauge for such a series.
+ */
+int export_add_linear(export_read_fn read, void *arg, const uint64_t *buckets,
+		      unsigned int nbuckets, uint64_t first, const char *fmt, ...)
+	__attribute__((format(printf, 6, 7)));
+
+/*
+ * spec is unix:PATH or a path containing a '/' for a Unix socket,
+ * [localhost:]PORT for TCP on the loopback address. Returns 0 or -1
+ * with errno set.
+ */
+int export_start(const char *spec);
+void export_stop(void);
+
+#endif	/* __RT_EXPORT_H */
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * rt-histogram.h - log-linear latency histogram
+ *
+ * Values below 2^sub_bits get one bucket each. Above that every power
+ * of two is split into 2^(sub_bits - 1) equally sized buckets, so the
+ * relative error stays constant while the table stays small enough to
+ * live in the cache of the measuring CPU.
+ */
+#ifndef __RT_HISTOGRAM_H
+#define __RT_HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define HIST_DIGITS_MIN		1
+#define HIST_DIGITS_MAX		4
+#define HIST_DIGITS_DEFAULT	3
+
+/* ranges covering latencies of up to ~67 seconds */
+#define HIST_RANGE_BITS_US	26
+#define HIST_RANGE_BITS_NS	36
+
+/* Percentiles reported by hist_print_percentiles_json(), ascending */
+extern const double hist_json_percentiles[];
+extern const unsigned int hist_json_npercentiles;
+
+struct histogram {
+	unsigned long *buckets;
+	unsigned int sub_bits;		/* bits of exact resolution */
+	unsigned int range_bits;	/* largest value is 2^range_bits - 1 */
+	unsigned int nbuckets;
+	uint64_t sub_mask;
+	uint64_t max_value;
+	unsigned long overflow;		/* samples clamped to max_value */
+};
+
+int hist_init(struct histogram *h, unsigned int digits, unsigned int range_bits);
+size_t hist_size(const struct histogram *h);
+int hist_alloc(struct histogram *h);
+void hist_free(struct histogram *h);
+void hist_reset(struct histogram *h);
+
+uint64_t hist_bucket_low(const struct histogram *h, unsigned int idx);
+uint64_t hist_bucket_high(const struct histogram *h, unsigned int idx);
+
+unsigned long hist_count(const struct histogram *h);
+uint64_t hist_percentile(const struct histogram *h, double pct);
+void hist_tail_percentiles(const struct histogram *h, unsigned long count,
+			   uint64_t max, const double *pct, uint64_t *val,
+			   unsigned int n);
+int hist_merge(struct histogram *dst, const struct histogram *src);
+
+void hist_print_json(FILE *f, const struct histogram *h, int indent);
+void hist_print_percentiles_json(FILE *f, const struct histogram *h,
+				 uint64_t max, int indent);
+
+static inline unsigned int hist_index(const struct histogram *h, uint64_t v)
+{
+	unsigned int exp;
+
+	exp = 63 - __builtin_clzll(v | h->sub_mask) - (h->sub_bits - 1);
+	return (exp << (h->sub_bits - 1)) + (unsigned int)(v >> exp);
+}
+
+static inline void hist_sample(struct histogram *h, uint64_t v)
+{
+	if (__builtin_expect(v > h->max_value, 0)) {
+		h->overflow++;
+		v = h->max_value;
+	}
+	h->buckets[hist_index(h, v)]++;
+}
+
+#endif	/* __RT_HISTOGRAM_H */
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * rt-ipc.h - IPC wakeup latency engine
+ *
+ * pmqtest, ptsematest, svsematest and sigwaittest all measure the time
+ * from a sender releasing a primitive until the blocked receiver runs.
+ * The tools only provide the primitive as a set of struct ipc_ops, the
+ * engine runs the sender and receiver loops, takes CLOCK_MONOTONIC
+ * timestamps and keeps min/avg/max and a histogram per pair, so the
+ * results of the tools can be compared directly.
+ *
+ * The parameters of all pairs are one block: receiver[num_threads],
+ * sender[num_threads] and the receiver histograms. The block may be
+ * shared memory mapped at different addresses by forked processes, so
+ * the records refer to each other by offsets, never by pointers.
+ */
+#ifndef __RT_IPC_H
+#define __RT_IPC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "rt-histogram.h"
+#include "rt-export.h"
+#include "rt-numa.h"
+
+/*
+ * Common part of the per thread parameters. Tools embed it as the first
+ * member of their own struct params and pass sizeof(struct params) to
+ * ipc_init().
+ */
+struct ipc_params {
+	int num;
+	int num_threads;
+	int cpu;
+	int priority;
+	int sender;
+	int samples;
+	int max_cycles;
+	int tracelimit;			/* us */
+	int nsecs;			/* report in ns instead of us */
+	int tid;
+	pid_t pid;
+	int shutdown;
+	int stopped;
+	struct timespec delay;
+	uint64_t stamp;			/* release or wakeup time in ns */
+	uint64_t min, max, cur;		/* receiver: in us or ns */
+	double sum;
+	struct histogram hist;		/* buckets only valid in the receiver */
+	int exporting;			/* receiver: update export */
+	struct export_stat export;
+	long hist_offset;
+	long neighbor_offset;
+	size_t size;			/* of the whole block */
+	pthread_t threadid;
+};
+
+/*
+ * The primitive under test. Every hook returns 0 on success and nonzero
+ * to shut the pair down. Only send and receive are mandatory.
+ *
+ * sender:   prepare, stamp, send, sync
+ * receiver: receive, stamp, release, delay, ack
+ *
+ * When the receiver is woken up somewhere else than in receive, e.g. in
+ * a notification thread, receive may set stamp of the receiver itself.
+ */
+struct ipc_ops {
+	int (*init)(struct ipc_params *par);
+	int (*prepare)(struct ipc_params *par);
+	int (*send)(struct ipc_params *par);
+	int (*sync)(struct ipc_params *par);
+	int (*receive)(struct ipc_params *par);
+	int (*release)(struct ipc_params *par);
+	int (*ack)(struct ipc_params *par);
+	void (*exit)(struct ipc_params *par);
+	/* extra status of a receiver, "NAME %d, " and "\"name\": %d,\n" */
+	void (*print)(FILE *f, struct ipc_params *par);
+	void (*json)(FILE *f, struct ipc_params *par);
+};
+
+static inline uint64_t ipc_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void ipc_init(const struct ipc_ops *ops, size_t stride);
+
+void *ipc_alloc(int num_threads, int nsecs, const char *shmname);
+void *ipc_attach(const char *shmname);
+void ipc_detach(void *base);
+void ipc_free(void *base, const char *shmname);
+
+struct ipc_params *ipc_receiver(void *base, int num);
+struct ipc_params *ipc_sender(void *base, int num);
+struct ipc_params *ipc_neighbor(struct ipc_params *par);
+
+int ipc_placement(const char *policy);
+int ipc_cpu(int setaffinity, int affinity, int num);
+int ipc_setup_thread(int cpu, int priority);
+void ipc_pair_init(void *base, int num, int cpu, int priority, int interval,
+		   int max_cycles, int tracelimit);
+int ipc_should_stop(void *base);
+void ipc_stop(void *base);
+
+void *ipc_thread(void *param);
+
+int ipc_export(void *base, const char *tool, const char *spec);
+void ipc_export_stop(void);
+
+void ipc_print_stat(void *base, int quiet);
+void ipc_print_percentiles(void *base);
+void ipc_write_stats(FILE *f, void *data);
+
+#endif	/* __RT_IPC_H */
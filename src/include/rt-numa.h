@@ -2,6 +2,7 @@
 #ifndef __RT_NUMA_H
 #define __RT_NUMA_H
 
+#include <stddef.h>
 #include <numa.h>
 
 enum {
@@ -18,4 +19,63 @@ int cpu_for_thread_ua(int thread_num, int max_cpus);
 
 int parse_cpumask(char *str, int max_cpus, struct bitmask **cpumask);
 
+/*
+ * Placement planner
+ *
+ * A plan is the list of allowed CPUs in the order threads should be put
+ * on them, thread N runs on cpus[N % nr_cpus]. The order follows the
+ * topology from sysfs, SMT siblings, last level caches and NUMA nodes:
+ *
+ *   rr          all CPUs by number, what -a always did
+ *   core        one thread per core before any SMT sibling is used
+ *   nosmt       only the first SMT sibling of every core
+ *   llc         one thread per last level cache, then the next core
+ *               of every cache, SMT siblings last
+ *   cross-node  alternate the NUMA nodes, so the threads 2N and 2N+1
+ *               of a pair run on different nodes
+ *
+ * queuelat keeps its explicit CPU lists. cyclicdeadline and deadline_test
+ * do not take a plan either: SCHED_DEADLINE tasks cannot be pinned with
+ * sched_setaffinity(), they are confined to CPUs by the cpusets those
+ * tools set up.
+ */
+enum {
+	CPU_PLAN_RR,
+	CPU_PLAN_CORE,
+	CPU_PLAN_NOSMT,
+	CPU_PLAN_LLC,
+	CPU_PLAN_CROSS_NODE,
+};
+
+#define CPU_PLAN_POLICIES	"rr, core, nosmt, llc, cross-node"
+
+struct cpu_plan {
+	int policy;
+	int nr_cpus;
+	int *cpus;
+};
+
+int cpu_plan_policy(const char *name);
+const char *cpu_plan_name(int policy);
+struct cpu_plan *cpu_plan_create(int policy, struct bitmask *cpumask);
+void cpu_plan_free(struct cpu_plan *plan);
+
+static inline int cpu_plan_cpu(const struct cpu_plan *plan, int thread_num)
+{
+	return plan->cpus[thread_num % plan->nr_cpus];
+}
+
+/*
+ * Zeroed, and so prefaulted, memory on the node of a CPU, or on a node.
+ * Without NUMA, or for cpu/node -1, this is zeroed heap memory aligned to
+ * the cache line. Free with the same size and cpu/node.
+ */
+void *node_local_alloc(size_t size, int node);
+void node_local_free(void *ptr, size_t size, int node);
+void *cpu_local_alloc(size_t size, int cpu);
+void cpu_local_free(void *ptr, size_t size, int cpu);
+
+/* The node cpu_local_alloc() uses for cpu, -1 without NUMA */
+int cpu_local_node(int cpu);
+
 #endif
@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * rt-perf.h - per thread performance counters around latency samples
+ *
+ * struct perf_counters counts cycles, instructions, LLC misses, dTLB
+ * misses and context switches of the calling thread. The values are
+ * taken from the mmap()ed perf_event pages, with rdpmc for the hardware
+ * events, so a read costs no system call and fits into every cycle of a
+ * measurement loop. Events the CPU or the kernel does not offer, e.g. in
+ * a guest without a virtual PMU, are left out of mask.
+ *
+ * A tool calls perf_counters_sample() once per sample, which leaves the
+ * increments since the previous sample in delta, perf_counters_spike()
+ * for the samples over its threshold and perf_counters_max() for a new
+ * maximum latency.
+ *
+ * The hardware events form one group, so they are scheduled together.
+ * A delta taken while an event was multiplexed off the PMU is low; such
+ * samples are flagged in delta_mux and counted, not scaled.
+ */
+#ifndef __RT_PERF_H
+#define __RT_PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_LLC_MISSES,
+	PERF_DTLB_MISSES,
+	PERF_CSWITCHES,
+	PERF_NR_COUNTERS
+};
+
+struct perf_event_mmap_page;
+
+struct perf_counters {
+	unsigned int mask;			/* bit N set: counter N is open */
+	int fd[PERF_NR_COUNTERS];
+	struct perf_event_mmap_page *page[PERF_NR_COUNTERS];
+	uint64_t prev[PERF_NR_COUNTERS];
+	uint64_t prev_stopped[PERF_NR_COUNTERS];	/* enabled - running */
+	uint64_t delta[PERF_NR_COUNTERS];	/* of the last sample */
+	unsigned int delta_mux;			/* bit N: counter N was scheduled out */
+	uint64_t total[PERF_NR_COUNTERS];
+	uint64_t spike_sum[PERF_NR_COUNTERS];
+	uint64_t spike_max[PERF_NR_COUNTERS];
+	uint64_t at_max[PERF_NR_COUNTERS];	/* delta of the max latency */
+	unsigned int at_max_mux;		/* delta_mux of at_max */
+	unsigned long spikes;
+	unsigned long mux_samples;		/* samples with a delta_mux */
+	unsigned long mux_spikes;
+};
+
+extern const char * const perf_counter_names[PERF_NR_COUNTERS];
+
+/* 0 if at least one counter could be opened for the calling thread */
+int perf_counters_open(struct perf_counters *pc);
+void perf_counters_close(struct perf_counters *pc);
+
+void perf_counters_read(const struct perf_counters *pc, uint64_t *val);
+void perf_counters_rebase(struct perf_counters *pc);
+void perf_counters_sample(struct perf_counters *pc);
+void perf_counters_spike(struct perf_counters *pc);
+void perf_counters_max(struct perf_counters *pc);
+
+/* "name value" pairs of the open counters, separated by blanks */
+void perf_counters_print(FILE *f, const struct perf_counters *pc,
+			 const uint64_t *val);
+/* The summary as a JSON object, indent is the one of its key */
+void perf_counters_json(FILE *f, const struct perf_counters *pc, int indent);
+
+#endif	/* __RT_PERF_H */
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * rt-tsc.h - cycle counter access and conversion
+ *
+ * frc() reads the free running counter of the CPU in an ordered way,
+ * struct tsc_scale converts between counter cycles and nanoseconds with
+ * a single multiply and shift.
+ */
+#ifndef __RT_TSC_H
+#define __RT_TSC_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __GNUC__
+# if defined(__x86_64__)
+#  define relax()          __asm__ __volatile__("pause" ::: "memory")
+static inline void frc(uint64_t *pval)
+{
+	uint32_t low, high;
+	/* See rdtsc_ordered() of Linux */
+	__asm__ __volatile__("lfence");
+	__asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+	*pval = ((uint64_t) high << 32) | low;
+}
+# elif defined(__i386__)
+#  define relax()          __asm__ __volatile__("pause" ::: "memory")
+static inline void frc(uint64_t *pval)
+{
+	__asm__ __volatile__("rdtsc" : "=A" (*pval));
+}
+# elif defined(__PPC64__)
+#  define relax()          do { } while (0)
+static inline void frc(uint64_t *pval)
+{
+	__asm__ __volatile__("mfspr %0, 268\n" : "=r" (*pval));
+}
+# else
+#  define relax()          do { } while (0)
+#  define frc(x)
+#  define FRC_MISSING
+# endif
+#else
+# error Need to add support for this compiler.
+#endif
+
+#define TSC_SCALE_SHIFT		32
+
+struct tsc_scale {
+	uint64_t hz;
+	uint64_t ns_mult;	/* cycles to ns */
+	uint64_t cyc_mult;	/* ns to cycles */
+};
+
+uint64_t tsc_measure_hz(void);
+unsigned int tsc_measure_mhz(void);
+int tsc_calibrate(struct tsc_scale *s, clockid_t clock, unsigned int msecs);
+void tsc_scale_init(struct tsc_scale *s, uint64_t hz);
+int tsc_is_stable(void);
+
+/* (v * mult) >> TSC_SCALE_SHIFT without losing the upper bits */
+static inline uint64_t tsc_mul_shift(uint64_t v, uint64_t mult)
+{
+#ifdef __SIZEOF_INT128__
+	return (uint64_t)(((unsigned __int128)v * mult) >> TSC_SCALE_SHIFT);
+#else
+	return (uint64_t)((double)v * mult / (double)(1ULL << TSC_SCALE_SHIFT));
+#endif
+}
+
+static inline uint64_t tsc_to_ns(const struct tsc_scale *s, uint64_t cycles)
+{
+	return tsc_mul_shift(cycles, s->ns_mult);
+}
+
+static inline uint64_t ns_to_tsc(const struct tsc_scale *s, uint64_t ns)
+{
+	return tsc_mul_shift(ns, s->cyc_mult);
+}
+
+#endif	/* __RT_TSC_H */
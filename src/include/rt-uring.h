@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * rt-uring.h - minimal io_uring access through the raw system calls
+ *
+ * Only what the tests need to block on a single request at a time,
+ * without depending on liburing.
+ */
+#ifndef __RT_URING_H
+#define __RT_URING_H
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+struct rt_uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_pending;	/* local tail, published on submit */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+int rt_uring_init(struct rt_uring *r, unsigned int entries);
+void rt_uring_exit(struct rt_uring *r);
+struct io_uring_sqe *rt_uring_get_sqe(struct rt_uring *r);
+int rt_uring_submit_and_wait(struct rt_uring *r, struct io_uring_cqe *cqe);
+int rt_uring_timeout(struct rt_uring *r, const struct __kernel_timespec *ts,
+		     unsigned int flags);
+
+#endif	/* __RT_URING_H */
@@ -3,6 +3,7 @@
 #define __RT_UTILS_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define _STR(x) #x
 #define STR(x) _STR(x)
@@ -30,6 +31,35 @@ pid_t gettid(void);
 int parse_time_string(char *val);
 int parse_mem_string(char *str, uint64_t *val);
 
+/*
+ * Trace marks. tracemark_open() opens the files once, the writers then
+ * issue a single write() from a buffer of the calling thread, so they
+ * can be used from several measurement threads at the same time.
+ * Stopping the trace is a separate tracemark_stop().
+ */
+#define TRACEMARK_QUIET		0x1
+
+extern int tracemark_active;
+
+int tracemark_open(unsigned int flags);
+void tracemark_close(void);
+void tracemark_write(const char *buf, size_t len);
+void tracemark_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int tracemark_raw(unsigned int id, const void *data, size_t len);
+void tracemark_stop(void);
+
+/* ids of the binary records written with tracemark_raw() */
+#define TRACEMARK_ID_CYCLICTEST	0x1	/* struct ct_trace_record */
+#define TRACEMARK_ID_OSLAT	0x2	/* struct oslat_trace_record */
+
+/* Annotation for hot loops, the arguments are only evaluated when tracing */
+#define TRACEMARK(fmt, ...)						\
+	do {								\
+		if (__builtin_expect(tracemark_active, 0))		\
+			tracemark_printf(fmt, ##__VA_ARGS__);		\
+	} while (0)
+
+/* mark and stop the trace, same as tracemark_printf() + tracemark_stop() */
 void enable_trace_mark(void);
 void tracemark(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void disable_trace_mark(void);
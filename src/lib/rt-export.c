@@ -0,0 +1,536 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Live OpenMetrics exporter
+ *
+ * The exporter thread renders the whole exposition into a memory stream
+ * for every connection, so a slow or stuck client only delays the next
+ * scrape and never the measurement threads. Histograms only list the
+ * buckets which have seen a sample; a bucket never becomes empty again,
+ * so the set of le labels of a series only grows during a run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rt-utils.h"
+#include "rt-export.h"
+
+#define EXPORT_NICE		19
+#define EXPORT_REQ_TIMEOUT_MS	1000
+#define EXPORT_SEND_TIMEOUT_S	5
+
+struct export_series {
+	char labels[128];
+	struct export_stat *stat;
+	const struct histogram *hist;
+	/* export_add_linear() */
+	export_read_fn read;
+	void *arg;
+	const uint64_t *lin;
+	unsigned int nlin;
+	uint64_t first;
+};
+
+static char tool_name[32] = "rt";
+static char unit_name[8] = "us";
+
+static pthread_mutex_t series_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct export_series *series;
+static unsigned int nseries;
+
+static pthread_t export_thread;
+static int export_running;
+static int listen_fd = -1;
+static int wake_fd[2] = { -1, -1 };
+static char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+void export_init(const char *tool, const char *unit)
+{
+	snprintf(tool_name, sizeof(tool_name), "%s", tool);
+	snprintf(unit_name, sizeof(unit_name), "%s", unit);
+}
+
+static int add_series(const struct export_series *s, const char *fmt,
+		      va_list ap)
+{
+	struct export_series *tmp;
+
+	pthread_mutex_lock(&series_lock);
+	tmp = realloc(series, (nseries + 1) * sizeof(*series));
+	if (!tmp) {
+		pthread_mutex_unlock(&series_lock);
+		return -1;
+	}
+	series = tmp;
+	tmp = &series[nseries];
+	*tmp = *s;
+	vsnprintf(tmp->labels, sizeof(tmp->labels), fmt, ap);
+	nseries++;
+	pthread_mutex_unlock(&series_lock);
+
+	return 0;
+}
+
+int export_add(struct export_stat *stat, const struct histogram *hist,
+	       const char *fmt, ...)
+{
+	struct export_series s = { .stat = stat, .hist = hist };
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = add_series(&s, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+int export_add_linear(export_read_fn read, void *arg, const uint64_t *buckets,
+		      unsigned int nbuckets, uint64_t first, const char *fmt, ...)
+{
+	struct export_series s = {
+		.read = read,
+		.arg = arg,
+		.lin = buckets,
+		.nlin = nbuckets,
+		.first = first,
+	};
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = add_series(&s, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+/* seqlock read side of export_stat_update() */
+static void export_stat_read(const struct export_stat *s, struct export_stat *copy)
+{
+	uint32_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		copy->count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+		copy->min = __atomic_load_n(&s->min, __ATOMIC_RELAXED);
+		copy->max = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+		copy->last = __atomic_load_n(&s->last, __ATOMIC_RELAXED);
+		copy->sum = __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+	copy->seq = seq;
+}
+
+/* name{labels,le="..."}, without a stray comma when labels is empty */
+static void print_sample(FILE *f, const char *metric, const char *suffix,
+			 const char *labels, const char *le,
+			 unsigned long long val)
+{
+	fprintf(f, "%s_%s_%s%s{%s", tool_name, metric, unit_name, suffix,
+		labels);
+	if (le)
+		fprintf(f, "%sle=\"%s\"", *labels ? "," : "", le);
+	fprintf(f, "} %llu\n", val);
+}
+
+static void print_hist(FILE *f, const struct export_series *s,
+		       const struct export_stat *snap)
+{
+	const struct histogram *h = s->hist;
+	unsigned long long cum = 0;
+	char le[24];
+	unsigned int i;
+
+	for (i = 0; h && i < h->nbuckets; i++) {
+		unsigned long n = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+
+		if (!n)
+			continue;
+		cum += n;
+		snprintf(le, sizeof(le), "%llu",
+			 (unsigned long long)hist_bucket_high(h, i));
+		print_sample(f, "latency", "_bucket", s->labels, le, cum);
+	}
+	for (i = 0; s->lin && i < s->nlin; i++) {
+		uint64_t n = __atomic_load_n(&s->lin[i], __ATOMIC_RELAXED);
+
+		cum += n;
+		if (!n || i == s->nlin - 1)
+			continue;
+		snprintf(le, sizeof(le), "%llu",
+			 (unsigned long long)(s->first + i));
+		print_sample(f, "latency", "_bucket", s->labels, le, cum);
+	}
+	/* without a histogram the +Inf bucket is all there is */
+	if (!h && !s->lin)
+		cum = snap->count;
+	print_sample(f, "latency", "_bucket", s->labels, "+Inf", cum);
+	fprintf(f, "%s_latency_%s_count{%s} %llu\n", tool_name, unit_name,
+		s->labels, cum);
+	fprintf(f, "%s_latency_%s_sum{%s} %llu\n", tool_name, unit_name,
+		s->labels, (unsigned long long)snap->sum);
+}
+
+static void render(FILE *f)
+{
+	struct export_stat *snap;
+	unsigned int i, with_hist = 0, with_last = 0;
+
+	pthread_mutex_lock(&series_lock);
+
+	snap = calloc(nseries ? nseries : 1, sizeof(*snap));
+	if (!snap)
+		goto out;
+	for (i = 0; i < nseries; i++) {
+		if (series[i].read)
+			series[i].read(series[i].arg, &snap[i]);
+		else
+			export_stat_read(series[i].stat, &snap[i]);
+		if (series[i].hist || series[i].lin)
+			with_hist = 1;
+		if (!series[i].read)
+			with_last = 1;
+	}
+
+	fprintf(f, "# TYPE %s_latency_%s %s\n", tool_name, unit_name,
+		with_hist ? "histogram" : "summary");
+	fprintf(f, "# HELP %s_latency_%s Latency samples in %s.\n",
+		tool_name, unit_name, unit_name);
+	for (i = 0; i < nseries; i++) {
+		if (with_hist) {
+			print_hist(f, &series[i], &snap[i]);
+			continue;
+		}
+		fprintf(f, "%s_latency_%s_count{%s} %llu\n", tool_name,
+			unit_name, series[i].labels,
+			(unsigned long long)snap[i].count);
+		fprintf(f, "%s_latency_%s_sum{%s} %llu\n", tool_name,
+			unit_name, series[i].labels,
+			(unsigned long long)snap[i].sum);
+	}
+
+	fprintf(f, "# TYPE %s_latency_min_%s gauge\n", tool_name, unit_name);
+	fprintf(f, "# HELP %s_latency_min_%s Smallest latency so far.\n",
+		tool_name, unit_name);
+	for (i = 0; i < nseries; i++)
+		print_sample(f, "latency_min", "", series[i].labels, NULL,
+			     snap[i].min);
+
+	fprintf(f, "# TYPE %s_latency_max_%s gauge\n", tool_name, unit_name);
+	fprintf(f, "# HELP %s_latency_max_%s Largest latency so far.\n",
+		tool_name, unit_name);
+	for (i = 0; i < nseries; i++)
+		print_sample(f, "latency_max", "", series[i].labels, NULL,
+			     snap[i].max);
+
+	if (!with_last)
+		goto out_free;
+	fprintf(f, "# TYPE %s_latency_last_%s gauge\n", tool_name, unit_name);
+	fprintf(f, "# HELP %s_latency_last_%s Latency of the last sample.\n",
+		tool_name, unit_name);
+	for (i = 0; i < nseries; i++)
+		if (!series[i].read)
+			print_sample(f, "latency_last", "", series[i].labels,
+				     NULL, snap[i].last);
+
+out_free:
+	free(snap);
+out:
+	pthread_mutex_unlock(&series_lock);
+	fprintf(f, "# EOF\n");
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Read the request up to the empty line. Returns 1 for GET, 2 for HEAD,
+ * -1 for any other HTTP request and 0 if the client sent no request
+ * within the timeout or closed its side, e.g. socat or nc.
+ */
+static int read_request(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char req[2048];
+	size_t len = 0;
+	ssize_t ret;
+
+	while (len < sizeof(req) - 1) {
+		if (poll(&pfd, 1, EXPORT_REQ_TIMEOUT_MS) <= 0)
+			break;
+		ret = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (ret <= 0)
+			break;
+		len += ret;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	req[len] = '\0';
+
+	if (!strncmp(req, "GET ", 4))
+		return 1;
+	if (!strncmp(req, "HEAD ", 5))
+		return 2;
+	if (strstr(req, " HTTP/"))
+		return -1;
+	return 0;
+}
+
+static void serve(int fd)
+{
+	static const char not_allowed[] =
+		"HTTP/1.0 405 Method Not Allowed\r\n"
+		"Allow: GET, HEAD\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	char *body = NULL, hdr[256];
+	size_t size = 0;
+	FILE *f;
+	int method;
+
+	method = read_request(fd);
+	if (method < 0) {
+		write_all(fd, not_allowed, sizeof(not_allowed) - 1);
+		return;
+	}
+
+	f = open_memstream(&body, &size);
+	if (!f)
+		return;
+	render(f);
+	fclose(f);
+
+	if (method) {
+		snprintf(hdr, sizeof(hdr),
+			 "HTTP/1.0 200 OK\r\n"
+			 "Content-Type: application/openmetrics-text; "
+			 "version=1.0.0; charset=utf-8\r\n"
+			 "Content-Length: %zu\r\n"
+			 "Connection: close\r\n\r\n", size);
+		if (write_all(fd, hdr, strlen(hdr)) == 0 && method == 1)
+			write_all(fd, body, size);
+	} else {
+		write_all(fd, body, size);
+	}
+	free(body);
+}
+
+static void *exporter(void *arg)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = listen_fd, .events = POLLIN },
+		{ .fd = wake_fd[0], .events = POLLIN },
+	};
+	struct timeval send_timeout = { .tv_sec = EXPORT_SEND_TIMEOUT_S };
+	int fd;
+
+	setpriority(PRIO_PROCESS, gettid(), EXPORT_NICE);
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+		/* a client which stops reading must not keep out the next */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+			   sizeof(send_timeout));
+		serve(fd);
+		shutdown(fd, SHUT_WR);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* a socket left behind by an earlier run, but nothing else */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	strcpy(unix_path, path);
+
+	return fd;
+}
+
+static int listen_tcp(const char *port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int fd, one = 1;
+	char *end;
+	long val;
+
+	val = strtol(port, &end, 10);
+	if (*end || end == port || val <= 0 || val > 65535) {
+		errno = EINVAL;
+		return -1;
+	}
+	addr.sin_port = htons(val);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int export_start(const char *spec)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	sigset_t all, old;
+	pthread_attr_t attr;
+	int err;
+
+	if (export_running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (!strncmp(spec, "unix:", 5))
+		listen_fd = listen_unix(spec + 5);
+	else if (strchr(spec, '/'))
+		listen_fd = listen_unix(spec);
+	else if (!strncmp(spec, "localhost:", 10))
+		listen_fd = listen_tcp(spec + 10);
+	else
+		listen_fd = listen_tcp(spec);
+	if (listen_fd < 0)
+		return -1;
+
+	if (listen(listen_fd, 8) < 0 || pipe2(wake_fd, O_CLOEXEC) < 0)
+		goto err_close;
+
+	/*
+	 * Keep the exporter out of the real time classes the tool may run
+	 * in, and out of signal delivery, which tools with sigwait() based
+	 * measurement threads depend on.
+	 */
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &param);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&export_thread, &attr, exporter, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		errno = err;
+		goto err_close;
+	}
+	export_running = 1;
+
+	return 0;
+
+err_close:
+	err = errno;
+	if (wake_fd[0] >= 0) {
+		close(wake_fd[0]);
+		close(wake_fd[1]);
+		wake_fd[0] = wake_fd[1] = -1;
+	}
+	close(listen_fd);
+	listen_fd = -1;
+	if (*unix_path) {
+		unlink(unix_path);
+		*unix_path = '\0';
+	}
+	errno = err;
+	return -1;
+}
+
+void export_stop(void)
+{
+	if (export_running) {
+		if (write(wake_fd[1], "", 1) < 0)
+			pthread_cancel(export_thread);
+		pthread_join(export_thread, NULL);
+		export_running = 0;
+		close(wake_fd[0]);
+		close(wake_fd[1]);
+		wake_fd[0] = wake_fd[1] = -1;
+		close(listen_fd);
+		listen_fd = -1;
+		if (*unix_path) {
+			unlink(unix_path);
+			*unix_path = '\0';
+		}
+	}
+
+	pthread_mutex_lock(&series_lock);
+	free(series);
+	series = NULL;
+	nseries = 0;
+	pthread_mutex_unlock(&series_lock);
+}
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Log-linear latency histogram shared by the rt-tests
+ *
+ * A sample is binned with a single count-leading-zeros, a shift and an
+ * add, see hist_index(). Everything else here runs outside of the
+ * measurement loop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "rt-utils.h"
+#include "rt-histogram.h"
+
+/*
+ * Translate decimal significant digits into the number of bits needed
+ * to represent 2 * 10^digits distinct values, which bounds the relative
+ * bucket width to 10^-digits.
+ */
+static unsigned int digits_to_bits(unsigned int digits)
+{
+	uint64_t need = 2;
+	unsigned int bits = 0;
+
+	while (digits--)
+		need *= 10;
+	while ((1ULL << bits) < need)
+		bits++;
+
+	return bits;
+}
+
+int hist_init(struct histogram *h, unsigned int digits, unsigned int range_bits)
+{
+	unsigned int sub_bits;
+
+	if (digits < HIST_DIGITS_MIN || digits > HIST_DIGITS_MAX)
+		return -EINVAL;
+
+	sub_bits = digits_to_bits(digits);
+	if (range_bits < sub_bits || range_bits > 63)
+		return -EINVAL;
+
+	memset(h, 0, sizeof(*h));
+	h->sub_bits = sub_bits;
+	h->range_bits = range_bits;
+	h->sub_mask = (1ULL << sub_bits) - 1;
+	h->max_value = (1ULL << range_bits) - 1;
+	h->nbuckets = (range_bits - sub_bits + 2) << (sub_bits - 1);
+
+	return 0;
+}
+
+size_t hist_size(const struct histogram *h)
+{
+	return h->nbuckets * sizeof(*h->buckets);
+}
+
+int hist_alloc(struct histogram *h)
+{
+	h->buckets = calloc(h->nbuckets, sizeof(*h->buckets));
+	if (!h->buckets)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void hist_free(struct histogram *h)
+{
+	free(h->buckets);
+	h->buckets = NULL;
+}
+
+void hist_reset(struct histogram *h)
+{
+	memset(h->buckets, 0, hist_size(h));
+	h->overflow = 0;
+}
+
+static unsigned int bucket_exp(const struct histogram *h, unsigned int idx)
+{
+	unsigned int exp = idx >> (h->sub_bits - 1);
+
+	return exp ? exp - 1 : 0;
+}
+
+uint64_t hist_bucket_low(const struct histogram *h, unsigned int idx)
+{
+	unsigned int exp = bucket_exp(h, idx);
+
+	return (uint64_t)(idx - (exp << (h->sub_bits - 1))) << exp;
+}
+
+uint64_t hist_bucket_high(const struct histogram *h, unsigned int idx)
+{
+	return hist_bucket_low(h, idx) + (1ULL << bucket_exp(h, idx)) - 1;
+}
+
+unsigned long hist_count(const struct histogram *h)
+{
+	unsigned long count = 0;
+	unsigned int i;
+
+	for (i = 0; i < h->nbuckets; i++)
+		count += h->buckets[i];
+
+	return count;
+}
+
+/*
+ * Return the upper bound of the bucket holding the sample at the given
+ * percentile (0-100), i.e. a value no sample below that rank exceeds.
+ * The bound may lie above the largest sample, callers which know it
+ * clamp the result to it.
+ */
+uint64_t hist_percentile(const struct histogram *h, double pct)
+{
+	unsigned long count = hist_count(h);
+	unsigned long rank, seen = 0;
+	double exact;
+	unsigned int i;
+
+	if (!count)
+		return 0;
+
+	exact = pct / 100.0 * count;
+	rank = (unsigned long)exact;
+	if (rank < exact)
+		rank++;
+	if (rank < 1)
+		rank = 1;
+	if (rank > count)
+		rank = count;
+
+	for (i = 0; i < h->nbuckets; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return hist_bucket_high(h, i);
+	}
+
+	return h->max_value;
+}
+
+/*
+ * Percentiles for a histogram which is still being filled, e.g. for a
+ * live display. Instead of summing the whole table this walks down from
+ * the bucket holding max, so the cost only depends on the width of the
+ * tail. count is the number of samples taken so far and pct must be
+ * sorted in ascending order.
+ */
+void hist_tail_percentiles(const struct histogram *h, unsigned long count,
+			   uint64_t max, const double *pct, uint64_t *val,
+			   unsigned int n)
+{
+	unsigned long above = 0;
+	int i, j = n - 1;
+
+	if (max > h->max_value)
+		max = h->max_value;
+
+	for (i = hist_index(h, max); i >= 0 && j >= 0; i--) {
+		above += h->buckets[i];
+		while (j >= 0) {
+			double exact = pct[j] / 100.0 * count;
+			unsigned long rank = (unsigned long)exact;
+
+			if (rank < exact)
+				rank++;
+			/* the sample of that rank lives in this bucket */
+			if (above <= count - rank)
+				break;
+			val[j] = hist_bucket_high(h, i);
+			if (val[j] > max)
+				val[j] = max;
+			j--;
+		}
+	}
+	while (j >= 0)
+		val[j--] = 0;
+}
+
+/* Add the counts of src to dst, both must share the same geometry */
+int hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	unsigned int i;
+
+	if (dst->sub_bits != src->sub_bits || dst->nbuckets != src->nbuckets)
+		return -EINVAL;
+
+	for (i = 0; i < dst->nbuckets; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->overflow += src->overflow;
+
+	return 0;
+}
+
+const double hist_json_percentiles[] = { 50, 90, 99, 99.9, 99.99, 99.9999 };
+const unsigned int hist_json_npercentiles = ARRAY_SIZE(hist_json_percentiles);
+
+/*
+ * Print the non-empty buckets as a JSON object keyed by the lower bound
+ * of each bucket. indent is the column of the line holding the key.
+ */
+void hist_print_json(FILE *f, const struct histogram *h, int indent)
+{
+	unsigned int i;
+	int comma = 0;
+
+	fprintf(f, "{");
+	for (i = 0; i < h->nbuckets; i++) {
+		if (h->buckets[i] == 0)
+			continue;
+		fprintf(f, "%s", comma ? ",\n" : "\n");
+		fprintf(f, "%*s\"%llu\": %lu", indent + 2, "",
+			(unsigned long long)hist_bucket_low(h, i),
+			h->buckets[i]);
+		comma = 1;
+	}
+	if (comma)
+		fprintf(f, "\n%*s", indent, "");
+	fprintf(f, "}");
+}
+
+/*
+ * Print hist_json_percentiles as a JSON object. max is the largest
+ * sample seen, the bucket bounds are clamped to it like in
+ * hist_tail_percentiles().
+ */
+void hist_print_percentiles_json(FILE *f, const struct histogram *h,
+				 uint64_t max, int indent)
+{
+	unsigned int i;
+	uint64_t val;
+
+	fprintf(f, "{\n");
+	for (i = 0; i < hist_json_npercentiles; i++) {
+		val = hist_percentile(h, hist_json_percentiles[i]);
+		if (val > max)
+			val = max;
+		fprintf(f, "%*s\"%g\": %llu%s\n", indent + 2, "",
+			hist_json_percentiles[i], (unsigned long long)val,
+			i == hist_json_npercentiles - 1 ? "" : ",");
+	}
+	fprintf(f, "%*s}", indent, "");
+}
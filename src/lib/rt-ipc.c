@@ -0,0 +1,509 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * IPC wakeup latency engine shared by pmqtest, ptsematest, svsematest
+ * and sigwaittest
+ *
+ * The loops below are the complete measurement methodology: the sender
+ * stamps right before it releases the receiver, the receiver stamps
+ * right after it returned from blocking. Everything differing between
+ * the tools lives behind struct ipc_ops.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rt-utils.h"
+#include "rt-get_cpu.h"
+#include "rt-error.h"
+#include "rt-numa.h"
+#include "rt-ipc.h"
+
+static const struct ipc_ops *ipc_ops;
+static size_t ipc_stride;
+static struct cpu_plan *ipc_plan;
+
+void ipc_init(const struct ipc_ops *ops, size_t stride)
+{
+	ipc_ops = ops;
+	ipc_stride = (stride + 63) & ~(size_t)63;
+}
+
+struct ipc_params *ipc_receiver(void *base, int num)
+{
+	return (struct ipc_params *)((char *)base + num * ipc_stride);
+}
+
+struct ipc_params *ipc_sender(void *base, int num)
+{
+	struct ipc_params *r = base;
+
+	return ipc_receiver(base, r->num_threads + num);
+}
+
+struct ipc_params *ipc_neighbor(struct ipc_params *par)
+{
+	return (struct ipc_params *)((char *)par + par->neighbor_offset);
+}
+
+/* Copy of the receiver histogram which is usable in this process */
+static void ipc_hist(struct ipc_params *par, struct histogram *h)
+{
+	*h = par->hist;
+	h->buckets = (unsigned long *)((char *)par + par->hist_offset);
+}
+
+void *ipc_alloc(int num_threads, int nsecs, const char *shmname)
+{
+	struct histogram hist;
+	size_t records, size;
+	void *base;
+	int i;
+
+	if (hist_init(&hist, HIST_DIGITS_DEFAULT,
+		      nsecs ? HIST_RANGE_BITS_NS : HIST_RANGE_BITS_US))
+		return NULL;
+	records = 2 * num_threads * ipc_stride;
+	size = records + num_threads * hist_size(&hist);
+
+	if (shmname) {
+		int shmem;
+
+		shm_unlink(shmname);
+		shmem = shm_open(shmname, O_CREAT|O_EXCL|O_RDWR,
+				 S_IRUSR|S_IWUSR);
+		if (shmem < 0)
+			return NULL;
+		if (ftruncate(shmem, size)) {
+			close(shmem);
+			shm_unlink(shmname);
+			return NULL;
+		}
+		base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			    shmem, 0);
+		close(shmem);
+		if (base == MAP_FAILED) {
+			shm_unlink(shmname);
+			return NULL;
+		}
+	} else {
+		base = calloc(1, size);
+		if (!base)
+			return NULL;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		struct ipc_params *r = ipc_receiver(base, i);
+		struct ipc_params *s = ipc_receiver(base, num_threads + i);
+
+		r->num = s->num = i;
+		r->num_threads = s->num_threads = num_threads;
+		r->nsecs = s->nsecs = nsecs;
+		r->size = s->size = size;
+		r->cpu = s->cpu = -1;
+		s->sender = 1;
+		r->neighbor_offset = (char *)s - (char *)r;
+		s->neighbor_offset = (char *)r - (char *)s;
+
+		r->min = UINT64_MAX;
+		r->hist = hist;
+		r->hist_offset = (char *)base + records + i * hist_size(&hist) -
+			(char *)r;
+	}
+
+	return base;
+}
+
+/* Map the block of the parent in a process started with --fork */
+void *ipc_attach(const char *shmname)
+{
+	struct ipc_params *r;
+	struct stat buf;
+	void *base;
+	int shmem;
+
+	shmem = shm_open(shmname, O_RDWR, S_IRUSR|S_IWUSR);
+	if (shmem < 0)
+		return NULL;
+	if (fstat(shmem, &buf) || buf.st_size < (off_t)sizeof(*r)) {
+		close(shmem);
+		return NULL;
+	}
+	base = mmap(NULL, buf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+		    shmem, 0);
+	close(shmem);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	r = base;
+	if (r->size != (size_t)buf.st_size || r->num_threads < 1 ||
+	    2 * r->num_threads * ipc_stride > r->size) {
+		warn("Memory size problem (expected %zu, found %zu)\n",
+		     r->size, (size_t)buf.st_size);
+		munmap(base, buf.st_size);
+		return NULL;
+	}
+
+	return base;
+}
+
+void ipc_detach(void *base)
+{
+	struct ipc_params *r = base;
+
+	munmap(base, r->size);
+}
+
+void ipc_free(void *base, const char *shmname)
+{
+	if (shmname) {
+		ipc_detach(base);
+		shm_unlink(shmname);
+	} else {
+		free(base);
+	}
+}
+
+/*
+ * With a placement plan thread N of a tool runs on plan CPU N and the
+ * two sides of pair N on plan CPUs 2N and 2N+1, so cross-node puts the
+ * receiver and the sender on different nodes.
+ */
+int ipc_placement(const char *policy)
+{
+	int p = cpu_plan_policy(policy);
+
+	if (p < 0)
+		return -1;
+	cpu_plan_free(ipc_plan);
+	ipc_plan = cpu_plan_create(p, NULL);
+	return ipc_plan ? 0 : -1;
+}
+
+int ipc_cpu(int setaffinity, int affinity, int num)
+{
+	if (ipc_plan)
+		return cpu_plan_cpu(ipc_plan, num);
+
+	switch (setaffinity) {
+	case AFFINITY_SPECIFIED:
+		return affinity;
+	case AFFINITY_USEALL:
+		return num % sysconf(_SC_NPROCESSORS_CONF);
+	}
+	return -1;
+}
+
+/* Both sides of a pair run with the same parameters, and CPU unless planned */
+void ipc_pair_init(void *base, int num, int cpu, int priority, int interval,
+		   int max_cycles, int tracelimit)
+{
+	struct ipc_params *r = ipc_receiver(base, num);
+	struct ipc_params *s = ipc_sender(base, num);
+
+	r->cpu = s->cpu = cpu;
+	if (ipc_plan) {
+		r->cpu = cpu_plan_cpu(ipc_plan, 2 * num);
+		s->cpu = cpu_plan_cpu(ipc_plan, 2 * num + 1);
+	}
+	r->priority = s->priority = priority;
+	r->delay.tv_sec = s->delay.tv_sec = interval / USEC_PER_SEC;
+	r->delay.tv_nsec = s->delay.tv_nsec = (interval % USEC_PER_SEC) * 1000;
+	r->max_cycles = s->max_cycles = max_cycles;
+	r->tracelimit = s->tracelimit = tracelimit;
+}
+
+int ipc_should_stop(void *base)
+{
+	struct ipc_params *r = base;
+	int i, stop = 0;
+
+	for (i = 0; i < r->num_threads; i++)
+		stop |= ipc_receiver(base, i)->shutdown |
+			ipc_sender(base, i)->shutdown;
+
+	return stop;
+}
+
+void ipc_stop(void *base)
+{
+	struct ipc_params *r = base;
+	int i;
+
+	for (i = 0; i < r->num_threads; i++) {
+		ipc_receiver(base, i)->shutdown = 1;
+		ipc_sender(base, i)->shutdown = 1;
+	}
+}
+
+static void ipc_breaktrace(void)
+{
+	char tracing_enabled_file[MAX_PATH];
+	int tracing_enabled;
+
+	strcpy(tracing_enabled_file, get_debugfileprefix());
+	strcat(tracing_enabled_file, "tracing_on");
+	tracing_enabled = open(tracing_enabled_file, O_WRONLY);
+	if (tracing_enabled < 0)
+		fatal("Could not access %s\n", tracing_enabled_file);
+	if (write(tracing_enabled, "0", 1) != 1)
+		warn("Could not write %s\n", tracing_enabled_file);
+	close(tracing_enabled);
+}
+
+static void ipc_account(struct ipc_params *par, uint64_t ns)
+{
+	uint64_t diff = par->nsecs ? ns : ns / 1000;
+
+	par->samples++;
+	par->cur = diff;
+	if (diff < par->min)
+		par->min = diff;
+	if (diff > par->max)
+		par->max = diff;
+	par->sum += (double) diff;
+	hist_sample(&par->hist, diff);
+	if (par->exporting)
+		export_stat_update(&par->export, diff);
+
+	if (par->tracelimit && ns > (uint64_t)par->tracelimit * 1000) {
+		ipc_breaktrace();
+		par->shutdown = 1;
+		ipc_neighbor(par)->shutdown = 1;
+	}
+}
+
+static struct histogram *ipc_export_hists;
+
+/*
+ * Serve the receiver statistics of all pairs, see rt-export.h. Has to be
+ * called before the pairs are started, with --fork before the fork, so
+ * the receivers see the flag in the block. The exporter runs in the
+ * calling process and reads the receivers' records through its own
+ * mapping of the block.
+ */
+int ipc_export(void *base, const char *tool, const char *spec)
+{
+	struct ipc_params *r = base;
+	int i, num_threads = r->num_threads;
+
+	ipc_export_hists = calloc(num_threads, sizeof(*ipc_export_hists));
+	if (!ipc_export_hists)
+		return -1;
+
+	export_init(tool, r->nsecs ? "ns" : "us");
+	for (i = 0; i < num_threads; i++) {
+		r = ipc_receiver(base, i);
+		ipc_hist(r, &ipc_export_hists[i]);
+		if (export_add(&r->export, &ipc_export_hists[i],
+			       "pair=\"%d\"", i))
+			return -1;
+		r->exporting = 1;
+	}
+
+	return export_start(spec);
+}
+
+void ipc_export_stop(void)
+{
+	export_stop();
+	free(ipc_export_hists);
+	ipc_export_hists = NULL;
+}
+
+/*
+ * Run the calling thread with SCHED_FIFO at priority on cpu, -1 leaves
+ * the placement to the scheduler. Returns nonzero when the caller has
+ * to track its CPU with get_cpu().
+ */
+int ipc_setup_thread(int cpu, int priority)
+{
+	struct sched_param schedp;
+	cpu_set_t mask;
+
+	memset(&schedp, 0, sizeof(schedp));
+	schedp.sched_priority = priority;
+	sched_setscheduler(0, SCHED_FIFO, &schedp);
+
+	if (cpu != -1) {
+		CPU_ZERO(&mask);
+		CPU_SET(cpu, &mask);
+		if (sched_setaffinity(0, sizeof(mask), &mask) == -1)
+			warn("Could not set CPU affinity to CPU #%d\n", cpu);
+		return 0;
+	}
+
+	return sysconf(_SC_NPROCESSORS_CONF) > 1;
+}
+
+void *ipc_thread(void *param)
+{
+	struct ipc_params *par = param;
+	struct ipc_params *neighbor = ipc_neighbor(par);
+	int mustgetcpu;
+	uint64_t now;
+
+	mustgetcpu = ipc_setup_thread(par->cpu, par->priority);
+	if (par->cpu == -1 && !mustgetcpu)
+		par->cpu = 0;
+
+	par->tid = gettid();
+	if (!par->sender)
+		par->hist.buckets = (unsigned long *)((char *)par +
+						      par->hist_offset);
+
+	if (ipc_ops->init && ipc_ops->init(par))
+		par->shutdown = 1;
+
+	while (!par->shutdown) {
+		if (par->sender) {
+			if (ipc_ops->prepare && ipc_ops->prepare(par)) {
+				par->shutdown = 1;
+				break;
+			}
+
+			/* Release the receiver: Start of latency measurement ... */
+			par->stamp = ipc_now();
+			if (ipc_ops->send(par))
+				par->shutdown = 1;
+			par->samples++;
+			if (par->max_cycles && par->samples >= par->max_cycles)
+				par->shutdown = 1;
+			if (mustgetcpu)
+				par->cpu = get_cpu();
+
+			/* Wait until the receiver is ready again */
+			if (ipc_ops->sync && ipc_ops->sync(par))
+				par->shutdown = 1;
+		} else {
+			if (ipc_ops->receive(par)) {
+				par->shutdown = 1;
+			} else {
+				/* ... Got released: End of latency measurement */
+				now = par->stamp ? par->stamp : ipc_now();
+				par->stamp = 0;
+				ipc_account(par, now - neighbor->stamp);
+			}
+			if (par->max_cycles && par->samples >= par->max_cycles)
+				par->shutdown = 1;
+			if (mustgetcpu)
+				par->cpu = get_cpu();
+
+			if (ipc_ops->release && ipc_ops->release(par))
+				par->shutdown = 1;
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &par->delay, NULL);
+			if (ipc_ops->ack && ipc_ops->ack(par))
+				par->shutdown = 1;
+		}
+	}
+
+	if (ipc_ops->exit)
+		ipc_ops->exit(par);
+	par->stopped = 1;
+	return NULL;
+}
+
+void ipc_print_stat(void *base, int quiet)
+{
+	struct ipc_params *r, *s;
+	int i, num_threads = ((struct ipc_params *)base)->num_threads;
+
+	if (quiet)
+		return;
+
+	for (i = 0; i < num_threads; i++) {
+		r = ipc_receiver(base, i);
+		s = ipc_sender(base, i);
+		printf("#%1d: ID%d, P%d, CPU%d, I%ld; #%1d: ID%d, P%d, CPU%d, ",
+		       i*2, r->tid, r->priority, r->cpu, r->delay.tv_nsec / 1000,
+		       i*2+1, s->tid, s->priority, s->cpu);
+		if (ipc_ops->print)
+			ipc_ops->print(stdout, r);
+		printf("Cycles %d\n", s->samples);
+	}
+	for (i = 0; i < num_threads; i++) {
+		r = ipc_receiver(base, i);
+		if (!r->samples)
+			printf("#%d -> #%d (not yet ready)\n", i*2+1, i*2);
+		else
+			printf("#%d -> #%d, Min %4llu, Cur %4llu, Avg %4llu, Max %4llu\n",
+			       i*2+1, i*2,
+			       (unsigned long long)r->min,
+			       (unsigned long long)r->cur,
+			       (unsigned long long)(r->sum / r->samples + 0.5),
+			       (unsigned long long)r->max);
+	}
+}
+
+static const double ipc_percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+
+void ipc_print_percentiles(void *base)
+{
+	uint64_t pct[ARRAY_SIZE(ipc_percentiles)];
+	struct histogram hist;
+	struct ipc_params *r;
+	int i, num_threads = ((struct ipc_params *)base)->num_threads;
+	unsigned int j;
+
+	for (i = 0; i < num_threads; i++) {
+		r = ipc_receiver(base, i);
+		if (!r->samples)
+			continue;
+		ipc_hist(r, &hist);
+		hist_tail_percentiles(&hist, r->samples, r->max,
+				      ipc_percentiles, pct, ARRAY_SIZE(pct));
+		printf("#%d -> #%d", i*2+1, i*2);
+		for (j = 0; j < ARRAY_SIZE(pct); j++)
+			printf(", P%g %4llu", ipc_percentiles[j],
+			       (unsigned long long)pct[j]);
+		printf("\n");
+	}
+}
+
+void ipc_write_stats(FILE *f, void *data)
+{
+	struct histogram hist;
+	struct ipc_params *s, *r;
+	int i, num_threads = ((struct ipc_params *)data)->num_threads;
+
+	fprintf(f, "  \"num_threads\": %d,\n", num_threads);
+	fprintf(f, "  \"resolution_in_ns\": %d,\n",
+		((struct ipc_params *)data)->nsecs);
+	fprintf(f, "  \"thread\": {\n");
+	for (i = 0; i < num_threads; i++) {
+		s = ipc_sender(data, i);
+		r = ipc_receiver(data, i);
+		ipc_hist(r, &hist);
+		fprintf(f, "    \"%u\": {\n", i);
+		fprintf(f, "      \"sender\": {\n");
+		fprintf(f, "        \"cpu\": %d,\n", s->cpu);
+		fprintf(f, "        \"priority\": %d,\n", s->priority);
+		fprintf(f, "        \"samples\": %d,\n", s->samples);
+		fprintf(f, "        \"interval\": %ld\n", r->delay.tv_nsec/1000);
+		fprintf(f, "      },\n");
+		fprintf(f, "      \"receiver\": {\n");
+		fprintf(f, "        \"cpu\": %d,\n", r->cpu);
+		fprintf(f, "        \"priority\": %d,\n", r->priority);
+		if (ipc_ops->json)
+			ipc_ops->json(f, r);
+		fprintf(f, "        \"samples\": %d,\n", r->samples);
+		fprintf(f, "        \"histogram\": ");
+		hist_print_json(f, &hist, 8);
+		fprintf(f, ",\n");
+		fprintf(f, "        \"percentiles\": ");
+		hist_print_percentiles_json(f, &hist, r->max, 8);
+		fprintf(f, ",\n");
+		fprintf(f, "        \"min\": %llu,\n",
+			r->samples ? (unsigned long long)r->min : 0);
+		fprintf(f, "        \"avg\": %.2f,\n",
+			r->samples ? r->sum / r->samples : 0.0);
+		fprintf(f, "        \"max\": %llu\n", (unsigned long long)r->max);
+		fprintf(f, "      }\n");
+		fprintf(f, "    }%s\n", i == num_threads - 1 ? "" : ",");
+	}
+	fprintf(f, "  }\n");
+}
@@ -8,6 +8,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
 #include "rt-error.h"
@@ -136,3 +139,286 @@ int parse_cpumask(char *str, int max_cpus, struct bitmask **cpumask)
 
 	return 0;
 }
+
+#define SYSFS_CPU	"/sys/devices/system/cpu"
+
+struct cpu_topo {
+	int cpu;
+	int core;	/* first SMT sibling */
+	int smt;	/* rank among the allowed siblings of the core */
+	int llc;	/* first CPU sharing the last level cache */
+	int node;
+	int key[4];
+};
+
+static const char * const cpu_plan_names[] = {
+	[CPU_PLAN_RR]		= "rr",
+	[CPU_PLAN_CORE]		= "core",
+	[CPU_PLAN_NOSMT]	= "nosmt",
+	[CPU_PLAN_LLC]		= "llc",
+	[CPU_PLAN_CROSS_NODE]	= "cross-node",
+};
+
+int cpu_plan_policy(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(cpu_plan_names) / sizeof(cpu_plan_names[0]); i++)
+		if (!strcmp(name, cpu_plan_names[i]))
+			return i;
+	return -1;
+}
+
+const char *cpu_plan_name(int policy)
+{
+	if (policy < 0 ||
+	    policy >= (int)(sizeof(cpu_plan_names) / sizeof(cpu_plan_names[0])))
+		return "unknown";
+	return cpu_plan_names[policy];
+}
+
+/*
+ * Read a cpulist file such as "0-3,8-11". Returns the first CPU of the
+ * list and sets *rank to the position of cpu in it. A missing file means
+ * the CPU shares nothing.
+ */
+static int read_cpulist(const char *path, int cpu, int *rank)
+{
+	char buf[4096], *p = buf, *end;
+	int first = -1, pos = 0;
+	long lo, hi;
+	FILE *f;
+
+	*rank = 0;
+	f = fopen(path, "r");
+	if (!f)
+		return cpu;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = '\0';
+	fclose(f);
+
+	while (*p) {
+		lo = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		hi = lo;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		if (first < 0)
+			first = lo;
+		if (cpu >= lo && cpu <= hi)
+			*rank = pos + cpu - lo;
+		pos += hi - lo + 1;
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	return first < 0 ? cpu : first;
+}
+
+/* The highest cache level listed for the CPU is its last level cache */
+static int cpu_llc(int cpu)
+{
+	char path[128];
+	int i, level, best = -1, llc = cpu, rank;
+	FILE *f;
+
+	for (i = 0; ; i++) {
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/level",
+			 cpu, i);
+		f = fopen(path, "r");
+		if (!f)
+			break;
+		if (fscanf(f, "%d", &level) != 1)
+			level = -1;
+		fclose(f);
+		if (level <= best)
+			continue;
+		best = level;
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+		llc = read_cpulist(path, cpu, &rank);
+	}
+
+	return llc;
+}
+
+static void cpu_topo_read(struct cpu_topo *t, int cpu, int numa)
+{
+	char path[128];
+
+	t->cpu = cpu;
+	snprintf(path, sizeof(path),
+		 SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+	t->core = read_cpulist(path, cpu, &t->smt);
+	t->llc = cpu_llc(cpu);
+	t->node = numa ? numa_node_of_cpu(cpu) : 0;
+	if (t->node < 0)
+		t->node = 0;
+}
+
+/* Number of cores in the same domain that come before the core of t */
+static int core_rank(struct cpu_topo *topo, int nr, struct cpu_topo *t,
+		     int llc)
+{
+	int i, rank = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (topo[i].smt || topo[i].core >= t->core)
+			continue;
+		if (llc ? topo[i].llc == t->llc : topo[i].node == t->node)
+			rank++;
+	}
+	return rank;
+}
+
+static int cpu_topo_cmp(const void *a, const void *b)
+{
+	const struct cpu_topo *x = a, *y = b;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (x->key[i] != y->key[i])
+			return x->key[i] < y->key[i] ? -1 : 1;
+	return 0;
+}
+
+struct cpu_plan *cpu_plan_create(int policy, struct bitmask *cpumask)
+{
+	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	int numa = numa_initialize();
+	struct cpu_topo *topo, *t;
+	struct cpu_plan *plan;
+	cpu_set_t cpuset;
+	int cpu, i, nr = 0;
+
+	if (!cpumask) {
+		CPU_ZERO(&cpuset);
+		if (sched_getaffinity(0, sizeof(cpuset), &cpuset))
+			return NULL;
+		if (max_cpus > CPU_SETSIZE)
+			max_cpus = CPU_SETSIZE;
+	}
+
+	topo = calloc(max_cpus, sizeof(*topo));
+	plan = calloc(1, sizeof(*plan));
+	if (!topo || !plan)
+		goto err;
+
+	for (cpu = 0; cpu < max_cpus; cpu++) {
+		if (cpumask ? !numa_bitmask_isbitset(cpumask, cpu) :
+			      !CPU_ISSET(cpu, &cpuset))
+			continue;
+		cpu_topo_read(&topo[nr++], cpu, numa);
+	}
+
+	/* a sibling is only second if the first one is allowed too */
+	for (i = 0; i < nr; i++) {
+		topo[i].smt = 0;
+		for (cpu = 0; cpu < i; cpu++)
+			if (topo[cpu].core == topo[i].core)
+				topo[i].smt++;
+	}
+
+	/* sort keys, the CPU number breaks all ties */
+	for (i = 0; i < nr; i++) {
+		t = &topo[i];
+		switch (policy) {
+		case CPU_PLAN_CORE:
+		case CPU_PLAN_NOSMT:
+			t->key[0] = t->smt;
+			t->key[1] = t->cpu;
+			break;
+		case CPU_PLAN_LLC:
+			t->key[0] = t->smt;
+			t->key[1] = core_rank(topo, nr, t, 1);
+			t->key[2] = t->llc;
+			t->key[3] = t->cpu;
+			break;
+		case CPU_PLAN_CROSS_NODE:
+			t->key[0] = t->smt;
+			t->key[1] = core_rank(topo, nr, t, 0);
+			t->key[2] = t->node;
+			t->key[3] = t->cpu;
+			break;
+		default:
+			t->key[0] = t->cpu;
+			break;
+		}
+	}
+	qsort(topo, nr, sizeof(*topo), cpu_topo_cmp);
+
+	plan->policy = policy;
+	plan->cpus = calloc(nr ? nr : 1, sizeof(int));
+	if (!plan->cpus)
+		goto err;
+	for (i = 0; i < nr; i++) {
+		if (policy == CPU_PLAN_NOSMT && topo[i].smt)
+			continue;
+		plan->cpus[plan->nr_cpus++] = topo[i].cpu;
+	}
+	free(topo);
+
+	if (!plan->nr_cpus) {
+		cpu_plan_free(plan);
+		return NULL;
+	}
+	return plan;
+
+err:
+	free(topo);
+	cpu_plan_free(plan);
+	return NULL;
+}
+
+void cpu_plan_free(struct cpu_plan *plan)
+{
+	if (!plan)
+		return;
+	free(plan->cpus);
+	free(plan);
+}
+
+void *node_local_alloc(size_t size, int node)
+{
+	void *ptr;
+
+	if (node < 0 || !numa_initialize()) {
+		/* numa_alloc_onnode() gives whole pages, keep cache lines */
+		if (posix_memalign(&ptr, 64, size))
+			return NULL;
+		memset(ptr, 0, size);
+		return ptr;
+	}
+
+	ptr = numa_alloc_onnode(size, node);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+void node_local_free(void *ptr, size_t size, int node)
+{
+	if (!ptr)
+		return;
+	if (node < 0 || !numa_initialize())
+		free(ptr);
+	else
+		numa_free(ptr, size);
+}
+
+int cpu_local_node(int cpu)
+{
+	if (cpu < 0 || !numa_initialize())
+		return -1;
+	return numa_node_of_cpu(cpu);
+}
+
+void *cpu_local_alloc(size_t size, int cpu)
+{
+	return node_local_alloc(size, cpu_local_node(cpu));
+}
+
+void cpu_local_free(void *ptr, size_t size, int cpu)
+{
+	node_local_free(ptr, size, cpu_local_node(cpu));
+}
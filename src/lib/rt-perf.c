@@ -0,0 +1,310 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Per thread performance counters read from user space
+ *
+ * The hardware events are opened as one group led by cycles, so the
+ * kernel schedules them onto the PMU together and the deltas of a spike
+ * cover the same stretch of time. A member which does not fit next to
+ * the others is opened on its own. Context switches, a software event,
+ * are always counted and stay outside the group.
+ *
+ * The first page of every event is mapped. The kernel keeps the base
+ * count and, while the event is loaded on a PMU, its counter index in
+ * that page, so the current value is offset plus rdpmc(index - 1), read
+ * under the seqlock of the page. Software events are never loaded on a
+ * PMU, offset alone is their count.
+ *
+ * When the PMU has more events than counters the kernel multiplexes them,
+ * and an event which is scheduled out keeps its count. The page also
+ * holds time_enabled and time_running as of the last schedule; when their
+ * difference grew between two samples the event was scheduled out for a
+ * part of it and its delta is too low. Such samples are counted in
+ * mux_samples and flagged in delta_mux instead of being scaled up.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "rt-perf.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# define HAVE_RDPMC	1
+static inline uint64_t rdpmc(uint32_t counter)
+{
+	uint32_t low, high;
+
+	__asm__ __volatile__("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+	return ((uint64_t)high << 32) | low;
+}
+#else
+# define HAVE_RDPMC	0
+static inline uint64_t rdpmc(uint32_t counter)
+{
+	return 0;
+}
+#endif
+
+#define barrier()	__asm__ __volatile__("" ::: "memory")
+
+#define HW_CACHE_MISS(cache)	((cache) |				\
+				 (PERF_COUNT_HW_CACHE_OP_READ << 8) |	\
+				 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+const char * const perf_counter_names[PERF_NR_COUNTERS] = {
+	[PERF_CYCLES]		= "cycles",
+	[PERF_INSTRUCTIONS]	= "instructions",
+	[PERF_LLC_MISSES]	= "llc_misses",
+	[PERF_DTLB_MISSES]	= "dtlb_misses",
+	[PERF_CSWITCHES]	= "context_switches",
+};
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} perf_events[PERF_NR_COUNTERS] = {
+	[PERF_CYCLES]		= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS]	= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_LLC_MISSES]	= { PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+	[PERF_DTLB_MISSES]	= { PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+	[PERF_CSWITCHES]	= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static int perf_event_open(int i, int exclude_kernel, int group_fd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_events[i].type;
+	attr.config = perf_events[i].config;
+	attr.exclude_kernel = exclude_kernel;
+	attr.exclude_hv = 1;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/* Without privileges only the user space part is counted */
+static int perf_event_open_user(int i, int group_fd)
+{
+	int fd;
+
+	fd = perf_event_open(i, 0, group_fd);
+	if (fd < 0 && (errno == EACCES || errno == EPERM))
+		fd = perf_event_open(i, 1, group_fd);
+	return fd;
+}
+
+int perf_counters_open(struct perf_counters *pc)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int i, fd, leader = -1;
+	void *page;
+
+	memset(pc, 0, sizeof(*pc));
+	for (i = 0; i < PERF_NR_COUNTERS; i++) {
+		pc->fd[i] = -1;
+
+		fd = -1;
+		if (perf_events[i].type != PERF_TYPE_SOFTWARE && leader >= 0)
+			fd = perf_event_open_user(i, leader);
+		if (fd < 0)
+			fd = perf_event_open_user(i, -1);
+		if (fd < 0)
+			continue;
+		if (i == PERF_CYCLES)
+			leader = fd;
+
+		page = mmap(NULL, pagesize, PROT_READ, MAP_SHARED, fd, 0);
+		if (page == MAP_FAILED) {
+			close(fd);
+			continue;
+		}
+		pc->fd[i] = fd;
+		pc->page[i] = page;
+		pc->mask |= 1U << i;
+	}
+
+	if (!pc->mask) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	perf_counters_rebase(pc);
+	return 0;
+}
+
+void perf_counters_close(struct perf_counters *pc)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int i;
+
+	/* mask stays, the totals are still reported */
+	for (i = 0; i < PERF_NR_COUNTERS; i++) {
+		if (pc->fd[i] < 0)
+			continue;
+		munmap(pc->page[i], pagesize);
+		close(pc->fd[i]);
+		pc->page[i] = NULL;
+		pc->fd[i] = -1;
+	}
+}
+
+/*
+ * Current count of counter i, and in *stopped the time it was enabled but
+ * not running up to the last schedule of the event.
+ */
+static uint64_t perf_counter_read(const struct perf_counters *pc, int i,
+				  uint64_t *stopped)
+{
+	volatile struct perf_event_mmap_page *pg = pc->page[i];
+	uint64_t count, pmc, enabled, running;
+	uint32_t seq, idx, width;
+	int slow;
+
+	do {
+		seq = pg->lock;
+		barrier();
+		idx = pg->index;
+		count = pg->offset;
+		enabled = pg->time_enabled;
+		running = pg->time_running;
+		slow = 0;
+		if (idx && pg->cap_user_rdpmc && HAVE_RDPMC) {
+			width = pg->pmc_width;
+			pmc = rdpmc(idx - 1);
+			/* the counter is width bits wide and signed */
+			count += (int64_t)(pmc << (64 - width)) >> (64 - width);
+		} else if (idx) {
+			slow = 1;
+		}
+		barrier();
+	} while (pg->lock != seq);
+
+	*stopped = enabled - running;
+
+	/* A loaded counter user space is not allowed to read */
+	if (slow && read(pc->fd[i], &count, sizeof(count)) != sizeof(count))
+		count = 0;
+
+	return count;
+}
+
+static void perf_counters_read_stopped(const struct perf_counters *pc,
+				       uint64_t *val, uint64_t *stopped)
+{
+	int i;
+
+	for (i = 0; i < PERF_NR_COUNTERS; i++) {
+		val[i] = stopped[i] = 0;
+		if (pc->mask & (1U << i))
+			val[i] = perf_counter_read(pc, i, &stopped[i]);
+	}
+}
+
+void perf_counters_read(const struct perf_counters *pc, uint64_t *val)
+{
+	uint64_t stopped[PERF_NR_COUNTERS];
+
+	perf_counters_read_stopped(pc, val, stopped);
+}
+
+void perf_counters_rebase(struct perf_counters *pc)
+{
+	perf_counters_read_stopped(pc, pc->prev, pc->prev_stopped);
+}
+
+void perf_counters_sample(struct perf_counters *pc)
+{
+	uint64_t now[PERF_NR_COUNTERS], stopped[PERF_NR_COUNTERS];
+	int i;
+
+	perf_counters_read_stopped(pc, now, stopped);
+	pc->delta_mux = 0;
+	for (i = 0; i < PERF_NR_COUNTERS; i++) {
+		pc->delta[i] = now[i] - pc->prev[i];
+		pc->total[i] += pc->delta[i];
+		pc->prev[i] = now[i];
+		if (stopped[i] != pc->prev_stopped[i])
+			pc->delta_mux |= 1U << i;
+		pc->prev_stopped[i] = stopped[i];
+	}
+	if (pc->delta_mux)
+		pc->mux_samples++;
+}
+
+void perf_counters_spike(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < PERF_NR_COUNTERS; i++) {
+		pc->spike_sum[i] += pc->delta[i];
+		if (pc->delta[i] > pc->spike_max[i])
+			pc->spike_max[i] = pc->delta[i];
+	}
+	pc->spikes++;
+	if (pc->delta_mux)
+		pc->mux_spikes++;
+}
+
+void perf_counters_max(struct perf_counters *pc)
+{
+	memcpy(pc->at_max, pc->delta, sizeof(pc->at_max));
+	pc->at_max_mux = pc->delta_mux;
+}
+
+void perf_counters_print(FILE *f, const struct perf_counters *pc,
+			 const uint64_t *val)
+{
+	const char *sep = "";
+	int i;
+
+	for (i = 0; i < PERF_NR_COUNTERS; i++) {
+		if (!(pc->mask & (1U << i)))
+			continue;
+		fprintf(f, "%s%s %llu", sep, perf_counter_names[i],
+			(unsigned long long)val[i]);
+		sep = " ";
+	}
+}
+
+static void perf_values_json(FILE *f, const struct perf_counters *pc,
+			     const uint64_t *val)
+{
+	const char *sep = "";
+	int i;
+
+	fprintf(f, "{");
+	for (i = 0; i < PERF_NR_COUNTERS; i++) {
+		if (!(pc->mask & (1U << i)))
+			continue;
+		fprintf(f, "%s\"%s\": %llu", sep, perf_counter_names[i],
+			(unsigned long long)val[i]);
+		sep = ", ";
+	}
+	fprintf(f, "}");
+}
+
+void perf_counters_json(FILE *f, const struct perf_counters *pc, int indent)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "%*s\"total\": ", indent + 2, "");
+	perf_values_json(f, pc, pc->total);
+	fprintf(f, ",\n%*s\"spikes\": %lu,\n", indent + 2, "", pc->spikes);
+	fprintf(f, "%*s\"spike_sum\": ", indent + 2, "");
+	perf_values_json(f, pc, pc->spike_sum);
+	fprintf(f, ",\n%*s\"spike_max\": ", indent + 2, "");
+	perf_values_json(f, pc, pc->spike_max);
+	fprintf(f, ",\n%*s\"at_max\": ", indent + 2, "");
+	perf_values_json(f, pc, pc->at_max);
+	fprintf(f, ",\n%*s\"at_max_multiplexed\": %s,\n", indent + 2, "",
+		pc->at_max_mux ? "true" : "false");
+	fprintf(f, "%*s\"multiplexed_samples\": %lu,\n", indent + 2, "",
+		pc->mux_samples);
+	fprintf(f, "%*s\"multiplexed_spikes\": %lu", indent + 2, "",
+		pc->mux_spikes);
+	fprintf(f, "\n%*s}", indent, "");
+}
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Cycle counter frequency measurement and calibration
+ *
+ * tsc_measure_hz() and tsc_measure_mhz() are the quick estimates oslat
+ * has been using. tsc_calibrate() measures against a POSIX clock over a
+ * longer period for callers which turn counter deltas into absolute
+ * times.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "rt-utils.h"
+#include "rt-tsc.h"
+
+uint64_t tsc_measure_hz(void)
+{
+	struct timeval tvs, tve;
+	uint64_t s, e;
+	double sec;
+
+	frc(&s);
+	e = s;
+	gettimeofday(&tvs, NULL);
+	while (e - s < 1000000)
+		frc(&e);
+	gettimeofday(&tve, NULL);
+	sec = tve.tv_sec - tvs.tv_sec + (tve.tv_usec - tvs.tv_usec) / 1e6;
+	return (uint64_t) ((e - s) / sec);
+}
+
+/* Counter frequency in MHz, repeated until two runs agree within 0.1% */
+unsigned int tsc_measure_mhz(void)
+{
+	uint64_t m, mprev, d;
+
+	mprev = tsc_measure_hz();
+	do {
+		m = tsc_measure_hz();
+		if (m > mprev)
+			d = m - mprev;
+		else
+			d = mprev - m;
+		mprev = m;
+	} while (d > m / 1000);
+
+	return (unsigned int) (m / 1000000);
+}
+
+void tsc_scale_init(struct tsc_scale *s, uint64_t hz)
+{
+	s->hz = hz;
+	s->ns_mult = (uint64_t)((double)NSEC_PER_SEC * (1ULL << TSC_SCALE_SHIFT) / hz);
+	s->cyc_mult = (uint64_t)((double)hz * (1ULL << TSC_SCALE_SHIFT) / NSEC_PER_SEC);
+}
+
+#ifndef FRC_MISSING
+/*
+ * Read clock and counter as close together as possible: the counter
+ * value is the middle of two reads bracketing clock_gettime(), retried
+ * a few times to keep the pair with the narrowest bracket.
+ */
+static void tsc_clock_pair(clockid_t clock, uint64_t *tsc, uint64_t *ns)
+{
+	uint64_t best = UINT64_MAX, a, b;
+	struct timespec ts;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		frc(&a);
+		clock_gettime(clock, &ts);
+		frc(&b);
+		if (b - a < best) {
+			best = b - a;
+			*tsc = a + (b - a) / 2;
+			*ns = (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+		}
+	}
+}
+#endif
+
+/* Measure the counter frequency against clock for msecs milliseconds */
+int tsc_calibrate(struct tsc_scale *s, clockid_t clock, unsigned int msecs)
+{
+#ifdef FRC_MISSING
+	return -ENOTSUP;
+#else
+	uint64_t tsc0, tsc1, ns0, ns1;
+	struct timespec delay;
+
+	delay.tv_sec = msecs / MSEC_PER_SEC;
+	delay.tv_nsec = (msecs % MSEC_PER_SEC) * 1000000L;
+
+	tsc_clock_pair(clock, &tsc0, &ns0);
+	clock_nanosleep(clock, 0, &delay, NULL);
+	tsc_clock_pair(clock, &tsc1, &ns1);
+
+	if (ns1 <= ns0 || tsc1 <= tsc0)
+		return -EINVAL;
+
+	tsc_scale_init(s, (uint64_t)((double)(tsc1 - tsc0) * NSEC_PER_SEC /
+				     (ns1 - ns0)));
+	return 0;
+#endif
+}
+
+/*
+ * The counter can only replace the clock if it ticks at a constant rate
+ * and keeps running in idle states. On x86 the kernel reports that through
+ * the constant_tsc and nonstop_tsc flags, elsewhere assume it does.
+ */
+int tsc_is_stable(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	char line[4096];
+	int stable = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/cpuinfo", "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "flags", 5))
+			continue;
+		stable = strstr(line, " constant_tsc") && strstr(line, " nonstop_tsc");
+		break;
+	}
+	fclose(fp);
+
+	return stable;
+#else
+	return 1;
+#endif
+}
@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Minimal io_uring helpers
+ *
+ * The rings are shared with the kernel: the tails we publish are stored
+ * with release semantics and the tails the kernel publishes are loaded
+ * with acquire semantics, see io_uring_setup(2).
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "rt-uring.h"
+
+#ifdef __NR_io_uring_setup
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+#else
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+/* Returns 0 on success, -errno on failure */
+int rt_uring_init(struct rt_uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto err_sq;
+	r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (r->cq_ring == MAP_FAILED)
+		goto err_cq;
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_sqes;
+
+	r->sq_head = r->sq_ring + p.sq_off.head;
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+	r->sq_pending = *r->sq_tail;
+
+	return 0;
+
+err_sqes:
+	err = errno;
+	munmap(r->cq_ring, r->cq_ring_size);
+	errno = err;
+err_cq:
+	err = errno;
+	munmap(r->sq_ring, r->sq_ring_size);
+	errno = err;
+err_sq:
+	err = errno;
+	close(r->fd);
+	r->fd = -1;
+	return -err;
+}
+
+void rt_uring_exit(struct rt_uring *r)
+{
+	if (r->fd < 0)
+		return;
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+/* Next free submission entry, cleared, or NULL if the queue is full */
+struct io_uring_sqe *rt_uring_get_sqe(struct rt_uring *r)
+{
+	unsigned int head, tail, idx;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	tail = r->sq_pending;
+	if (tail - head > *r->sq_mask)
+		return NULL;
+
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->sq_pending = tail + 1;
+
+	return sqe;
+}
+
+/*
+ * Submit the queued entries and wait for one completion, which is copied
+ * to cqe. Returns 0 on success, -errno on failure.
+ */
+int rt_uring_submit_and_wait(struct rt_uring *r, struct io_uring_cqe *cqe)
+{
+	unsigned int head, to_submit;
+	int ret;
+
+	/* publish the entries filled in since the last submission */
+	__atomic_store_n(r->sq_tail, r->sq_pending, __ATOMIC_RELEASE);
+	to_submit = r->sq_pending - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	head = *r->cq_head;
+	while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		ret = io_uring_enter(r->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+		if (ret < 0)
+			return -errno;
+		to_submit -= ret;
+	}
+
+	*cqe = r->cqes[head & *r->cq_mask];
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Block on a timeout request, flags are the IORING_TIMEOUT_* flags.
+ * Returns 0 when the timeout expired, -errno otherwise.
+ */
+int rt_uring_timeout(struct rt_uring *r, const struct __kernel_timespec *ts,
+		     unsigned int flags)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	int ret;
+
+	sqe = rt_uring_get_sqe(r);
+	if (!sqe)
+		return -EBUSY;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long) ts;
+	sqe->len = 1;
+	sqe->timeout_flags = flags;
+
+	ret = rt_uring_submit_and_wait(r, &cqe);
+	if (ret)
+		return ret;
+
+	return cqe.res == -ETIME ? 0 : (cqe.res < 0 ? cqe.res : -EINTR);
+}
@@ -36,9 +36,12 @@ static char debugfileprefix[MAX_PATH];
 static char *fileprefix;
 static int trace_fd = -1;
 static int tracemark_fd = -1;
+static int tracemark_raw_fd = -1;
 static __thread char tracebuf[TRACEBUFSIZ];
+int tracemark_active;
 static char test_cmdline[MAX_COMMAND_LINE];
 static char ts_start[MAX_TS_SIZE];
+static unsigned long long mono_start;
 
 /*
  * Finds the tracing directory in a mounted debugfs
@@ -400,62 +403,145 @@ int parse_mem_string(char *str, uint64_t *val)
 	return 0;
 }
 
-static void open_tracemark_fd(void)
+static int trace_file_exists(char *name)
 {
+	struct stat sbuf;
+	char *tracing_prefix = get_debugfileprefix();
 	char path[MAX_PATH];
+	strcat(strcpy(path, tracing_prefix), name);
+	return stat(path, &sbuf) ? 0 : 1;
+}
 
-	/*
-	 * open the tracemark file if it's not already open
-	 */
-	if (tracemark_fd < 0) {
-		sprintf(path, "%s/%s", fileprefix, "trace_marker");
-		tracemark_fd = open(path, O_WRONLY);
-		if (tracemark_fd < 0) {
-			warn("unable to open trace_marker file: %s\n", path);
-			return;
-		}
+static void debugfs_prepare(void)
+{
+	if (mount_debugfs(NULL))
+		fatal("could not mount debugfs");
+
+	fileprefix = get_debugfileprefix();
+	if (!trace_file_exists("tracing_enabled") &&
+	    !trace_file_exists("tracing_on"))
+		warn("tracing_enabled or tracing_on not found\n"
+		     "debug fs not mounted");
+}
+
+static int open_trace_file(const char *name, int quiet)
+{
+	char path[MAX_PATH];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", fileprefix, name);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 && !quiet)
+		warn("unable to open %s file: %s\n", name, path);
+	return fd;
+}
+
+/*
+ * Open trace_marker, trace_marker_raw and tracing_on. With TRACEMARK_QUIET
+ * a missing debugfs is not mounted and nothing is reported, for tools
+ * which only annotate the trace when one happens to be running.
+ *
+ * Returns 0 if trace marks can be written.
+ */
+int tracemark_open(unsigned int flags)
+{
+	int quiet = flags & TRACEMARK_QUIET;
+
+	if (tracemark_fd >= 0)
+		return 0;
+
+	if (quiet) {
+		fileprefix = get_debugfileprefix();
+		if (!strlen(fileprefix))
+			return -1;
+	} else {
+		debugfs_prepare();
 	}
 
+	tracemark_fd = open_trace_file("trace_marker", quiet);
+	if (tracemark_fd < 0)
+		return -1;
+
+	/* Older kernels do not have it, tracemark_raw() fails then */
+	tracemark_raw_fd = open_trace_file("trace_marker_raw", 1);
+
 	/*
-	 * if we're not tracing and the tracing_on fd is not open,
 	 * open the tracing_on file so that we can stop the trace
 	 * if we hit a breaktrace threshold
 	 */
-	if (trace_fd < 0) {
-		sprintf(path, "%s/%s", fileprefix, "tracing_on");
-		if ((trace_fd = open(path, O_WRONLY)) < 0)
-			warn("unable to open tracing_on file: %s\n", path);
-	}
+	if (trace_fd < 0)
+		trace_fd = open_trace_file("tracing_on", quiet);
+
+	tracemark_active = 1;
+	return 0;
 }
 
-static void close_tracemark_fd(void)
+void tracemark_close(void)
 {
-	if (tracemark_fd > 0)
-		close(tracemark_fd);
+	tracemark_active = 0;
 
-	if (trace_fd > 0)
+	if (tracemark_fd >= 0)
+		close(tracemark_fd);
+	if (tracemark_raw_fd >= 0)
+		close(tracemark_raw_fd);
+	if (trace_fd >= 0)
 		close(trace_fd);
+	tracemark_fd = tracemark_raw_fd = trace_fd = -1;
 }
 
-static int trace_file_exists(char *name)
+/* Write an already formatted mark, one write() so marks never mix */
+void tracemark_write(const char *buf, size_t len)
 {
-	struct stat sbuf;
-	char *tracing_prefix = get_debugfileprefix();
-	char path[MAX_PATH];
-	strcat(strcpy(path, tracing_prefix), name);
-	return stat(path, &sbuf) ? 0 : 1;
+	if (tracemark_fd < 0)
+		return;
+
+	write(tracemark_fd, buf, len);
 }
 
-static void debugfs_prepare(void)
+/* Format into the buffer of the calling thread and write it */
+void tracemark_printf(const char *fmt, ...)
 {
-	if (mount_debugfs(NULL))
-		fatal("could not mount debugfs");
+	va_list ap;
+	int len;
 
-	fileprefix = get_debugfileprefix();
-	if (!trace_file_exists("tracing_enabled") &&
-	    !trace_file_exists("tracing_on"))
-		warn("tracing_enabled or tracing_on not found\n"
-		     "debug fs not mounted");
+	if (tracemark_fd < 0)
+		return;
+
+	va_start(ap, fmt);
+	len = vsnprintf(tracebuf, TRACEBUFSIZ, fmt, ap);
+	va_end(ap);
+
+	if (len >= TRACEBUFSIZ)
+		len = TRACEBUFSIZ - 1;
+	write(tracemark_fd, tracebuf, len);
+}
+
+/*
+ * Write a binary record to trace_marker_raw. The trace shows @id and the
+ * payload as hex bytes. Nothing is formatted, so this is the cheapest
+ * mark that carries values.
+ *
+ * Returns 0 on success, -1 when raw marks are unavailable or @len is
+ * too large.
+ */
+int tracemark_raw(unsigned int id, const void *data, size_t len)
+{
+	if (tracemark_raw_fd < 0 || len > TRACEBUFSIZ - sizeof(id))
+		return -1;
+
+	memcpy(tracebuf, &id, sizeof(id));
+	memcpy(tracebuf + sizeof(id), data, len);
+
+	return write(tracemark_raw_fd, tracebuf, sizeof(id) + len) < 0 ? -1 : 0;
+}
+
+/* Stop tracing, so that the trace ends at the event just marked */
+void tracemark_stop(void)
+{
+	if (trace_fd < 0)
+		return;
+
+	write(trace_fd, "0\n", 2);
 }
 
 void tracemark(char *fmt, ...)
@@ -472,22 +558,20 @@ void tracemark(char *fmt, ...)
 	len = vsnprintf(tracebuf, TRACEBUFSIZ, fmt, ap);
 	va_end(ap);
 
-	/* write the tracemark message */
-	write(tracemark_fd, tracebuf, len);
-
-	/* now stop any trace */
-	write(trace_fd, "0\n", 2);
+	if (len >= TRACEBUFSIZ)
+		len = TRACEBUFSIZ - 1;
+	tracemark_write(tracebuf, len);
+	tracemark_stop();
 }
 
 void enable_trace_mark(void)
 {
-	debugfs_prepare();
-	open_tracemark_fd();
+	tracemark_open(0);
 }
 
 void disable_trace_mark(void)
 {
-	close_tracemark_fd();
+	tracemark_close();
 }
 
 static void get_timestamp(char *tsbuf)
@@ -503,6 +587,15 @@ static void get_timestamp(char *tsbuf)
 	strftime(tsbuf, MAX_TS_SIZE, "%a, %d %b %Y %T %z", tm);
 }
 
+/* CLOCK_MONOTONIC is common to all processes, unlike the wall clock */
+static unsigned long long get_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 void rt_init(int argc, char *argv[])
 {
 	int offset = 0;
@@ -529,6 +622,7 @@ void rt_init(int argc, char *argv[])
 	}
 
 	get_timestamp(ts_start);
+	mono_start = get_monotonic_ns();
 }
 
 void rt_write_json(const char *filename, int return_code,
@@ -538,6 +632,7 @@ void rt_write_json(const char *filename, int return_code,
 	unsigned char buf[1];
 	struct utsname uts;
 	char ts_end[MAX_TS_SIZE];
+	unsigned long long mono_end;
 	FILE *f, *s;
 	size_t n;
 	int rt = 0;
@@ -551,6 +646,7 @@ void rt_write_json(const char *filename, int return_code,
 	}
 
 	get_timestamp(ts_end);
+	mono_end = get_monotonic_ns();
 
 	s = fopen("/sys/kernel/realtime", "r");
 	if (s) {
@@ -569,6 +665,8 @@ void rt_write_json(const char *filename, int return_code,
 	fprintf(f, "  \"rt_test_version:\": \"%1.2f\",\n", VERSION);
 	fprintf(f, "  \"start_time\": \"%s\",\n", ts_start);
 	fprintf(f, "  \"end_time\": \"%s\",\n", ts_end);
+	fprintf(f, "  \"start_monotonic_ns\": %llu,\n", mono_start);
+	fprintf(f, "  \"end_monotonic_ns\": %llu,\n", mono_end);
 	fprintf(f, "  \"return_code\": %d,\n", return_code);
 	fprintf(f, "  \"sysinfo\": {\n");
 	fprintf(f, "    \"sysname\": \"%s\",\n", uts.sysname);
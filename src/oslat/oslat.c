@@ -45,40 +45,14 @@
 
 #include "rt-utils.h"
 #include "rt-numa.h"
+#include "rt-perf.h"
 #include "rt-error.h"
+#include "rt-tsc.h"
+#include "rt-export.h"
 
-#ifdef __GNUC__
-# define atomic_inc(ptr)   __sync_add_and_fetch((ptr), 1)
-# if defined(__x86_64__)
-#  define relax()          __asm__ __volatile__("pause" ::: "memory")
-static inline void frc(uint64_t *pval)
-{
-	uint32_t low, high;
-	/* See rdtsc_ordered() of Linux */
-	__asm__ __volatile__("lfence");
-	__asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
-	*pval = ((uint64_t) high << 32) | low;
-}
-# elif defined(__i386__)
-#  define relax()          __asm__ __volatile__("pause" ::: "memory")
-static inline void frc(uint64_t *pval)
-{
-	__asm__ __volatile__("rdtsc" : "=A" (*pval));
-}
-# elif defined(__PPC64__)
-#  define relax()          do { } while (0)
-static inline void frc(uint64_t *pval)
-{
-	__asm__ __volatile__("mfspr %0, 268\n" : "=r" (*pval));
-}
-# else
-#  define relax()          do { } while (0)
-#  define frc(x)
-#  define FRC_MISSING
-# endif
-#else
-# error Need to add support for this compiler.
-#endif
+#include "oslat_buckets.h"
+
+#define atomic_inc(ptr)   __sync_add_and_fetch((ptr), 1)
 
 typedef uint64_t stamp_t;   /* timestamp */
 typedef uint64_t cycles_t;  /* number of cycles */
@@ -95,18 +69,34 @@ enum command {
 enum workload_type {
 	WORKLOAD_NONE = 0,
 	WORKLOAD_MEMMOVE,
-	WORKLOAD_NUM,
 };
 
 /* This workload needs pre-allocated memory */
 #define  WORK_NEED_MEM  (1UL << 0)
+/* Only the source buffer is used */
+#define  WORK_SRC_ONLY  (1UL << 1)
+/* One implementation of the workload class named before the '-' */
+#define  WORK_VARIANT   (1UL << 2)
 
-typedef void (*workload_fn)(char *src, char *dst, size_t size);
+struct thread;
+typedef void (*workload_fn)(struct thread *t);
 
+/*
+ * A workload runs once per sampling loop.  WORK_VARIANT workloads with a
+ * common name prefix, e.g. "copy-avx512", "copy-avx2" and "copy-generic",
+ * are alternative implementations: "-w copy" picks the first one the CPU
+ * supports, the full name forces one.  Any other name has to match exactly.
+ */
 struct workload {
 	const char *w_name;
 	uint64_t w_flags;
 	workload_fn w_fn;
+	/* CPU feature check, NULL if the workload runs everywhere */
+	int (*w_supported)(void);
+	/* Default memory size, NULL for WORKLOAD_MEM_SIZE */
+	uint64_t (*w_mem_size)(void);
+	/* Set up the buffers once they are allocated */
+	void (*w_prepare)(struct thread *t);
 };
 
 /* We'll have buckets 1us, 2us, ..., (BUCKET_SIZE) us. */
@@ -115,12 +105,68 @@ struct workload {
 /* Default size of the workloads per thread (in bytes, which is 16KB) */
 #define  WORKLOAD_MEM_SIZE  (16UL << 10)
 
+/*
+ * With --perf the counters are also sampled every PERF_WINDOW loops, so
+ * the delta of a spike covers at most that many loops before it.
+ */
+#define  PERF_WINDOW        1024
+
 /* By default, no workload */
 #define  WORKLOAD_DEFAULT  WORKLOAD_NONE
 
+/* One interval of the --timeseries output, written by the sampling thread */
+struct ts_slot {
+	cycles_t             max_cycles;
+	uint64_t             over;	/* samples at or above the threshold */
+};
+
+/* Payload of the TRACEMARK_ID_OSLAT mark at the -T threshold */
+struct oslat_trace_record {
+	uint32_t             latency;	/* us */
+	uint32_t             threshold;	/* us */
+	int32_t              cpu;
+};
+
+/* Counter deltas of one interval, written by the main thread */
+struct ts_noise {
+	uint64_t             irqs;
+	uint64_t             softirqs;
+	uint64_t             preempts;	/* involuntary context switches */
+};
+
+/*
+ * Every struct thread is allocated on the node of its core and starts on
+ * its own cache line, so the sampling state of one core never shares a
+ * line with another core.  The fields used by insert_bucket() come first.
+ */
 struct thread {
+	/* Sampling state, everything in cycles */
+	stamp_t              *buckets;
+	uint64_t             us_mult;	/* cycles to us, see tsc_mul_shift() */
+	cycles_t             bias_cycles;
+	cycles_t             trace_cycles;	/* UINT64_MAX when disabled */
+	cycles_t             min_cycles;
+	cycles_t             max_cycles;
+	uint64_t             last_bucket;
+	/*
+	 * The extra part of the interruptions that cannot be put into even the
+	 * biggest bucket.  We'll use this to calculate a more accurate average at
+	 * the end of the tests.
+	 */
+	uint64_t             overflow_sum;
+
+	/* --timeseries state */
+	struct ts_slot       *ts;
+	cycles_t             ts_thr_cycles;
+
+	/* --perf state */
+	cycles_t             perf_thr_cycles;
+	struct perf_counters perf;
+
 	int                  core_i;
 	pthread_t            thread_id;
+	pid_t                tid;
+	struct ts_noise      *noise;
 
 	/* NOTE! this is also how many ticks per us */
 	unsigned int         cpu_mhz;
@@ -128,25 +174,21 @@ struct thread {
 	stamp_t              frc_start;
 	stamp_t              frc_stop;
 	cycles_t             runtime;
-	stamp_t              *buckets;
+	/* Min and max latency detected, in us */
 	uint64_t             minlat;
-	/* Maximum latency detected */
 	uint64_t             maxlat;
-	/*
-	 * The extra part of the interruptions that cannot be put into even the
-	 * biggest bucket.  We'll use this to calculate a more accurate average at
-	 * the end of the tests.
-	 */
-	uint64_t             overflow_sum;
 	int                  memory_allocated;
 
 	/* Buffers used for the workloads */
 	char                 *src_buf;
 	char                 *dst_buf;
+	/* Workload private state, e.g. the pointer chase position */
+	void                 *w_cursor;
+	uint64_t             w_sink;
 
 	/* These variables are calculated after the test */
 	double               average;
-};
+} __attribute__((aligned(64)));
 
 struct global {
 	/* Configuration. */
@@ -167,15 +209,29 @@ struct global {
 	/* The core that we run the main thread.  Default is cpu0 */
 	int                   cpu_main_thread;
 	char                  *cpu_list;
+	int                   placement;
 	char                  *app_name;
 	struct workload       *workload;
 	uint64_t              workload_mem_size;
+	int                   workload_mem_set;
+	int                   hugepage;
+	uint64_t              hugepage_size;
+	/* Per interval output, interval in ms and threshold in us */
+	int                   ts_interval;
+	int                   ts_threshold;
+	/* --perf, spike threshold in us */
+	int                   perf;
+	int                   perf_threshold;
+	/* ts_slot == ts_nslots is a scratch slot once the slots run out */
+	unsigned int          ts_nslots;
+	volatile unsigned int ts_slot;
 	int                   enable_bias;
 	uint64_t              bias;
 	int                   quiet;
 	int                   single_preheat_thread;
 	int                   output_omit_zero_buckets;
 	char                  jsonfile[MAX_PATH];
+	char                  exportspec[MAX_PATH];
 
 	/* Mutable state. */
 	volatile enum command cmd;
@@ -186,21 +242,6 @@ struct global {
 
 static struct global g;
 
-static void workload_nop(char *dst, char *src, size_t size)
-{
-	/* Nop */
-}
-
-static void workload_memmove(char *dst, char *src, size_t size)
-{
-	memmove(dst, src, size);
-}
-
-struct workload workload_list[WORKLOAD_NUM] = {
-	{ "no", 0, workload_nop },
-	{ "memmove", WORK_NEED_MEM, workload_memmove },
-};
-
 #define TEST(x)						\
 	do {						\
 		if (!(x))                             \
@@ -219,71 +260,308 @@ static void test_fail(const char *what, int line)
 	exit(1);
 }
 
-static int move_to_core(int core_i)
+static void workload_nop(struct thread *t)
 {
-	cpu_set_t cpus;
+	/* Nop */
+}
 
-	CPU_ZERO(&cpus);
-	CPU_SET(core_i, &cpus);
-	return sched_setaffinity(0, sizeof(cpus), &cpus);
+static void workload_memmove(struct thread *t)
+{
+	memmove(t->dst_buf, t->src_buf, g.workload_mem_size);
+}
+
+static void workload_copy(struct thread *t)
+{
+	memcpy(t->dst_buf, t->src_buf, g.workload_mem_size);
+}
+
+static void workload_checksum(struct thread *t)
+{
+	const uint64_t *p = (const uint64_t *)t->src_buf;
+	uint64_t i, sum = 0;
+
+	for (i = 0; i < g.workload_mem_size / sizeof(*p); i++)
+		sum += p[i];
+	t->w_sink += sum;
 }
 
-static cycles_t __measure_cpu_hz(void)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+static int has_avx2(void)
 {
-	struct timeval tvs, tve;
-	stamp_t s, e;
-	double sec;
+	return __builtin_cpu_supports("avx2");
+}
 
-	frc(&s);
-	e = s;
-	gettimeofday(&tvs, NULL);
-	while (e - s < 1000000)
-		frc(&e);
-	gettimeofday(&tve, NULL);
-	sec = tve.tv_sec - tvs.tv_sec + (tve.tv_usec - tvs.tv_usec) / 1e6;
-	return (cycles_t) ((e - s) / sec);
+static int has_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f");
 }
 
-static unsigned int measure_cpu_mhz(void)
+static void __attribute__((target("avx2"))) workload_copy_avx2(struct thread *t)
 {
-	cycles_t m, mprev, d;
+	const __m256i *src = (const __m256i *)t->src_buf;
+	__m256i *dst = (__m256i *)t->dst_buf;
+	uint64_t i;
 
-	mprev = __measure_cpu_hz();
-	do {
-		m = __measure_cpu_hz();
-		if (m > mprev)
-			d = m - mprev;
-		else
-			d = mprev - m;
-		mprev = m;
-	} while (d > m / 1000);
+	for (i = 0; i < g.workload_mem_size / sizeof(*src); i++)
+		_mm256_store_si256(dst + i, _mm256_load_si256(src + i));
+}
 
-	return (unsigned int) (m / 1000000);
+static void __attribute__((target("avx2"))) workload_checksum_avx2(struct thread *t)
+{
+	const __m256i *src = (const __m256i *)t->src_buf;
+	__m256i sum = _mm256_setzero_si256();
+	uint64_t i, lanes[4];
+
+	for (i = 0; i < g.workload_mem_size / sizeof(*src); i++)
+		sum = _mm256_add_epi64(sum, _mm256_load_si256(src + i));
+	_mm256_storeu_si256((__m256i *)lanes, sum);
+	t->w_sink += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static void __attribute__((target("avx512f"))) workload_copy_avx512(struct thread *t)
+{
+	const __m512i *src = (const __m512i *)t->src_buf;
+	__m512i *dst = (__m512i *)t->dst_buf;
+	uint64_t i;
+
+	for (i = 0; i < g.workload_mem_size / sizeof(*src); i++)
+		_mm512_store_si512(dst + i, _mm512_load_si512(src + i));
+}
+
+static void __attribute__((target("avx512f"))) workload_checksum_avx512(struct thread *t)
+{
+	const __m512i *src = (const __m512i *)t->src_buf;
+	__m512i sum = _mm512_setzero_si512();
+	uint64_t i;
+
+	for (i = 0; i < g.workload_mem_size / sizeof(*src); i++)
+		sum = _mm512_add_epi64(sum, _mm512_load_si512(src + i));
+	t->w_sink += _mm512_reduce_add_epi64(sum);
+}
+#endif
+
+/* Pointer chase: dependent loads, so no prefetcher or MLP can hide a miss */
+#define  CHASE_HOPS  64
+
+static void workload_chase(struct thread *t)
+{
+	void **p = t->w_cursor;
+	int i;
+
+	for (i = 0; i < CHASE_HOPS; i++)
+		p = *p;
+	t->w_cursor = p;
+}
+
+static void *chase_node(struct thread *t, uint64_t idx, uint64_t stride)
+{
+	/* Spread the nodes of page sized strides over all cache sets */
+	uint64_t offset = stride > 64 ? (idx % (stride / 64)) * 64 : 0;
+
+	return t->src_buf + idx * stride + offset;
+}
+
+/* Link nodes of the buffer in one random cycle (Sattolo's algorithm) */
+static void chase_prepare(struct thread *t, uint64_t stride)
+{
+	uint64_t i, j, tmp, *order, n = g.workload_mem_size / stride;
+	unsigned int seed = t->core_i;
+
+	TEST(n >= 2);
+	TEST(order = malloc(n * sizeof(*order)));
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		j = rand_r(&seed) % i;
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < n; i++)
+		*(void **)chase_node(t, order[i], stride) =
+			chase_node(t, order[(i + 1) % n], stride);
+	t->w_cursor = chase_node(t, order[0], stride);
+	free(order);
+}
+
+static void chase_prepare_line(struct thread *t)
+{
+	chase_prepare(t, 64);
+}
+
+static void chase_prepare_page(struct thread *t)
+{
+	chase_prepare(t, getpagesize());
+}
+
+static uint64_t cache_size(int name, uint64_t fallback)
+{
+	long size = sysconf(name);
+
+	return size > 0 ? (uint64_t)size : fallback;
+}
+
+static uint64_t l1_size(void)
+{
+	return cache_size(_SC_LEVEL1_DCACHE_SIZE, 32UL << 10);
+}
+
+static uint64_t l2_size(void)
+{
+	return cache_size(_SC_LEVEL2_CACHE_SIZE, 1UL << 20);
+}
+
+static uint64_t llc_size(void)
+{
+	return cache_size(_SC_LEVEL3_CACHE_SIZE, l2_size() * 8);
+}
+
+/* Far more pages than any second level TLB holds */
+static uint64_t tlb_size(void)
+{
+	return 64UL << 20;
+}
+
+struct workload workload_list[] = {
+	{ "no", 0, workload_nop },
+	{ "memmove", WORK_NEED_MEM, workload_memmove },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "copy-avx512", WORK_NEED_MEM | WORK_VARIANT, workload_copy_avx512, has_avx512 },
+	{ "copy-avx2", WORK_NEED_MEM | WORK_VARIANT, workload_copy_avx2, has_avx2 },
+#endif
+	{ "copy-generic", WORK_NEED_MEM | WORK_VARIANT, workload_copy },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "checksum-avx512", WORK_NEED_MEM | WORK_SRC_ONLY | WORK_VARIANT,
+	  workload_checksum_avx512, has_avx512 },
+	{ "checksum-avx2", WORK_NEED_MEM | WORK_SRC_ONLY | WORK_VARIANT,
+	  workload_checksum_avx2, has_avx2 },
+#endif
+	{ "checksum-generic", WORK_NEED_MEM | WORK_SRC_ONLY | WORK_VARIANT, workload_checksum },
+	{ "chase-l1", WORK_NEED_MEM | WORK_SRC_ONLY, workload_chase,
+	  NULL, l1_size, chase_prepare_line },
+	{ "chase-l2", WORK_NEED_MEM | WORK_SRC_ONLY, workload_chase,
+	  NULL, l2_size, chase_prepare_line },
+	{ "chase-llc", WORK_NEED_MEM | WORK_SRC_ONLY, workload_chase,
+	  NULL, llc_size, chase_prepare_line },
+	{ "chase-tlb", WORK_NEED_MEM | WORK_SRC_ONLY, workload_chase,
+	  NULL, tlb_size, chase_prepare_page },
+};
+
+/*
+ * Huge page backed buffers come from hugetlbfs if pages are reserved,
+ * transparent huge pages otherwise.
+ */
+static char *workload_alloc(uint64_t size)
+{
+	static int thp_warned;
+	char *buf;
+
+	if (g.hugepage) {
+		size = (size + g.hugepage_size - 1) & ~(g.hugepage_size - 1);
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buf != MAP_FAILED)
+			goto out;
+		if (__sync_bool_compare_and_swap(&thp_warned, 0, 1))
+			printf("WARNING: no hugetlb pages available, "
+			       "using transparent huge pages\n");
+		TEST0(posix_memalign((void **)&buf, g.hugepage_size, size));
+		madvise(buf, size, MADV_HUGEPAGE);
+	} else {
+		TEST0(posix_memalign((void **)&buf, getpagesize(), size));
+	}
+out:
+	/* First touch from the measuring thread makes the memory node local */
+	memset(buf, 0, size);
+	return buf;
+}
+
+static uint64_t hugepage_size(void)
+{
+	uint64_t size = 2UL << 20;
+	char line[128];
+	FILE *fp;
+
+	fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return size;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "Hugepagesize: %" SCNu64 " kB", &size) == 1) {
+			size <<= 10;
+			break;
+		}
+	}
+	fclose(fp);
+
+	return size;
+}
+
+static int move_to_core(int core_i)
+{
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(core_i, &cpus);
+	return sched_setaffinity(0, sizeof(cpus), &cpus);
 }
 
 static void thread_init(struct thread *t)
 {
-	t->cpu_mhz = measure_cpu_mhz();
+	t->cpu_mhz = tsc_measure_mhz();
 	t->maxlat = 0;
 	t->overflow_sum = 0;
 	t->minlat = (uint64_t)-1;
 
+	/* The reciprocal is only an estimate, insert_bucket() corrects it */
+	t->us_mult = ((1ULL << TSC_SCALE_SHIFT) + t->cpu_mhz - 1) / t->cpu_mhz;
+	t->bias_cycles = g.bias * t->cpu_mhz;
+	/* us = index + 1 >= trace_threshold */
+	if (!g.preheat && g.trace_threshold)
+		t->trace_cycles = (cycles_t)(g.trace_threshold - 1) * t->cpu_mhz;
+	else
+		t->trace_cycles = UINT64_MAX;
+	t->min_cycles = UINT64_MAX;
+	t->max_cycles = 0;
+	t->last_bucket = g.bucket_size - 1;
+
 	/* NOTE: all the buffers are not freed until the process quits. */
 	if (!t->memory_allocated) {
 		TEST(t->buckets = calloc(1, sizeof(t->buckets[0]) * g.bucket_size));
 		if (g.workload->w_flags & WORK_NEED_MEM) {
-			TEST0(posix_memalign((void **)&t->src_buf, getpagesize(),
-					     g.workload_mem_size));
-			memset(t->src_buf, 0, g.workload_mem_size);
-			TEST0(posix_memalign((void **)&t->dst_buf, getpagesize(),
-					     g.workload_mem_size));
-			memset(t->dst_buf, 0, g.workload_mem_size);
+			t->src_buf = workload_alloc(g.workload_mem_size);
+			if (!(g.workload->w_flags & WORK_SRC_ONLY))
+				t->dst_buf = workload_alloc(g.workload_mem_size);
 		}
+		if (g.workload->w_prepare)
+			g.workload->w_prepare(t);
 		t->memory_allocated = 1;
 	} else {
 		/* Clear the buckets */
 		memset(t->buckets, 0, sizeof(t->buckets[0]) * g.bucket_size);
 	}
+
+	/* us >= perf_threshold as reported, like ts_thr_cycles below */
+	if (g.perf_threshold)
+		t->perf_thr_cycles = (cycles_t)(g.perf_threshold - 1) * t->cpu_mhz;
+	else
+		t->perf_thr_cycles = (g.bias + g.bucket_size - 1) * t->cpu_mhz;
+
+	if (g.ts_interval && !g.preheat) {
+		/* Touch it here so the hot loop never faults it in */
+		TEST(t->ts = malloc((g.ts_nslots + 1) * sizeof(*t->ts)));
+		memset(t->ts, 0, (g.ts_nslots + 1) * sizeof(*t->ts));
+		/*
+		 * Reported as us = cycles / cpu_mhz + 1, so count the samples
+		 * of us >= ts_threshold, by default the ones which overflow
+		 * the histogram.
+		 */
+		if (g.ts_threshold)
+			t->ts_thr_cycles = (cycles_t)(g.ts_threshold - 1) * t->cpu_mhz;
+		else
+			t->ts_thr_cycles = (g.bias + g.bucket_size - 1) * t->cpu_mhz;
+	}
 }
 
 static float cycles_to_sec(const struct thread *t, uint64_t cycles)
@@ -291,62 +569,44 @@ static float cycles_to_sec(const struct thread *t, uint64_t cycles)
 	return cycles / (t->cpu_mhz * 1e6);
 }
 
-static void insert_bucket(struct thread *t, stamp_t value)
+static void __attribute__((noinline)) trace_triggered(struct thread *t,
+							stamp_t value)
 {
-	int index, us;
-	uint64_t extra;
-
-	index = value / t->cpu_mhz;
-	assert(index >= 0);
-	us = index + 1;
-	assert(us > 0);
-
-	if (!g.preheat && g.trace_threshold && us >= g.trace_threshold) {
-		char *line = "%s: Trace threshold (%d us) triggered with %u us!\n"
-		    "Stopping the test.\n";
-		tracemark(line, g.app_name, g.trace_threshold, us);
-		err_quit(line, g.app_name, g.trace_threshold, us);
-	}
+	char *line = "%s: Trace threshold (%d us) triggered with %u us!\n"
+	    "Stopping the test.\n";
+	unsigned int us = value / t->cpu_mhz + 1;
+	struct oslat_trace_record rec = {
+		.latency = us,
+		.threshold = g.trace_threshold,
+		.cpu = t->core_i,
+	};
+
+	/* text only for kernels without trace_marker_raw */
+	if (tracemark_raw(TRACEMARK_ID_OSLAT, &rec, sizeof(rec)))
+		tracemark_printf(line, g.app_name, g.trace_threshold, us);
+	tracemark_stop();
+	err_quit(line, g.app_name, g.trace_threshold, us);
+}
 
-	/* Update max latency */
-	if (us > t->maxlat)
-		t->maxlat = us;
+/*
+ * Runs after every loop of the workload, so it is kept free of divisions
+ * and of branches except for the trace threshold, which never fires in a
+ * run that keeps going.  Bucket counters and overflow_sum are 64 bit and
+ * cannot wrap within any realistic runtime.
+ */
+static inline void insert_bucket(struct thread *t, stamp_t value)
+{
+	uint64_t index;
 
-	if (us < t->minlat)
-		t->minlat = us;
+	if (__builtin_expect(value >= t->trace_cycles, 0))
+		trace_triggered(t, value);
 
-	if (g.bias) {
-		/* t->bias will be set after pre-heat if user enabled it */
-		us -= g.bias;
-		/*
-		 * Negative should hardly happen, but if it happens, we assume we're in
-		 * the smallest bucket, which is 1us.  Same to index.
-		 */
-		if (us <= 0)
-			us = 1;
-		index -= g.bias;
-		if (index < 0)
-			index = 0;
-	}
+	t->max_cycles = value > t->max_cycles ? value : t->max_cycles;
+	t->min_cycles = value < t->min_cycles ? value : t->min_cycles;
 
-	/* Too big the jitter; put into the last bucket */
-	if (index >= g.bucket_size) {
-		/* Keep the extra bit (in us) */
-		extra = index - g.bucket_size;
-		if (t->overflow_sum + extra < t->overflow_sum) {
-			/* The uint64_t even overflowed itself; bail out */
-			printf("Accumulated overflow too much!\n");
-			exit(1);
-		}
-		t->overflow_sum += extra;
-		index = g.bucket_size - 1;
-	}
-
-	t->buckets[index]++;
-	if (t->buckets[index] == 0) {
-		printf("Bucket %d overflowed\n", index);
-		exit(1);
-	}
+	index = oslat_bucket_index(value, t->bias_cycles, t->us_mult,
+				   t->cpu_mhz);
+	oslat_bucket_add(t->buckets, t->last_bucket, &t->overflow_sum, index);
 }
 
 static void doit(struct thread *t)
@@ -356,13 +616,74 @@ static void doit(struct thread *t)
 
 	frc(&ts2);
 	do {
-		workload_fn(t->dst_buf, t->src_buf, g.workload_mem_size);
+		workload_fn(t);
 		frc(&ts1);
 		insert_bucket(t, ts1 - ts2);
 		ts2 = ts1;
 	} while (g.cmd == GO);
 }
 
+/* doit() plus the interval the main thread currently accounts in ts_slot */
+static void doit_timeseries(struct thread *t)
+{
+	stamp_t ts1, ts2, delta;
+	workload_fn workload_fn = g.workload->w_fn;
+	struct ts_slot *slot;
+
+	frc(&ts2);
+	do {
+		workload_fn(t);
+		frc(&ts1);
+		delta = ts1 - ts2;
+		insert_bucket(t, delta);
+		slot = &t->ts[g.ts_slot];
+		slot->max_cycles = delta > slot->max_cycles ? delta : slot->max_cycles;
+		slot->over += delta >= t->ts_thr_cycles;
+		ts2 = ts1;
+	} while (g.cmd == GO);
+}
+
+/*
+ * doit() with the counters sampled at every spike and every PERF_WINDOW
+ * loops. The time of a counter read is not part of the next sample.
+ */
+static void doit_perf(struct thread *t)
+{
+	stamp_t ts1, ts2, delta;
+	workload_fn workload_fn = g.workload->w_fn;
+	struct ts_slot *slot;
+	unsigned int n = 0;
+
+	perf_counters_rebase(&t->perf);
+	frc(&ts2);
+	do {
+		workload_fn(t);
+		frc(&ts1);
+		delta = ts1 - ts2;
+		insert_bucket(t, delta);
+		if (t->ts) {
+			slot = &t->ts[g.ts_slot];
+			slot->max_cycles = delta > slot->max_cycles ?
+				delta : slot->max_cycles;
+			slot->over += delta >= t->ts_thr_cycles;
+		}
+		if (__builtin_expect(delta >= t->perf_thr_cycles, 0)) {
+			perf_counters_sample(&t->perf);
+			perf_counters_spike(&t->perf);
+			if (delta == t->max_cycles)
+				perf_counters_max(&t->perf);
+			frc(&ts1);
+			n = 0;
+		} else if (++n == PERF_WINDOW) {
+			perf_counters_sample(&t->perf);
+			frc(&ts1);
+			n = 0;
+		}
+		ts2 = ts1;
+	} while (g.cmd == GO);
+	perf_counters_sample(&t->perf);
+}
+
 static int set_fifo_prio(int prio)
 {
 	struct sched_param param;
@@ -385,6 +706,7 @@ static void *thread_main(void *arg)
 	 * the "struct thread" since we expect that to stay cache resident.
 	 */
 	TEST(move_to_core(t->core_i) == 0);
+	t->tid = gettid();
 	if (g.rtprio)
 		TEST(set_fifo_prio(g.rtprio) == 0);
 
@@ -400,11 +722,24 @@ static void *thread_main(void *arg)
 	while (g.n_threads_running != g.n_threads)
 		relax();
 
+	if (g.perf && !g.preheat && perf_counters_open(&t->perf))
+		printf("WARNING: no performance counters on core %d: %s\n",
+		       t->core_i, strerror(errno));
+
 	frc(&t->frc_start);
-	doit(t);
+	if (t->perf.mask)
+		doit_perf(t);
+	else if (t->ts)
+		doit_timeseries(t);
+	else
+		doit(t);
 	frc(&t->frc_stop);
+	if (t->perf.mask)
+		perf_counters_close(&t->perf);
 
 	t->runtime = t->frc_stop - t->frc_start;
+	t->minlat = t->min_cycles / t->cpu_mhz + 1;
+	t->maxlat = t->max_cycles / t->cpu_mhz + 1;
 
 	/* Wait for everyone to finish so we don't disturb them by exiting and
 	 * waking the main thread.
@@ -423,7 +758,7 @@ static void *thread_main(void *arg)
 		printf("%s\n", end);                    \
 	} while (0)
 
-void calculate(struct thread *t)
+void calculate(struct thread **t)
 {
 	int i, j;
 	double sum;
@@ -433,29 +768,65 @@ void calculate(struct thread *t)
 		/* Calculate average */
 		sum = count = 0;
 		for (j = 0; j < g.bucket_size; j++) {
-			sum += 1.0 * t[i].buckets[j] * (g.bias+j+1);
-			count += t[i].buckets[j];
+			sum += 1.0 * t[i]->buckets[j] * (g.bias+j+1);
+			count += t[i]->buckets[j];
 		}
 		/* Add the extra amount of huge spikes in */
-		sum += t->overflow_sum;
-		t[i].average = sum / count;
+		sum += t[i]->overflow_sum;
+		t[i]->average = sum / count;
 	}
 }
 
-static void write_summary(struct thread *t)
+/*
+ * Number of --timeseries intervals that were accounted. The sampler
+ * closes the interval the run stops in before it exits, so the slot
+ * g.ts_slot points at holds at most a few samples taken after that.
+ */
+static unsigned int ts_used(void)
+{
+	return g.ts_slot;
+}
+
+static uint64_t ts_max_us(const struct thread *t, unsigned int k)
+{
+	return t->ts[k].max_cycles ? t->ts[k].max_cycles / t->cpu_mhz + 1 : 0;
+}
+
+static void write_timeseries_summary(struct thread **t)
+{
+	unsigned int i, k, worst;
+
+	printf("Noisiest %d ms interval per core:\n", g.ts_interval);
+	for (i = 0; i < g.n_threads; i++) {
+		worst = 0;
+		for (k = 1; k < ts_used(); k++)
+			if (t[i]->ts[k].max_cycles > t[i]->ts[worst].max_cycles)
+				worst = k;
+		printf("    CPU %3d: at %.3f (sec) max %" PRIu64 " (us), %" PRIu64
+		       " over threshold, irqs %" PRIu64 ", softirqs %" PRIu64
+		       ", preemptions %" PRIu64 "\n",
+		       t[i]->core_i, (double)worst * g.ts_interval / 1000,
+		       ts_max_us(t[i], worst), t[i]->ts[worst].over,
+		       t[i]->noise[worst].irqs, t[i]->noise[worst].softirqs,
+		       t[i]->noise[worst].preempts);
+	}
+	printf("\n");
+}
+
+static void write_summary(struct thread **t)
 {
 	int i, j, k, print_dotdotdot = 0;
 	char bucket_name[64];
 
 	calculate(t);
 
-	putfield("Core", t[i].core_i, "d", "");
-	putfield("CPU Freq", t[i].cpu_mhz, "u", " (Mhz)");
+	putfield("Core", t[i]->core_i, "d", "");
+	putfield("CPU Freq", t[i]->cpu_mhz, "u", " (Mhz)");
 
 	for (j = 0; j < g.bucket_size; j++) {
 		if (j < g.bucket_size-1 && g.output_omit_zero_buckets) {
 			for (k = 0; k < g.n_threads; k++) {
-				if (t[k].buckets[j] != 0)
+				if (t[k]->buckets[j] != 0)
 					break;
 			}
 			if (k == g.n_threads) {
@@ -471,53 +842,305 @@ static void write_summary(struct thread *t)
 
 		snprintf(bucket_name, sizeof(bucket_name), "%03"PRIu64
 			 " (us)", g.bias+j+1);
-		putfield(bucket_name, t[i].buckets[j], PRIu64,
+		putfield(bucket_name, t[i]->buckets[j], PRIu64,
 			 (j == g.bucket_size - 1) ? " (including overflows)" : "");
 	}
 
-	putfield("Minimum", t[i].minlat, PRIu64, " (us)");
-	putfield("Average", t[i].average, ".3lf", " (us)");
-	putfield("Maximum", t[i].maxlat, PRIu64, " (us)");
-	putfield("Max-Min", t[i].maxlat - t[i].minlat, PRIu64, " (us)");
-	putfield("Duration", cycles_to_sec(&(t[i]), t[i].runtime),
+	putfield("Minimum", t[i]->minlat, PRIu64, " (us)");
+	putfield("Average", t[i]->average, ".3lf", " (us)");
+	putfield("Maximum", t[i]->maxlat, PRIu64, " (us)");
+	putfield("Max-Min", t[i]->maxlat - t[i]->minlat, PRIu64, " (us)");
+	putfield("Duration", cycles_to_sec(t[i], t[i]->runtime),
 		 ".3f", " (sec)");
+	if (g.perf) {
+		putfield("Perf spikes", t[i]->perf.spikes, "lu", "");
+		for (j = 0; j < PERF_NR_COUNTERS; j++) {
+			if (!(t[0]->perf.mask & (1U << j)))
+				continue;
+			/* the average increment of a spike */
+			putfield(perf_counter_names[j], t[i]->perf.spikes ?
+				 (double)t[i]->perf.spike_sum[j] / t[i]->perf.spikes : 0.0,
+				 ".2f", " (per spike)");
+		}
+	}
 	printf("\n");
+
+	if (g.ts_interval)
+		write_timeseries_summary(t);
+}
+
+static void write_timeseries_json(FILE *f, const struct thread *t)
+{
+	unsigned int k;
+
+	fprintf(f, "      \"timeseries\": {\n");
+	fprintf(f, "        \"interval_ms\": %d,\n", g.ts_interval);
+	fprintf(f, "        \"threshold\": %" PRIu64 ",\n",
+		t->ts_thr_cycles / t->cpu_mhz + 1);
+	fprintf(f, "        \"samples\": [");
+	for (k = 0; k < ts_used(); k++)
+		fprintf(f, "%s\n          { \"max\": %" PRIu64 ", \"over\": %" PRIu64
+			", \"irqs\": %" PRIu64 ", \"softirqs\": %" PRIu64
+			", \"preemptions\": %" PRIu64 " }",
+			k ? "," : "", ts_max_us(t, k), t->ts[k].over,
+			t->noise[k].irqs, t->noise[k].softirqs,
+			t->noise[k].preempts);
+	fprintf(f, "\n        ]\n");
+	fprintf(f, "      }\n");
 }
 
 static void write_summary_json(FILE *f, void *data)
 {
-	struct thread *t = data;
+	struct thread **t = data;
 	int i, j, comma;
 
 	fprintf(f, "  \"num_threads\": %d,\n", g.n_threads);
+	fprintf(f, "  \"workload\": \"%s\",\n", g.workload->w_name);
 	fprintf(f, "  \"thread\": {\n");
 	for (i = 0; i < g.n_threads; ++i) {
 		fprintf(f, "    \"%u\": {\n", i);
-		fprintf(f, "      \"cpu\": %d,\n", t[i].core_i);
-		fprintf(f, "      \"freq\": %d,\n", t[i].cpu_mhz);
-		fprintf(f, "      \"min\": %" PRIu64 ",\n", t[i].minlat);
-		fprintf(f, "      \"avg\": %3lf,\n", t[i].average);
-		fprintf(f, "      \"max\": %" PRIu64 ",\n", t[i].maxlat);
+		fprintf(f, "      \"cpu\": %d,\n", t[i]->core_i);
+		fprintf(f, "      \"freq\": %d,\n", t[i]->cpu_mhz);
+		fprintf(f, "      \"min\": %" PRIu64 ",\n", t[i]->minlat);
+		fprintf(f, "      \"avg\": %3lf,\n", t[i]->average);
+		fprintf(f, "      \"max\": %" PRIu64 ",\n", t[i]->maxlat);
 		fprintf(f, "      \"duration\": %.3f,\n",
-			cycles_to_sec(&(t[i]), t[i].runtime));
+			cycles_to_sec(t[i], t[i]->runtime));
 		fprintf(f, "      \"histogram\": {");
 		for (j = 0, comma = 0; j < g.bucket_size; j++) {
-			if (t[i].buckets[j] == 0)
+			if (t[i]->buckets[j] == 0)
 				continue;
 			fprintf(f, "%s", comma ? ",\n" : "\n");
 			fprintf(f, "        \"%" PRIu64 "\": %" PRIu64,
-				g.bias+j+1, t[i].buckets[j]);
+				g.bias+j+1, t[i]->buckets[j]);
 			comma = 1;
 		}
 		if (comma)
 			fprintf(f, "\n");
-		fprintf(f, "      }\n");
+		fprintf(f, "      }%s\n", g.ts_interval || t[i]->perf.mask ? "," : "");
+		if (t[i]->perf.mask) {
+			fprintf(f, "      \"perf\": ");
+			perf_counters_json(f, &t[i]->perf, 6);
+			fprintf(f, ",\n      \"perf_threshold\": %" PRIu64 "%s\n",
+				t[i]->perf_thr_cycles / t[i]->cpu_mhz + 1,
+				g.ts_interval ? "," : "");
+		}
+		if (g.ts_interval)
+			write_timeseries_json(f, t[i]);
 		fprintf(f, "    }%s\n", i == g.n_threads - 1 ? "" : ",");
 	}
 	fprintf(f, "  }\n");
 }
 
-static void run_expt(struct thread *threads, int runtime_secs, bool preheat)
+/*
+ * Noise counters, snapshotted by the main thread at every --timeseries
+ * interval: the per CPU sums of /proc/interrupts and /proc/softirqs and
+ * the involuntary context switches of every sampling thread.
+ */
+struct noise_snap {
+	uint64_t *irqs;		/* indexed by CPU */
+	uint64_t *softirqs;
+	uint64_t *preempts;	/* indexed by thread */
+};
+
+static char *proc_buf;
+static size_t proc_buf_size = 64 << 10;
+
+static char *read_proc(int fd)
+{
+	ssize_t len;
+
+	for (;;) {
+		len = pread(fd, proc_buf, proc_buf_size, 0);
+		if (len < 0)
+			return NULL;
+		if ((size_t)len < proc_buf_size)
+			break;
+		proc_buf_size *= 2;
+		TEST(proc_buf = realloc(proc_buf, proc_buf_size));
+	}
+	proc_buf[len] = '\0';
+
+	return proc_buf;
+}
+
+/* Sum up the CPU columns of /proc/interrupts or /proc/softirqs */
+static void read_percpu_table(int fd, uint64_t *sum, int ncpus, int *col_cpu)
+{
+	char *line, *next, *p, *end;
+	int ncol = 0, j, cpu;
+	uint64_t v;
+
+	memset(sum, 0, ncpus * sizeof(*sum));
+	line = read_proc(fd);
+	if (!line)
+		return;
+
+	/* The header names the CPU of every column */
+	next = strchr(line, '\n');
+	if (!next)
+		return;
+	*next++ = '\0';
+	for (p = line; (p = strstr(p, "CPU")); p += 3)
+		if (sscanf(p, "CPU%d", &cpu) == 1 && ncol < ncpus)
+			col_cpu[ncol++] = cpu;
+
+	for (line = next; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		p = strchr(line, ':');
+		if (!p)
+			continue;
+		p++;
+		/* Lines like ERR: have a single column, stop at the first text */
+		for (j = 0; j < ncol; j++, p = end) {
+			v = strtoull(p, &end, 10);
+			if (end == p)
+				break;
+			if (col_cpu[j] < ncpus)
+				sum[col_cpu[j]] += v;
+		}
+	}
+}
+
+static uint64_t read_preempts(int fd)
+{
+	char *buf = fd >= 0 ? read_proc(fd) : NULL;
+	uint64_t v = 0;
+
+	if (buf && (buf = strstr(buf, "nonvoluntary_ctxt_switches:")))
+		sscanf(buf, "nonvoluntary_ctxt_switches: %" SCNu64, &v);
+
+	return v;
+}
+
+static void timeseries_run(struct thread **t)
+{
+	int i, ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	int irq_fd, softirq_fd, *status_fd, *col_cpu;
+	struct noise_snap snap[2], *prev = &snap[0], *cur = &snap[1], *tmp;
+	struct timespec next, interval;
+	char path[64];
+	unsigned int k;
+
+	TEST(proc_buf = malloc(proc_buf_size + 1));
+	TEST(col_cpu = calloc(ncpus, sizeof(*col_cpu)));
+	TEST(status_fd = calloc(g.n_threads, sizeof(*status_fd)));
+	for (k = 0; k < 2; k++) {
+		TEST(snap[k].irqs = calloc(ncpus, sizeof(uint64_t)));
+		TEST(snap[k].softirqs = calloc(ncpus, sizeof(uint64_t)));
+		TEST(snap[k].preempts = calloc(g.n_threads, sizeof(uint64_t)));
+	}
+	irq_fd = open("/proc/interrupts", O_RDONLY);
+	softirq_fd = open("/proc/softirqs", O_RDONLY);
+	for (i = 0; i < g.n_threads; i++) {
+		snprintf(path, sizeof(path), "/proc/self/task/%d/status", t[i]->tid);
+		status_fd[i] = open(path, O_RDONLY);
+		TEST(t[i]->noise = calloc(g.ts_nslots, sizeof(*t[i]->noise)));
+	}
+
+	interval.tv_sec = g.ts_interval / 1000;
+	interval.tv_nsec = (g.ts_interval % 1000) * 1000000L;
+
+#define snapshot(s) do {						\
+		read_percpu_table(irq_fd, (s)->irqs, ncpus, col_cpu);	\
+		read_percpu_table(softirq_fd, (s)->softirqs, ncpus, col_cpu); \
+		for (i = 0; i < g.n_threads; i++)			\
+			(s)->preempts[i] = read_preempts(status_fd[i]); \
+	} while (0)
+
+	snapshot(prev);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (g.cmd == GO) {
+		next.tv_sec += interval.tv_sec;
+		next.tv_nsec += interval.tv_nsec;
+		tsnorm(&next);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		snapshot(cur);
+		k = g.ts_slot;
+		for (i = 0; k < g.ts_nslots && i < g.n_threads; i++) {
+			int cpu = t[i]->core_i;
+
+			t[i]->noise[k].irqs = cur->irqs[cpu] - prev->irqs[cpu];
+			t[i]->noise[k].softirqs = cur->softirqs[cpu] - prev->softirqs[cpu];
+			t[i]->noise[k].preempts = cur->preempts[i] - prev->preempts[i];
+		}
+		if (k < g.ts_nslots)
+			g.ts_slot = k + 1;
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+#undef snapshot
+	if (g.ts_slot == g.ts_nslots)
+		warn("--timeseries: the run outlasted its %u intervals, "
+		     "the rest is not recorded\n", g.ts_nslots);
+
+	for (i = 0; i < g.n_threads; i++)
+		if (status_fd[i] >= 0)
+			close(status_fd[i]);
+	if (irq_fd >= 0)
+		close(irq_fd);
+	if (softirq_fd >= 0)
+		close(softirq_fd);
+	for (k = 0; k < 2; k++) {
+		free(snap[k].irqs);
+		free(snap[k].softirqs);
+		free(snap[k].preempts);
+	}
+	free(status_fd);
+	free(col_cpu);
+	free(proc_buf);
+}
+
+/*
+ * Called by the exporter thread. It only reads what the sampling threads
+ * keep anyway, so --export adds nothing to insert_bucket().
+ */
+static void export_read(void *arg, struct export_stat *snap)
+{
+	struct thread *t = arg;
+	uint64_t n, min, max;
+	int j;
+
+	min = __atomic_load_n(&t->min_cycles, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&t->max_cycles, __ATOMIC_RELAXED);
+	snap->count = snap->sum = 0;
+	for (j = 0; j < g.bucket_size; j++) {
+		n = __atomic_load_n(&t->buckets[j], __ATOMIC_RELAXED);
+		snap->count += n;
+		snap->sum += n * (g.bias + j + 1);
+	}
+	snap->sum += __atomic_load_n(&t->overflow_sum, __ATOMIC_RELAXED);
+	snap->min = snap->count ? min / t->cpu_mhz + 1 : 0;
+	snap->max = snap->count ? max / t->cpu_mhz + 1 : 0;
+}
+
+/* The buckets exist once every thread went through thread_init() */
+static void export_run(struct thread **t)
+{
+	int i;
+
+	while (g.n_threads_running != g.n_threads && g.cmd == GO)
+		usleep(1000);
+	if (g.n_threads_running != g.n_threads)
+		return;
+
+	export_init("oslat", "us");
+	for (i = 0; i < g.n_threads; i++)
+		TEST0(export_add_linear(export_read, t[i], t[i]->buckets,
+					g.bucket_size, g.bias + 1,
+					"cpu=\"%d\"", t[i]->core_i));
+	if (export_start(g.exportspec)) {
+		printf("Failed to export on %s: %s\n", g.exportspec,
+		       strerror(errno));
+		exit(1);
+	}
+}
+
+static void run_expt(struct thread **threads, int runtime_secs, bool preheat)
 {
 	int i;
 
@@ -529,19 +1152,26 @@ static void run_expt(struct thread *threads, int runtime_secs, bool preheat)
 	g.cmd = WAIT;
 
 	for (i = 0; i < g.n_threads; ++i)
-		TEST0(pthread_create(&(threads[i].thread_id), NULL,
-				     thread_main, &(threads[i])));
+		TEST0(pthread_create(&threads[i]->thread_id, NULL,
+				     thread_main, threads[i]));
 	while (g.n_threads_started != g.n_threads)
 		usleep(1000);
 
 	gettimeofday(&g.tv_start, NULL);
+	g.ts_slot = 0;
 	g.cmd = GO;
 
 	alarm(runtime_secs);
 
+	if (*g.exportspec && !preheat)
+		export_run(threads);
+
+	if (g.ts_interval && !preheat)
+		timeseries_run(threads);
+
 	/* Go to sleep until the threads have done their stuff. */
 	for (i = 0; i < g.n_threads; ++i)
-		pthread_join(threads[i].thread_id, NULL);
+		pthread_join(threads[i]->thread_id, NULL);
 }
 
 static void handle_alarm(int code)
@@ -560,8 +1190,12 @@ static void usage(int error)
 	       "-B, --bias             Add a bias to all the buckets using the estimated mininum\n"
 	       "-c, --cpu-list         Specify CPUs to run on, e.g. '1,3,5,7-15'\n"
 	       "-C, --cpu-main-thread  Specify which CPU the main thread runs on.  Default is cpu0.\n"
+	       "    --placement=POL    Pick the CPUs of the cpu list by topology: rr (all, the\n"
+	       "                       default), core, nosmt, llc or cross-node\n"
 	       "-D, --duration         Specify test duration, e.g., 60, 20m, 2H\n"
 	       "                       (m/M: minutes, h/H: hours, d/D: days)\n"
+	       "    --export=SPEC      serve the live histograms in OpenMetrics format on the\n"
+	       "                       Unix socket unix:PATH or on localhost:PORT\n"
 	       "    --json=FILENAME    write final results into FILENAME, JSON formatted\n"
 	       "-f, --rtprio           Using SCHED_FIFO priority (1-99)\n"
 	       "-m, --workload-mem     Size of the memory to use for the workload (e.g., 4K, 1M).\n"
@@ -577,24 +1211,74 @@ static void usage(int error)
 	       "                       print a marker in ftrace and stop ftrace too.\n"
 	       "-v, --version          Display the version of the software.\n"
 	       "-w, --workload         Specify a kind of workload, default is no workload\n"
-	       "                       (options: no, memmove)\n"
+	       "                       (options: no, memmove, copy, checksum, chase-l1,\n"
+	       "                       chase-l2, chase-llc, chase-tlb; copy and checksum\n"
+	       "                       use the widest vector unit, force one with e.g.\n"
+	       "                       copy-avx2 or copy-generic)\n"
+	       "    --hugepage         Back the workload buffers with huge pages\n"
+	       "    --perf[=US]        Count cycles, instructions, LLC and dTLB misses and context\n"
+	       "                       switches up to every sample of US or more (default: the\n"
+	       "                       overflow bucket) and report them per spike\n"
+	       "    --timeseries=MS    Record the max latency, the samples at or above the\n"
+	       "                       threshold and the IRQ, softirq and preemption counts of\n"
+	       "                       every MS interval\n"
+	       "    --timeseries-threshold=US\n"
+	       "                       Threshold counted by --timeseries, default is the\n"
+	       "                       overflow bucket of the histogram\n"
 	       "-z, --zero-omit        Don't display buckets in the output histogram if all zeros.\n"
 	       );
 	exit(error);
 }
 
+static int workload_usable(struct workload *w)
+{
+	return !w->w_supported || w->w_supported();
+}
+
+/*
+ * Returns 0 on success, -1 for an unknown name and -2 for a name that is
+ * only the prefix of several distinct workloads, e.g. "chase".
+ */
 static int workload_select(char *name)
 {
-	int i = 0;
+	size_t len = strlen(name);
+	int i, variants = 0;
 
-	for (i = 0; i < WORKLOAD_NUM; i++) {
+	for (i = 0; i < ARRAY_SIZE(workload_list); i++) {
 		if (!strcmp(name, workload_list[i].w_name)) {
+			if (!workload_usable(&workload_list[i])) {
+				printf("Workload '%s' is not supported by this CPU.\n\n",
+				       name);
+				exit(1);
+			}
 			g.workload = &workload_list[i];
 			return 0;
 		}
 	}
 
-	return -1;
+	for (i = 0; i < ARRAY_SIZE(workload_list); i++) {
+		if (strncmp(name, workload_list[i].w_name, len) ||
+		    workload_list[i].w_name[len] != '-')
+			continue;
+		if (!(workload_list[i].w_flags & WORK_VARIANT))
+			return -2;
+		variants++;
+	}
+	if (!variants)
+		return -1;
+
+	/* Pick the first supported variant of the workload class */
+	for (i = 0; i < ARRAY_SIZE(workload_list); i++) {
+		if (!strncmp(name, workload_list[i].w_name, len) &&
+		    workload_list[i].w_name[len] == '-' &&
+		    workload_usable(&workload_list[i])) {
+			g.workload = &workload_list[i];
+			return 0;
+		}
+	}
+
+	printf("No variant of workload '%s' is supported by this CPU.\n\n", name);
+	exit(1);
 }
 
 enum option_value {
@@ -602,7 +1286,8 @@ enum option_value {
 	OPT_DURATION, OPT_JSON, OPT_RT_PRIO, OPT_HELP, OPT_TRACE_TH,
 	OPT_WORKLOAD, OPT_WORKLOAD_MEM, OPT_BIAS,
 	OPT_QUIET, OPT_SINGLE_PREHEAT, OPT_ZERO_OMIT,
-	OPT_VERSION
+	OPT_VERSION, OPT_HUGEPAGE, OPT_TIMESERIES, OPT_TIMESERIES_TH,
+	OPT_PLACEMENT, OPT_PERF, OPT_EXPORT
 };
 
 /* Process commandline options */
@@ -615,6 +1300,7 @@ static void parse_options(int argc, char *argv[])
 			{ "cpu-list",	required_argument,	NULL, OPT_CPU_LIST },
 			{ "cpu-main-thread", required_argument, NULL, OPT_CPU_MAIN_THREAD},
 			{ "duration",	required_argument,	NULL, OPT_DURATION },
+			{ "export",	required_argument,	NULL, OPT_EXPORT },
 			{ "json",	required_argument,      NULL, OPT_JSON },
 			{ "rtprio",	required_argument,	NULL, OPT_RT_PRIO },
 			{ "help",	no_argument,		NULL, OPT_HELP },
@@ -626,9 +1312,14 @@ static void parse_options(int argc, char *argv[])
 			{ "single-preheat", no_argument,	NULL, OPT_SINGLE_PREHEAT },
 			{ "zero-omit",	no_argument,		NULL, OPT_ZERO_OMIT },
 			{ "version",	no_argument,		NULL, OPT_VERSION },
+			{ "hugepage",	no_argument,		NULL, OPT_HUGEPAGE },
+			{ "timeseries",	required_argument,	NULL, OPT_TIMESERIES },
+			{ "timeseries-threshold", required_argument, NULL, OPT_TIMESERIES_TH },
+			{ "placement",	required_argument,	NULL, OPT_PLACEMENT },
+			{ "perf",	optional_argument,	NULL, OPT_PERF },
 			{ NULL, 0, NULL, 0 },
 		};
-		int i, c = getopt_long(argc, argv, "b:Bc:C:D:f:hm:qsw:T:vz",
+		int i, ret, c = getopt_long(argc, argv, "b:Bc:C:D:f:hm:qsw:T:vz",
 				       options, &option_index);
 		long ncores;
 
@@ -682,6 +1373,9 @@ static void parse_options(int argc, char *argv[])
 		case OPT_JSON:
 			strncpy(g.jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
 			break;
+		case OPT_EXPORT:
+			strncpy(g.exportspec, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
 		case OPT_TRACE_TH:
 		case 'T':
 			g.trace_threshold = strtol(optarg, NULL, 10);
@@ -689,15 +1383,17 @@ static void parse_options(int argc, char *argv[])
 				printf("Parameter --trace-threshold needs to be positive\n");
 				exit(1);
 			}
-			enable_trace_mark();
+			tracemark_open(0);
 			break;
 		case OPT_WORKLOAD:
 		case 'w':
-			if (workload_select(optarg)) {
-				printf("Unknown workload '%s'.  Please choose from: ", optarg);
-				for (i = 0; i < WORKLOAD_NUM; i++) {
+			ret = workload_select(optarg);
+			if (ret) {
+				printf("%s workload '%s'.  Please choose from: ",
+				       ret == -2 ? "Ambiguous" : "Unknown", optarg);
+				for (i = 0; i < ARRAY_SIZE(workload_list); i++) {
 					printf("'%s'", workload_list[i].w_name);
-					if (i != WORKLOAD_NUM - 1)
+					if (i != ARRAY_SIZE(workload_list) - 1)
 						printf(", ");
 				}
 				printf("\n\n");
@@ -710,6 +1406,42 @@ static void parse_options(int argc, char *argv[])
 				printf("Unknown workload memory size '%s'.\n\n", optarg);
 				exit(1);
 			}
+			g.workload_mem_set = 1;
+			break;
+		case OPT_HUGEPAGE:
+			g.hugepage = 1;
+			break;
+		case OPT_TIMESERIES:
+			g.ts_interval = strtol(optarg, NULL, 10);
+			if (g.ts_interval <= 0) {
+				printf("Parameter --timeseries needs to be positive\n");
+				exit(1);
+			}
+			break;
+		case OPT_TIMESERIES_TH:
+			g.ts_threshold = strtol(optarg, NULL, 10);
+			if (g.ts_threshold <= 0) {
+				printf("Parameter --timeseries-threshold needs to be positive\n");
+				exit(1);
+			}
+			break;
+		case OPT_PERF:
+			g.perf = 1;
+			if (optarg) {
+				g.perf_threshold = strtol(optarg, NULL, 10);
+				if (g.perf_threshold <= 0) {
+					printf("Parameter --perf needs to be positive\n");
+					exit(1);
+				}
+			}
+			break;
+		case OPT_PLACEMENT:
+			g.placement = cpu_plan_policy(optarg);
+			if (g.placement < 0) {
+				printf("Unknown placement '%s', use one of "
+				       CPU_PLAN_POLICIES "\n", optarg);
+				exit(1);
+			}
 			break;
 		case OPT_QUIET:
 		case 'q':
@@ -755,17 +1487,19 @@ void dump_globals(void)
 	else
 		printf("default\n");
 	printf("CPU list: \t\t%s\n", g.cpu_list ?: "(all cores)");
+	printf("CPU placement: \t\t%s\n", cpu_plan_name(g.placement));
 	printf("CPU for main thread: \t%d\n", g.cpu_main_thread);
 	printf("Workload: \t\t%s\n", g.workload->w_name);
-	printf("Workload mem: \t\t%"PRIu64" (KiB)\n",
+	printf("Workload mem: \t\t%"PRIu64" (KiB)%s\n",
 	       (g.workload->w_flags & WORK_NEED_MEM) ?
-	       (g.workload_mem_size / 1024) : 0);
+	       (g.workload_mem_size / 1024) : 0,
+	       g.hugepage ? " (huge pages)" : "");
 	printf("Preheat cores: \t\t%d\n", g.single_preheat_thread ?
 	       1 : g.n_threads_total);
 	printf("\n");
 }
 
-static void record_bias(struct thread *t)
+static void record_bias(struct thread **t)
 {
 	int i;
 	uint64_t bias = (uint64_t)-1;
@@ -775,8 +1509,8 @@ static void record_bias(struct thread *t)
 
 	/* Record the min value of minlat on all the threads */
 	for (i = 0; i < g.n_threads; ++i) {
-		if (t[i].minlat < bias)
-			bias = t[i].minlat;
+		if (t[i]->minlat < bias)
+			bias = t[i]->minlat;
 	}
 	g.bias = bias;
 	printf("Global bias set to %" PRId64 " (us)\n", bias);
@@ -784,9 +1518,10 @@ static void record_bias(struct thread *t)
 
 int main(int argc, char *argv[])
 {
-	struct thread *threads;
-	int i, n_cores;
+	struct thread **threads, *t;
+	int i, cpu, n_cores;
 	struct bitmask *cpu_set = NULL;
+	struct cpu_plan *plan;
 
 #ifdef FRC_MISSING
 	printf("This architecture is not yet supported. "
@@ -811,6 +1546,19 @@ int main(int argc, char *argv[])
 	printf("oslat V %1.2f\n", VERSION);
 	parse_options(argc, argv);
 
+	if (!g.workload_mem_set && g.workload->w_mem_size)
+		g.workload_mem_size = g.workload->w_mem_size();
+	/* The vector kernels work on whole cache lines */
+	g.workload_mem_size &= ~63ULL;
+	if ((g.workload->w_flags & WORK_NEED_MEM) && !g.workload_mem_size) {
+		printf("Workload memory size needs to be at least 64 bytes.\n");
+		exit(1);
+	}
+	if (g.hugepage)
+		g.hugepage_size = hugepage_size();
+	if (g.ts_interval)
+		g.ts_nslots = (uint64_t)g.runtime * 1000 / g.ts_interval + 2;
+
 	TEST(mlockall(MCL_CURRENT | MCL_FUTURE) == 0);
 
 	if (!g.cpu_list)
@@ -819,15 +1567,24 @@ int main(int argc, char *argv[])
 	cpu_set = numa_parse_cpustring_all(g.cpu_list);
 	if (!cpu_set)
 		fatal("oslat: parse_cpumask failed.\n");
-	n_cores = numa_bitmask_weight(cpu_set);
+	/* The plan keeps only the CPUs of the list the policy allows */
+	plan = cpu_plan_create(g.placement, cpu_set);
+	if (!plan)
+		fatal("oslat: no CPU left for placement %s\n",
+		      cpu_plan_name(g.placement));
+	n_cores = plan->nr_cpus;
 
 	TEST(threads = calloc(1, n_cores * sizeof(threads[0])));
-	for (i = 0; n_cores && i < cpu_set->size; i++) {
-		if (numa_bitmask_isbitset(cpu_set, i) && move_to_core(i) == 0) {
-			threads[g.n_threads_total++].core_i = i;
-			n_cores--;
+	for (i = 0; i < n_cores; i++) {
+		cpu = plan->cpus[i];
+		if (move_to_core(cpu) == 0) {
+			/* the thread struct is hot, keep it on its node */
+			TEST(t = cpu_local_alloc(sizeof(*t), cpu));
+			t->core_i = cpu;
+			threads[g.n_threads_total++] = t;
 		}
 	}
+	cpu_plan_free(plan);
 
 	if (numa_bitmask_isbitset(cpu_set, 0) && g.rtprio)
 		printf("WARNING: Running SCHED_FIFO workload on CPU 0 may hang the thread\n");
@@ -858,6 +1615,9 @@ int main(int argc, char *argv[])
 	g.n_threads = g.n_threads_total;
 	run_expt(threads, g.runtime, false);
 
+	if (*g.exportspec)
+		export_stop();
+
 	if (!g.quiet)
 		printf("Test completed.\n\n");
 
@@ -871,7 +1631,7 @@ int main(int argc, char *argv[])
 		g.cpu_list = NULL;
 	}
 
-	disable_trace_mark();
+	tracemark_close();
 
 	return 0;
 }
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * oslat_buckets.h - the 1 us buckets of oslat
+ *
+ * Shared with rt-bench, which measures the cost of insert_bucket(), run
+ * after every loop of the workload.
+ */
+#ifndef __OSLAT_BUCKETS_H
+#define __OSLAT_BUCKETS_H
+
+#include <stdint.h>
+
+#include "rt-tsc.h"
+
+/*
+ * Bucket of a loop time of value cycles: (value - bias) / cpu_mhz, with
+ * us_mult the rounded reciprocal of cpu_mhz for tsc_mul_shift().
+ */
+static inline uint64_t oslat_bucket_index(uint64_t value, uint64_t bias,
+					  uint64_t us_mult,
+					  unsigned int cpu_mhz)
+{
+	uint64_t index;
+
+	/*
+	 * Values below the bias should hardly happen, if they do they go to
+	 * the smallest bucket, which is 1us.
+	 */
+	value = value > bias ? value - bias : 0;
+	index = tsc_mul_shift(value, us_mult);
+	/*
+	 * The rounded reciprocal can be one us off for large values, fix
+	 * the index up to value / cpu_mhz without a division or a branch.
+	 */
+	index -= index * cpu_mhz > value;
+	index += (index + 1) * cpu_mhz <= value;
+
+	return index;
+}
+
+/* buckets has last_bucket + 1 entries */
+static inline void oslat_bucket_add(uint64_t *buckets, uint64_t last_bucket,
+				    uint64_t *overflow_sum, uint64_t index)
+{
+	/* Too big the jitter; put into the last bucket and keep the extra us */
+	*overflow_sum += index > last_bucket ? index - last_bucket - 1 : 0;
+	index = index < last_bucket ? index : last_bucket;
+
+	buckets[index]++;
+}
+
+#endif	/* __OSLAT_BUCKETS_H */
@@ -48,6 +48,8 @@
 #include "rt-sched.h"
 #include "rt-utils.h"
 #include "rt-error.h"
+#include "rt-numa.h"
+#include "rt-histogram.h"
 
 /* test timeout */
 #define TIMEOUT 2
@@ -123,6 +125,15 @@ int uniprocessor = 0;
 /* lock all memory */
 int lockall = 0;
 
+/* CPUs the groups are spread over, NULL for all but the admin CPU */
+struct bitmask *affinity_mask = NULL;
+
+/* libnuma is usable, group state is allocated node local */
+int numa = 0;
+
+/* --placement policy for the group CPUs, -1 for round robin */
+int placement = -1;
+
 #define NUM_TEST_THREADS 3
 #define NUM_ADMIN_THREADS 1
 
@@ -185,7 +196,22 @@ struct group_parameters {
 	/* total watchdog hits */
 	int watchdog_hits;
 
-} *groups;
+	/* memory node of cpu, -1 without NUMA support */
+	int node;
+	size_t alloc_size;
+
+	/*
+	 * Time the high priority thread was blocked in the mutex, i.e.
+	 * from the boost of the low priority thread until the mutex was
+	 * handed over, in ns. Only written by the high priority thread.
+	 */
+	unsigned long boosts;
+	uint64_t boost_min;
+	uint64_t boost_max;
+	double boost_sum;
+	struct histogram hist;
+
+} **groups;
 
 /* number of consecutive watchdog hits before quitting */
 #define WATCHDOG_LIMIT 5
@@ -202,6 +228,7 @@ void *watchdog(void *arg);
 int setup_thread_attr(pthread_attr_t * attr, struct sched_attr * sa,
 		      cpu_set_t * mask);
 int set_cpu_affinity(cpu_set_t * test_mask, cpu_set_t * admin_mask);
+struct cpu_plan *plan_test_cpus(cpu_set_t *test_mask);
 void process_command_line(int argc, char **argv);
 void usage(int error);
 int block_signals(void);
@@ -210,6 +237,9 @@ void set_shutdown_flag(void);
 int initialize_group(struct group_parameters *group);
 int create_group(struct group_parameters *group);
 unsigned long total_inversions(void);
+uint64_t max_boost(void);
+struct group_parameters *alloc_group(int id, long cpu);
+void free_groups(void);
 void banner(void);
 void summary(void);
 void write_stats(FILE *f, void *data);
@@ -227,6 +257,7 @@ int main(int argc, char **argv)
 	int retval = FAILURE;
 	int core;
 	int nthreads;
+	struct cpu_plan *plan = NULL;
 
 	/* Make sure we see all message, even those on stdout.  */
 	setvbuf(stdout, NULL, _IONBF, 0);
@@ -240,6 +271,8 @@ int main(int argc, char **argv)
 
 	/* process command line arguments */
 	rt_init(argc, argv);
+	/* -a parses its CPU set with libnuma */
+	numa = numa_initialize();
 	process_command_line(argc, argv);
 
 	/* set default sched attributes */
@@ -263,7 +296,7 @@ int main(int argc, char **argv)
 	block_signals();
 
 	/* allocate our groups array */
-	groups = calloc(ngroups, sizeof(struct group_parameters));
+	groups = calloc(ngroups, sizeof(struct group_parameters *));
 	if (groups == NULL) {
 		pi_error("main: failed to allocate %d groups\n", ngroups);
 		return FAILURE;
@@ -283,17 +316,35 @@ int main(int argc, char **argv)
 	if (barrier_init(&all_threads_done, NULL, nthreads, "all_threads_done"))
 		return FAILURE;
 
+	/* --placement: group N runs on CPU N of the plan over the test CPUs */
+	if (placement >= 0) {
+		plan = plan_test_cpus(&test_cpu_mask);
+		if (!plan) {
+			pi_error("no test CPU left for placement %s\n",
+				 cpu_plan_name(placement));
+			return FAILURE;
+		}
+	}
+
 	/* create the groups */
 	pi_info("Creating %d test groups\n", ngroups);
 	for (core = 0; core < num_processors; core++)
 		if (CPU_ISSET(core, &test_cpu_mask))
 			break;
 	for (i = 0; i < ngroups; i++) {
-		groups[i].id = i;
-		groups[i].cpu = core++;
-		if (core >= num_processors)
-			core = 0;
-		if (create_group(&groups[i]) != SUCCESS)
+		if (plan)
+			core = cpu_plan_cpu(plan, i);
+		groups[i] = alloc_group(i, core);
+		if (groups[i] == NULL) {
+			pi_error("main: failed to allocate group %d\n", i);
+			return FAILURE;
+		}
+		/* with a CPU set the groups are sharded over its CPUs only */
+		do {
+			if (++core >= num_processors)
+				core = 0;
+		} while (affinity_mask && !CPU_ISSET(core, &test_cpu_mask));
+		if (create_group(groups[i]) != SUCCESS)
 			return FAILURE;
 	}
 
@@ -344,6 +395,9 @@ int main(int argc, char **argv)
 	if (strlen(jsonfile) != 0)
 		rt_write_json(jsonfile, retval, write_stats, NULL);
 
+	if (retval == SUCCESS)
+		free_groups();
+	cpu_plan_free(plan);
 	if (lockall)
 		munlockall();
 	exit(retval);
@@ -400,6 +454,21 @@ setup_thread_attr(pthread_attr_t * attr, struct sched_attr * sa,
 	return SUCCESS;
 }
 
+struct cpu_plan *plan_test_cpus(cpu_set_t *test_mask)
+{
+	struct bitmask *mask = numa_allocate_cpumask();
+	struct cpu_plan *plan;
+	int i;
+
+	for (i = 0; i < num_processors; i++)
+		if (CPU_ISSET(i, test_mask))
+			numa_bitmask_setbit(mask, i);
+	plan = cpu_plan_create(placement, mask);
+	numa_bitmask_free(mask);
+
+	return plan;
+}
+
 int set_cpu_affinity(cpu_set_t * test_mask, cpu_set_t * admin_mask)
 {
 	int status, i, admin_proc;
@@ -429,7 +498,15 @@ int set_cpu_affinity(cpu_set_t * test_mask, cpu_set_t * admin_mask)
 		pi_error("No schedulable CPU found for main!\n");
 		return FAILURE;
 	}
-	admin_proc = i;
+	/* keep main off the test CPUs if the set leaves one for it */
+	for (admin_proc = i; affinity_mask && i < num_processors; i++) {
+		if (CPU_ISSET(i, &current_mask) &&
+		    !numa_bitmask_isbitset(affinity_mask, i)) {
+			admin_proc = i;
+			break;
+		}
+	}
+	i = admin_proc;
 	CPU_ZERO(admin_mask);
 	CPU_SET(admin_proc, admin_mask);
 	status = sched_setaffinity(0, sizeof(cpu_set_t), admin_mask);
@@ -442,6 +519,18 @@ int set_cpu_affinity(cpu_set_t * test_mask, cpu_set_t * admin_mask)
 
 	/* Set test affinity so that tests run on the non-admin processors */
 	CPU_ZERO(test_mask);
+	if (affinity_mask) {
+		for (i = 0; i < num_processors; i++)
+			if (numa_bitmask_isbitset(affinity_mask, i))
+				CPU_SET(i, test_mask);
+		if (CPU_COUNT(test_mask) == 0) {
+			pi_error("no online CPU in the affinity set\n");
+			return FAILURE;
+		}
+		pi_info("Test threads running on %d processors of the affinity set\n",
+			CPU_COUNT(test_mask));
+		return SUCCESS;
+	}
 	for (i = admin_proc + 1; i < num_processors; i++)
 		CPU_SET(i, test_mask);
 
@@ -460,7 +549,7 @@ void watchdog_clear(void)
 {
 	int i;
 	for (i = 0; i < ngroups; i++)
-		groups[i].watchdog = 0;
+		groups[i]->watchdog = 0;
 }
 
 /* check for zero watchdog counters */
@@ -471,7 +560,7 @@ int watchdog_check(void)
 	struct group_parameters *g;
 
 	for (i = 0; i < ngroups; i++) {
-		g = &groups[i];
+		g = groups[i];
 		if (g->watchdog == 0) {
 			/* don't report deadlock if group is finished */
 			if (g->inversions == g->total)
@@ -549,8 +638,9 @@ void *reporter(void *arg)
 			pthread_mutex_lock(&shutdown_mtx);
 			if (shutdown == 0) {
 				fputs(UP_ONE, stdout);
-				printf("Current Inversions: %lu\n",
-						total_inversions());
+				printf("Current Inversions: %lu, Max boost latency: %"
+				       PRIu64 " ns\n", total_inversions(),
+				       max_boost());
 			}
 		}
 		pthread_mutex_unlock(&shutdown_mtx);
@@ -839,6 +929,20 @@ void *med_priority(void *arg)
 	return NULL;
 }
 
+/* one sample of the blocked time of the high priority thread */
+static void account_boost(struct group_parameters *p, int64_t ns)
+{
+	uint64_t diff = ns < 0 ? 0 : ns;
+
+	if (!p->boosts || diff < p->boost_min)
+		p->boost_min = diff;
+	if (diff > p->boost_max)
+		p->boost_max = diff;
+	p->boost_sum += diff;
+	p->boosts++;
+	hist_sample(&p->hist, diff);
+}
+
 void *high_priority(void *arg)
 {
 	int status;
@@ -848,6 +952,7 @@ void *high_priority(void *arg)
 	pthread_barrier_t *loop_barr = &p->loop_barr;
 	pthread_mutex_t *loop_mtx = &p->loop_mtx;
 	int *loop = &p->loop;
+	struct timespec blocked, acquired;
 	cpu_set_t cpu_mask;
 	int i;
 
@@ -939,8 +1044,11 @@ void *high_priority(void *arg)
 			return NULL;
 		}
 		pi_debug("high_priority[%d]: locking mutex\n", p->id);
+		clock_gettime(CLOCK_MONOTONIC, &blocked);
 		pthread_mutex_lock(&p->mutex);
+		clock_gettime(CLOCK_MONOTONIC, &acquired);
 		pi_debug("high_priority[%d]: got mutex\n", p->id);
+		account_boost(p, calcdiff_ns(acquired, blocked));
 
 		pi_debug("high_priority[%d]: unlocking mutex\n", p->id);
 		pthread_mutex_unlock(&p->mutex);
@@ -983,16 +1091,21 @@ void usage(int error)
 	printf("pi_stress V %1.2f\n", VERSION);
 	printf("Usage:\n"
 	       "pi_stress <options>\n\n"
+	       "-a CPUSET --affinity=CPUSET shard the groups over the CPUs in CPUSET,\n"
+	       "                           one group per CPU (default: all but the first)\n"
 	       "-d       --debug           turn on debug prints\n"
 	       "-D TIME  --duration=TIME   length of test run in seconds (default is infinite)\n"
 	       "                           Append 'm', 'h', or 'd'\n"
 	       "                           to specify minutes, hours or days.\n"
 	       "-g N     --groups=N        set the number of inversion groups\n"
+	       "                           (default: one per test CPU)\n"
 	       "-h       --help            print this message\n"
 	       "-i INV   --inversions=INV  number of inversions per group (default is infinite)\n"
 	       "         --json=FILENAME   write final results into FILENAME, JSON formatted\n"
 	       "-m       --mlockall        lock current and future memory\n"
 	       "-p       --prompt          prompt before starting the test\n"
+	       "         --placement=POL   order the test CPUs of the groups by topology:\n"
+	       "                           rr, core, nosmt, llc or cross-node\n"
 	       "-q       --quiet           suppress running output\n"
 	       "-r       --rr              use SCHED_RR for test threads [SCHED_FIFO]\n"
 	       "-s OPTS  --sched OPTS      scheduling options per thread type:\n"
@@ -1066,6 +1179,54 @@ void set_shutdown_flag(void)
 	pthread_mutex_unlock(&shutdown_mtx);
 }
 
+/*
+ * Allocate the state of a group together with its histogram on the
+ * memory node of the group's CPU. Only the three threads of the group
+ * touch it while the test runs, so nothing crosses the interconnect.
+ */
+struct group_parameters *alloc_group(int id, long cpu)
+{
+	struct group_parameters *group;
+	struct histogram hist;
+	size_t offset, size;
+	int node = numa ? numa_node_of_cpu(cpu) : -1;
+
+	if (hist_init(&hist, HIST_DIGITS_DEFAULT, HIST_RANGE_BITS_NS))
+		return NULL;
+
+	offset = (sizeof(*group) + 63) & ~63UL;
+	size = offset + hist_size(&hist);
+	group = node_local_alloc(size, node);
+	if (group == NULL)
+		return NULL;
+
+	group->id = id;
+	group->cpu = cpu;
+	group->node = node;
+	group->alloc_size = size;
+	group->hist = hist;
+	group->hist.buckets = (unsigned long *)((char *)group + offset);
+
+	return group;
+}
+
+/* Join the threads, which are past the done barrier, and free the groups */
+void free_groups(void)
+{
+	struct group_parameters *g;
+	int i;
+
+	for (i = 0; i < ngroups; i++) {
+		g = groups[i];
+		pthread_join(g->low_tid, NULL);
+		pthread_join(g->med_tid, NULL);
+		pthread_join(g->high_tid, NULL);
+		node_local_free(g, g->alloc_size, g->node);
+	}
+	free(groups);
+	groups = NULL;
+}
+
 /* set up a test group */
 int initialize_group(struct group_parameters *group)
 {
@@ -1281,15 +1442,18 @@ int process_sched_line(const char *arg)
 }
 
 enum option_values {
-	OPT_DEBUG=1, OPT_DURATION, OPT_GROUPS, OPT_HELP, OPT_INVERSIONS,
-	OPT_JSON, OPT_MLOCKALL, OPT_PROMPT, OPT_QUIET, OPT_RR, OPT_SCHED,
-	OPT_UNIPROCESSOR, OPT_VERBOSE, OPT_VERSION,
+	OPT_AFFINITY=1, OPT_DEBUG, OPT_DURATION, OPT_GROUPS, OPT_HELP, OPT_INVERSIONS,
+	OPT_JSON, OPT_MLOCKALL, OPT_PLACEMENT, OPT_PROMPT, OPT_QUIET, OPT_RR,
+	OPT_SCHED, OPT_UNIPROCESSOR, OPT_VERBOSE, OPT_VERSION,
 };
 
 void process_command_line(int argc, char **argv)
 {
+	int groups_set = 0;
+
 	for (;;) {
 		struct option options[] = {
+			{"affinity",		required_argument,	NULL, OPT_AFFINITY},
 			{"debug",		no_argument,		NULL, OPT_DEBUG},
 			{"duration",		required_argument,	NULL, OPT_DURATION},
 			{"groups",		required_argument,	NULL, OPT_GROUPS},
@@ -1297,6 +1461,7 @@ void process_command_line(int argc, char **argv)
 			{"inversions",		required_argument,	NULL, OPT_INVERSIONS},
 			{"json",		required_argument,	NULL, OPT_JSON},
 			{"mlockall",		no_argument,		NULL, OPT_MLOCKALL},
+			{"placement",		required_argument,	NULL, OPT_PLACEMENT},
 			{"prompt",		no_argument,		NULL, OPT_PROMPT},
 			{"quiet",		no_argument,		NULL, OPT_QUIET},
 			{"rr",			no_argument,		NULL, OPT_RR},
@@ -1307,10 +1472,18 @@ void process_command_line(int argc, char **argv)
 			{NULL, 0, NULL, 0},
 		};
 
-		int c = getopt_long(argc, argv, "+hD:vqi:g:rs:pdVum", options, NULL);
+		int c = getopt_long(argc, argv, "+a:hD:vqi:g:rs:pdVum", options, NULL);
 		if (c == -1)
 			break;
 		switch (c) {
+		case OPT_AFFINITY:
+		case 'a':
+			if (parse_cpumask(optarg, num_processors, &affinity_mask) ||
+			    !affinity_mask) {
+				pi_error("invalid CPU set '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case OPT_DEBUG:
 		case 'd':
 			debugging = 1;
@@ -1322,6 +1495,7 @@ void process_command_line(int argc, char **argv)
 		case OPT_GROUPS:
 		case 'g':
 			ngroups = strtol(optarg, NULL, 10);
+			groups_set = 1;
 			if (ngroups > num_processors) {
 					pi_error("the number of groups cannot exceed "
 					 "the number of online processors (%ld)\n",
@@ -1346,6 +1520,14 @@ void process_command_line(int argc, char **argv)
 		case 'm':
 			lockall = 1;
 			break;
+		case OPT_PLACEMENT:
+			placement = cpu_plan_policy(optarg);
+			if (placement < 0) {
+				pi_error("invalid placement '%s', use one of "
+					 CPU_PLAN_POLICIES "\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case OPT_PROMPT:
 		case 'p':
 			prompt = 1;
@@ -1382,6 +1564,11 @@ void process_command_line(int argc, char **argv)
 			break;
 		}
 	}
+
+	if (affinity_mask && !groups_set) {
+		ngroups = numa_bitmask_weight(affinity_mask);
+		pi_info("number of groups set to %d\n", ngroups);
+	}
 }
 
 /* total the number of inversions that have been performed */
@@ -1391,10 +1578,78 @@ unsigned long total_inversions(void)
 	unsigned long total = 0;
 
 	for (i = 0; i < ngroups; i++)
-		total += groups[i].total;
+		total += groups[i]->total;
 	return total;
 }
 
+/* worst blocked time of any high priority thread so far */
+uint64_t max_boost(void)
+{
+	int i;
+	uint64_t max = 0;
+
+	for (i = 0; i < ngroups; i++)
+		if (groups[i]->boost_max > max)
+			max = groups[i]->boost_max;
+	return max;
+}
+
+static const double boost_percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+
+/* fold the boost latencies of all groups into one histogram */
+static struct group_parameters *merge_boosts(void)
+{
+	struct group_parameters *all;
+	struct group_parameters *g;
+	int i;
+
+	all = calloc(1, sizeof(*all));
+	if (all == NULL)
+		return NULL;
+	all->hist = groups[0]->hist;
+	if (hist_alloc(&all->hist)) {
+		free(all);
+		return NULL;
+	}
+
+	for (i = 0; i < ngroups; i++) {
+		g = groups[i];
+		if (!g->boosts)
+			continue;
+		if (!all->boosts || g->boost_min < all->boost_min)
+			all->boost_min = g->boost_min;
+		if (g->boost_max > all->boost_max)
+			all->boost_max = g->boost_max;
+		all->boost_sum += g->boost_sum;
+		all->boosts += g->boosts;
+		hist_merge(&all->hist, &g->hist);
+	}
+	return all;
+}
+
+static void free_boosts(struct group_parameters *all)
+{
+	hist_free(&all->hist);
+	free(all);
+}
+
+static void print_boosts(const char *name, struct group_parameters *g)
+{
+	uint64_t pct[ARRAY_SIZE(boost_percentiles)];
+	unsigned int i;
+
+	if (!g->boosts)
+		return;
+
+	hist_tail_percentiles(&g->hist, g->boosts, g->boost_max,
+			      boost_percentiles, pct, ARRAY_SIZE(pct));
+	printf("%s Min %" PRIu64 ", Avg %.0f", name, g->boost_min,
+	       g->boost_sum / g->boosts);
+	for (i = 0; i < ARRAY_SIZE(pct); i++)
+		printf(", P%g %" PRIu64, boost_percentiles[i], pct[i]);
+	printf(", Max %" PRIu64 "\n", g->boost_max);
+}
+
 void print_sched_attr(const char *name, struct sched_attr * sa)
 {
 	printf("    %6s thread", name);
@@ -1443,15 +1698,67 @@ void summary(void)
 {
 	time_t interval = finish - start;
 	struct tm *t = gmtime(&interval);
+	struct group_parameters *all;
+	char name[32];
+	int i;
 
 	printf("Total inversion performed: %lu\n", total_inversions());
 	printf("Test Duration: %d days, %d hours, %d minutes, %d seconds\n",
 	       t->tm_yday, t->tm_hour, t->tm_min, t->tm_sec);
+
+	all = merge_boosts();
+	if (all == NULL)
+		return;
+	printf("PI boost latency (ns):\n");
+	print_boosts("  All:", all);
+	for (i = 0; verbose && i < ngroups; i++) {
+		snprintf(name, sizeof(name), "  G%d (CPU%ld):", i, groups[i]->cpu);
+		print_boosts(name, groups[i]);
+	}
+	free_boosts(all);
+}
+
+static void write_boosts(FILE *f, struct group_parameters *g, int indent)
+{
+	fprintf(f, "%*s\"samples\": %lu,\n", indent, "", g->boosts);
+	fprintf(f, "%*s\"min\": %" PRIu64 ",\n", indent, "",
+		g->boosts ? g->boost_min : 0);
+	fprintf(f, "%*s\"avg\": %.2f,\n", indent, "",
+		g->boosts ? g->boost_sum / g->boosts : 0.0);
+	fprintf(f, "%*s\"max\": %" PRIu64 ",\n", indent, "", g->boost_max);
+	fprintf(f, "%*s\"percentiles\": ", indent, "");
+	hist_print_percentiles_json(f, &g->hist, g->boost_max, indent);
+	fprintf(f, "\n");
 }
 
 void write_stats(FILE *f, void *data)
 {
-	fprintf(f, "  \"inversion\": %lu\n", total_inversions());
+	struct group_parameters *all = merge_boosts();
+	struct group_parameters *g;
+	int i;
+
+	fprintf(f, "  \"inversion\": %lu,\n", total_inversions());
+	fprintf(f, "  \"resolution_in_ns\": 1,\n");
+	if (all) {
+		fprintf(f, "  \"boost_latency\": {\n");
+		fprintf(f, "    \"histogram\": ");
+		hist_print_json(f, &all->hist, 4);
+		fprintf(f, ",\n");
+		write_boosts(f, all, 4);
+		fprintf(f, "  },\n");
+		free_boosts(all);
+	}
+	fprintf(f, "  \"group\": {\n");
+	for (i = 0; i < ngroups; i++) {
+		g = groups[i];
+		fprintf(f, "    \"%d\": {\n", i);
+		fprintf(f, "      \"cpu\": %ld,\n", g->cpu);
+		fprintf(f, "      \"node\": %d,\n", g->node);
+		fprintf(f, "      \"inversions\": %lu,\n", g->total);
+		write_boosts(f, g, 6);
+		fprintf(f, "    }%s\n", i == ngroups - 1 ? "" : ",");
+	}
+	fprintf(f, "  }\n");
 }
 
 int
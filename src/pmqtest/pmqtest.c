@@ -22,198 +22,278 @@
 #include <utmpx.h>
 #include <mqueue.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <inttypes.h>
+#include <sys/epoll.h>
 
 #include "rt-utils.h"
 #include "rt-get_cpu.h"
 #include "rt-error.h"
+#include "rt-numa.h"
+#include "rt-ipc.h"
 
 #define SYNCMQ_NAME "/syncmsg%d"
 #define TESTMQ_NAME "/testmsg%d"
 #define MSG_SIZE 8
 
+#define PRIO_MIX_MAX 8
+
 char *syncmsg = "Syncing";
 char *testmsg = "Testing";
 
+/* How a receiver waits for the test queue */
 enum {
-	AFFINITY_UNSPECIFIED,
-	AFFINITY_SPECIFIED,
-	AFFINITY_USEALL
+	WAIT_RECEIVE,
+	WAIT_EPOLL,
+	WAIT_NOTIFY,
 };
 
+static const char * const wait_names[] = { "receive", "epoll", "notify" };
+
+static int msgsize = MSG_SIZE;
+static int wait_mode = WAIT_RECEIVE;
+static unsigned int prio_mix[PRIO_MIX_MAX] = { 1 };
+static int nprios = 1;
+static int producers;
+static int depth = 10;
+static char *testbuf;
+
 struct params {
-	int num;
-	int cpu;
-	int priority;
-	int affinity;
-	int sender;
-	int samples;
-	int max_cycles;
-	int tracelimit;
-	int tid;
-	int shutdown;
-	int stopped;
-	struct timespec delay;
-	unsigned int mindiff, maxdiff;
-	double sumdiff;
-	struct timeval sent, received, diff;
-	pthread_t threadid;
+	struct ipc_params ipc;
 	int timeout;
 	int forcetimeout;
 	int timeoutcount;
 	mqd_t syncmq, testmq;
+	unsigned int seq;
+	int epfd;
+	sem_t notified;
+	int notify_ret;
+	pthread_attr_t attr;
 	char recvsyncmsg[MSG_SIZE];
-	char recvtestmsg[MSG_SIZE];
-	struct params *neighbor;
+	char *recvtestmsg;
 };
 
-void *pmqthread(void *param)
+/* Let notification threads run like the receiver they stand in for */
+static void notify_attr(pthread_attr_t *attr, int cpu, int prio)
 {
-	int mustgetcpu = 0;
-	struct params *par = param;
-	cpu_set_t mask;
-	int policy = SCHED_FIFO;
 	struct sched_param schedp;
-	struct timespec ts;
-
-	memset(&schedp, 0, sizeof(schedp));
-	schedp.sched_priority = par->priority;
-	sched_setscheduler(0, policy, &schedp);
+	cpu_set_t mask;
 
-	if (par->cpu != -1) {
+	pthread_attr_init(attr);
+	if (prio) {
+		memset(&schedp, 0, sizeof(schedp));
+		schedp.sched_priority = prio;
+		pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+		pthread_attr_setschedparam(attr, &schedp);
+	}
+	if (cpu != -1) {
 		CPU_ZERO(&mask);
-		CPU_SET(par->cpu, &mask);
-		if (sched_setaffinity(0, sizeof(mask), &mask) == -1)
-			fprintf(stderr,	"WARNING: Could not set CPU affinity "
-				"to CPU #%d\n", par->cpu);
-	} else
-		mustgetcpu = 1;
+		CPU_SET(cpu, &mask);
+		pthread_attr_setaffinity_np(attr, sizeof(mask), &mask);
+	}
+}
 
-	par->tid = gettid();
+static void pmq_notified(union sigval sv)
+{
+	struct params *p = sv.sival_ptr;
+
+	/* ... Notified: End of latency measurement */
+	p->ipc.stamp = ipc_now();
+	p->notify_ret = mq_receive(p->testmq, p->recvtestmsg, msgsize, NULL) !=
+		msgsize;
+	if (p->notify_ret)
+		perror("could not receive test message");
+	sem_post(&p->notified);
+}
 
-	while (!par->shutdown) {
-		if (par->sender) {
+static int pmq_arm(struct params *p)
+{
+	struct sigevent sev;
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD;
+	sev.sigev_notify_function = pmq_notified;
+	sev.sigev_notify_attributes = &p->attr;
+	sev.sigev_value.sival_ptr = p;
+	if (mq_notify(p->testmq, &sev)) {
+		perror("mq_notify");
+		return 1;
+	}
+	return 0;
+}
 
-			/* Optionally force receiver timeout */
-			if (par->forcetimeout) {
-				struct timespec senddelay;
+static int pmq_init(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	struct epoll_event ev;
 
-				senddelay.tv_sec = par->forcetimeout;
-				senddelay.tv_nsec = 0;
-				clock_nanosleep(CLOCK_MONOTONIC, 0, &senddelay, NULL);
-			}
+	if (par->sender || wait_mode != WAIT_EPOLL)
+		return 0;
 
-			/* Send message: Start of latency measurement ... */
-			gettimeofday(&par->sent, NULL);
-			if (mq_send(par->testmq, testmsg, strlen(testmsg), 1) != 0) {
-				fprintf(stderr, "could not send test message\n");
-				par->shutdown = 1;
-			}
-			par->samples++;
-			if (par->max_cycles && par->samples >= par->max_cycles)
-				par->shutdown = 1;
-			if (mustgetcpu)
-				par->cpu = get_cpu();
-			/* Wait until receiver ready */
-			if (par->timeout) {
-				clock_gettime(CLOCK_REALTIME, &ts);
-				ts.tv_sec += par->timeout;
-
-				if (mq_timedreceive(par->syncmq, par->recvsyncmsg, MSG_SIZE, NULL, &ts)
-				    != strlen(syncmsg)) {
-					fprintf(stderr, "could not receive sync message\n");
-					par->shutdown = 1;
-				}
-			}
-			if (mq_receive(par->syncmq, par->recvsyncmsg, MSG_SIZE, NULL) !=
-			    strlen(syncmsg)) {
-				perror("could not receive sync message");
-				par->shutdown = 1;
+	p->epfd = epoll_create1(0);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (p->epfd < 0 || epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->testmq, &ev)) {
+		perror("epoll");
+		return 1;
+	}
+	return 0;
+}
+
+static int pmq_prepare(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	struct timespec senddelay;
+
+	/* Optionally force receiver timeout */
+	if (p->forcetimeout) {
+		senddelay.tv_sec = p->forcetimeout;
+		senddelay.tv_nsec = 0;
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &senddelay, NULL);
+	}
+	return 0;
+}
+
+static int pmq_send(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+
+	if (mq_send(p->testmq, testbuf, msgsize,
+		    prio_mix[p->seq++ % nprios]) != 0) {
+		fprintf(stderr, "could not send test message\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int pmq_sync(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	struct timespec ts;
+	int ret = 0;
+
+	/* Wait until receiver ready */
+	if (p->timeout) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += p->timeout;
+
+		if (mq_timedreceive(p->syncmq, p->recvsyncmsg, MSG_SIZE, NULL, &ts)
+		    != strlen(syncmsg)) {
+			fprintf(stderr, "could not receive sync message\n");
+			ret = 1;
+		}
+	} else if (mq_receive(p->syncmq, p->recvsyncmsg, MSG_SIZE, NULL) !=
+	    strlen(syncmsg)) {
+		perror("could not receive sync message");
+		ret = 1;
+	}
+	if (!ret && strcmp(syncmsg, p->recvsyncmsg)) {
+		fprintf(stderr, "ERROR: Sync message mismatch detected\n");
+		fprintf(stderr, "  %s != %s\n", syncmsg, p->recvsyncmsg);
+		ret = 1;
+	}
+	return ret;
+}
+
+static int pmq_receive(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	struct epoll_event ev;
+	struct timespec ts;
+
+	if (wait_mode == WAIT_NOTIFY) {
+		while (sem_wait(&p->notified)) {
+			if (errno != EINTR) {
+				perror("sem_wait");
+				return 1;
 			}
-			if (!par->shutdown && strcmp(syncmsg, par->recvsyncmsg)) {
-				fprintf(stderr, "ERROR: Sync message mismatch detected\n");
-				fprintf(stderr, "  %s != %s\n", syncmsg, par->recvsyncmsg);
-				par->shutdown = 1;
+		}
+		if (p->notify_ret)
+			return 1;
+	} else if (wait_mode == WAIT_EPOLL) {
+		while (epoll_wait(p->epfd, &ev, 1, -1) != 1) {
+			if (errno != EINTR) {
+				perror("epoll_wait");
+				return 1;
 			}
-		} else {
-			/* Receiver */
-			if (par->timeout) {
-				clock_gettime(CLOCK_REALTIME, &ts);
-				par->timeoutcount = 0;
-				ts.tv_sec += par->timeout;
-				do {
-					if (mq_timedreceive(par->testmq, par->recvtestmsg,
-					    MSG_SIZE, NULL, &ts) != strlen(testmsg)) {
-						if (!par->forcetimeout || errno != ETIMEDOUT) {
-							perror("could not receive test message");
-							par->shutdown = 1;
-							break;
-						}
-						if (errno == ETIMEDOUT) {
-							par->timeoutcount++;
-							clock_gettime(CLOCK_REALTIME, &ts);
-							ts.tv_sec += par->timeout;
-						}
-					} else
-						break;
-				} while (1);
-			} else {
-				if (mq_receive(par->testmq, par->recvtestmsg, MSG_SIZE, NULL) !=
-				    strlen(testmsg)) {
-					perror("could not receive test message");
-					par->shutdown = 1;
-				}
+		}
+		/* ... Readable: End of latency measurement */
+		par->stamp = ipc_now();
+		if (mq_receive(p->testmq, p->recvtestmsg, msgsize, NULL) !=
+		    msgsize) {
+			perror("could not receive test message");
+			return 1;
+		}
+	} else if (p->timeout) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		p->timeoutcount = 0;
+		ts.tv_sec += p->timeout;
+		do {
+			if (mq_timedreceive(p->testmq, p->recvtestmsg,
+			    msgsize, NULL, &ts) == msgsize)
+				break;
+			if (!p->forcetimeout || errno != ETIMEDOUT) {
+				perror("could not receive test message");
+				return 1;
 			}
-			/* ... Received the message: End of latency measurement */
-			gettimeofday(&par->received, NULL);
+			p->timeoutcount++;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += p->timeout;
+		} while (1);
+	} else {
+		if (mq_receive(p->testmq, p->recvtestmsg, msgsize, NULL) !=
+		    msgsize) {
+			perror("could not receive test message");
+			return 1;
+		}
+	}
 
-			if (!par->shutdown && strcmp(testmsg, par->recvtestmsg)) {
-				fprintf(stderr, "ERROR: Test message mismatch detected\n");
-				fprintf(stderr, "  %s != %s\n", testmsg, par->recvtestmsg);
-				par->shutdown = 1;
-			}
-			par->samples++;
-			timersub(&par->received, &par->neighbor->sent,
-			    &par->diff);
-
-			if (par->diff.tv_usec < par->mindiff)
-				par->mindiff = par->diff.tv_usec;
-			if (par->diff.tv_usec > par->maxdiff)
-				par->maxdiff = par->diff.tv_usec;
-			par->sumdiff += (double) par->diff.tv_usec;
-			if (par->tracelimit && par->maxdiff > par->tracelimit) {
-				char tracing_enabled_file[MAX_PATH];
-
-				strcpy(tracing_enabled_file, get_debugfileprefix());
-				strcat(tracing_enabled_file, "tracing_on");
-				int tracing_enabled =
-				    open(tracing_enabled_file, O_WRONLY);
-				if (tracing_enabled >= 0) {
-					write(tracing_enabled, "0", 1);
-					close(tracing_enabled);
-				} else
-					fatal("Could not access %s\n", tracing_enabled_file);
-				par->shutdown = 1;
-				par->neighbor->shutdown = 1;
-			}
+	if (strcmp(testmsg, p->recvtestmsg)) {
+		fprintf(stderr, "ERROR: Test message mismatch detected\n");
+		fprintf(stderr, "  %s != %s\n", testmsg, p->recvtestmsg);
+		return 1;
+	}
+	return 0;
+}
 
-			if (par->max_cycles && par->samples >= par->max_cycles)
-				par->shutdown = 1;
-			if (mustgetcpu)
-				par->cpu = get_cpu();
-			clock_nanosleep(CLOCK_MONOTONIC, 0, &par->delay, NULL);
+static int pmq_ack(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
 
-			/* Tell receiver that we are ready for the next measurement */
-			if (mq_send(par->syncmq, syncmsg, strlen(syncmsg), 1) != 0) {
-				fprintf(stderr, "could not send sync message\n");
-				par->shutdown = 1;
-			}
-		}
+	if (wait_mode == WAIT_NOTIFY && pmq_arm(p))
+		return 1;
+
+	/* Tell receiver that we are ready for the next measurement */
+	if (mq_send(p->syncmq, syncmsg, strlen(syncmsg), 1) != 0) {
+		fprintf(stderr, "could not send sync message\n");
+		return 1;
 	}
-	par->stopped = 1;
-	return NULL;
+	return 0;
 }
 
+static void pmq_print(FILE *f, struct ipc_params *par)
+{
+	fprintf(f, "TO %d, ", ((struct params *)par)->timeoutcount);
+}
+
+static void pmq_json(FILE *f, struct ipc_params *par)
+{
+	fprintf(f, "        \"timeoutcount\": %d,\n",
+		((struct params *)par)->timeoutcount);
+}
+
+static const struct ipc_ops pmq_ops = {
+	.init		= pmq_init,
+	.prepare	= pmq_prepare,
+	.send		= pmq_send,
+	.sync		= pmq_sync,
+	.receive	= pmq_receive,
+	.ack		= pmq_ack,
+	.print		= pmq_print,
+	.json		= pmq_json,
+};
+
 static void display_help(int error)
 {
 	printf("pmqtest V %1.2f\n", VERSION);
@@ -225,15 +305,29 @@ static void display_help(int error)
 	       "                           with NUM pin all threads to the processor NUM\n"
 	       "-b USEC  --breaktrace=USEC send break trace command when latency > USEC\n"
 	       "-d DIST  --distance=DIST   distance of thread intervals in us default=500\n"
+	       "         --depth=NUM       queue depth with --producers, default=10\n"
 	       "-D TIME  --duration=TIME   specify a length for the test run.\n"
 	       "                           Append 'm', 'h', or 'd' to specify\n"
 	       "                           minutes, hours or days.\n"
+	       "         --export=SPEC     serve live stats in OpenMetrics format on the Unix\n"
+	       "                           socket unix:PATH or on localhost:PORT\n"
 	       "-f TO    --forcetimeout=TO force timeout of mq_timedreceive(), requires -T\n"
 	       "-h       --help            print this help message\n"
 	       "-i INTV  --interval=INTV   base interval of thread in us default=1000\n"
 	       "         --json=FILENAME   write final results into FILENAME, JSON formatted\n"
 	       "-l LOOPS --loops=LOOPS     number of loops: default=0(endless)\n"
+	       "                           with --producers messages per producer\n"
+	       "         --msgsize=BYTES   size of the test messages, default=8\n"
+	       "-N       --nsecs           print results in ns instead of us (default us)\n"
+	       "         --placement=POL   order the CPUs of the threads by topology, POL is\n"
+	       "                           rr, core, nosmt, llc or cross-node; the two\n"
+	       "                           sides of a pair get consecutive CPUs\n"
 	       "-p PRIO  --prio=PRIO       priority\n"
+	       "         --prio-mix=LIST   comma separated message priorities, used in\n"
+	       "                           turn, default=1\n"
+	       "         --producers=NUM   stream from NUM producers into every queue instead\n"
+	       "                           of ping-pong pairs, -i is the send interval then\n"
+	       "                           and -i 0 sends back to back\n"
 	       "-q       --quiet           print a summary only on exit\n"
 	       "-S       --smp             SMP testing: options -a -t and same priority\n"
 	       "                           of all threads\n"
@@ -242,7 +336,11 @@ static void display_help(int error)
 	       "                           without NUM, threads = max_cpus\n"
 	       "                           without -t default = 1\n"
 	       "-T TO    --timeout=TO      use mq_timedreceive() instead of mq_receive()\n"
-	       "                           with timeout TO in seconds\n");
+	       "                           with timeout TO in seconds\n"
+	       "         --wait=MODE       how receivers wait for a message:\n"
+	       "                           receive  block in mq_receive() (default)\n"
+	       "                           epoll    epoll_wait() on the queue descriptor\n"
+	       "                           notify   mq_notify() with SIGEV_THREAD\n");
 	exit(error);
 }
 
@@ -260,14 +358,47 @@ static int sameprio;
 static int timeout;
 static int forcetimeout;
 static int quiet;
+static int use_nsecs;
 static char jsonfile[MAX_PATH];
+static char exportspec[MAX_PATH];
 
 enum option_value {
-	OPT_AFFINITY=1, OPT_BREAKTRACE, OPT_DISTANCE, OPT_DURATION,
-	OPT_FORCETIMEOUT, OPT_HELP, OPT_INTERVAL, OPT_JSON, OPT_LOOPS,
-	OPT_PRIORITY, OPT_QUIET, OPT_SMP, OPT_THREADS, OPT_TIMEOUT
+	OPT_AFFINITY=1, OPT_BREAKTRACE, OPT_DEPTH, OPT_DISTANCE, OPT_DURATION,
+	OPT_EXPORT, OPT_FORCETIMEOUT, OPT_HELP, OPT_INTERVAL, OPT_JSON, OPT_LOOPS,
+	OPT_MSGSIZE, OPT_NSECS, OPT_PLACEMENT, OPT_PRIORITY, OPT_PRIOMIX,
+	OPT_PRODUCERS, OPT_QUIET, OPT_SMP, OPT_THREADS, OPT_TIMEOUT, OPT_WAIT
 };
 
+static int parse_prio_mix(char *str)
+{
+	long prio_max = sysconf(_SC_MQ_PRIO_MAX);
+	char *tok, *end;
+
+	nprios = 0;
+	for (tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+		if (nprios == PRIO_MIX_MAX)
+			return 1;
+		prio_mix[nprios] = strtoul(tok, &end, 10);
+		if (*end || end == tok || prio_mix[nprios] >= prio_max)
+			return 1;
+		nprios++;
+	}
+	return nprios == 0;
+}
+
+static int parse_wait_mode(const char *str)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(wait_names); i++) {
+		if (!strcmp(str, wait_names[i])) {
+			wait_mode = i;
+			return 0;
+		}
+	}
+	return 1;
+}
+
 static void process_options(int argc, char *argv[])
 {
 	int error = 0;
@@ -279,21 +410,29 @@ static void process_options(int argc, char *argv[])
 		static struct option long_options[] = {
 			{"affinity",	optional_argument,	NULL, OPT_AFFINITY},
 			{"breaktrace",	required_argument,	NULL, OPT_BREAKTRACE},
+			{"depth",	required_argument,	NULL, OPT_DEPTH},
 			{"distance",	required_argument,	NULL, OPT_DISTANCE},
 			{"duration",	required_argument,	NULL, OPT_DURATION},
+			{"export",	required_argument,	NULL, OPT_EXPORT},
 			{"forcetimeout",required_argument,	NULL, OPT_FORCETIMEOUT},
 			{"help",	no_argument,		NULL, OPT_HELP},
 			{"interval",	required_argument,	NULL, OPT_INTERVAL},
 			{"json",	required_argument,      NULL, OPT_JSON },
 			{"loops",	required_argument,	NULL, OPT_LOOPS},
+			{"msgsize",	required_argument,	NULL, OPT_MSGSIZE},
+			{"nsecs",	no_argument,		NULL, OPT_NSECS},
+			{"placement",	required_argument,	NULL, OPT_PLACEMENT},
 			{"priority",	required_argument,	NULL, OPT_PRIORITY},
+			{"prio-mix",	required_argument,	NULL, OPT_PRIOMIX},
+			{"producers",	required_argument,	NULL, OPT_PRODUCERS},
 			{"quiet",	no_argument,		NULL, OPT_QUIET},
 			{"smp",		no_argument,		NULL, OPT_SMP},
 			{"threads",	optional_argument,	NULL, OPT_THREADS},
 			{"timeout",	required_argument,	NULL, OPT_TIMEOUT},
+			{"wait",	required_argument,	NULL, OPT_WAIT},
 			{NULL, 0, NULL, 0}
 		};
-		int c = getopt_long (argc, argv, "a::b:d:D:f:i:l:p:qSt::T:",
+		int c = getopt_long (argc, argv, "a::b:d:D:f:i:l:Np:qSt::T:",
 			long_options, &option_index);
 		if (c == -1)
 			break;
@@ -318,6 +457,9 @@ static void process_options(int argc, char *argv[])
 		case 'b':
 			tracelimit = atoi(optarg);
 			break;
+		case OPT_DEPTH:
+			depth = atoi(optarg);
+			break;
 		case OPT_DISTANCE:
 		case 'd':
 			distance = atoi(optarg);
@@ -339,6 +481,9 @@ static void process_options(int argc, char *argv[])
 		case 'i':
 			interval = atoi(optarg);
 			break;
+		case OPT_EXPORT:
+			strncpy(exportspec, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
 		case OPT_JSON:
 			strncpy(jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
 			break;
@@ -346,10 +491,35 @@ static void process_options(int argc, char *argv[])
 		case 'l':
 			max_cycles = atoi(optarg);
 			break;
+		case OPT_MSGSIZE:
+			msgsize = atoi(optarg);
+			break;
+		case OPT_NSECS:
+		case 'N':
+			use_nsecs = 1;
+			break;
+		case OPT_PLACEMENT:
+			if (ipc_placement(optarg)) {
+				warn("invalid placement '%s', use one of "
+				     CPU_PLAN_POLICIES "\n", optarg);
+				error = 1;
+			}
+			break;
 		case OPT_PRIORITY:
 		case 'p':
 			priority = atoi(optarg);
 			break;
+		case OPT_PRIOMIX:
+			if (parse_prio_mix(optarg)) {
+				warn("invalid message priority list\n");
+				error = 1;
+			}
+			break;
+		case OPT_PRODUCERS:
+			producers = atoi(optarg);
+			if (producers < 1)
+				error = 1;
+			break;
 		case OPT_QUIET:
 		case 'q':
 			quiet = 1;
@@ -377,6 +547,12 @@ static void process_options(int argc, char *argv[])
 		case 'T':
 			timeout = atoi(optarg);
 			break;
+		case OPT_WAIT:
+			if (parse_wait_mode(optarg)) {
+				warn("unknown wait mode '%s'\n", optarg);
+				error = 1;
+			}
+			break;
 		default:
 			display_help(1);
 			break;
@@ -405,6 +581,27 @@ static void process_options(int argc, char *argv[])
 	if (forcetimeout && !timeout)
 		error = 1;
 
+	/* the stream mode stores the send timestamp in the message */
+	if (msgsize < (int)strlen(testmsg) + 1 ||
+	    (producers && msgsize < (int)sizeof(uint64_t)))
+		error = 1;
+
+	if (depth < 1)
+		error = 1;
+
+	if (interval < 0)
+		error = 1;
+
+	if (timeout && wait_mode != WAIT_RECEIVE) {
+		warn("-T only works with --wait=receive\n");
+		error = 1;
+	}
+
+	if (producers && (timeout || tracelimit)) {
+		warn("-T, -f and -b are not supported with --producers\n");
+		error = 1;
+	}
+
 	if (duration < 0)
 		error = 1;
 
@@ -423,78 +620,509 @@ static void sighand(int sig)
 	shutdown = 1;
 }
 
-static void print_stat(FILE *fp, struct params *receiver, struct params *sender,
-		       int verbose, int quiet)
+/*
+ * Many-to-one streaming
+ *
+ * With --producers=NUM, NUM producer threads per queue send timestamped
+ * messages, every interval us or back to back with -i 0, and a single
+ * receiver drains the queue. Besides throughput this measures the per
+ * message latency including the time spent waiting in the queue.
+ */
+struct stream_queue {
+	int num;
+	int cpu;
+	int mustgetcpu;
+	int tid;
+	mqd_t mq;		/* receiver side */
+	mqd_t sendmq;
+	int epfd;
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_mutex_t lock;	/* serializes notification threads */
+	sem_t done;
+	int stopped;
+	char *buf;
+	unsigned long msgs;
+	unsigned long long bytes;
+	uint64_t min, max, cur, last;
+	double sum;
+	struct histogram hist;
+	struct export_stat export;
+	unsigned long prio_msgs[PRIO_MIX_MAX];
+	double prio_sum[PRIO_MIX_MAX];
+	uint64_t prio_max[PRIO_MIX_MAX];
+};
+
+struct stream_producer {
+	struct stream_queue *q;
+	int num;
+	int cpu;
+	int tid;
+	int done;
+	unsigned long sent;
+	pthread_t thread;
+};
+
+static struct stream_queue *queues;
+static struct stream_producer *stream_producers;
+static uint64_t stream_start;
+static int volatile stream_stop;
+
+/* Returns nonzero for the empty message which closes the stream */
+static int stream_account(struct stream_queue *q, ssize_t len,
+			  unsigned int prio)
 {
-	int i;
+	uint64_t now = ipc_now(), stamp, lat;
+	int j;
 
-	if (quiet)
-		return;
+	if (len == 0)
+		return 1;
 
-	for (i = 0; i < num_threads; i++) {
-		printf("#%1d: ID%d, P%d, CPU%d, I%ld; #%1d: ID%d, P%d, CPU%d, TO %d, Cycles %d\n",
-			i*2, receiver[i].tid, receiver[i].priority, receiver[i].cpu,
-			receiver[i].delay.tv_nsec / 1000,
-			i*2+1, sender[i].tid, sender[i].priority, sender[i].cpu,
-			receiver[i].timeoutcount, sender[i].samples);
+	memcpy(&stamp, q->buf, sizeof(stamp));
+	lat = now - stamp;
+	if (!use_nsecs)
+		lat /= 1000;
+
+	q->msgs++;
+	q->bytes += len;
+	q->last = now;
+	q->cur = lat;
+	if (lat < q->min)
+		q->min = lat;
+	if (lat > q->max)
+		q->max = lat;
+	q->sum += (double) lat;
+	hist_sample(&q->hist, lat);
+	if (*exportspec)
+		export_stat_update(&q->export, lat);
+	if (q->mustgetcpu)
+		q->cpu = get_cpu();
+
+	for (j = 0; j < nprios; j++) {
+		if (prio_mix[j] != prio)
+			continue;
+		q->prio_msgs[j]++;
+		q->prio_sum[j] += (double) lat;
+		if (lat > q->prio_max[j])
+			q->prio_max[j] = lat;
+		break;
 	}
-	for (i = 0; i < num_threads; i++) {
-		printf("#%d -> #%d, Min %4d, Cur %4d, Avg %4d, Max %4d\n",
-			i*2+1, i*2,
-			receiver[i].mindiff, (int) receiver[i].diff.tv_usec,
-			(int) ((receiver[i].sumdiff / receiver[i].samples) + 0.5),
-			receiver[i].maxdiff);
+	return 0;
+}
+
+/* Empty a non-blocking queue: 0 when empty, 1 at the end, -1 on error */
+static int stream_drain(struct stream_queue *q)
+{
+	unsigned int prio;
+	ssize_t len;
+
+	for (;;) {
+		len = mq_receive(q->mq, q->buf, msgsize, &prio);
+		if (len < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			warn("could not receive message: %s\n", strerror(errno));
+			return -1;
+		}
+		if (stream_account(q, len, prio))
+			return 1;
 	}
 }
 
-struct params_stats {
-	struct params *receiver;
-	struct params *sender;
-};
+/*
+ * A notification is only sent when the queue goes from empty to not
+ * empty, so drain again after re-arming for messages which arrived in
+ * between.
+ */
+static void stream_notified(union sigval sv)
+{
+	struct stream_queue *q = sv.sival_ptr;
+	struct sigevent sev;
+	int ret;
+
+	pthread_mutex_lock(&q->lock);
+	ret = stream_drain(q);
+	if (ret == 0) {
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify = SIGEV_THREAD;
+		sev.sigev_notify_function = stream_notified;
+		sev.sigev_notify_attributes = &q->attr;
+		sev.sigev_value.sival_ptr = q;
+		if (mq_notify(q->mq, &sev)) {
+			warn("mq_notify failed: %s\n", strerror(errno));
+			ret = -1;
+		} else {
+			ret = stream_drain(q);
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
 
-static void write_stats(FILE *f, void *data)
+	if (ret)
+		sem_post(&q->done);
+}
+
+static void *stream_receiver(void *arg)
 {
-	struct params_stats *ps = data;
-	struct params *s, *r;
-	unsigned int i;
+	struct stream_queue *q = arg;
+	struct epoll_event ev;
+	unsigned int prio;
+	union sigval sv;
+	ssize_t len;
+
+	q->mustgetcpu = ipc_setup_thread(q->cpu, priority);
+	if (q->cpu == -1 && !q->mustgetcpu)
+		q->cpu = 0;
+	q->tid = gettid();
+
+	switch (wait_mode) {
+	case WAIT_RECEIVE:
+		for (;;) {
+			len = mq_receive(q->mq, q->buf, msgsize, &prio);
+			if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				warn("could not receive message: %s\n",
+				     strerror(errno));
+				break;
+			}
+			if (stream_account(q, len, prio))
+				break;
+		}
+		break;
+	case WAIT_EPOLL:
+		while (stream_drain(q) == 0) {
+			if (epoll_wait(q->epfd, &ev, 1, -1) < 0 &&
+			    errno != EINTR) {
+				warn("epoll_wait failed: %s\n", strerror(errno));
+				break;
+			}
+		}
+		break;
+	case WAIT_NOTIFY:
+		sv.sival_ptr = q;
+		stream_notified(sv);
+		while (sem_wait(&q->done) && errno == EINTR)
+			;
+		break;
+	}
+
+	q->stopped = 1;
+	return NULL;
+}
+
+static void *stream_producer(void *arg)
+{
+	struct stream_producer *p = arg;
+	struct timespec ts, delay;
+	unsigned int seq;
+	uint64_t stamp;
+	char *buf;
+
+	buf = calloc(1, msgsize);
+	if (!buf) {
+		warn("could not allocate message buffer\n");
+		p->done = 1;
+		return NULL;
+	}
+
+	ipc_setup_thread(p->cpu, priority);
+	p->tid = gettid();
+	delay.tv_sec = interval / USEC_PER_SEC;
+	delay.tv_nsec = (interval % USEC_PER_SEC) * 1000;
+
+	for (seq = p->num; !stream_stop; seq++) {
+		if (max_cycles && p->sent >= max_cycles)
+			break;
+
+		stamp = ipc_now();
+		memcpy(buf, &stamp, sizeof(stamp));
+
+		/* Do not block forever on a queue nobody drains anymore */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		tsnorm(&ts);
+		if (mq_timedsend(p->q->sendmq, buf, msgsize,
+				 prio_mix[seq % nprios], &ts)) {
+			if (errno == ETIMEDOUT || errno == EINTR)
+				continue;
+			warn("could not send message: %s\n", strerror(errno));
+			break;
+		}
+		p->sent++;
+
+		if (interval)
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &delay, NULL);
+	}
+
+	free(buf);
+	p->done = 1;
+	return NULL;
+}
+
+static const double stream_percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+
+static double stream_rate(struct stream_queue *q)
+{
+	if (!q->msgs || q->last <= stream_start)
+		return 0.0;
+	return q->msgs * 1e9 / (q->last - stream_start);
+}
+
+static void stream_print(int final)
+{
+	uint64_t pct[ARRAY_SIZE(stream_percentiles)];
+	struct stream_queue *q;
+	int i, j;
 
-	fprintf(f, "  \"num_threads\": %d,\n", num_threads);
-	fprintf(f, "  \"thread\": {\n");
 	for (i = 0; i < num_threads; i++) {
-		s = &ps->sender[i];
-		r = &ps->receiver[i];
-		fprintf(f, "    \"%u\": {\n", i);
-		fprintf(f, "      \"sender\": {\n");
-		fprintf(f, "        \"cpu\": %d,\n", s->cpu);
-		fprintf(f, "        \"priority\": %d,\n", s->priority);
-		fprintf(f, "        \"samples\": %d,\n", s->samples);
-		fprintf(f, "        \"interval\": %ld\n", r->delay.tv_nsec/1000);
+		q = &queues[i];
+		printf("#%d: ID%d, P%d, CPU%d, Producers %d, Msgs %lu, Rate %.0f/s, %.2f MB/s\n",
+		       i, q->tid, priority, q->cpu, producers, q->msgs,
+		       stream_rate(q), stream_rate(q) * msgsize / 1e6);
+		if (!q->msgs)
+			printf("#%d: (not yet ready)\n", i);
+		else
+			printf("#%d: Min %4llu, Cur %4llu, Avg %4llu, Max %4llu\n",
+			       i, (unsigned long long)q->min,
+			       (unsigned long long)q->cur,
+			       (unsigned long long)(q->sum / q->msgs + 0.5),
+			       (unsigned long long)q->max);
+	}
+	if (!final)
+		return;
+
+	for (i = 0; i < num_threads; i++) {
+		q = &queues[i];
+		if (!q->msgs)
+			continue;
+		hist_tail_percentiles(&q->hist, q->msgs, q->max,
+				      stream_percentiles, pct, ARRAY_SIZE(pct));
+		printf("#%d", i);
+		for (j = 0; j < (int)ARRAY_SIZE(pct); j++)
+			printf(", P%g %4llu", stream_percentiles[j],
+			       (unsigned long long)pct[j]);
+		printf("\n");
+		for (j = 0; nprios > 1 && j < nprios; j++)
+			printf("#%d: prio %u: Msgs %lu, Avg %4llu, Max %4llu\n",
+			       i, prio_mix[j], q->prio_msgs[j],
+			       q->prio_msgs[j] ? (unsigned long long)
+			       (q->prio_sum[j] / q->prio_msgs[j] + 0.5) : 0,
+			       (unsigned long long)q->prio_max[j]);
+	}
+}
+
+static void stream_write_stats(FILE *f, void *data)
+{
+	struct stream_queue *q;
+	int i, j;
+
+	fprintf(f, "  \"mode\": \"stream\",\n");
+	fprintf(f, "  \"wait\": \"%s\",\n", wait_names[wait_mode]);
+	fprintf(f, "  \"num_queues\": %d,\n", num_threads);
+	fprintf(f, "  \"producers\": %d,\n", producers);
+	fprintf(f, "  \"msgsize\": %d,\n", msgsize);
+	fprintf(f, "  \"depth\": %d,\n", depth);
+	fprintf(f, "  \"interval\": %d,\n", interval);
+	fprintf(f, "  \"resolution_in_ns\": %d,\n", use_nsecs);
+	fprintf(f, "  \"queue\": {\n");
+	for (i = 0; i < num_threads; i++) {
+		q = &queues[i];
+		fprintf(f, "    \"%d\": {\n", i);
+		fprintf(f, "      \"cpu\": %d,\n", q->cpu);
+		fprintf(f, "      \"priority\": %d,\n", priority);
+		fprintf(f, "      \"messages\": %lu,\n", q->msgs);
+		fprintf(f, "      \"bytes\": %llu,\n", q->bytes);
+		fprintf(f, "      \"rate\": %.1f,\n", stream_rate(q));
+		fprintf(f, "      \"histogram\": ");
+		hist_print_json(f, &q->hist, 6);
+		fprintf(f, ",\n");
+		fprintf(f, "      \"percentiles\": ");
+		hist_print_percentiles_json(f, &q->hist, q->max, 6);
+		fprintf(f, ",\n");
+		fprintf(f, "      \"message_priority\": {\n");
+		for (j = 0; j < nprios; j++) {
+			fprintf(f, "        \"%u\": {\n", prio_mix[j]);
+			fprintf(f, "          \"messages\": %lu,\n", q->prio_msgs[j]);
+			fprintf(f, "          \"avg\": %.2f,\n", q->prio_msgs[j] ?
+				q->prio_sum[j] / q->prio_msgs[j] : 0.0);
+			fprintf(f, "          \"max\": %llu\n",
+				(unsigned long long)q->prio_max[j]);
+			fprintf(f, "        }%s\n", j == nprios - 1 ? "" : ",");
+		}
 		fprintf(f, "      },\n");
-		fprintf(f, "      \"receiver\": {\n");
-		fprintf(f, "        \"cpu\": %d,\n", r->cpu);
-		fprintf(f, "        \"priority\": %d,\n", r->priority);
-		fprintf(f, "        \"timeoutcount\": %d,\n", r->timeoutcount);
-		fprintf(f, "        \"min\": %d,\n", r->mindiff);
-		fprintf(f, "        \"avg\": %.2f,\n", r->sumdiff/r->samples);
-		fprintf(f, "        \"max\": %d\n", r->maxdiff);
-		fprintf(f, "      }\n");
+		fprintf(f, "      \"min\": %llu,\n",
+			q->msgs ? (unsigned long long)q->min : 0);
+		fprintf(f, "      \"avg\": %.2f,\n",
+			q->msgs ? q->sum / q->msgs : 0.0);
+		fprintf(f, "      \"max\": %llu\n", (unsigned long long)q->max);
 		fprintf(f, "    }%s\n", i == num_threads - 1 ? "" : ",");
 	}
 	fprintf(f, "  }\n");
 }
 
+static int stream_main(void)
+{
+	struct stream_producer *p;
+	struct stream_queue *q;
+	struct timespec maindelay, ts;
+	struct epoll_event ev;
+	struct mq_attr mqstat;
+	sigset_t sigset;
+	char mqname[19];
+	int i, k, done;
+
+	memset(&mqstat, 0, sizeof(mqstat));
+	mqstat.mq_maxmsg = depth;
+	mqstat.mq_msgsize = msgsize;
+
+	queues = calloc(num_threads, sizeof(*queues));
+	stream_producers = calloc(num_threads * producers,
+				  sizeof(*stream_producers));
+	if (!queues || !stream_producers)
+		fatal("could not allocate queues\n");
+
+	for (i = 0; i < num_threads; i++) {
+		q = &queues[i];
+		q->num = i;
+		q->min = UINT64_MAX;
+		q->cpu = ipc_cpu(setaffinity, affinity, i * (producers + 1));
+		q->buf = malloc(msgsize);
+		if (!q->buf ||
+		    hist_init(&q->hist, HIST_DIGITS_DEFAULT,
+			      use_nsecs ? HIST_RANGE_BITS_NS : HIST_RANGE_BITS_US) ||
+		    hist_alloc(&q->hist))
+			fatal("could not allocate queue #%d\n", i);
+
+		/* A left over queue could have different attributes */
+		sprintf(mqname, TESTMQ_NAME, i);
+		mq_unlink(mqname);
+		q->sendmq = mq_open(mqname, O_CREAT|O_WRONLY, 0777, &mqstat);
+		if (q->sendmq == (mqd_t) -1) {
+			perror("could not open POSIX message queue");
+			return 1;
+		}
+		q->mq = mq_open(mqname, O_RDONLY |
+				(wait_mode == WAIT_RECEIVE ? 0 : O_NONBLOCK));
+		if (q->mq == (mqd_t) -1) {
+			perror("could not open POSIX message queue");
+			return 1;
+		}
+
+		if (wait_mode == WAIT_EPOLL) {
+			q->epfd = epoll_create1(0);
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			if (q->epfd < 0 ||
+			    epoll_ctl(q->epfd, EPOLL_CTL_ADD, q->mq, &ev)) {
+				perror("epoll");
+				return 1;
+			}
+		} else if (wait_mode == WAIT_NOTIFY) {
+			pthread_mutex_init(&q->lock, NULL);
+			sem_init(&q->done, 0, 0);
+			notify_attr(&q->attr, q->cpu, priority);
+		}
+	}
+
+	if (*exportspec) {
+		export_init("pmqtest", use_nsecs ? "ns" : "us");
+		for (i = 0; i < num_threads; i++)
+			if (export_add(&queues[i].export, &queues[i].hist,
+				       "queue=\"%d\"", i))
+				fatal("failed to export queue %d\n", i);
+		if (export_start(exportspec))
+			fatal("failed to export stats on %s: %s\n", exportspec,
+			      strerror(errno));
+	}
+
+	sigemptyset(&sigset);
+	stream_start = ipc_now();
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&queues[i].thread, NULL, stream_receiver,
+			       &queues[i]);
+	for (i = 0; i < num_threads; i++) {
+		for (k = 0; k < producers; k++) {
+			p = &stream_producers[i * producers + k];
+			p->q = &queues[i];
+			p->num = k;
+			p->cpu = ipc_cpu(setaffinity, affinity,
+					 i * (producers + 1) + 1 + k);
+			pthread_create(&p->thread, NULL, stream_producer, p);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+
+	maindelay.tv_sec = 0;
+	maindelay.tv_nsec = 50000000; /* 50 ms */
+
+	while (!shutdown) {
+		nanosleep(&maindelay, NULL);
+
+		for (i = 0, done = 1; i < num_threads * producers; i++)
+			done &= stream_producers[i].done;
+		for (i = 0; i < num_threads; i++)
+			done |= queues[i].stopped;
+		if (done)
+			break;
+
+		if (!quiet) {
+			stream_print(0);
+			printf("\033[%dA", num_threads*2);
+			fflush(stdout);
+		}
+	}
+
+	stream_stop = 1;
+	for (i = 0; i < num_threads * producers; i++)
+		pthread_join(stream_producers[i].thread, NULL);
+
+	/* The empty message sorts behind everything still queued */
+	for (i = 0; i < num_threads; i++) {
+		q = &queues[i];
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		if (!q->stopped && mq_timedsend(q->sendmq, "", 0, 0, &ts))
+			warn("could not stop queue #%d\n", i);
+		else
+			pthread_join(q->thread, NULL);
+	}
+
+	stream_print(1);
+
+	if (*exportspec)
+		export_stop();
+
+	if (strlen(jsonfile) != 0)
+		rt_write_json(jsonfile, 0, stream_write_stats, NULL);
+
+	for (i = 0; i < num_threads; i++) {
+		q = &queues[i];
+		mq_close(q->mq);
+		mq_close(q->sendmq);
+		sprintf(mqname, TESTMQ_NAME, i);
+		mq_unlink(mqname);
+		hist_free(&q->hist);
+		free(q->buf);
+	}
+	free(stream_producers);
+	free(queues);
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int i;
-	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
-	struct params *receiver = NULL;
-	struct params *sender = NULL;
+	struct params *receiver, *sender;
+	void *param = NULL;
 	sigset_t sigset;
 	int oldsamples = INT_MAX;
 	int oldtimeoutcount = INT_MAX;
 	struct timespec maindelay;
 	int oflag = O_CREAT|O_RDWR;
-	struct mq_attr mqstat;
+	struct mq_attr mqstat, testmqstat;
 
 	memset(&mqstat, 0, sizeof(mqstat));
 	mqstat.mq_maxmsg = 1;
@@ -525,55 +1153,66 @@ int main(int argc, char *argv[])
 	if (duration)
 		alarm(duration);
 
-	receiver = calloc(num_threads, sizeof(struct params));
-	sender = calloc(num_threads, sizeof(struct params));
-	if (receiver == NULL || sender == NULL)
+	if (producers)
+		return stream_main();
+
+	testmqstat = mqstat;
+	testmqstat.mq_msgsize = msgsize;
+	testbuf = calloc(1, msgsize);
+	if (testbuf == NULL)
 		goto nomem;
+	strcpy(testbuf, testmsg);
+
+	ipc_init(&pmq_ops, sizeof(struct params));
+	param = ipc_alloc(num_threads, use_nsecs, NULL);
+	if (param == NULL)
+		goto nomem;
+	if (*exportspec && ipc_export(param, "pmqtest", exportspec))
+		fatal("failed to export stats on %s: %s\n", exportspec,
+		      strerror(errno));
 
 	for (i = 0; i < num_threads; i++) {
 		char mqname[19];
 
+		receiver = (struct params *)ipc_receiver(param, i);
+		sender = (struct params *)ipc_sender(param, i);
+
 		sprintf(mqname, SYNCMQ_NAME, i);
-		receiver[i].syncmq = mq_open(mqname, oflag, 0777, &mqstat);
-		if (receiver[i].syncmq == (mqd_t) -1) {
+		receiver->syncmq = mq_open(mqname, oflag, 0777, &mqstat);
+		if (receiver->syncmq == (mqd_t) -1) {
 			fprintf(stderr, "could not open POSIX message queue #1\n");
 			return 1;
 		}
 		sprintf(mqname, TESTMQ_NAME, i);
-		receiver[i].testmq = mq_open(mqname, oflag, 0777, &mqstat);
-		if (receiver[i].testmq == (mqd_t) -1) {
+		mq_unlink(mqname);
+		receiver->testmq = mq_open(mqname, oflag, 0777, &testmqstat);
+		if (receiver->testmq == (mqd_t) -1) {
 			fprintf(stderr, "could not open POSIX message queue #2\n");
 			return 1;
 		}
+		sender->syncmq = receiver->syncmq;
+		sender->testmq = receiver->testmq;
 
-		receiver[i].mindiff = UINT_MAX;
-		receiver[i].maxdiff = 0;
-		receiver[i].sumdiff = 0.0;
-
-		receiver[i].num = i;
-		receiver[i].cpu = i;
-		switch (setaffinity) {
-		case AFFINITY_UNSPECIFIED: receiver[i].cpu = -1; break;
-		case AFFINITY_SPECIFIED: receiver[i].cpu = affinity; break;
-		case AFFINITY_USEALL: receiver[i].cpu = i % max_cpus; break;
-		}
-		receiver[i].priority = priority;
-		receiver[i].tracelimit = tracelimit;
+		ipc_pair_init(param, i, ipc_cpu(setaffinity, affinity, i),
+			      priority, interval, max_cycles, tracelimit);
 		if (priority > 1 && !sameprio)
 			priority--;
-		receiver[i].delay.tv_sec = interval / USEC_PER_SEC;
-		receiver[i].delay.tv_nsec = (interval % USEC_PER_SEC) * 1000;
 		interval += distance;
-		receiver[i].max_cycles = max_cycles;
-		receiver[i].sender = 0;
-		receiver[i].neighbor = &sender[i];
-		receiver[i].timeout = timeout;
-		receiver[i].forcetimeout = forcetimeout;
-		pthread_create(&receiver[i].threadid, NULL, pmqthread, &receiver[i]);
-		memcpy(&sender[i], &receiver[i], sizeof(receiver[0]));
-		sender[i].sender = 1;
-		sender[i].neighbor = &receiver[i];
-		pthread_create(&sender[i].threadid, NULL, pmqthread, &sender[i]);
+		receiver->timeout = sender->timeout = timeout;
+		receiver->forcetimeout = sender->forcetimeout = forcetimeout;
+		receiver->recvtestmsg = malloc(msgsize);
+		if (receiver->recvtestmsg == NULL)
+			goto nomem;
+		if (wait_mode == WAIT_NOTIFY) {
+			/* armed before the sender can fill the queue */
+			sem_init(&receiver->notified, 0, 0);
+			notify_attr(&receiver->attr, receiver->ipc.cpu,
+				    receiver->ipc.priority);
+			if (pmq_arm(receiver))
+				return 1;
+		}
+		pthread_create(&receiver->ipc.threadid, NULL, ipc_thread, receiver);
+		pthread_create(&sender->ipc.threadid, NULL, ipc_thread, sender);
 	}
 
 	maindelay.tv_sec = 0;
@@ -587,71 +1226,66 @@ int main(int argc, char *argv[])
 		int minsamples = INT_MAX;
 
 		for (i = 0; i < num_threads; i++) {
-			newsamples += receiver[i].samples;
-			newtimeoutcount += receiver[i].timeoutcount;
-			if (receiver[i].samples < minsamples)
-				minsamples = receiver[i].samples;
+			receiver = (struct params *)ipc_receiver(param, i);
+			newsamples += receiver->ipc.samples;
+			newtimeoutcount += receiver->timeoutcount;
+			if (receiver->ipc.samples < minsamples)
+				minsamples = receiver->ipc.samples;
 		}
 
 		if (minsamples > 1 && (shutdown || newsamples > oldsamples ||
 			newtimeoutcount > oldtimeoutcount)) {
-			print_stat(stdout, receiver, sender, 0, quiet);
+			ipc_print_stat(param, quiet);
 			if (!quiet)
 				printf("\033[%dA", num_threads*2);
 		}
 
 		fflush(NULL);
 
-		oldsamples = 0;
-		oldtimeoutcount = 0;
-		for (i = 0; i < num_threads; i++) {
-			oldsamples += receiver[i].samples;
-			oldtimeoutcount += receiver[i].timeoutcount;
-		}
+		oldsamples = newsamples;
+		oldtimeoutcount = newtimeoutcount;
 
 		nanosleep(&maindelay, NULL);
 
-		for (i = 0; i < num_threads; i++)
-			shutdown |= receiver[i].shutdown | sender[i].shutdown;
-
+		shutdown |= ipc_should_stop(param);
 	} while (!shutdown);
 
 	if (!quiet)
 		printf("\033[%dB", num_threads*2 + 2);
 	else
-		print_stat(stdout, receiver, sender, 0, 0);
+		ipc_print_stat(param, 0);
+	ipc_print_percentiles(param);
 
-	for (i = 0; i < num_threads; i++) {
-		receiver[i].shutdown = 1;
-		sender[i].shutdown = 1;
-	}
+	ipc_stop(param);
 
 	for (i = 0; i < num_threads; i++) {
-		if (!receiver[i].stopped)
-			pthread_kill(receiver[i].threadid, SIGTERM);
-		if (!sender[i].stopped)
-			pthread_kill(sender[i].threadid, SIGTERM);
+		receiver = (struct params *)ipc_receiver(param, i);
+		sender = (struct params *)ipc_sender(param, i);
+		if (!receiver->ipc.stopped)
+			pthread_kill(receiver->ipc.threadid, SIGTERM);
+		if (!sender->ipc.stopped)
+			pthread_kill(sender->ipc.threadid, SIGTERM);
 	}
 	nanosleep(&maindelay, NULL);
 	for (i = 0; i < num_threads; i++) {
 		char mqname[19];
 
-		mq_close(receiver[i].syncmq);
+		receiver = (struct params *)ipc_receiver(param, i);
+
+		mq_close(receiver->syncmq);
 		sprintf(mqname, SYNCMQ_NAME, i);
 		mq_unlink(mqname);
 
-		mq_close(receiver[i].testmq);
+		mq_close(receiver->testmq);
 		sprintf(mqname, TESTMQ_NAME, i);
 		mq_unlink(mqname);
 	}
 
-	if (strlen(jsonfile) != 0) {
-		struct params_stats ps = {
-			.receiver = receiver,
-			.sender = sender,
-		};
-		rt_write_json(jsonfile, 0, write_stats, &ps);
-	}
+	if (*exportspec)
+		ipc_export_stop();
+
+	if (strlen(jsonfile) != 0)
+		rt_write_json(jsonfile, 0, ipc_write_stats, param);
 
 nomem:
 
@@ -21,118 +21,510 @@
 #include <utmpx.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "rt-utils.h"
 #include "rt-get_cpu.h"
 #include "rt-error.h"
+#include "rt-numa.h"
+#include "rt-ipc.h"
 
+static pthread_mutex_t *testmutex;
+static pthread_mutex_t *syncmutex;
+
+static int ptsem_prepare(struct ipc_params *par)
+{
+	return pthread_mutex_lock(&syncmutex[par->num]);
+}
+
+static int ptsem_send(struct ipc_params *par)
+{
+	return pthread_mutex_unlock(&testmutex[par->num]);
+}
+
+static int ptsem_receive(struct ipc_params *par)
+{
+	return pthread_mutex_lock(&testmutex[par->num]);
+}
+
+static int ptsem_ack(struct ipc_params *par)
+{
+	return pthread_mutex_unlock(&syncmutex[par->num]);
+}
+
+static const struct ipc_ops ptsem_ops = {
+	.prepare	= ptsem_prepare,
+	.send		= ptsem_send,
+	.receive	= ptsem_receive,
+	.ack		= ptsem_ack,
+};
+
+/*
+ * Futex modes
+ *
+ * futex: the receiver sleeps in FUTEX_WAIT until the sender bumps seq and
+ *        calls FUTEX_WAKE.
+ * pi:    the receiver blocks in FUTEX_LOCK_PI on a lock held by the
+ *        sender, which hands it over with FUTEX_UNLOCK_PI.
+ * spin:  the receiver polls seq for up to spin_ns before it goes to sleep
+ *        in FUTEX_WAIT; the sender only enters the kernel when somebody
+ *        sleeps.
+ * waitv: like futex, but the receiver sleeps in futex_waitv() on seq and
+ *        on the stop word at once.
+ *
+ * With --waiters=NUM, NUM-1 herd threads wait on seq together with the
+ * receiver, so every release wakes NUM threads. The sender waits in
+ * prepare until all of them acknowledged the previous release.
+ */
 enum {
-	AFFINITY_UNSPECIFIED,
-	AFFINITY_SPECIFIED,
-	AFFINITY_USEALL
+	MODE_MUTEX,
+	MODE_FUTEX,
+	MODE_PI,
+	MODE_SPIN,
+	MODE_WAITV,
 };
 
-static pthread_mutex_t *testmutex;
-static pthread_mutex_t *syncmutex;
+static const char * const mode_names[] = {
+	"mutex", "futex", "pi", "spin", "waitv"
+};
+
+static int mode = MODE_MUTEX;
+static int spin_ns = 20000;
+static int waiters = 1;
 
 struct params {
-	int num;
+	struct ipc_params ipc;
+	uint32_t seen;			/* last seq the receiver woke up for */
+	int held;			/* sender owns the PI lock */
+	int spins;			/* wakeups caught while spinning */
+};
+
+struct futex_pair {
+	uint32_t seq;			/* releases of the sender */
+	uint32_t ack;			/* acknowledgements of all waiters */
+	uint32_t sleepers;		/* waiters in FUTEX_WAIT, spin mode */
+	uint32_t lock;			/* PI futex, owner TID */
+	uint32_t ready;			/* sender owns lock initially */
+	uint32_t taken;			/* PI lock handoffs to the receiver */
+} __attribute__((aligned(64)));
+
+struct herd_waiter {
+	int pair;
 	int cpu;
 	int priority;
-	int affinity;
-	int sender;
-	int samples;
-	int max_cycles;
-	int tracelimit;
 	int tid;
-	int shutdown;
-	int stopped;
-	struct timespec delay;
-	unsigned int mindiff, maxdiff;
-	double sumdiff;
-	struct timeval unblocked, received, diff;
+	uint32_t seen;
+	int spins;
+	int samples;
+	uint64_t min, max;
+	double sum;
 	pthread_t threadid;
-	struct params *neighbor;
 };
 
-void *semathread(void *param)
-{
-	int mustgetcpu = 0;
-	struct params *par = param;
-	cpu_set_t mask;
-	int policy = SCHED_FIFO;
-	struct sched_param schedp;
-
-	memset(&schedp, 0, sizeof(schedp));
-	schedp.sched_priority = par->priority;
-	sched_setscheduler(0, policy, &schedp);
-
-	if (par->cpu != -1) {
-		CPU_ZERO(&mask);
-		CPU_SET(par->cpu, &mask);
-		if (sched_setaffinity(0, sizeof(mask), &mask) == -1)
-			fprintf(stderr,	"WARNING: Could not set CPU affinity "
-				"to CPU #%d\n", par->cpu);
-	} else
-		mustgetcpu = 1;
-
-	par->tid = gettid();
-
-	while (!par->shutdown) {
-		if (par->sender) {
-			pthread_mutex_lock(&syncmutex[par->num]);
-
-			/* Release lock: Start of latency measurement ... */
-			gettimeofday(&par->unblocked, NULL);
-			pthread_mutex_unlock(&testmutex[par->num]);
-			par->samples++;
-			if (par->max_cycles && par->samples >= par->max_cycles)
-				par->shutdown = 1;
-			if (mustgetcpu)
-				par->cpu = get_cpu();
-		} else {
-			pthread_mutex_lock(&testmutex[par->num]);
-
-			/* ... Got the lock: End of latency measurement */
-			gettimeofday(&par->received, NULL);
-			par->samples++;
-			timersub(&par->received, &par->neighbor->unblocked,
-			    &par->diff);
-
-			if (par->diff.tv_usec < par->mindiff)
-				par->mindiff = par->diff.tv_usec;
-			if (par->diff.tv_usec > par->maxdiff)
-				par->maxdiff = par->diff.tv_usec;
-			par->sumdiff += (double) par->diff.tv_usec;
-			if (par->tracelimit && par->maxdiff > par->tracelimit) {
-				char tracing_enabled_file[MAX_PATH];
-
-				strcpy(tracing_enabled_file, get_debugfileprefix());
-				strcat(tracing_enabled_file, "tracing_on");
-				int tracing_enabled =
-				    open(tracing_enabled_file, O_WRONLY);
-				if (tracing_enabled >= 0) {
-					write(tracing_enabled, "0", 1);
-					close(tracing_enabled);
-				} else
-					fatal("Could not access %s\n",
-					      tracing_enabled_file);
-				par->shutdown = 1;
-				par->neighbor->shutdown = 1;
+static struct futex_pair *fpair;
+static struct herd_waiter *herd;
+static uint32_t futex_stopping;
+static void *param;
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static long futex(uint32_t *uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *uaddr, int nr)
+{
+	futex(uaddr, FUTEX_WAKE_PRIVATE, nr);
+}
+
+static int futex_stopped(void)
+{
+	return __atomic_load_n(&futex_stopping, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Sleep until *word is (equal) or is no longer (!equal) val. Returns
+ * nonzero when the test is being stopped, futex_stop() sets the stop
+ * word before it bumps all futex words, so a stale wakeup is never
+ * reported as a release.
+ */
+static int futex_await(uint32_t *word, uint32_t val, int equal)
+{
+	uint32_t cur;
+
+	for (;;) {
+		cur = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+		if ((cur == val) == equal)
+			return futex_stopped();
+		if (futex_stopped())
+			return 1;
+		futex(word, FUTEX_WAIT_PRIVATE, cur);
+	}
+}
+
+static void futex_stop(void)
+{
+	int i;
+
+	__atomic_store_n(&futex_stopping, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&futex_stopping, INT_MAX);
+	for (i = 0; i < ((struct ipc_params *)param)->num_threads; i++) {
+		__atomic_fetch_add(&fpair[i].seq, 1, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&fpair[i].ack, 1, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&fpair[i].ready, 1, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&fpair[i].taken, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&fpair[i].seq, INT_MAX);
+		futex_wake(&fpair[i].ack, INT_MAX);
+		futex_wake(&fpair[i].ready, INT_MAX);
+		futex_wake(&fpair[i].taken, INT_MAX);
+	}
+}
+
+#if defined(__NR_futex_waitv) && defined(FUTEX_WAITV_MAX)
+static int futex_waitv_seq(struct futex_pair *fp, uint32_t seen)
+{
+	struct futex_waitv wv[2];
+
+	memset(wv, 0, sizeof(wv));
+	wv[0].uaddr = (uintptr_t)&fp->seq;
+	wv[0].val = seen;
+	wv[0].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+	wv[1].uaddr = (uintptr_t)&futex_stopping;
+	wv[1].val = 0;
+	wv[1].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+
+	for (;;) {
+		if (__atomic_load_n(&fp->seq, __ATOMIC_ACQUIRE) != seen)
+			return futex_stopped();
+		if (futex_stopped())
+			return 1;
+		if (syscall(__NR_futex_waitv, wv, 2, 0, NULL, CLOCK_MONOTONIC) < 0 &&
+		    errno != EAGAIN && errno != EINTR)
+			return 1;
+	}
+}
+
+static int futex_waitv_supported(void)
+{
+	return syscall(__NR_futex_waitv, NULL, 0, 0, NULL, 0) < 0 &&
+		errno != ENOSYS;
+}
+#else
+static int futex_waitv_seq(struct futex_pair *fp, uint32_t seen)
+{
+	return 1;
+}
+
+static int futex_waitv_supported(void)
+{
+	return 0;
+}
+#endif
+
+/* Wait for the next release of the pair, shared by receiver and herd */
+static int futex_pair_wait(struct futex_pair *fp, uint32_t *seen, int *spins)
+{
+	uint64_t deadline;
+	int ret;
+
+	switch (mode) {
+	case MODE_SPIN:
+		deadline = ipc_now() + spin_ns;
+		do {
+			if (__atomic_load_n(&fp->seq, __ATOMIC_ACQUIRE) != *seen) {
+				(*spins)++;
+				*seen = __atomic_load_n(&fp->seq, __ATOMIC_RELAXED);
+				return futex_stopped();
 			}
+			cpu_relax();
+		} while (ipc_now() < deadline);
+		__atomic_fetch_add(&fp->sleepers, 1, __ATOMIC_SEQ_CST);
+		ret = futex_await(&fp->seq, *seen, 0);
+		__atomic_fetch_sub(&fp->sleepers, 1, __ATOMIC_SEQ_CST);
+		break;
+	case MODE_WAITV:
+		ret = futex_waitv_seq(fp, *seen);
+		break;
+	default:
+		ret = futex_await(&fp->seq, *seen, 0);
+		break;
+	}
+	*seen = __atomic_load_n(&fp->seq, __ATOMIC_RELAXED);
+	return ret;
+}
 
-			if (par->max_cycles && par->samples >= par->max_cycles)
-				par->shutdown = 1;
-			if (mustgetcpu)
-				par->cpu = get_cpu();
-			nanosleep(&par->delay, NULL);
-			pthread_mutex_unlock(&syncmutex[par->num]);
-		}
+static void futex_pair_ack(struct futex_pair *fp)
+{
+	__atomic_fetch_add(&fp->ack, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&fp->ack, 1);
+}
+
+static int pi_lock(uint32_t *lock, int tid)
+{
+	uint32_t zero = 0;
+
+	if (__atomic_compare_exchange_n(lock, &zero, tid, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED))
+		return 0;
+	return futex(lock, FUTEX_LOCK_PI_PRIVATE, 0) ? -1 : 0;
+}
+
+static int pi_unlock(uint32_t *lock, int tid)
+{
+	uint32_t owner = tid;
+
+	if (__atomic_compare_exchange_n(lock, &owner, 0, 0, __ATOMIC_RELEASE,
+					__ATOMIC_RELAXED))
+		return 0;
+	return futex(lock, FUTEX_UNLOCK_PI_PRIVATE, 0) ? -1 : 0;
+}
+
+static int futex_init(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	struct futex_pair *fp = &fpair[par->num];
+
+	if (mode != MODE_PI)
+		return 0;
+
+	/* The receiver must not take the lock before the sender owns it */
+	if (!par->sender)
+		return futex_await(&fp->ready, 0, 0);
+
+	if (pi_lock(&fp->lock, par->tid))
+		return 1;
+	p->held = 1;
+	__atomic_store_n(&fp->ready, 1, __ATOMIC_RELEASE);
+	futex_wake(&fp->ready, INT_MAX);
+	return 0;
+}
+
+static int futex_prepare(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	struct futex_pair *fp = &fpair[par->num];
+	uint32_t seq = __atomic_load_n(&fp->seq, __ATOMIC_RELAXED);
+
+	/*
+	 * Take the lock back while the receiver releases it, but only after
+	 * the receiver got it, else the unlock of send went to the fast path
+	 * and we would simply grab it again.
+	 */
+	if (mode == MODE_PI && !p->held) {
+		if (futex_await(&fp->taken, seq, 1))
+			return 1;
+		if (pi_lock(&fp->lock, par->tid))
+			return 1;
+		p->held = 1;
+	}
+
+	return futex_await(&fp->ack, seq * waiters, 1);
+}
+
+static int futex_send(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	struct futex_pair *fp = &fpair[par->num];
+
+	__atomic_fetch_add(&fp->seq, 1, __ATOMIC_SEQ_CST);
+	switch (mode) {
+	case MODE_PI:
+		p->held = 0;
+		return pi_unlock(&fp->lock, par->tid);
+	case MODE_SPIN:
+		if (!__atomic_load_n(&fp->sleepers, __ATOMIC_SEQ_CST))
+			break;
+		/* fall through */
+	default:
+		futex_wake(&fp->seq, INT_MAX);
+		break;
+	}
+	return 0;
+}
+
+static int futex_receive(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	struct futex_pair *fp = &fpair[par->num];
+
+	if (mode == MODE_PI) {
+		if (pi_lock(&fp->lock, par->tid))
+			return 1;
+		__atomic_fetch_add(&fp->taken, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&fp->taken, 1);
+		return futex_stopped();
+	}
+	return futex_pair_wait(fp, &p->seen, &p->spins);
+}
+
+static int futex_release(struct ipc_params *par)
+{
+	if (mode == MODE_PI)
+		return pi_unlock(&fpair[par->num].lock, par->tid);
+	return 0;
+}
+
+static int futex_ack(struct ipc_params *par)
+{
+	struct futex_pair *fp = &fpair[par->num];
+
+	/*
+	 * The sender has to own the lock again before the next receive
+	 * blocks on it. A PI futex word can not be waited for with
+	 * FUTEX_WAIT, so yield until it is taken.
+	 */
+	while (mode == MODE_PI && !__atomic_load_n(&fp->lock, __ATOMIC_ACQUIRE)) {
+		if (futex_stopped())
+			return 1;
+		sched_yield();
+	}
+	futex_pair_ack(fp);
+	return 0;
+}
+
+static void futex_exit(struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+
+	/* Let a receiver blocked on the lock run to its shutdown check */
+	if (p->held) {
+		pi_unlock(&fpair[par->num].lock, par->tid);
+		p->held = 0;
+	}
+}
+
+static void herd_stats(int pair, int *samples, uint64_t *min, uint64_t *max,
+		       double *sum)
+{
+	struct herd_waiter *w = &herd[pair * (waiters - 1)];
+	int i;
+
+	*samples = 0;
+	*min = UINT64_MAX;
+	*max = 0;
+	*sum = 0;
+	for (i = 0; i < waiters - 1; i++, w++) {
+		*samples += w->samples;
+		if (w->samples && w->min < *min)
+			*min = w->min;
+		if (w->max > *max)
+			*max = w->max;
+		*sum += w->sum;
+	}
+}
+
+static void futex_print(FILE *f, struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	uint64_t min, max;
+	double sum;
+	int samples;
+
+	fprintf(f, "Mode %s, ", mode_names[mode]);
+	if (mode == MODE_SPIN)
+		fprintf(f, "Spun %d, ", p->spins);
+	if (waiters > 1) {
+		herd_stats(par->num, &samples, &min, &max, &sum);
+		fprintf(f, "W%d Max %llu, ", waiters, (unsigned long long)max);
+	}
+}
+
+static void futex_json(FILE *f, struct ipc_params *par)
+{
+	struct params *p = (struct params *)par;
+	uint64_t min, max;
+	double sum;
+	int samples;
+
+	fprintf(f, "        \"mode\": \"%s\",\n", mode_names[mode]);
+	if (mode == MODE_SPIN) {
+		fprintf(f, "        \"spin_ns\": %d,\n", spin_ns);
+		fprintf(f, "        \"spin_wakeups\": %d,\n", p->spins);
+	}
+	if (waiters > 1) {
+		herd_stats(par->num, &samples, &min, &max, &sum);
+		fprintf(f, "        \"waiters\": %d,\n", waiters);
+		fprintf(f, "        \"herd\": { \"samples\": %d, \"min\": %llu, "
+			"\"avg\": %.2f, \"max\": %llu },\n", samples,
+			samples ? (unsigned long long)min : 0,
+			samples ? sum / samples : 0.0, (unsigned long long)max);
+	}
+}
+
+static const struct ipc_ops futex_ops = {
+	.init		= futex_init,
+	.prepare	= futex_prepare,
+	.send		= futex_send,
+	.receive	= futex_receive,
+	.release	= futex_release,
+	.ack		= futex_ack,
+	.exit		= futex_exit,
+	.print		= futex_print,
+	.json		= futex_json,
+};
+
+/* Additional waiters of a pair, their latency is kept apart from the pair */
+static void *herd_thread(void *arg)
+{
+	struct herd_waiter *w = arg;
+	struct futex_pair *fp = &fpair[w->pair];
+	struct ipc_params *sender = ipc_sender(param, w->pair);
+	int nsecs = sender->nsecs;
+	uint64_t diff;
+
+	ipc_setup_thread(w->cpu, w->priority);
+	w->tid = gettid();
+
+	while (!futex_pair_wait(fp, &w->seen, &w->spins)) {
+		diff = ipc_now() - sender->stamp;
+		if (!nsecs)
+			diff /= 1000;
+		if (!w->samples || diff < w->min)
+			w->min = diff;
+		if (diff > w->max)
+			w->max = diff;
+		w->sum += (double) diff;
+		w->samples++;
+		futex_pair_ack(fp);
 	}
-	par->stopped = 1;
 	return NULL;
 }
 
+static void herd_print(void)
+{
+	uint64_t min, max;
+	double sum;
+	int i, samples;
+
+	for (i = 0; i < ((struct ipc_params *)param)->num_threads; i++) {
+		herd_stats(i, &samples, &min, &max, &sum);
+		if (!samples)
+			continue;
+		printf("#%d -> herd of %d, Min %4llu, Avg %4llu, Max %4llu\n",
+		       i*2+1, waiters - 1, (unsigned long long)min,
+		       (unsigned long long)(sum / samples + 0.5),
+		       (unsigned long long)max);
+	}
+}
+
+static int parse_mode(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(mode_names); i++)
+		if (!strcmp(name, mode_names[i]))
+			return i;
+	return -1;
+}
+
 
 static void display_help(int error)
 {
@@ -148,17 +540,32 @@ static void display_help(int error)
 	       "-D       --duration=TIME   specify a length for the test run.\n"
 	       "                           Append 'm', 'h', or 'd' to specify minutes, hours or\n"
 	       "                           days.\n"
+	       "         --export=SPEC     serve live stats in OpenMetrics format on the Unix\n"
+	       "                           socket unix:PATH or on localhost:PORT\n"
 	       "-i INTV  --interval=INTV   base interval of thread in us default=1000\n"
 	       "         --json=FILENAME   write final results into FILENAME, JSON formatted\n"
 	       "-l LOOPS --loops=LOOPS     number of loops: default=0(endless)\n"
+	       "         --mode=MODE       primitive the receiver blocks on:\n"
+	       "                           mutex  pthread mutex handoff (default)\n"
+	       "                           futex  FUTEX_WAIT/FUTEX_WAKE\n"
+	       "                           pi     FUTEX_LOCK_PI/FUTEX_UNLOCK_PI\n"
+	       "                           spin   spin for --spin=NSEC, then FUTEX_WAIT\n"
+	       "                           waitv  futex_waitv() (Linux 5.16 and later)\n"
+	       "-N       --nsecs           print results in ns instead of us (default us)\n"
+	       "         --placement=POL   order the CPUs of the threads by topology, POL is\n"
+	       "                           rr, core, nosmt, llc or cross-node; the two\n"
+	       "                           sides of a pair get consecutive CPUs\n"
 	       "-p PRIO  --prio=PRIO       priority\n"
 	       "-q       --quiet           print a summary only on exit\n"
 	       "-S       --smp             SMP testing: options -a -t and same priority\n"
 	       "                           of all threads\n"
+	       "         --spin=NSEC       spin budget of --mode=spin in ns, default=20000\n"
 	       "-t       --threads         one thread per available processor\n"
 	       "-t [NUM] --threads=NUM     number of threads:\n"
 	       "                           without NUM, threads = max_cpus\n"
 	       "                           without -t default = 1\n"
+	       "         --waiters=NUM     wake NUM waiters per release, needs --mode=futex,\n"
+	       "                           spin or waitv, default=1\n"
 	       );
 	exit(error);
 }
@@ -176,12 +583,15 @@ static int distance = 500;
 static int smp;
 static int sameprio;
 static int quiet;
+static int use_nsecs;
 static char jsonfile[MAX_PATH];
+static char exportspec[MAX_PATH];
 
 enum option_value {
-	OPT_AFFINITY=1, OPT_BREAKTRACE, OPT_DISTANCE, OPT_DURATION,
-	OPT_HELP, OPT_INTERVAL, OPT_JSON, OPT_LOOPS, OPT_PRIORITY,
-	OPT_QUIET, OPT_SMP, OPT_THREADS
+	OPT_AFFINITY=1, OPT_BREAKTRACE, OPT_DISTANCE, OPT_DURATION, OPT_EXPORT,
+	OPT_HELP, OPT_INTERVAL, OPT_JSON, OPT_LOOPS, OPT_MODE, OPT_NSECS,
+	OPT_PLACEMENT, OPT_PRIORITY, OPT_QUIET, OPT_SMP, OPT_SPIN, OPT_THREADS,
+	OPT_WAITERS
 };
 
 static void process_options(int argc, char *argv[])
@@ -197,17 +607,23 @@ static void process_options(int argc, char *argv[])
 			{"breaktrace",	required_argument,	NULL, OPT_BREAKTRACE},
 			{"distance",	required_argument,	NULL, OPT_DISTANCE},
 			{"duration",	required_argument,	NULL, OPT_DURATION},
+			{"export",	required_argument,	NULL, OPT_EXPORT},
 			{"help",	no_argument,		NULL, OPT_HELP},
 			{"interval",	required_argument,	NULL, OPT_INTERVAL},
 			{"json",	required_argument,      NULL, OPT_JSON },
 			{"loops",	required_argument,	NULL, OPT_LOOPS},
+			{"mode",	required_argument,	NULL, OPT_MODE},
+			{"nsecs",	no_argument,		NULL, OPT_NSECS},
+			{"placement",	required_argument,	NULL, OPT_PLACEMENT},
 			{"priority",	required_argument,	NULL, OPT_PRIORITY},
 			{"quiet",	no_argument	,	NULL, OPT_QUIET},
 			{"smp",		no_argument,		NULL, OPT_SMP},
+			{"spin",	required_argument,	NULL, OPT_SPIN},
 			{"threads",	optional_argument,	NULL, OPT_THREADS},
+			{"waiters",	required_argument,	NULL, OPT_WAITERS},
 			{NULL, 0, NULL, 0}
 		};
-		int c = getopt_long (argc, argv, "a::b:d:i:l:D:p:qSt::h",
+		int c = getopt_long (argc, argv, "a::b:d:i:l:ND:p:qSt::h",
 			long_options, &option_index);
 		if (c == -1)
 			break;
@@ -244,6 +660,9 @@ static void process_options(int argc, char *argv[])
 		case 'i':
 			interval = atoi(optarg);
 			break;
+		case OPT_EXPORT:
+			strncpy(exportspec, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
 		case OPT_JSON:
 			strncpy(jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
 			break;
@@ -256,6 +675,24 @@ static void process_options(int argc, char *argv[])
 		case 'l':
 			max_cycles = atoi(optarg);
 			break;
+		case OPT_MODE:
+			mode = parse_mode(optarg);
+			if (mode < 0) {
+				warn("unknown mode %s\n", optarg);
+				error = 1;
+			}
+			break;
+		case OPT_NSECS:
+		case 'N':
+			use_nsecs = 1;
+			break;
+		case OPT_PLACEMENT:
+			if (ipc_placement(optarg)) {
+				warn("invalid placement '%s', use one of "
+				     CPU_PLAN_POLICIES "\n", optarg);
+				error = 1;
+			}
+			break;
 		case OPT_PRIORITY:
 		case 'p':
 			priority = atoi(optarg);
@@ -270,6 +707,9 @@ static void process_options(int argc, char *argv[])
 			num_threads = max_cpus;
 			setaffinity = AFFINITY_USEALL;
 			break;
+		case OPT_SPIN:
+			spin_ns = atoi(optarg);
+			break;
 		case OPT_THREADS:
 		case 't':
 			if (smp) {
@@ -283,6 +723,9 @@ static void process_options(int argc, char *argv[])
 			else
 				num_threads = max_cpus;
 			break;
+		case OPT_WAITERS:
+			waiters = atoi(optarg);
+			break;
 		default:
 			display_help(1);
 			break;
@@ -311,6 +754,22 @@ static void process_options(int argc, char *argv[])
 	if (duration < 0)
 		error = 1;
 
+	if (spin_ns < 0)
+		error = 1;
+
+	if (waiters < 1 || waiters > 256)
+		error = 1;
+
+	if (waiters > 1 && (mode == MODE_MUTEX || mode == MODE_PI)) {
+		warn("--waiters only works with --mode=futex, spin or waitv\n");
+		error = 1;
+	}
+
+	if (mode == MODE_WAITV && !futex_waitv_supported()) {
+		warn("futex_waitv() is not supported by this kernel\n");
+		error = 1;
+	}
+
 	if (priority && smp)
 		sameprio = 1;
 
@@ -326,72 +785,11 @@ static void sighand(int sig)
 	shutdown = 1;
 }
 
-static void print_stat(FILE *fp, struct params *receiver, struct params *sender,
-		       int verbose, int quiet)
-{
-	int i;
-
-	if (quiet)
-		return;
-
-	for (i = 0; i < num_threads; i++) {
-		printf("#%1d: ID%d, P%d, CPU%d, I%ld; #%1d: ID%d, P%d, CPU%d, Cycles %d\n",
-			i*2, receiver[i].tid, receiver[i].priority, receiver[i].cpu,
-			receiver[i].delay.tv_nsec / 1000,
-			i*2+1, sender[i].tid, sender[i].priority, sender[i].cpu,
-			sender[i].samples);
-	}
-	for (i = 0; i < num_threads; i++) {
-		printf("#%d -> #%d, Min %4d, Cur %4d, Avg %4d, Max %4d\n",
-			i*2+1, i*2,
-			receiver[i].mindiff, (int) receiver[i].diff.tv_usec,
-			(int) ((receiver[i].sumdiff / receiver[i].samples) + 0.5),
-			receiver[i].maxdiff);
-	}
-}
-
-struct params_stats {
-	struct params *receiver;
-	struct params *sender;
-};
-
-static void write_stats(FILE *f, void *data)
-{
-	struct params_stats *ps = data;
-	struct params *s, *r;
-	unsigned int i;
-
-	fprintf(f, "  \"num_threads\": %d,\n", num_threads);
-	fprintf(f, "  \"thread\": {\n");
-	for (i = 0; i < num_threads; i++) {
-		s = &ps->sender[i];
-		r = &ps->receiver[i];
-		fprintf(f, "    \"%u\": {\n", i);
-		fprintf(f, "      \"sender\": {\n");
-		fprintf(f, "        \"cpu\": %d,\n", s->cpu);
-		fprintf(f, "        \"priority\": %d,\n", s->priority);
-		fprintf(f, "        \"samples\": %d,\n", s->samples);
-		fprintf(f, "        \"interval\": %ld\n", r->delay.tv_nsec/1000);
-		fprintf(f, "      },\n");
-		fprintf(f, "      \"receiver\": {\n");
-		fprintf(f, "        \"cpu\": %d,\n", r->cpu);
-		fprintf(f, "        \"priority\": %d,\n", r->priority);
-		fprintf(f, "        \"min\": %d,\n", r->mindiff);
-		fprintf(f, "        \"avg\": %.2f,\n", r->sumdiff/r->samples);
-		fprintf(f, "        \"max\": %d\n", r->maxdiff);
-		fprintf(f, "      }\n");
-		fprintf(f, "    }%s\n", i == num_threads - 1 ? "" : ",");
-	}
-	fprintf(f, "  }\n");
-}
-
 int main(int argc, char *argv[])
 {
 	int i;
-	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
 	int oldsamples = 1;
-	struct params *receiver = NULL;
-	struct params *sender = NULL;
+	struct ipc_params *receiver, *sender;
 	sigset_t sigset;
 	struct timespec maindelay;
 
@@ -413,61 +811,70 @@ int main(int argc, char *argv[])
 	if (duration)
 		alarm(duration);
 
-	receiver = calloc(num_threads, sizeof(struct params));
-	sender = calloc(num_threads, sizeof(struct params));
-	if (receiver == NULL || sender == NULL)
-		goto nomem;
-
-	testmutex = (pthread_mutex_t *) calloc(num_threads, sizeof(pthread_mutex_t));
-	syncmutex = (pthread_mutex_t *) calloc(num_threads, sizeof(pthread_mutex_t));
-	if (testmutex == NULL || syncmutex == NULL)
+	ipc_init(mode == MODE_MUTEX ? &ptsem_ops : &futex_ops,
+		 sizeof(struct params));
+	param = ipc_alloc(num_threads, use_nsecs, NULL);
+	if (param == NULL)
 		goto nomem;
+	if (*exportspec && ipc_export(param, "ptsematest", exportspec))
+		fatal("failed to export stats on %s: %s\n", exportspec,
+		      strerror(errno));
+
+	if (mode == MODE_MUTEX) {
+		testmutex = calloc(num_threads, sizeof(pthread_mutex_t));
+		syncmutex = calloc(num_threads, sizeof(pthread_mutex_t));
+		if (testmutex == NULL || syncmutex == NULL)
+			goto nomem;
+	} else {
+		if (posix_memalign((void **)&fpair, sizeof(struct futex_pair),
+				   num_threads * sizeof(struct futex_pair)))
+			goto nomem;
+		memset(fpair, 0, num_threads * sizeof(struct futex_pair));
+		herd = calloc(num_threads * waiters, sizeof(struct herd_waiter));
+		if (herd == NULL)
+			goto nomem;
+	}
 
 	for (i = 0; i < num_threads; i++) {
-		receiver[i].mindiff = UINT_MAX;
-		receiver[i].maxdiff = 0;
-		receiver[i].sumdiff = 0.0;
+		int cpu = ipc_cpu(setaffinity, affinity, i);
+		int j;
 
+		if (mode == MODE_MUTEX) {
+			pthread_mutex_init(&testmutex[i], NULL);
+			pthread_mutex_init(&syncmutex[i], NULL);
 
-		pthread_mutex_init(&testmutex[i], NULL);
-		pthread_mutex_init(&syncmutex[i], NULL);
+			/* Wait on first attempt */
+			pthread_mutex_lock(&testmutex[i]);
+		}
 
-		/* Wait on first attempt */
-		pthread_mutex_lock(&testmutex[i]);
+		ipc_pair_init(param, i, cpu, priority, interval, max_cycles,
+			      tracelimit);
+		for (j = 0; j < waiters - 1; j++) {
+			struct herd_waiter *w = &herd[i * (waiters - 1) + j];
 
-		receiver[i].num = i;
-		receiver[i].cpu = i;
-		switch (setaffinity) {
-		case AFFINITY_UNSPECIFIED: receiver[i].cpu = -1; break;
-		case AFFINITY_SPECIFIED: receiver[i].cpu = affinity; break;
-		case AFFINITY_USEALL: receiver[i].cpu = i % max_cpus; break;
+			w->pair = i;
+			w->cpu = cpu;
+			w->priority = priority;
+			pthread_create(&w->threadid, NULL, herd_thread, w);
 		}
-		receiver[i].priority = priority;
-		receiver[i].tracelimit = tracelimit;
 		if (priority > 1 && !sameprio)
 			priority--;
-		receiver[i].delay.tv_sec = interval / USEC_PER_SEC;
-		receiver[i].delay.tv_nsec = (interval % USEC_PER_SEC) * 1000;
 		interval += distance;
-		receiver[i].max_cycles = max_cycles;
-		receiver[i].sender = 0;
-		receiver[i].neighbor = &sender[i];
-		pthread_create(&receiver[i].threadid, NULL, semathread, &receiver[i]);
-		memcpy(&sender[i], &receiver[i], sizeof(receiver[0]));
-		sender[i].sender = 1;
-		sender[i].neighbor = &receiver[i];
-		pthread_create(&sender[i].threadid, NULL, semathread, &sender[i]);
+		receiver = ipc_receiver(param, i);
+		sender = ipc_sender(param, i);
+		pthread_create(&receiver->threadid, NULL, ipc_thread, receiver);
+		pthread_create(&sender->threadid, NULL, ipc_thread, sender);
 	}
 
 	maindelay.tv_sec = 0;
 	maindelay.tv_nsec = 50000000; /* 50 ms */
+	receiver = ipc_receiver(param, 0);
 
 	while (!shutdown) {
-		for (i = 0; i < num_threads; i++)
-			shutdown |= receiver[i].shutdown | sender[i].shutdown;
+		shutdown |= ipc_should_stop(param);
 
-		if (receiver[0].samples > oldsamples || shutdown) {
-			print_stat(stdout, receiver, sender, 0, quiet);
+		if (receiver->samples > oldsamples || shutdown) {
+			ipc_print_stat(param, quiet);
 			if (!quiet)
 				printf("\033[%dA", num_threads*2);
 		}
@@ -486,35 +893,44 @@ int main(int argc, char *argv[])
 	if (!quiet)
 		printf("\033[%dB", num_threads*2 + 2);
 	else
-		print_stat(stdout, receiver, sender, 0, 0);
-
-	for (i = 0; i < num_threads; i++) {
-		receiver[i].shutdown = 1;
-		sender[i].shutdown = 1;
-		pthread_mutex_unlock(&testmutex[i]);
-		pthread_mutex_unlock(&syncmutex[i]);
+		ipc_print_stat(param, 0);
+	ipc_print_percentiles(param);
+	if (waiters > 1)
+		herd_print();
+
+	ipc_stop(param);
+	if (mode == MODE_MUTEX) {
+		for (i = 0; i < num_threads; i++) {
+			pthread_mutex_unlock(&testmutex[i]);
+			pthread_mutex_unlock(&syncmutex[i]);
+		}
+	} else {
+		futex_stop();
 	}
-	nanosleep(&receiver[0].delay, NULL);
+	nanosleep(&receiver->delay, NULL);
 
 	for (i = 0; i < num_threads; i++) {
-		if (!receiver[i].stopped)
-			pthread_kill(receiver[i].threadid, SIGTERM);
-		if (!sender[i].stopped)
-			pthread_kill(sender[i].threadid, SIGTERM);
+		receiver = ipc_receiver(param, i);
+		sender = ipc_sender(param, i);
+		if (!receiver->stopped)
+			pthread_kill(receiver->threadid, SIGTERM);
+		if (!sender->stopped)
+			pthread_kill(sender->threadid, SIGTERM);
 	}
 
-	for (i = 0; i < num_threads; i++) {
+	for (i = 0; i < num_threads * (waiters - 1); i++)
+		pthread_join(herd[i].threadid, NULL);
+
+	for (i = 0; mode == MODE_MUTEX && i < num_threads; i++) {
 		pthread_mutex_destroy(&testmutex[i]);
 		pthread_mutex_destroy(&syncmutex[i]);
 	}
 
-	if (strlen(jsonfile) != 0) {
-		struct params_stats ps = {
-			.receiver = receiver,
-			.sender = sender,
-		};
-		rt_write_json(jsonfile, 0, write_stats, &ps);
-	}
+	if (*exportspec)
+		ipc_export_stop();
+
+	if (strlen(jsonfile) != 0)
+		rt_write_json(jsonfile, 0, ipc_write_stats, param);
 
 nomem:
 
@@ -4,11 +4,10 @@
 # Copyright (C) 2018 Marcelo Tosatti <mtosatti@redhat.com>
 
 #  A script to determine the maximum mpps. Logic:
-#  Increase mpps in 0.5 units 
-# 
+#  Let queuelat --search find the maximum, then confirm it with a
+#  10 minute run, stepping down by 0.1 Mpps until one passes
 MAXLAT="20000"
 CYCLES_PER_PACKET="300"
-OUTFILE=/usr/tmp/outfile
 PRIO=1
 CPULIST=0
 SCHED=""
@@ -89,98 +88,25 @@ echo "Determining maximum mpps the machine can handle"
 echo "Will take a few minutes to determine mpps value"
 echo "And 10 minutes run to confirm the final mpps value is stable"
 
-for mpps in $(seq 3 3 50); do
-	echo testing "$mpps" Mpps
-
-	OUTFILE=$(mktemp)
-	$PREAMBLE queuelat -m $MAXLAT -c $CYCLES_PER_PACKET -f "$(get_cpuinfo_mhz)" -p "$mpps" -t 30 > "$OUTFILE"
-
-	exceeded=$(grep exceeded "$OUTFILE")
-	if [ ! -z "$exceeded" ]; then
-		echo mpps failed: "$mpps"
-		break;
-	fi
-	echo success
-done
-echo first loop mpps: "$mpps"
-
-first_mpps=$(($mpps - 1))
-for mpps in $(seq $first_mpps -1 3); do
-	echo testing "$mpps" Mpps
-
-	OUTFILE=$(mktemp)
-	$PREAMBLE queuelat -m $MAXLAT -c $CYCLES_PER_PACKET -f "$(get_cpuinfo_mhz)" -p "$mpps" -t 30 > "$OUTFILE"
-
-	exceeded=$(grep exceeded "$OUTFILE")
-	if [ -z "$exceeded" ]; then
-		echo mpps success "$mpps"
-		break;
-	fi
-	echo failure
-done
-
-second_mpps=$(echo "$mpps + 0.3" | bc)
-echo second loop mpps: "$mpps"
-
-for mpps in $(seq "$second_mpps" 0.3 $first_mpps); do
-	echo testing "$mpps" Mpps
-
-	OUTFILE=$(mktemp)
-	$PREAMBLE queuelat -m $MAXLAT -c $CYCLES_PER_PACKET -f "$(get_cpuinfo_mhz)" -p "$mpps" -t 30 > "$OUTFILE"
-
-	exceeded=$(grep exceeded "$OUTFILE")
-	if [ ! -z "$exceeded" ]; then
-		echo mpps failure "$mpps"
-		break;
-	fi
-	echo success
-done
-
-echo third loop mpps: "$mpps"
-third_mpps=$(echo "$mpps -0.1" | bc)
-
-for mpps in $(seq "$third_mpps" -0.1 3); do
-	echo testing "$mpps" Mpps
-
-	OUTFILE=$(mktemp)
-	$PREAMBLE queuelat -m $MAXLAT -c $CYCLES_PER_PACKET -f "$(get_cpuinfo_mhz)" -p "$mpps" -t 30 > "$OUTFILE"
-
-	exceeded=$(grep exceeded "$OUTFILE")
-	if [ -z "$exceeded" ]; then
-		echo mpps success "$mpps"
-		break;
-	fi
-	echo failure
-done
-
-export queuelat_failure=1
-while [ $queuelat_failure == 1 ]; do
-
-	export queuelat_failure=0
-
-	echo -n "Starting 10 runs of 30 seconds with "
-	echo "$mpps Mpps"
-
-	for i in $(seq 1 10); do
-		$PREAMBLE queuelat -m $MAXLAT -c $CYCLES_PER_PACKET -f "$(get_cpuinfo_mhz)" -p "$mpps" -t 30 > "$OUTFILE"
-		exceeded=$(grep exceeded "$OUTFILE")
-
-		if [ ! -z "$exceeded" ]; then
-			echo "mpps failure (run $i) $mpps"
-			export queuelat_failure=1
-			mpps=$(echo "$mpps" - 0.1 | bc)
-			export mpps
-			break
-		fi
-		echo "run $i success"
-	done
-
-done
+# queuelat calibrates once and searches the rate itself, each step
+# soaking for 30 seconds.
+OUTFILE=$(mktemp)
+trap 'rm -f "$OUTFILE"' EXIT
+$PREAMBLE queuelat -m $MAXLAT -c $CYCLES_PER_PACKET -f "$(get_cpuinfo_mhz)" -p 3 \
+	--search --soak 30 --resolution 0.1 | tee "$OUTFILE"
+
+mpps=$(awk '/^maximum mpps:/ { print $3 }' "$OUTFILE")
+if [ -z "$mpps" ]; then
+	echo "no sustainable mpps found"
+	exit 1
+fi
 
+run=0
 export queuelat_failure=1
 while [ $queuelat_failure == 1 ]; do
 
 	export queuelat_failure=0
+	run=$((run + 1))
 
 	echo -n "Starting 10 minutes run with "
 	echo "$mpps Mpps"
@@ -189,13 +115,13 @@ while [ $queuelat_failure == 1 ]; do
 	exceeded=$(grep exceeded "$OUTFILE")
 
 	if [ ! -z "$exceeded" ]; then
-		echo "mpps failure (run $i) $mpps"
+		echo "mpps failure (run $run) $mpps"
 		export queuelat_failure=1
 		mpps=$(echo "$mpps" - 0.1 | bc)
 		export mpps
 		continue
 	fi
-	echo "run $i success"
+	echo "run $run success"
 done
 
 echo Final mpps is: "$mpps"
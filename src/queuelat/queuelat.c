@@ -17,8 +17,16 @@
 #include <signal.h>
 #include <time.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 
 #include "rt-utils.h"
+#include "rt-error.h"
+#include "rt-numa.h"
+#include "rt-histogram.h"
+
+#include "queuelat_buckets.h"
 
 /* Program parameters:
  * max_queue_len: maximum latency allowed, in nanoseconds (int).
@@ -66,32 +74,12 @@ int max_queue_len;
 int default_n;
 int nr_packets_drain_per_block;
 
-/* 
- * Parameters for the stats collection buckets
- */
-
-#define LAST_VAL 70000
-#define VALS_PER_BUCKET 100
-#define NR_BUCKETS LAST_VAL/VALS_PER_BUCKET
-
 unsigned long long buckets[NR_BUCKETS+1];
 unsigned long long total_count;
 
-#define OUTLIER_BUCKET NR_BUCKETS
-
-static int val_to_bucket(unsigned long long val)
-{
-	int bucket_nr = val / VALS_PER_BUCKET;
-	if (bucket_nr >= NR_BUCKETS)
-		return OUTLIER_BUCKET;
-	return bucket_nr;
-}
-
 static void account(unsigned long long val)
 {
-	int bucket_nr = val_to_bucket(val);
-	buckets[bucket_nr]++;
-	total_count++;
+	account_bucket(buckets, &total_count, val);
 }
 
 static unsigned long long total_samples(void)
@@ -280,6 +268,7 @@ static inline unsigned long long __rdtscll(void)
 }
 
 #define gettick(val) do { (val) = __rdtscll(); } while (0)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
 
 #else
 
@@ -296,9 +285,13 @@ static inline unsigned long long __clock_gettime(void)
 }
 
 #define gettick(val) do { (val) = __clock_gettime(); } while (0)
+#define cpu_relax() do { } while (0)
 
 #endif
 
+/* the copies are never read, keep the compiler from dropping them */
+#define keep_buffer(p) __asm__ __volatile__("" : : "r" (p) : "memory")
+
 static void init_buckets(void)
 {
 	int i;
@@ -325,31 +318,6 @@ static int find_highest_count_bucket(void)
 	return max_bucket;
 }
 
-int tracing_mark_fd;
-static void trace_open(void)
-{
-	int fd;
-
-	fd = open("/sys/kernel/debug/tracing/trace_marker", O_RDWR);
-
-	if (fd == -1) {
-		perror("open");
-		exit(0);
-	}
-	tracing_mark_fd = fd;
-}
-
-static void trace_write(char *buf, int len)
-{
-	int ret;
-
-	ret = write(tracing_mark_fd, buf, len);
-	if (ret == -1) {
-		perror("write");
-		exit(0);
-	}
-}
-
 static void run_n(int n)
 {
 	u64 a, b, delta;
@@ -377,6 +345,7 @@ static void run_n(int n)
 	for (i = 0; i < loops; i++) {
 		gettick(b);
 		memmove(dest, src, n);
+		keep_buffer(dest);
 		gettick(a);
 		delta = (a - b) * cycles_to_ns;
 		account(delta);
@@ -447,7 +416,8 @@ void main_loop(void)
 	void *dest, *src;
 	int queue_size = 0;
 
-	trace_open();
+	if (tracemark_open(TRACEMARK_QUIET))
+		printf("trace_marker not available, not annotating the trace\n");
 
 	init_buckets();
 
@@ -468,12 +438,11 @@ void main_loop(void)
 	memmove(dest, src, default_n);
 
 	while (1) {
-		char buf[500];
-		int ret;
 		int nr_packets_fill;
 
 		gettick(b);
 		memmove(dest, src, default_n);
+		keep_buffer(dest);
 		gettick(a);
 		delta = (a - b) * cycles_to_ns;
 		account(delta);
@@ -496,20 +465,17 @@ void main_loop(void)
 		if (queue_size <= min_queue_size_to_print)
 			continue;
 
-		ret = sprintf(buf, "memmove block queue_size=%d queue_dec=%d"
-			           " queue_inc=%d delta=%llu ns\n", queue_size,
-				   nr_packets_drain_per_block,
-				   nr_packets_fill, delta);
-		trace_write(buf, ret);
+		TRACEMARK("memmove block queue_size=%d queue_dec=%d"
+			  " queue_inc=%d delta=%llu ns\n", queue_size,
+			  nr_packets_drain_per_block, nr_packets_fill, delta);
 
 		if (queue_size > max_queue_len) {
 			printf("queue length exceeded: "
 				" queue_size=%d max_queue_len=%d\n",
 				queue_size, max_queue_len);
-			ret = sprintf(buf, "queue length exceeded: "
-					   "queue_size=%d max_queue_len=%d\n",
-					   queue_size, max_queue_len);
-			trace_write(buf, ret);
+			tracemark_printf("queue length exceeded: "
+					 "queue_size=%d max_queue_len=%d\n",
+					 queue_size, max_queue_len);
 			print_exit_info();
 			exit(0);
 		}
@@ -519,8 +485,682 @@ void main_loop(void)
 	free(src);
 }
 
+/*
+ * Maximum rate search
+ * ===================
+ *
+ * With --search queuelat looks for the highest packet rate the single
+ * queue model sustains. The calibration done by measure_n() and the
+ * drain rate do not depend on the rate, so they are computed once and
+ * every step reuses the same warm buffers. Starting at -p the rate is
+ * doubled until a step fails, or halved until one passes, and the
+ * bracket is then bisected down to --resolution.
+ *
+ * A step passes after --soak seconds without exceeding max_queue_len.
+ * It fails as soon as the queue overflows, or early when the mean net
+ * growth of the queue per block is above zero with --confidence: such
+ * a queue is bound to overflow and waiting for it only costs time.
+ */
+
+#define SEARCH_CHECK_BLOCKS	1024
+
+struct search_step {
+	double mpps;
+	double secs;
+	unsigned long long blocks;
+	int max_queue;
+	double avg_queue;
+	int passed;
+	const char *reason;
+};
+
+static const struct {
+	double pct;
+	double z;
+} z_table[] = {
+	{ 90, 1.645 }, { 95, 1.960 }, { 99, 2.576 }, { 99.9, 3.291 },
+	{ 99.99, 3.891 },
+};
+
+int search;
+double soak_secs = 10;
+double resolution = 0.1;
+double confidence = 99;
+int confirm_runs;
+char *jsonfile;
+volatile sig_atomic_t search_stop;
+
+static double search_z2;
+static void *search_dest, *search_src;
+static struct search_step *steps;
+static unsigned int nr_steps;
+static double search_result = -1;
+
+static double confidence_to_z(double pct)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(z_table) - 1; i++)
+		if (pct <= z_table[i].pct)
+			break;
+
+	return z_table[i].z;
+}
+
+static double elapsed_secs(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / (double)NSEC_PER_SEC;
+}
+
+static void search_soak(struct search_step *st)
+{
+	struct timespec start;
+	u64 a, b, delta;
+	double growth, mean, var, sum = 0, sumsq = 0, queue_sum = 0;
+	int nr_packets_fill, queue_size = 0;
+
+	init_buckets();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		gettick(b);
+		memmove(search_dest, search_src, default_n);
+		keep_buffer(search_dest);
+		gettick(a);
+		delta = (a - b) * cycles_to_ns;
+		account(delta);
+
+		nr_packets_fill = delta * st->mpps * 1000000 / NSEC_PER_SEC;
+		growth = nr_packets_fill - nr_packets_drain_per_block;
+		queue_size += nr_packets_fill - nr_packets_drain_per_block;
+		if (queue_size < 0)
+			queue_size = 0;
+
+		st->blocks++;
+		sum += growth;
+		sumsq += growth * growth;
+		queue_sum += queue_size;
+		if (queue_size > st->max_queue)
+			st->max_queue = queue_size;
+
+		if (queue_size > max_queue_len) {
+			st->reason = "queue length exceeded";
+			break;
+		}
+
+		if (st->blocks % SEARCH_CHECK_BLOCKS)
+			continue;
+
+		if (search_stop) {
+			st->reason = "interrupted";
+			break;
+		}
+		if (elapsed_secs(&start) >= soak_secs) {
+			st->passed = 1;
+			break;
+		}
+
+		/* mean - z * stddev / sqrt(n) > 0, squared */
+		mean = sum / st->blocks;
+		var = sumsq / st->blocks - mean * mean;
+		if (mean > 0 && mean * mean * st->blocks > search_z2 * var) {
+			st->reason = "queue growing";
+			break;
+		}
+	}
+
+	st->secs = elapsed_secs(&start);
+	st->avg_queue = queue_sum / st->blocks;
+}
+
+static int search_try(double rate)
+{
+	struct search_step *st;
+
+	steps = realloc(steps, (nr_steps + 1) * sizeof(*steps));
+	if (!steps)
+		fatal("failed to allocate search steps\n");
+	st = &steps[nr_steps++];
+	memset(st, 0, sizeof(*st));
+	st->mpps = rate;
+
+	search_soak(st);
+
+	printf("step %2u: %8.3f mpps %s after %.1f s, queue max %d avg %.1f",
+	       nr_steps, rate, st->passed ? "passed" : "failed", st->secs,
+	       st->max_queue, st->avg_queue);
+	if (st->reason)
+		printf(" (%s)", st->reason);
+	printf("\n");
+	fflush(stdout);
+
+	return st->passed;
+}
+
+static void search_run(void)
+{
+	double rate = mpps, lo = 0, hi = 0;
+	int i;
+
+	search_z2 = confidence_to_z(confidence);
+	search_z2 *= search_z2;
+
+	search_dest = malloc(default_n);
+	search_src = malloc(default_n);
+	if (!search_dest || !search_src)
+		fatal("failure to allocate %d bytes\n", default_n);
+	memset(search_src, 0, default_n);
+	memmove(search_dest, search_src, default_n);
+
+	/* find a bracket [lo, hi) */
+	while (!search_stop) {
+		if (search_try(rate)) {
+			lo = rate;
+			if (hi)
+				break;
+			rate *= 2;
+		} else {
+			hi = rate;
+			if (lo)
+				break;
+			rate /= 2;
+			if (rate < resolution)
+				break;
+		}
+	}
+
+	while (!search_stop && hi - lo > resolution) {
+		rate = (lo + hi) / 2;
+		if (search_try(rate))
+			lo = rate;
+		else
+			hi = rate;
+	}
+
+	/* like determine_maximum_mpps.sh, step down until all runs pass */
+	for (i = 0; !search_stop && lo > 0 && i < confirm_runs; i++) {
+		if (!search_try(lo)) {
+			lo -= resolution;
+			i = -1;
+		}
+	}
+
+	if (search_stop)
+		printf("search interrupted\n");
+	else
+		search_result = lo > 0 ? lo : 0;
+
+	if (search_result > 0)
+		printf("maximum mpps: %.3f\n", search_result);
+	else if (!search_stop)
+		printf("no sustainable mpps found down to %.3f\n", resolution);
+
+	free(search_dest);
+	free(search_src);
+}
+
+static void write_search_json(FILE *f, void *data)
+{
+	unsigned int i;
+
+	fprintf(f, "  \"max_mpps\": %.3f,\n", search_result);
+	fprintf(f, "  \"maxlatency\": %d,\n", maxlatency);
+	fprintf(f, "  \"cycles_per_packet\": %d,\n", cycles_per_packet);
+	fprintf(f, "  \"cycles_to_ns\": %f,\n", cycles_to_ns);
+	fprintf(f, "  \"max_queue_len\": %d,\n", max_queue_len);
+	fprintf(f, "  \"default_n\": %d,\n", default_n);
+	fprintf(f, "  \"nr_packets_drain_per_block\": %d,\n",
+		nr_packets_drain_per_block);
+	fprintf(f, "  \"soak\": %.1f,\n", soak_secs);
+	fprintf(f, "  \"resolution\": %.3f,\n", resolution);
+	fprintf(f, "  \"confidence\": %g,\n", confidence);
+	fprintf(f, "  \"steps\": [\n");
+	for (i = 0; i < nr_steps; i++) {
+		struct search_step *st = &steps[i];
+
+		fprintf(f, "    {\n");
+		fprintf(f, "      \"mpps\": %.3f,\n", st->mpps);
+		fprintf(f, "      \"passed\": %s,\n", st->passed ? "true" : "false");
+		if (st->reason)
+			fprintf(f, "      \"reason\": \"%s\",\n", st->reason);
+		fprintf(f, "      \"secs\": %.3f,\n", st->secs);
+		fprintf(f, "      \"blocks\": %llu,\n", st->blocks);
+		fprintf(f, "      \"max_queue\": %d,\n", st->max_queue);
+		fprintf(f, "      \"avg_queue\": %.2f\n", st->avg_queue);
+		fprintf(f, "    }%s\n", i == nr_steps - 1 ? "" : ",");
+	}
+	fprintf(f, "  ]\n");
+}
+
+/*
+ * Multi-queue model
+ * =================
+ *
+ * With --rx-cpus and --worker-cpus queuelat runs one thread per CPU:
+ * every worker polls its own queue, every RX thread feeds all queues at
+ * their share of the per queue packet rate, in bursts. Queues are
+ * bounded rings of packet descriptors, single producer when there is
+ * one RX thread and multi producer otherwise. A burst which does not fit
+ * is dropped. Workers spend cycles_per_packet per packet and record the
+ * queue depth seen by every dequeue and the time each packet spent in
+ * the queue and in processing.
+ */
+
+struct pkt {
+	u64 ts;			/* TSC at enqueue */
+	uint32_t rx;
+	uint32_t seq;
+};
+
+/*
+ * Producers reserve slots by moving prod_head and publish them in order
+ * by moving prod_tail, the consumer frees them by moving cons_tail.
+ */
+struct qring {
+	uint32_t prod_head __attribute__((aligned(64)));
+	uint32_t prod_tail;
+	uint32_t cons_tail __attribute__((aligned(64)));
+	uint32_t size __attribute__((aligned(64)));
+	uint32_t mask;
+	int mp;			/* more than one producer */
+	struct pkt *slots;
+};
+
+static unsigned int qring_enqueue(struct qring *r, const struct pkt *p,
+				  unsigned int n)
+{
+	uint32_t head, next, free, i;
+
+	head = __atomic_load_n(&r->prod_head, __ATOMIC_RELAXED);
+	do {
+		free = r->size + __atomic_load_n(&r->cons_tail, __ATOMIC_ACQUIRE) - head;
+		if (n > free)
+			n = free;
+		if (!n)
+			return 0;
+		next = head + n;
+		if (!r->mp) {
+			r->prod_head = next;
+			break;
+		}
+	} while (!__atomic_compare_exchange_n(&r->prod_head, &head, next, 0,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	for (i = 0; i < n; i++)
+		r->slots[(head + i) & r->mask] = p[i];
+
+	/* Wait for producers which reserved earlier slots to publish theirs */
+	if (r->mp)
+		while (__atomic_load_n(&r->prod_tail, __ATOMIC_RELAXED) != head)
+			cpu_relax();
+	__atomic_store_n(&r->prod_tail, next, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/* Single consumer; *depth is the number of queued packets before dequeue */
+static unsigned int qring_dequeue(struct qring *r, struct pkt *p,
+				  unsigned int n, unsigned int *depth)
+{
+	uint32_t tail = r->cons_tail, avail, i;
+
+	avail = __atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE) - tail;
+	*depth = avail;
+	if (n > avail)
+		n = avail;
+	for (i = 0; i < n; i++)
+		p[i] = r->slots[(tail + i) & r->mask];
+	__atomic_store_n(&r->cons_tail, tail + n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+struct worker {
+	int cpu;
+	float mpps;			/* offered load of its queue */
+	struct qring *ring;
+	pthread_t thread;
+	unsigned long long processed;
+	unsigned long long over_maxlat;	/* packets slower than -m */
+	struct histogram depth;
+	struct histogram latency;	/* ns */
+} __attribute__((aligned(64)));
+
+struct rx {
+	int cpu;
+	int num;
+	pthread_t thread;
+	unsigned long long *sent;	/* per queue */
+	unsigned long long *dropped;
+	u64 *first_drop;		/* TSC of the first drop, 0 for none */
+} __attribute__((aligned(64)));
+
+static struct worker *workers;
+static struct rx *rxs;
+static int nr_workers, nr_rx;
+static char *rx_cpus, *worker_cpus, *queue_mpps;
+static int burst = 32;
+static int ring_size = 1024;
+
+/* two digits take 8 sub bits, i.e. depths up to 255 are exact */
+#define DEPTH_HIST_DIGITS	2
+#define DEPTH_HIST_MIN_BITS	8
+
+static int multi_stop;
+static u64 multi_start;
+static pthread_barrier_t multi_barrier;
+
+static void pin_to_cpu(int cpu)
+{
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask))
+		warn("Could not set CPU affinity to CPU #%d\n", cpu);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int i, n, depth;
+	u64 now, end, lat;
+	struct pkt *pkts;
+
+	pin_to_cpu(w->cpu);
+	pkts = calloc(burst, sizeof(*pkts));
+	if (!pkts)
+		fatal("failed to allocate the worker burst\n");
+
+	pthread_barrier_wait(&multi_barrier);
+
+	while (!__atomic_load_n(&multi_stop, __ATOMIC_RELAXED)) {
+		n = qring_dequeue(w->ring, pkts, burst, &depth);
+		if (!n)
+			continue;
+		hist_sample(&w->depth, depth);
+
+		gettick(now);
+		for (i = 0; i < n; i++) {
+			/* process the packet */
+			end = now + cycles_per_packet;
+			while (now < end)
+				gettick(now);
+			lat = (now - pkts[i].ts) * cycles_to_ns;
+			hist_sample(&w->latency, lat);
+			if (lat > maxlatency)
+				w->over_maxlat++;
+		}
+		w->processed += n;
+	}
+
+	free(pkts);
+	return NULL;
+}
+
+static void *rx_thread(void *arg)
+{
+	struct rx *r = arg;
+	double *rate, due;
+	u64 now, *seq;
+	struct pkt *pkts;
+	unsigned int n;
+	int q, i;
+
+	pin_to_cpu(r->cpu);
+	pkts = calloc(burst, sizeof(*pkts));
+	rate = calloc(nr_workers, sizeof(*rate));
+	seq = calloc(nr_workers, sizeof(*seq));
+	if (!pkts || !rate || !seq)
+		fatal("failed to allocate the RX state\n");
+
+	/* packets per TSC cycle this thread sends to every queue */
+	for (q = 0; q < nr_workers; q++)
+		rate[q] = workers[q].mpps * cycles_to_ns / 1000 / nr_rx;
+
+	pthread_barrier_wait(&multi_barrier);
+
+	while (!__atomic_load_n(&multi_stop, __ATOMIC_RELAXED)) {
+		gettick(now);
+		for (q = 0; q < nr_workers; q++) {
+			due = (now - multi_start) * rate[q];
+			while (due - r->sent[q] >= burst) {
+				for (i = 0; i < burst; i++) {
+					pkts[i].ts = now;
+					pkts[i].rx = r->num;
+					pkts[i].seq = seq[q]++;
+				}
+				n = qring_enqueue(workers[q].ring, pkts, burst);
+				if (n < burst) {
+					r->dropped[q] += burst - n;
+					if (!r->first_drop[q])
+						r->first_drop[q] = now;
+				}
+				r->sent[q] += burst;
+			}
+		}
+	}
+
+	free(seq);
+	free(rate);
+	free(pkts);
+	return NULL;
+}
+
+static int parse_cpu_list(char *str, int **cpus)
+{
+	int i, n = 0, max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	struct bitmask *mask;
+
+	if (parse_cpumask(str, max_cpus, &mask))
+		fatal("invalid CPU list '%s'\n", str);
+	*cpus = calloc(max_cpus, sizeof(int));
+	if (!*cpus)
+		fatal("failed to allocate the CPU list\n");
+	for (i = 0; i < max_cpus; i++)
+		if (numa_bitmask_isbitset(mask, i))
+			(*cpus)[n++] = i;
+	numa_bitmask_free(mask);
+
+	return n;
+}
+
+static void multi_setup(void)
+{
+	int *rx_cpu, *worker_cpu, i, bits;
+	char *rates = queue_mpps, *next;
+
+	if (ring_size < 2 || (ring_size & (ring_size - 1)))
+		fatal("ring size must be a power of two\n");
+	if (burst < 1 || burst > ring_size)
+		fatal("burst must be between 1 and the ring size\n");
+	if (!numa_initialize())
+		fatal("queuelat: libnuma is not available\n");
+
+	nr_rx = parse_cpu_list(rx_cpus, &rx_cpu);
+	nr_workers = parse_cpu_list(worker_cpus, &worker_cpu);
+	if (!nr_rx || !nr_workers)
+		fatal("need at least one RX and one worker CPU\n");
+
+	workers = calloc(nr_workers, sizeof(*workers));
+	rxs = calloc(nr_rx, sizeof(*rxs));
+	if (!workers || !rxs)
+		fatal("failed to allocate threads\n");
+
+	/*
+	 * The depth histogram covers the ring, but not less than the exact
+	 * range of its DEPTH_HIST_DIGITS, which hist_init() would reject.
+	 */
+	for (bits = DEPTH_HIST_MIN_BITS; (1 << bits) <= ring_size; bits++)
+		;
+
+	/* every --queue-mpps value, also those past the last worker */
+	for (rates = queue_mpps; rates && *rates;
+	     rates = *next == ',' ? next + 1 : next) {
+		float val = strtof(rates, &next);
+
+		if (next == rates || val <= 0 || (*next != ',' && *next))
+			fatal("invalid --queue-mpps value: %s\n", rates);
+	}
+	rates = queue_mpps;
+
+	for (i = 0; i < nr_workers; i++) {
+		struct worker *w = &workers[i];
+		struct qring *r;
+
+		w->cpu = worker_cpu[i];
+		w->mpps = mpps;
+		if (rates && *rates) {
+			w->mpps = strtof(rates, &next);
+			rates = *next == ',' ? next + 1 : next;
+		}
+
+		/* the ring lives next to its consumer */
+		r = cpu_local_alloc(sizeof(*r), worker_cpu[i]);
+		if (!r)
+			fatal("failed to allocate ring %d\n", i);
+		r->size = ring_size;
+		r->mask = ring_size - 1;
+		r->mp = nr_rx > 1;
+		r->slots = cpu_local_alloc(ring_size * sizeof(struct pkt),
+					   worker_cpu[i]);
+		if (!r->slots)
+			fatal("failed to allocate ring %d\n", i);
+		w->ring = r;
+
+		if (hist_init(&w->depth, DEPTH_HIST_DIGITS, bits) || hist_alloc(&w->depth) ||
+		    hist_init(&w->latency, HIST_DIGITS_DEFAULT, HIST_RANGE_BITS_NS) ||
+		    hist_alloc(&w->latency))
+			fatal("failed to allocate histograms\n");
+	}
+
+	for (i = 0; i < nr_rx; i++) {
+		struct rx *r = &rxs[i];
+
+		r->cpu = rx_cpu[i];
+		r->num = i;
+		r->sent = calloc(nr_workers, sizeof(*r->sent));
+		r->dropped = calloc(nr_workers, sizeof(*r->dropped));
+		r->first_drop = calloc(nr_workers, sizeof(*r->first_drop));
+		if (!r->sent || !r->dropped || !r->first_drop)
+			fatal("failed to allocate RX counters\n");
+	}
+
+	free(rx_cpu);
+	free(worker_cpu);
+}
+
+/* The depth histogram folded into power of two ranges */
+static void print_depth_histogram(const struct histogram *h)
+{
+	unsigned long count = 0;
+	uint64_t low = 0, high = 0;
+	unsigned int j;
+
+	printf("  depth histogram:\n");
+	for (j = 0; j <= h->nbuckets; j++) {
+		if (j == h->nbuckets || hist_bucket_low(h, j) > high) {
+			if (count)
+				printf("    [%llu - %llu] = %lu\n",
+				       (unsigned long long)low,
+				       (unsigned long long)high, count);
+			if (j == h->nbuckets)
+				break;
+			low = hist_bucket_low(h, j);
+			high = low ? low * 2 - 1 : 0;
+			count = 0;
+		}
+		count += h->buckets[j];
+	}
+}
+
+static void multi_print(void)
+{
+	static const double pct[] = { 50, 99, 99.99 };
+	unsigned long long sent, dropped;
+	u64 first_drop;
+	unsigned int j;
+	int q, i;
+
+	for (q = 0; q < nr_workers; q++) {
+		struct worker *w = &workers[q];
+
+		sent = dropped = 0;
+		first_drop = 0;
+		for (i = 0; i < nr_rx; i++) {
+			sent += rxs[i].sent[q];
+			dropped += rxs[i].dropped[q];
+			if (rxs[i].first_drop[q] &&
+			    (!first_drop || rxs[i].first_drop[q] < first_drop))
+				first_drop = rxs[i].first_drop[q];
+		}
+
+		printf("queue %d: worker CPU %d, %.3f mpps offered, ring %d, burst %d\n",
+		       q, w->cpu, w->mpps, ring_size, burst);
+		printf("  packets: sent %llu processed %llu dropped %llu (%.4f%%)\n",
+		       sent, w->processed, dropped,
+		       sent ? 100.0 * dropped / sent : 0.0);
+		if (first_drop)
+			printf("  drop point: first drop after %.6f s\n",
+			       (first_drop - multi_start) * cycles_to_ns / NSEC_PER_SEC);
+		else
+			printf("  drop point: no drops\n");
+		printf("  depth:");
+		for (j = 0; j < ARRAY_SIZE(pct); j++)
+			printf(" P%g=%llu", pct[j], (unsigned long long)
+			       hist_percentile(&w->depth, pct[j]));
+		printf("\n  latency (ns):");
+		for (j = 0; j < ARRAY_SIZE(pct); j++)
+			printf(" P%g=%llu", pct[j], (unsigned long long)
+			       hist_percentile(&w->latency, pct[j]));
+		printf(" over max-len=%llu\n", w->over_maxlat);
+		print_depth_histogram(&w->depth);
+	}
+}
+
+static void multi_run(void)
+{
+	int i;
+
+	multi_setup();
+
+	pthread_barrier_init(&multi_barrier, NULL, nr_rx + nr_workers + 1);
+	for (i = 0; i < nr_workers; i++)
+		if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]))
+			fatal("failed to create worker %d\n", i);
+	for (i = 0; i < nr_rx; i++)
+		if (pthread_create(&rxs[i].thread, NULL, rx_thread, &rxs[i]))
+			fatal("failed to create RX thread %d\n", i);
+
+	gettick(multi_start);
+	pthread_barrier_wait(&multi_barrier);
+
+	/* until -t expires or a signal arrives */
+	while (!__atomic_load_n(&multi_stop, __ATOMIC_RELAXED))
+		pause();
+
+	for (i = 0; i < nr_rx; i++)
+		pthread_join(rxs[i].thread, NULL);
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	multi_print();
+}
+
 void sig_handler(int sig)
 {
+	if (search) {
+		search_stop = 1;
+		return;
+	}
+	if (rx_cpus) {
+		__atomic_store_n(&multi_stop, 1, __ATOMIC_RELAXED);
+		return;
+	}
 	print_exit_info();
 	exit(0);
 }
@@ -558,6 +1198,12 @@ int calculate_nr_packets_drain_per_block(void)
 	return nr_packets_drain_per_block;
 }
 
+enum option_values {
+	OPT_RX_CPUS = 256, OPT_WORKER_CPUS, OPT_QUEUE_MPPS, OPT_BURST,
+	OPT_RING_SIZE, OPT_SEARCH, OPT_SOAK, OPT_RESOLUTION, OPT_CONFIDENCE,
+	OPT_CONFIRM, OPT_JSON,
+};
+
 static void print_help(int error)
 {
 	printf("queuelat V %1.2f\n", VERSION);
@@ -570,6 +1216,22 @@ static void print_help(int error)
 	       "-p F     --packets F       million packets per second (float)\n"
 	       "-q N     --queue-len N     minimum queue len to print trace (int)\n"
 	       "-t TIME  --timeout TIME    timeout, in seconds (int)\n"
+	       "\nMulti-queue model, one queue per worker CPU:\n"
+	       "         --rx-cpus=CPUSET  run an RX thread feeding all queues on each CPU\n"
+	       "         --worker-cpus=CPUSET\n"
+	       "                           run a worker polling its own queue on each CPU\n"
+	       "         --queue-mpps=F[,F...]\n"
+	       "                           million packets per second per queue, default -p\n"
+	       "         --burst=N         packets per enqueue and dequeue, default 32\n"
+	       "         --ring-size=N     descriptors per queue, a power of two, default 1024\n"
+	       "\nMaximum mpps search, starting at -p:\n"
+	       "         --search          search the highest sustainable mpps\n"
+	       "         --soak=SECS       time a rate has to pass, default 10\n"
+	       "         --resolution=F    mpps resolution of the search, default 0.1\n"
+	       "         --confidence=PCT  confidence for failing a growing queue early\n"
+	       "                           90, 95, 99, 99.9 or 99.99, default 99\n"
+	       "         --confirm=N       rerun the result N times, stepping down on failure\n"
+	       "         --json=FILENAME   write the search results into FILENAME\n"
 	       );
 	exit(error);
 }
@@ -585,6 +1247,7 @@ int main(int argc, char **argv)
 	char *tvalue = NULL;
 	char *qvalue = NULL;
 
+	rt_init(argc, argv);
 	opterr = 0;
 
 	for (;;) {
@@ -596,6 +1259,17 @@ int main(int argc, char **argv)
 			{"packets",	required_argument,	NULL, 'p'},
 			{"queue-len",	required_argument,	NULL, 'q'},
 			{"timeout",	required_argument,	NULL, 't'},
+			{"rx-cpus",	required_argument,	NULL, OPT_RX_CPUS},
+			{"worker-cpus",	required_argument,	NULL, OPT_WORKER_CPUS},
+			{"queue-mpps",	required_argument,	NULL, OPT_QUEUE_MPPS},
+			{"burst",	required_argument,	NULL, OPT_BURST},
+			{"ring-size",	required_argument,	NULL, OPT_RING_SIZE},
+			{"search",	no_argument,		NULL, OPT_SEARCH},
+			{"soak",	required_argument,	NULL, OPT_SOAK},
+			{"resolution",	required_argument,	NULL, OPT_RESOLUTION},
+			{"confidence",	required_argument,	NULL, OPT_CONFIDENCE},
+			{"confirm",	required_argument,	NULL, OPT_CONFIRM},
+			{"json",	required_argument,	NULL, OPT_JSON},
 			{NULL, 0, NULL, 0}
 		};
 		int c = getopt_long(argc, argv, "c:f:hm:p:q:t:", options, NULL);
@@ -624,6 +1298,39 @@ int main(int argc, char **argv)
 		case 't':
 			tvalue = optarg;
 			break;
+		case OPT_RX_CPUS:
+			rx_cpus = optarg;
+			break;
+		case OPT_WORKER_CPUS:
+			worker_cpus = optarg;
+			break;
+		case OPT_QUEUE_MPPS:
+			queue_mpps = optarg;
+			break;
+		case OPT_BURST:
+			burst = atoi(optarg);
+			break;
+		case OPT_RING_SIZE:
+			ring_size = atoi(optarg);
+			break;
+		case OPT_SEARCH:
+			search = 1;
+			break;
+		case OPT_SOAK:
+			soak_secs = atof(optarg);
+			break;
+		case OPT_RESOLUTION:
+			resolution = atof(optarg);
+			break;
+		case OPT_CONFIDENCE:
+			confidence = atof(optarg);
+			break;
+		case OPT_CONFIRM:
+			confirm_runs = atoi(optarg);
+			break;
+		case OPT_JSON:
+			jsonfile = optarg;
+			break;
 		default:
 			print_help(1);
 			break;
@@ -656,6 +1363,22 @@ int main(int argc, char **argv)
 	max_queue_len_f = maxlatency / (cycles_per_packet*cycles_to_ns);
 	max_queue_len = max_queue_len_f;
 
+	if (rx_cpus || worker_cpus) {
+		if (!rx_cpus || !worker_cpus) {
+			printf("options --rx-cpus and --worker-cpus go together\n");
+			exit(1);
+		}
+		multi_run();
+		return 0;
+	}
+
+	if (search && (soak_secs <= 0 || resolution <= 0 ||
+		       confidence <= 50 || confidence >= 100 || mpps <= 0)) {
+		printf("--soak, --resolution and -p must be positive, "
+		       "--confidence between 50 and 100\n");
+		exit(1);
+	}
+
 	printf("max_queue_len = %d\n", max_queue_len);
 	default_n = measure_n();
 
@@ -665,6 +1388,14 @@ int main(int argc, char **argv)
 	printf("default_n=%d nr_packets_drain_per_block=%d\n", default_n,
 		nr_packets_drain_per_block);
 
+	if (search) {
+		search_run();
+		if (jsonfile)
+			rt_write_json(jsonfile, search_result > 0 ? 0 : 1,
+				      write_search_json, NULL);
+		return search_result > 0 ? 0 : 1;
+	}
+
 	main_loop();
 
 	return 0;
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * queuelat_buckets.h - loop time buckets of the single queue model
+ *
+ * Shared with rt-bench, which measures the cost of the accounting done
+ * once per memmove block.
+ */
+#ifndef __QUEUELAT_BUCKETS_H
+#define __QUEUELAT_BUCKETS_H
+
+/*
+ * Parameters for the stats collection buckets
+ */
+
+#define LAST_VAL 70000
+#define VALS_PER_BUCKET 100
+#define NR_BUCKETS LAST_VAL/VALS_PER_BUCKET
+
+#define OUTLIER_BUCKET NR_BUCKETS
+
+static inline int val_to_bucket(unsigned long long val)
+{
+	int bucket_nr = val / VALS_PER_BUCKET;
+	if (bucket_nr >= NR_BUCKETS)
+		return OUTLIER_BUCKET;
+	return bucket_nr;
+}
+
+/* buckets has NR_BUCKETS + 1 entries */
+static inline void account_bucket(unsigned long long *buckets,
+				  unsigned long long *count,
+				  unsigned long long val)
+{
+	int bucket_nr = val_to_bucket(val);
+	buckets[bucket_nr]++;
+	(*count)++;
+}
+
+#endif	/* __QUEUELAT_BUCKETS_H */
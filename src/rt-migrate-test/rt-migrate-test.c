@@ -28,50 +28,12 @@
 #include <linux/unistd.h>
 
 #include "rt-utils.h"
+#include "rt-get_cpu.h"
+#include "rt-histogram.h"
 
 int nr_tasks;
 int lfd;
 
-static int mark_fd = -1;
-static __thread char buff[BUFSIZ+1];
-
-static void setup_ftrace_marker(void)
-{
-	struct stat st;
-	char *files[] = {
-		"/sys/kernel/debug/tracing/trace_marker",
-		"/debug/tracing/trace_marker",
-		"/debugfs/tracing/trace_marker",
-	};
-	int ret;
-	int i;
-
-	for (i = 0; i < (sizeof(files) / sizeof(char *)); i++) {
-		ret = stat(files[i], &st);
-		if (ret >= 0)
-			goto found;
-	}
-	/* todo, check mounts system */
-	return;
-found:
-	mark_fd = open(files[i], O_WRONLY);
-}
-
-static void ftrace_write(const char *fmt, ...)
-{
-	va_list ap;
-	int n;
-
-	if (mark_fd < 0)
-		return;
-
-	va_start(ap, fmt);
-	n = vsnprintf(buff, BUFSIZ, fmt, ap);
-	va_end(ap);
-
-	write(mark_fd, buff, n);
-}
-
 #define nano2sec(nan) (nan / 1000000000ULL)
 #define nano2ms(nan) (nan / 1000000ULL)
 #define nano2usec(nan) (nan / 1000ULL)
@@ -109,8 +71,31 @@ static pthread_barrier_t end_barrier;
 static unsigned long long **intervals;
 static unsigned long long **intervals_length;
 static unsigned long **intervals_loops;
+static unsigned long long **intervals_settle;
+static int **intervals_from;
+static int **intervals_cpu;
 static long *thread_pids;
 
+/*
+ * Migration latency of all tasks of one priority: the time from the
+ * release of start_barrier until a task first ran on the CPU it ended
+ * the interval on. Indexed by calc_prio() - prio_start.
+ */
+struct migration {
+	unsigned long samples;
+	unsigned long migrated;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long sum;
+	struct histogram hist;
+};
+
+static struct migration *migrations;
+static unsigned long *migration_matrix;	/* [from * nr_cpus + to] */
+static int nr_cpus;
+
+static const double migration_percentiles[] = { 50, 90, 99 };
+
 static char buffer[BUFSIZ];
 
 static void perr(char *fmt, ...)
@@ -256,18 +241,15 @@ static void parse_options(int argc, char *argv[])
 
 static unsigned long long get_time(void)
 {
-	struct timeval tv;
-	unsigned long long time;
+	struct timespec ts;
 
-	gettimeofday(&tv, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	time = sec2nano(tv.tv_sec);
-	time += usec2nano(tv.tv_usec);
-
-	return time;
+	return sec2nano(ts.tv_sec) + ts.tv_nsec;
 }
 
-static void record_time(int id, unsigned long long time, unsigned long l)
+static void record_time(int id, unsigned long long time, unsigned long l,
+			unsigned long long settle, int from, int cpu)
 {
 	unsigned long long ltime;
 
@@ -279,6 +261,9 @@ static void record_time(int id, unsigned long long time, unsigned long l)
 	intervals[loop][id] = time;
 	intervals_length[loop][id] = ltime;
 	intervals_loops[loop][id] = l;
+	intervals_settle[loop][id] = settle - now;
+	intervals_from[loop][id] = from;
+	intervals_cpu[loop][id] = cpu;
 }
 
 static int calc_prio(int id)
@@ -287,6 +272,87 @@ static int calc_prio(int id)
 	return prio + prio_start;
 }
 
+static void collect_migrations(void)
+{
+	struct migration *m;
+	unsigned long long lat;
+	int from, cpu;
+	int i, t;
+
+	migrations = calloc(nr_tasks, sizeof(*migrations));
+	migration_matrix = calloc(nr_cpus * nr_cpus, sizeof(*migration_matrix));
+	if (!migrations || !migration_matrix)
+		perr("malloc migrations");
+
+	for (t = 0; t < nr_tasks; t++) {
+		m = &migrations[calc_prio(t) - prio_start];
+		if (m->hist.buckets)
+			continue;
+		hist_init(&m->hist, HIST_DIGITS_DEFAULT, HIST_RANGE_BITS_NS);
+		if (hist_alloc(&m->hist))
+			perr("malloc migration histogram");
+	}
+
+	for (i = 0; i < nr_runs; i++) {
+		for (t = 0; t < nr_tasks; t++) {
+			m = &migrations[calc_prio(t) - prio_start];
+			lat = intervals_settle[i][t];
+			from = intervals_from[i][t];
+			cpu = intervals_cpu[i][t];
+
+			if (!m->samples || lat < m->min)
+				m->min = lat;
+			if (lat > m->max)
+				m->max = lat;
+			m->sum += lat;
+			m->samples++;
+			hist_sample(&m->hist, lat);
+
+			if (from < 0 || from >= nr_cpus ||
+			    cpu < 0 || cpu >= nr_cpus)
+				continue;
+			if (from != cpu)
+				m->migrated++;
+			migration_matrix[from * nr_cpus + cpu]++;
+		}
+	}
+}
+
+static void print_migrations(void)
+{
+	uint64_t pct[ARRAY_SIZE(migration_percentiles)];
+	struct migration *m;
+	unsigned long n;
+	unsigned int j;
+	int i, to;
+
+	printf("Migration latency (ns):\n");
+	for (i = 0; i < nr_tasks; i++) {
+		m = &migrations[i];
+		if (!m->samples)
+			continue;
+		hist_tail_percentiles(&m->hist, m->samples, m->max,
+				      migration_percentiles, pct,
+				      ARRAY_SIZE(pct));
+		printf(" prio %d: Min %llu, Avg %llu", i + prio_start, m->min,
+		       m->sum / m->samples);
+		for (j = 0; j < ARRAY_SIZE(pct); j++)
+			printf(", P%g %" PRIu64, migration_percentiles[j], pct[j]);
+		printf(", Max %llu, Migrated %lu/%lu\n", m->max, m->migrated,
+		       m->samples);
+	}
+
+	printf("CPU migrations (from -> to: count):\n");
+	for (i = 0; i < nr_cpus; i++) {
+		for (to = 0; to < nr_cpus; to++) {
+			n = migration_matrix[i * nr_cpus + to];
+			if (n && i != to)
+				printf(" %d -> %d: %lu\n", i, to, n);
+		}
+	}
+	printf("\n");
+}
+
 static void print_results(void)
 {
 	int i;
@@ -331,6 +397,17 @@ static void print_results(void)
 			printf("%6ld  ", loops);
 		}
 		printf("\n");
+		printf(" mig:   ");
+		for (t=0; t < nr_tasks; t++) {
+			unsigned long long settle = intervals_settle[i][t];
+
+			printf("%6lld  ", nano2usec(settle));
+		}
+		printf("\n");
+		printf(" cpu:   ");
+		for (t=0; t < nr_tasks; t++)
+			printf("%6d  ", intervals_cpu[i][t]);
+		printf("\n");
 		printf("\n");
 	}
 
@@ -346,6 +423,8 @@ static void print_results(void)
 		printf("\n");
 	}
 
+	print_migrations();
+
 	if (check) {
 		if (check < 0)
 			printf(" Failed!\n");
@@ -354,6 +433,60 @@ static void print_results(void)
 	}
 }
 
+static void write_migrations(FILE *f)
+{
+	struct migration *m;
+	unsigned long n;
+	int i, to;
+	int first;
+
+	fprintf(f, "  \"migration\": {\n");
+	fprintf(f, "    \"resolution_in_ns\": 1,\n");
+	fprintf(f, "    \"prio\": {\n");
+	for (i = 0, first = 1; i < nr_tasks; i++) {
+		m = &migrations[i];
+		if (!m->samples)
+			continue;
+		fprintf(f, "%s      \"%d\": {\n", first ? "" : ",\n",
+			i + prio_start);
+		fprintf(f, "        \"histogram\": ");
+		hist_print_json(f, &m->hist, 8);
+		fprintf(f, ",\n");
+		fprintf(f, "        \"percentiles\": ");
+		hist_print_percentiles_json(f, &m->hist, m->max, 8);
+		fprintf(f, ",\n");
+		fprintf(f, "        \"samples\": %lu,\n", m->samples);
+		fprintf(f, "        \"migrated\": %lu,\n", m->migrated);
+		fprintf(f, "        \"min\": %llu,\n", m->min);
+		fprintf(f, "        \"avg\": %llu,\n", m->sum / m->samples);
+		fprintf(f, "        \"max\": %llu\n", m->max);
+		fprintf(f, "      }");
+		first = 0;
+	}
+	fprintf(f, "\n    },\n");
+
+	/* sparse: "from": { "to": count }, the diagonal are the stays */
+	fprintf(f, "    \"matrix\": {");
+	for (i = 0, first = 1; i < nr_cpus; i++) {
+		int row = 1;
+
+		for (to = 0; to < nr_cpus; to++) {
+			n = migration_matrix[i * nr_cpus + to];
+			if (!n)
+				continue;
+			if (row)
+				fprintf(f, "%s\n      \"%d\": {", first ? "" : ",", i);
+			fprintf(f, "%s \"%d\": %lu", row ? "" : ",", to, n);
+			row = 0;
+			first = 0;
+		}
+		if (!row)
+			fprintf(f, " }");
+	}
+	fprintf(f, "\n    }\n");
+	fprintf(f, "  }\n");
+}
+
 static void write_stats(FILE *f, void *data)
 {
 	int i;
@@ -389,17 +522,33 @@ static void write_stats(FILE *f, void *data)
 		fprintf(f, "      \"total\": %lld\n", nano2usec(tasks_avg[i]));
 		fprintf(f, "    }%s\n", i == nr_tasks - 1 ? "" : ",");
 	}
-	fprintf(f, "  }\n");
+	fprintf(f, "  },\n");
+	write_migrations(f);
 }
 
-static unsigned long busy_loop(unsigned long long start_time)
+/*
+ * Spin for the run interval and track the CPU we run on. settle is the
+ * first time stamp taken on the CPU we end up on, i.e. after the last
+ * push or pull migration of this task.
+ */
+static unsigned long busy_loop(unsigned long long start_time, int *cpu,
+			       unsigned long long *settle)
 {
-	unsigned long long time;
+	unsigned long long time = start_time;
 	unsigned long l = 0;
+	int c;
 
+	*cpu = get_cpu();
+	*settle = start_time;
 	do {
 		l++;
 		time = get_time();
+		c = get_cpu();
+		if (c != *cpu) {
+			/* time may still have been taken on the old CPU */
+			*cpu = c;
+			*settle = get_time();
+		}
 	} while ((time - start_time) < RUN_INTERVAL);
 
 	return l;
@@ -418,6 +567,8 @@ void *start_task(void *data)
 	cpu_set_t cpumask;
 	cpu_set_t save_cpumask;
 	int cpu = 0;
+	int from, last;
+	unsigned long long settle;
 	unsigned long l;
 	long pid;
 
@@ -445,12 +596,13 @@ void *start_task(void *data)
 			CPU_SET(cpu, &cpumask); cpu++;
 			sched_setaffinity(0, sizeof(cpumask), &cpumask);
 		}
+		from = get_cpu();
 		pthread_barrier_wait(&start_barrier);
 		start_time = get_time();
-		ftrace_write("Thread %d: started %lld diff %lld\n",
-			     pid, start_time, start_time - now);
-		l = busy_loop(start_time);
-		record_time(id, start_time, l);
+		TRACEMARK("Thread %ld: started %lld diff %lld\n",
+			  pid, start_time, start_time - now);
+		l = busy_loop(start_time, &last, &settle);
+		record_time(id, start_time, l, settle, from, last);
 		pthread_barrier_wait(&end_barrier);
 	}
 
@@ -477,7 +629,7 @@ static int check_times(int l)
 			    intervals[l][i] > last_length ||
 			    (intervals_length[l][i] > last_length &&
 			     intervals_length[l][i] - last_length > max_err)) {
-				ftrace_write("Task %d FAILED\n", thread_pids[i]);
+				TRACEMARK("Task %ld FAILED\n", thread_pids[i]);
 				check = -1;
 				return 1;
 			}
@@ -544,11 +696,15 @@ int main (int argc, char **argv)
 	if (duration)
 		alarm(duration);
 
+	nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
 	if (argc >= (optind + 1))
 		nr_tasks = atoi(argv[optind]);
 	else
 		nr_tasks = count_cpus() + 1;
 
+	if (get_cpu_setup())
+		perr("get_cpu_setup");
+
 	threads = malloc(sizeof(*threads) * nr_tasks);
 	if (!threads)
 		perr("malloc");
@@ -571,6 +727,12 @@ int main (int argc, char **argv)
 	if (!intervals_loops)
 		perr("malloc intervals loops array");
 
+	intervals_settle = malloc(sizeof(void*) * nr_runs);
+	intervals_from = malloc(sizeof(void*) * nr_runs);
+	intervals_cpu = malloc(sizeof(void*) * nr_runs);
+	if (!intervals_settle || !intervals_from || !intervals_cpu)
+		perr("malloc intervals migration arrays");
+
 	thread_pids = malloc(sizeof(long) * nr_tasks);
 	if (!thread_pids)
 		perr("malloc thread_pids");
@@ -590,6 +752,13 @@ int main (int argc, char **argv)
 		if (!intervals_loops[i])
 			perr("malloc loops intervals");
 		memset(intervals_loops[i], 0, sizeof(unsigned long)*nr_tasks);
+
+		intervals_settle[i] = calloc(nr_tasks, sizeof(unsigned long long));
+		intervals_from[i] = calloc(nr_tasks, sizeof(int));
+		intervals_cpu[i] = calloc(nr_tasks, sizeof(int));
+		if (!intervals_settle[i] || !intervals_from[i] ||
+		    !intervals_cpu[i])
+			perr("malloc migration intervals");
 	}
 
 	for (i=0; i < nr_tasks; i++) {
@@ -619,7 +788,7 @@ int main (int argc, char **argv)
 	if (!quiet)
 		print_progress_bar(0);
 
-	setup_ftrace_marker();
+	tracemark_open(TRACEMARK_QUIET);
 
 	for (loop=0; loop < nr_runs; loop++) {
 		unsigned long long end;
@@ -629,11 +798,11 @@ int main (int argc, char **argv)
 
 		now = get_time();
 
-		ftrace_write("Loop %d now=%lld\n", loop, now);
+		TRACEMARK("Loop %d now=%lld\n", loop, now);
 
 		pthread_barrier_wait(&start_barrier);
 
-		ftrace_write("All running!!!\n");
+		TRACEMARK("All running!!!\n");
 
 		nanosleep(&intv, NULL);
 
@@ -641,7 +810,7 @@ int main (int argc, char **argv)
 			print_progress_bar((loop * 100)/nr_runs);
 
 		end = get_time();
-		ftrace_write("Loop %d end now=%lld diff=%lld\n", loop, end, end - now);
+		TRACEMARK("Loop %d end now=%lld diff=%lld\n", loop, end, end - now);
 
 		pthread_barrier_wait(&end_barrier);
 
@@ -660,6 +829,7 @@ int main (int argc, char **argv)
 	for (i=0; i < nr_tasks; i++)
 		pthread_join(threads[i], (void*)&thread_pids[i]);
 
+	collect_migrations();
 	print_results();
 
 	if (strlen(jsonfile) != 0)
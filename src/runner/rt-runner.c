@@ -0,0 +1,694 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * rt-runner - run several rt-tests and load generators as one scenario
+ *
+ * The tools of a scenario are forked and pinned up front, then wait on a
+ * common pipe. Closing its write end releases all of them at once, that
+ * moment is T0 of the run. Afterwards the JSON results of the tools are
+ * merged into one report, each with its start and end relative to T0.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "rt-utils.h"
+#include "rt-error.h"
+#include "rt-numa.h"
+
+#define MAX_ENTRIES	64
+#define MAX_ARGS	128
+#define MAX_LINE	4096
+#define KILL_TIMEOUT	10	/* s, after the stop signal */
+
+enum {
+	ROLE_RUN,	/* measures, the scenario ends with the last one */
+	ROLE_LOAD,	/* generates load until the measurements are done */
+};
+
+struct entry {
+	int role;
+	char name[64];
+	char *cpus;
+	struct bitmask *cpumask;
+	int json;
+	int argc;
+	char *argv[MAX_ARGS];
+	char jsonfile[PATH_MAX];
+	pid_t pid;
+	int status;
+	int running;
+	unsigned long long end_ns;
+};
+
+static struct entry entries[MAX_ENTRIES];
+static int nr_entries;
+static int nr_runs;
+static int duration;
+static char *scenario;
+static char *logdir;
+static int verbose;
+static unsigned long long t0;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void display_help(int error)
+{
+	printf("rt-runner V %1.2f\n", VERSION);
+	printf("Usage:\n"
+	       "rt-runner <options> SCENARIO\n\n"
+	       "-D       --duration=TIME   specify a length for the run, overrides the\n"
+	       "                           duration of the scenario. Append 'm', 'h', or\n"
+	       "                           'd' to specify minutes, hours or days\n"
+	       "-h       --help            print this help message\n"
+	       "         --json=FILENAME   write the merged report into FILENAME,\n"
+	       "                           default is stdout\n"
+	       "-l DIR   --logdir=DIR      redirect the output of every tool to DIR/NAME.log\n"
+	       "                           and keep their JSON files in DIR\n"
+	       "-v       --verbose         print the commands as they are launched\n\n"
+	       "Scenario lines, '#' starts a comment:\n"
+	       "  duration TIME\n"
+	       "  run  [name=NAME] [cpus=LIST|rest] [json=yes|no] COMMAND [ARGS...]\n"
+	       "  load [name=NAME] [cpus=LIST|rest] [json=yes|no] COMMAND [ARGS...]\n"
+		);
+	if (error)
+		exit(EXIT_FAILURE);
+	exit(EXIT_SUCCESS);
+}
+
+/* Splits line in place, words may be quoted with ' or " */
+static int split_line(char *line, char **words, int max)
+{
+	char *p = line, *q;
+	int n = 0;
+	char quote;
+
+	while (*p) {
+		while (*p == ' ' || *p == '\t' || *p == '\n')
+			p++;
+		if (!*p || *p == '#')
+			break;
+		if (n == max)
+			return -1;
+
+		words[n++] = q = p;
+		quote = 0;
+		while (*p && (quote || (*p != ' ' && *p != '\t' && *p != '\n'))) {
+			if (!quote && (*p == '\'' || *p == '"'))
+				quote = *p;
+			else if (quote && *p == quote)
+				quote = 0;
+			else
+				*q++ = *p;
+			p++;
+		}
+		if (quote)
+			return -1;
+		if (*p)
+			p++;
+		*q = '\0';
+	}
+
+	return n;
+}
+
+static void parse_entry(int role, char **words, int n, int lineno)
+{
+	struct entry *e;
+	int i = 0;
+
+	if (nr_entries == MAX_ENTRIES)
+		fatal("%s:%d: more than %d tools\n", scenario, lineno, MAX_ENTRIES);
+
+	e = &entries[nr_entries];
+	e->role = role;
+	e->json = role == ROLE_RUN;
+	if (role == ROLE_RUN)
+		nr_runs++;
+
+	for (; i < n; i++) {
+		if (!strncmp(words[i], "name=", 5)) {
+			snprintf(e->name, sizeof(e->name), "%s", words[i] + 5);
+		} else if (!strncmp(words[i], "cpus=", 5)) {
+			e->cpus = strdup(words[i] + 5);
+		} else if (!strncmp(words[i], "json=", 5)) {
+			if (!strcmp(words[i] + 5, "yes"))
+				e->json = 1;
+			else if (!strcmp(words[i] + 5, "no"))
+				e->json = 0;
+			else
+				fatal("%s:%d: json is yes or no\n", scenario, lineno);
+		} else {
+			break;
+		}
+	}
+
+	if (i == n)
+		fatal("%s:%d: missing command\n", scenario, lineno);
+	/* one slot for --json=, one for the terminating NULL */
+	if (n - i > MAX_ARGS - 2)
+		fatal("%s:%d: too many arguments\n", scenario, lineno);
+
+	for (; i < n; i++)
+		e->argv[e->argc++] = strdup(words[i]);
+
+	if (!e->name[0])
+		snprintf(e->name, sizeof(e->name), "%s.%d",
+			 basename(e->argv[0]), nr_entries);
+
+	nr_entries++;
+}
+
+static void parse_scenario(void)
+{
+	char line[MAX_LINE];
+	char *words[MAX_ARGS];
+	int lineno = 0, n;
+	FILE *f;
+
+	f = fopen(scenario, "r");
+	if (!f)
+		fatal("Cannot open '%s': %s\n", scenario, strerror(errno));
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		n = split_line(line, words, MAX_ARGS);
+		if (n < 0)
+			fatal("%s:%d: cannot parse line\n", scenario, lineno);
+		if (n == 0)
+			continue;
+
+		if (!strcmp(words[0], "duration")) {
+			if (n != 2)
+				fatal("%s:%d: duration TIME\n", scenario, lineno);
+			/* the command line wins */
+			if (!duration)
+				duration = parse_time_string(words[1]);
+		} else if (!strcmp(words[0], "run")) {
+			parse_entry(ROLE_RUN, words + 1, n - 1, lineno);
+		} else if (!strcmp(words[0], "load")) {
+			parse_entry(ROLE_LOAD, words + 1, n - 1, lineno);
+		} else {
+			fatal("%s:%d: unknown keyword '%s'\n", scenario, lineno,
+			      words[0]);
+		}
+	}
+	fclose(f);
+
+	if (!nr_entries)
+		fatal("%s: no tools to run\n", scenario);
+	if (!nr_runs && !duration)
+		fatal("%s: only load, a duration is needed\n", scenario);
+}
+
+/*
+ * cpus=rest are the CPUs no other entry names, typically the
+ * housekeeping CPUs a load generator is meant to run on.
+ */
+static void setup_cpus(void)
+{
+	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	struct bitmask *used, *rest;
+	struct entry *e;
+	int i, c;
+
+	/* the cpumask helpers work without NUMA support as well */
+	numa_initialize();
+
+	used = numa_allocate_cpumask();
+	for (i = 0; i < nr_entries; i++) {
+		e = &entries[i];
+		if (!e->cpus || !strcmp(e->cpus, "rest"))
+			continue;
+		if (parse_cpumask(e->cpus, max_cpus, &e->cpumask) ||
+		    !e->cpumask)
+			fatal("%s: no usable CPUs in '%s'\n", e->name, e->cpus);
+		for (c = 0; c < max_cpus; c++)
+			if (numa_bitmask_isbitset(e->cpumask, c))
+				numa_bitmask_setbit(used, c);
+	}
+
+	rest = numa_allocate_cpumask();
+	numa_sched_getaffinity(0, rest);
+	for (c = 0; c < max_cpus; c++)
+		if (numa_bitmask_isbitset(used, c))
+			numa_bitmask_clearbit(rest, c);
+	numa_bitmask_free(used);
+
+	for (i = 0; i < nr_entries; i++) {
+		e = &entries[i];
+		if (!e->cpus || strcmp(e->cpus, "rest"))
+			continue;
+		if (numa_bitmask_weight(rest) == 0)
+			fatal("%s: no CPUs left for cpus=rest\n", e->name);
+		e->cpumask = rest;
+	}
+}
+
+static void setup_json(void)
+{
+	struct entry *e;
+	char arg[PATH_MAX + 8];
+	int i;
+
+	for (i = 0; i < nr_entries; i++) {
+		e = &entries[i];
+		if (!e->json)
+			continue;
+		if (logdir)
+			snprintf(e->jsonfile, sizeof(e->jsonfile), "%s/%s.json",
+				 logdir, e->name);
+		else
+			snprintf(e->jsonfile, sizeof(e->jsonfile),
+				 "/tmp/rt-runner-%d-%s.json", getpid(), e->name);
+		/* a stale file must not pass for a result */
+		unlink(e->jsonfile);
+		snprintf(arg, sizeof(arg), "--json=%s", e->jsonfile);
+		e->argv[e->argc++] = strdup(arg);
+	}
+}
+
+static void __attribute__((noreturn)) child(struct entry *e, int barrier)
+{
+	char log[PATH_MAX];
+	sigset_t set;
+	char c;
+	int fd;
+
+	/* own process group, stopping it reaches the children of a tool too */
+	setpgid(0, 0);
+
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	if (e->cpumask && numa_sched_setaffinity(0, e->cpumask)) {
+		fprintf(stderr, "%s: cannot set affinity: %s\n", e->name,
+			strerror(errno));
+		_exit(127);
+	}
+
+	if (logdir) {
+		snprintf(log, sizeof(log), "%s/%s.log", logdir, e->name);
+		fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "%s: cannot open %s: %s\n", e->name,
+				log, strerror(errno));
+			_exit(127);
+		}
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+
+	/* EOF once the runner closes the write end */
+	while (read(barrier, &c, 1) < 0 && errno == EINTR)
+		;
+	close(barrier);
+
+	execvp(e->argv[0], e->argv);
+	fprintf(stderr, "%s: cannot execute %s: %s\n", e->name, e->argv[0],
+		strerror(errno));
+	_exit(127);
+}
+
+static void launch(void)
+{
+	struct entry *e;
+	int barrier[2];
+	int i, j;
+
+	if (pipe(barrier))
+		fatal("pipe: %s\n", strerror(errno));
+
+	for (i = 0; i < nr_entries; i++) {
+		e = &entries[i];
+		if (verbose) {
+			fprintf(stderr, "# %s %s:", e->role == ROLE_RUN ?
+				"run" : "load", e->name);
+			for (j = 0; j < e->argc; j++)
+				fprintf(stderr, " %s", e->argv[j]);
+			fprintf(stderr, "\n");
+		}
+
+		e->pid = fork();
+		if (e->pid < 0)
+			fatal("fork: %s\n", strerror(errno));
+		if (e->pid == 0) {
+			close(barrier[1]);
+			child(e, barrier[0]);
+		}
+		/* also from here, so that a signal never misses the group */
+		setpgid(e->pid, e->pid);
+		e->running = 1;
+	}
+
+	close(barrier[0]);
+	t0 = now_ns();
+	close(barrier[1]);
+}
+
+static int reap(void)
+{
+	struct entry *e;
+	int status, i, n = 0;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < nr_entries; i++) {
+			e = &entries[i];
+			if (e->pid != pid)
+				continue;
+			e->status = status;
+			e->running = 0;
+			e->end_ns = now_ns() - t0;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+static int nr_running(int role)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nr_entries; i++)
+		if (entries[i].running && entries[i].role == role)
+			n++;
+	return n;
+}
+
+static void signal_all(int role, int sig)
+{
+	int i;
+
+	for (i = 0; i < nr_entries; i++)
+		if (entries[i].running && (role < 0 || entries[i].role == role))
+			kill(-entries[i].pid, sig);
+}
+
+/* 0 on timeout, the signal otherwise */
+static int wait_signal(sigset_t *set, unsigned long long deadline)
+{
+	struct timespec ts;
+	unsigned long long now;
+	int sig;
+
+	do {
+		now = now_ns();
+		if (deadline && now >= deadline)
+			return 0;
+		if (deadline) {
+			ts.tv_sec = (deadline - now) / 1000000000ULL;
+			ts.tv_nsec = (deadline - now) % 1000000000ULL;
+		}
+		sig = sigtimedwait(set, NULL, deadline ? &ts : NULL);
+	} while (sig < 0 && errno == EINTR);
+
+	return sig < 0 ? 0 : sig;
+}
+
+static void supervise(sigset_t *set)
+{
+	unsigned long long deadline;
+	int sig;
+
+	deadline = duration ? t0 + duration * 1000000000ULL : 0;
+
+	/* The run ends with the measurements or after the duration */
+	while (nr_running(ROLE_RUN) || (duration && !nr_runs)) {
+		sig = wait_signal(set, deadline);
+		if (sig == SIGCHLD) {
+			reap();
+			continue;
+		}
+		if (sig)
+			fprintf(stderr, "rt-runner: %s, stopping\n", strsignal(sig));
+		break;
+	}
+	reap();
+
+	/* The tools end a run on SIGINT like on Ctrl-C and write their JSON */
+	signal_all(ROLE_RUN, SIGINT);
+	signal_all(ROLE_LOAD, SIGTERM);
+
+	deadline = now_ns() + KILL_TIMEOUT * 1000000000ULL;
+	while (nr_running(ROLE_RUN) + nr_running(ROLE_LOAD)) {
+		sig = wait_signal(set, deadline);
+		if (sig == SIGCHLD) {
+			reap();
+			continue;
+		}
+		if (sig)
+			continue;
+		warn("tools still running after %d s, killing them\n",
+		     KILL_TIMEOUT);
+		signal_all(-1, SIGKILL);
+		while (nr_running(ROLE_RUN) + nr_running(ROLE_LOAD)) {
+			if (wait_signal(set, 0) == SIGCHLD)
+				reap();
+		}
+	}
+}
+
+static void write_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* The result of a tool in the report, shifted right by the indentation */
+static int write_result(FILE *f, struct entry *e, long long *start)
+{
+	char line[MAX_LINE];
+	unsigned long long ns;
+	long len;
+	char *p;
+	FILE *r;
+	int first = 1;
+
+	/* without a JSON file from this run the result is null */
+	r = e->json ? fopen(e->jsonfile, "r") : NULL;
+	if (!r)
+		return -1;
+	fseek(r, 0, SEEK_END);
+	len = ftell(r);
+	rewind(r);
+	if (len <= 0) {
+		fclose(r);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), r)) {
+		p = strstr(line, "\"start_monotonic_ns\":");
+		if (p && sscanf(p + 21, "%llu", &ns) == 1)
+			*start = ns - t0;
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len)
+			continue;
+		fprintf(f, "%s%*s%s", first ? "" : "\n", first ? 0 : 6, "",
+			line);
+		first = 0;
+	}
+	fclose(r);
+
+	return 0;
+}
+
+static void write_report(FILE *f, void *data)
+{
+	long long start;
+	struct entry *e;
+	char *cmd;
+	size_t len;
+	int i, j;
+
+	fprintf(f, "  \"scenario\": ");
+	write_string(f, scenario);
+	fprintf(f, ",\n  \"duration\": %d,\n", duration);
+	fprintf(f, "  \"t0_monotonic_ns\": %llu,\n", t0);
+	fprintf(f, "  \"tools\": [\n");
+
+	for (i = 0; i < nr_entries; i++) {
+		e = &entries[i];
+
+		len = 1;
+		for (j = 0; j < e->argc; j++)
+			len += strlen(e->argv[j]) + 1;
+		cmd = calloc(1, len);
+		if (!cmd)
+			fatal("Could not allocate memory\n");
+		for (j = 0; j < e->argc; j++) {
+			strcat(cmd, e->argv[j]);
+			if (j + 1 < e->argc)
+				strcat(cmd, " ");
+		}
+
+		fprintf(f, "    {\n      \"name\": ");
+		write_string(f, e->name);
+		fprintf(f, ",\n      \"role\": \"%s\",\n",
+			e->role == ROLE_RUN ? "run" : "load");
+		fprintf(f, "      \"cpus\": ");
+		if (e->cpus)
+			write_string(f, e->cpus);
+		else
+			fprintf(f, "null");
+		fprintf(f, ",\n      \"command\": ");
+		write_string(f, cmd);
+		fprintf(f, ",\n      \"pid\": %d,\n", e->pid);
+		if (WIFSIGNALED(e->status))
+			fprintf(f, "      \"signal\": %d,\n", WTERMSIG(e->status));
+		else
+			fprintf(f, "      \"exit_code\": %d,\n",
+				WEXITSTATUS(e->status));
+		fprintf(f, "      \"end_offset_ns\": %llu,\n", e->end_ns);
+		free(cmd);
+
+		/* the tools do not know T0, their start is in their JSON */
+		start = -1;
+		fprintf(f, "      \"result\": ");
+		if (write_result(f, e, &start))
+			fprintf(f, "null");
+		fprintf(f, ",\n      \"start_offset_ns\": ");
+		if (start >= 0)
+			fprintf(f, "%lld\n", start);
+		else
+			fprintf(f, "null\n");
+		fprintf(f, "    }%s\n", i + 1 < nr_entries ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+}
+
+static int failed(void)
+{
+	struct entry *e;
+	int i, ret = 0;
+
+	for (i = 0; i < nr_entries; i++) {
+		e = &entries[i];
+		/* loads are stopped by a signal, that is their normal end */
+		if (e->role == ROLE_LOAD)
+			continue;
+		if (WIFSIGNALED(e->status) || WEXITSTATUS(e->status)) {
+			warn("%s failed\n", e->name);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+static void cleanup(void)
+{
+	int i;
+
+	if (logdir)
+		return;
+	for (i = 0; i < nr_entries; i++)
+		if (entries[i].json)
+			unlink(entries[i].jsonfile);
+}
+
+enum option_values {
+	OPT_DURATION = 1, OPT_HELP, OPT_JSON, OPT_LOGDIR, OPT_VERBOSE,
+};
+
+int main(int argc, char *argv[])
+{
+	char *jsonfile = NULL;
+	sigset_t set;
+	int ret;
+
+	rt_init(argc, argv);
+
+	for (;;) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{"duration",	required_argument,	NULL, OPT_DURATION},
+			{"help",	no_argument,		NULL, OPT_HELP},
+			{"json",	required_argument,	NULL, OPT_JSON},
+			{"logdir",	required_argument,	NULL, OPT_LOGDIR},
+			{"verbose",	no_argument,		NULL, OPT_VERBOSE},
+			{NULL, 0, NULL, 0},
+		};
+		/* + stops at the scenario, nothing after it is ours */
+		int c = getopt_long(argc, argv, "+D:hl:v", long_options,
+				    &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'D':
+		case OPT_DURATION:
+			duration = parse_time_string(optarg);
+			break;
+		case 'h':
+		case OPT_HELP:
+			display_help(0);
+			break;
+		case OPT_JSON:
+			jsonfile = optarg;
+			break;
+		case 'l':
+		case OPT_LOGDIR:
+			logdir = optarg;
+			break;
+		case 'v':
+		case OPT_VERBOSE:
+			verbose = 1;
+			break;
+		default:
+			display_help(1);
+		}
+	}
+
+	if (optind != argc - 1)
+		display_help(1);
+	scenario = argv[optind];
+
+	parse_scenario();
+	if (logdir && mkdir(logdir, 0755) && errno != EEXIST)
+		fatal("Cannot create '%s': %s\n", logdir, strerror(errno));
+	setup_cpus();
+	setup_json();
+
+	/* All signals are taken synchronously, the children unblock them */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	launch();
+	supervise(&set);
+
+	ret = failed();
+	rt_write_json(jsonfile, ret, write_report, NULL);
+	cleanup();
+
+	return ret;
+}
@@ -33,6 +33,9 @@
 #include "rt-utils.h"
 #include "rt-sched.h"
 #include "rt-error.h"
+#include "rt-histogram.h"
+#include "rt-tsc.h"
+#include "rt-export.h"
 
 #define _STR(x) #x
 #define STR(x) _STR(x)
@@ -66,17 +69,23 @@ struct thread_stat {
 	long cycleofmax;
 	long hist_overflow;
 	long num_outliers;
+	struct histogram hist;	/* in us, or ns with --nsecs */
+	struct export_stat export;
 };
 
 struct sched_data {
 	u64 runtime_us;
 	u64 deadline_us;
+	u64 deadline_ns;
+
+	/* --tsc: counter and clock read as a pair, refreshed every resync */
+	u64 tsc_base;
+	u64 ns_base;
+	unsigned long tsc_resync;
 
 	int bufmsk;
 
 	struct thread_stat stat;
-
-	char buff[BUFSIZ+1];
 };
 
 static int shutdown;
@@ -87,9 +96,11 @@ static int cpu_count;
 static int all_cpus;
 static int nr_threads;
 static int use_nsecs;
-static int mark_fd;
+static int use_tsc;
+static struct tsc_scale tsc_scale;
 static int quiet;
 static char jsonfile[MAX_PATH];
+static char exportspec[MAX_PATH];
 
 static int find_mount(const char *mount, char *debugfs)
 {
@@ -129,107 +140,6 @@ static const char *find_debugfs(void)
 	return debugfs;
 }
 
-static int my_vsprintf(char *buf, int size, const char *fmt, va_list ap)
-{
-	const char *p;
-	char tmp[100];
-	char *s = buf;
-	char *end = buf + size;
-	char *str;
-	long long lng;
-	int l;
-	int i;
-
-	end[-1] = 0;
-
-	for (p = fmt; *p && s < end; p++) {
-		if (*p == '%') {
-			l = 0;
- again:
-			p++;
-			switch (*p) {
-			case 's':
-				if (l)
-					fatal("Illegal print format l used with %%s\n");
-				str = va_arg(ap, char *);
-				l = strlen(str);
-				strncpy(s, str, end - s);
-				s += l;
-				break;
-			case 'l':
-				l++;
-				goto again;
-			case 'd':
-				if (l == 1) {
-					if (sizeof(long) == 8)
-						l = 2;
-				}
-				if (l == 2)
-					lng = va_arg(ap, long long);
-				else if (l > 2)
-					fatal("Illegal print format l=%d\n", l);
-				else
-					lng = va_arg(ap, int);
-				i = 0;
-				while (lng > 0) {
-					tmp[i++] = (lng % 10) + '0';
-					lng /= 10;
-				}
-				tmp[i] = 0;
-				l = strlen(tmp);
-				if (!l) {
-					*s++ = '0';
-				} else {
-					while (l)
-						*s++ = tmp[--l];
-				}
-				break;
-			default:
-				fatal("Illegal print format '%c'\n", *p);
-			}
-			continue;
-		}
-		*s++ = *p;
-	}
-
-	return s - buf;
-}
-
-static void ftrace_write(char *buf, const char *fmt, ...)
-{
-	va_list ap;
-	int n;
-
-	if (mark_fd < 0)
-		return;
-
-	va_start(ap, fmt);
-	n = my_vsprintf(buf, BUFSIZ, fmt, ap);
-	va_end(ap);
-
-	write(mark_fd, buf, n);
-}
-
-static void setup_ftrace_marker(void)
-{
-	struct stat st;
-	const char *debugfs = find_debugfs();
-	char files[strlen(debugfs) + strlen("/tracing/trace_marker") + 1];
-	int ret;
-
-	if (strlen(debugfs) == 0)
-		return;
-
-	sprintf(files, "%s/tracing/trace_marker", debugfs);
-	ret = stat(files, &st);
-	if (ret >= 0)
-		goto found;
-	/* Do nothing if not mounted */
-	return;
-found:
-	mark_fd = open(files, O_WRONLY);
-}
-
 /*
  * Return true if file exists
  */
@@ -257,16 +167,16 @@ static int fill_sched_features(char *path)
 	if (strlen(debugfs) == 0)
 		return -1;
 
-	snprintf(path, MAX_PATH, "%s/sched/features", debugfs);
-	ret = check_file_exists(path);
-	if (ret)
+	ret = snprintf(path, MAX_PATH, "%s/sched/features", debugfs);
+	if (ret < MAX_PATH && check_file_exists(path))
 		return 0;
 
-	snprintf(path, MAX_PATH, "%s/sched_features", debugfs);
-	ret = check_file_exists(path);
-	if (ret)
+	ret = snprintf(path, MAX_PATH, "%s/sched_features", debugfs);
+	if (ret < MAX_PATH && check_file_exists(path))
 		return 0;
 
+	ret = 0;
+
 	memset(path, 0, MAX_PATH);
 
 	return ret;
@@ -659,25 +569,53 @@ static void usage(int error)
 	       "-h       --help            Show this help menu.\n"
 	       "-i INTV  --interval        The shortest deadline for the tasks in us\n"
 	       "                           (default 1000us).\n"
+	       "         --export=SPEC     serve live stats in OpenMetrics format on the Unix\n"
+	       "                           socket unix:PATH or on localhost:PORT\n"
 	       "         --json=FILENAME   write final results into FILENAME, JSON formatted\n"
+	       "-N       --nsecs           print results in ns instead of us (default us)\n"
 	       "-s STEP  --step            The amount to increase the deadline for each task in us\n"
 	       "                           (default 500us).\n"
 	       "-t NUM   --threads         The number of threads to run as deadline (default 1).\n"
 	       "-q       --quiet           print a summary only on exit\n"
+	       "         --tsc             timestamp the periods with the cycle counter\n"
 	       );
 	exit(error);
 }
 
-static u64 get_time_us(void)
+#define TSC_CALIBRATE_MS	200
+#define TSC_RESYNC_NS		10000000ULL
+
+static u64 get_clock_ns(void)
 {
 	struct timespec ts;
-	u64 time;
 
 	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-	time = ts.tv_sec * 1000000;
-	time += ts.tv_nsec / 1000;
 
-	return time;
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Take a new (counter, clock) pair so calibration errors cannot add up */
+static void tsc_anchor(struct sched_data *sd)
+{
+	uint64_t a, b;
+
+	frc(&a);
+	sd->ns_base = get_clock_ns();
+	frc(&b);
+	sd->tsc_base = a + (b - a) / 2;
+}
+
+static inline u64 get_time_ns(struct sched_data *sd)
+{
+	uint64_t tsc;
+
+	if (!use_tsc)
+		return get_clock_ns();
+
+	frc(&tsc);
+	if (tsc < sd->tsc_base)
+		return sd->ns_base - tsc_to_ns(&tsc_scale, sd->tsc_base - tsc);
+	return sd->ns_base + tsc_to_ns(&tsc_scale, tsc - sd->tsc_base);
 }
 
 static void print_stat(FILE *fp, struct sched_data *sd, int index, int verbose, int quiet)
@@ -715,8 +653,8 @@ static void print_stat(FILE *fp, struct sched_data *sd, int index, int verbose,
 static u64 do_runtime(long tid, struct sched_data *sd, u64 period)
 {
 	struct thread_stat *stat = &sd->stat;
-	u64 next_period = period + sd->deadline_us;
-	u64 now = get_time_us();
+	u64 next_period = period + sd->deadline_ns;
+	u64 now = get_time_ns(sd);
 	u64 diff;
 
 	if (now < period) {
@@ -726,25 +664,30 @@ static u64 do_runtime(long tid, struct sched_data *sd, u64 period)
 		 * preempting us when we started. If that's the case then
 		 * adjust the current period.
 		 */
-		ftrace_write(sd->buff,
-			     "Adjusting period: now: %lld period: %lld delta:%lld%s\n",
-			     now, period, delta, delta > sd->deadline_us / 2 ?
-			     " HUGE ADJUSTMENT" : "");
+		TRACEMARK("Adjusting period: now: %lld period: %lld delta:%lld%s\n",
+			  now, period, delta, delta > sd->deadline_ns / 2 ?
+			  " HUGE ADJUSTMENT" : "");
 		period = now;
-		next_period = period + sd->deadline_us;
+		next_period = period + sd->deadline_ns;
 	}
 
-	ftrace_write(sd->buff, "start at %lld off=%lld (period=%lld next=%lld)\n",
-		     now, now - period, period, next_period);
+	TRACEMARK("start at %lld off=%lld (period=%lld next=%lld)\n",
+		  now, now - period, period, next_period);
 
 
 	diff = now - period;
+	if (!use_nsecs)
+		diff /= 1000;
+	if (stat->hist.buckets)
+		hist_sample(&stat->hist, diff);
 	if (diff > stat->max)
 		stat->max = diff;
 	if (!stat->min || diff < stat->min)
 		stat->min = diff;
 	stat->act = diff;
 	stat->avg += (double) diff;
+	if (*exportspec)
+		export_stat_update(&stat->export, diff);
 
 	stat->cycles++;
 
@@ -796,10 +739,13 @@ void *run_deadline(void *data)
 	pthread_barrier_wait(&barrier);
 
 	sched_yield();
-	period = get_time_us();
+	period = get_time_ns(sd);
 
 	while (!shutdown) {
 		period = do_runtime(tid, sd, period);
+		/* outside of the measured path, we only wake up again */
+		if (use_tsc && stat->cycles % sd->tsc_resync == 0)
+			tsc_anchor(sd);
 		sched_yield();
 	}
 	ret = sched_getattr(0, &attr, sizeof(attr), 0);
@@ -1025,10 +971,18 @@ static void write_stats(FILE *f, void *data)
 
 	fprintf(f, "  \"num_threads\": %d,\n", nr_threads);
 	fprintf(f, "  \"resolution_in_ns\": %u,\n", use_nsecs);
+	fprintf(f, "  \"tsc\": %d,\n", use_tsc);
 	fprintf(f, "  \"thread\": {\n");
 	for (i = 0; i < nr_threads; i++) {
 		s = &sd[i].stat;
 		fprintf(f, "    \"%u\": {\n", i);
+		fprintf(f, "      \"histogram\": ");
+		hist_print_json(f, &s->hist, 6);
+		fprintf(f, ",\n");
+		fprintf(f, "      \"percentiles\": ");
+		hist_print_percentiles_json(f, &s->hist, s->max, 6);
+		fprintf(f, ",\n");
+		fprintf(f, "      \"interval\": %lld,\n", sd[i].deadline_us);
 		fprintf(f, "	 \"cycles\": %ld,\n", s->cycles);
 		fprintf(f, "	 \"min\": %ld,\n", s->min);
 		fprintf(f, "	 \"max\": %ld,\n", s->max);
@@ -1040,7 +994,8 @@ static void write_stats(FILE *f, void *data)
 
 enum options_valud {
 	OPT_AFFINITY=1, OPT_DURATION, OPT_HELP, OPT_INTERVAL,
-	OPT_JSON, OPT_STEP, OPT_THREADS, OPT_QUIET
+	OPT_JSON, OPT_NSECS, OPT_STEP, OPT_THREADS, OPT_QUIET, OPT_TSC,
+	OPT_EXPORT
 };
 
 int main(int argc, char **argv)
@@ -1073,15 +1028,18 @@ int main(int argc, char **argv)
 		static struct option options[] = {
 			{ "affinity",	optional_argument,	NULL,	OPT_AFFINITY },
 			{ "duration",	required_argument,	NULL,	OPT_DURATION },
+			{ "export",	required_argument,	NULL,	OPT_EXPORT },
 			{ "help",	no_argument,		NULL,	OPT_HELP },
 			{ "interval",	required_argument,	NULL,	OPT_INTERVAL },
 			{ "json",	required_argument,	NULL,	OPT_JSON },
+			{ "nsecs",	no_argument,		NULL,	OPT_NSECS },
 			{ "step",	required_argument,	NULL,	OPT_STEP },
 			{ "threads",	required_argument,	NULL,	OPT_THREADS },
 			{ "quiet",	no_argument,		NULL,	OPT_QUIET },
+			{ "tsc",	no_argument,		NULL,	OPT_TSC },
 			{ NULL,		0,			NULL,	0   },
 		};
-		c = getopt_long(argc, argv, "a::c:D:hi:s:t:q", options, NULL);
+		c = getopt_long(argc, argv, "a::c:D:hi:Ns:t:q", options, NULL);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -1104,6 +1062,20 @@ int main(int argc, char **argv)
 		case OPT_JSON:
 			strncpy(jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
 			break;
+		case OPT_EXPORT:
+			strncpy(exportspec, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
+		case OPT_NSECS:
+		case 'N':
+			use_nsecs = 1;
+			break;
+		case OPT_TSC:
+#ifdef FRC_MISSING
+			fatal("--tsc is not available on your arch\n");
+#else
+			use_tsc = 1;
+#endif
+			break;
 		case OPT_STEP:
 		case 's':
 			step = atoi(optarg);
@@ -1160,7 +1132,15 @@ int main(int argc, char **argv)
 	if (mlockall(MCL_CURRENT|MCL_FUTURE) == -1)
 		warn("mlockall");
 
-	setup_ftrace_marker();
+	tracemark_open(TRACEMARK_QUIET);
+
+	if (use_tsc) {
+		if (!tsc_is_stable())
+			warn("cycle counter is not invariant, --tsc results may be skewed\n");
+		if (tsc_calibrate(&tsc_scale, CLOCK_MONOTONIC_RAW,
+				  TSC_CALIBRATE_MS))
+			fatal("failed to calibrate the cycle counter\n");
+	}
 
 	thread = calloc(nr_threads, sizeof(*thread));
 	sched_data = calloc(nr_threads, sizeof(*sched_data));
@@ -1195,13 +1175,22 @@ int main(int argc, char **argv)
 		}
 		sd->runtime_us = runtime;
 		sd->deadline_us = interval;
+		sd->deadline_ns = interval * 1000ULL;
+		sd->tsc_resync = TSC_RESYNC_NS / sd->deadline_ns + 1;
+
+		hist_init(&sd->stat.hist, HIST_DIGITS_DEFAULT, HIST_RANGE_BITS_NS);
+		if (hist_alloc(&sd->stat.hist))
+			fatal("allocating histogram");
 
 		printf("interval: %lld:%lld\n", sd->runtime_us, sd->deadline_us);
 
+		if (use_tsc)
+			tsc_anchor(sd);
+
 		/* Make sure that we can make our deadlines */
-		start_period = get_time_us();
-		do_runtime(gettid(), sd, start_period);
-		end_period = get_time_us();
+		start_period = get_time_ns(sd) / 1000;
+		do_runtime(gettid(), sd, start_period * 1000);
+		end_period = get_time_ns(sd) / 1000;
 		if (end_period - start_period > sd->runtime_us)
 			fatal("Failed to perform task within runtime: Missed by %lld us\n",
 			      end_period - start_period - sd->runtime_us);
@@ -1209,10 +1198,28 @@ int main(int argc, char **argv)
 		printf("  Tested at %lldus of %lldus\n",
 		       end_period - start_period, sd->runtime_us);
 
+		/* the self test is not a sample */
+		sd->stat.min = sd->stat.max = sd->stat.act = 0;
+		sd->stat.avg = 0;
+		sd->stat.cycles = 0;
+		hist_reset(&sd->stat.hist);
+		memset(&sd->stat.export, 0, sizeof(sd->stat.export));
+
 		interval += step;
 	}
 
 
+	if (*exportspec) {
+		export_init("cyclicdeadline", use_nsecs ? "ns" : "us");
+		for (i = 0; i < nr_threads; i++)
+			if (export_add(&sched_data[i].stat.export,
+				       &sched_data[i].stat.hist, "thread=\"%d\"", i))
+				fatal("failed to export thread %d\n", i);
+		if (export_start(exportspec))
+			fatal("failed to export stats on %s: %s\n", exportspec,
+			      strerror(errno));
+	}
+
 	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
 
 	for (i = 0; i < nr_threads; i++) {
@@ -1280,11 +1287,16 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (*exportspec)
+		export_stop();
+
 	if (strlen(jsonfile) != 0)
 		rt_write_json(jsonfile, 0, write_stats, sched_data);
 
 	if (setcpu_buf)
 		free(setcpu_buf);
+	for (i = 0; i < nr_threads; i++)
+		hist_free(&sched_data[i].stat.hist);
 	free(thread);
 	free(sched_data);
 
@@ -18,6 +18,10 @@
  * 1) Simplest - create one deadline task that can migrate across all CPUS.
  *    Look for "simple_test"
  *
+ * 2) Capacity search (-S) - ramp the number of deadline tasks and their
+ *    utilization until admission fails or deadlines are missed.
+ *    Look for "search_capacity"
+ *
  */
 #include <pthread.h>
 #include <stdarg.h>
@@ -43,6 +47,7 @@
 
 #include <rt-utils.h>
 #include <rt-sched.h>
+#include <rt-tsc.h>
 
 /**
  * usage - show the usage of the program and exit.
@@ -59,15 +64,20 @@ static void usage(int error)
 	       "-b                         Bind on the last cpu. (shortcut for -c <lastcpu>)\n"
 	       "-c CPUSET                  Comma/hyphen separated list of CPUs to run deadline\n"
 	       "                           tasks on\n"
+	       "-D TIME                    Length of a run (default 10s, 2s per step with -S)\n"
 	       "-h                         Show this help menu\n"
 	       "-i INTV                    The shortest deadline for the tasks\n"
+	       "-L                         Burn a fixed number of loops per period, calibrated\n"
+	       "                           once at startup, instead of spinning for the runtime\n"
 	       "-p PERCENT                 The percent of bandwidth to use (1-90%%)\n"
 	       "-P PERCENT                 The percent of runtime for execution completion\n"
 	       "                           (default 100%%)\n"
 	       "-r PRIO                    Add an RT task with given prio to stress system\n"
 	       "-s STEP                    The amount to increase the deadline for each task in us\n"
 	       "                           (default 500us)\n"
+	       "-S                         Search the deadline bandwidth the system sustains\n"
 	       "-t NUM                     The number of threads to run as deadline (default 1)\n"
+	       "                           with -S the most threads to try (default 2 per CPU)\n"
 	       );
 	exit(error);
 }
@@ -105,6 +115,9 @@ typedef int s32;
  * @runtime_us: The runtime for sched_deadline tasks in microseconds
  * @deadline_us: The deadline for sched_deadline tasks in microseconds
  * @loops_per_period: The amount of loops to run for the runtime
+ * @burn_ns: Time to burn per period, zero to run @loops_per_period instead
+ * @chunk: Loops between two clock checks of the burn engine
+ * @max_overshoot_ns: How far the burn engine ran past @burn_ns at most
  * @max_time: Recorded max time to complete loops
  * @min_time: Recorded min time to complete loops
  * @total_time: The total time of all periods to perform the loops
@@ -128,6 +141,9 @@ struct sched_data {
 	u64 deadline_us;
 
 	u64 loops_per_period;
+	u64 burn_ns;
+	u64 chunk;
+	u64 max_overshoot_ns;
 
 	u64 max_time;
 	u64 min_time;
@@ -309,7 +325,7 @@ static int my_vsprintf(char *buf, int size, const char *fmt, va_list ap)
 }
 
 /* The ftrace tracing_marker file descriptor to write to ftrace */
-static int mark_fd;
+static int mark_fd = -1;
 
 /**
  * ftrace_write - write a string to ftrace tracing_marker
@@ -537,7 +553,9 @@ static int open_cpuset(const char *path, const char *name)
 	int fd;
 
 	buf[MAXPATH - 1] = 0;
-	snprintf(buf, MAXPATH - 1, "%s/%s", path, name);
+	ret = snprintf(buf, MAXPATH - 1, "%s/%s", path, name);
+	if (ret >= MAXPATH - 1)
+		return -1;
 
 	ret = stat(buf, &st);
 	if (ret < 0)
@@ -994,15 +1012,14 @@ static u64 get_time_us(void)
 }
 
 /**
- * run_loops - execute a number of loops to perform
+ * prime_loops - execute a number of loops to perform
  * @loops: The number of loops to execute.
  *
- * Calculates prime numbers, because what else should we do?
+ * Calculates prime numbers, because what else should we do? The loop
+ * only works on registers, so its speed does not depend on the caches.
  */
-static u64 run_loops(struct sched_data *data, u64 loops)
+static void prime_loops(struct sched_data *data, u64 loops)
 {
-	u64 start = get_time_us();
-	u64 end;
 	u64 i;
 	u64 prime;
 	u64 cnt = 2;
@@ -1026,9 +1043,97 @@ static u64 run_loops(struct sched_data *data, u64 loops)
 
 	/* Memory barrier */
 	asm("":::"memory");
+}
 
-	end = get_time_us();
-	return end - start;
+/**
+ * run_loops - execute a number of loops and time them
+ * @loops: The number of loops to execute.
+ *
+ * Returns the time in microseconds it took.
+ */
+static u64 run_loops(struct sched_data *data, u64 loops)
+{
+	u64 start = get_time_us();
+
+	prime_loops(data, loops);
+
+	return get_time_us() - start;
+}
+
+/*
+ * The burn engine spins on prime_loops() in chunks and checks the clock
+ * in between, until the requested time has passed. The loop count that
+ * fits into a period is no longer fixed at startup, so frequency changes
+ * and busy SMT siblings do not make the runtime drift. After each period
+ * the chunk is resized to about BURN_CHECK_NS of work at the speed just
+ * seen, which bounds the overshoot.
+ *
+ * The clock is the cycle counter when it is invariant, clock_gettime()
+ * otherwise.
+ */
+#define BURN_CHECK_NS		2000
+#define TSC_CALIBRATE_MS	200
+
+static int use_tsc;
+static struct tsc_scale tsc_scale;
+
+static inline u64 burn_clock(void)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	if (use_tsc) {
+		frc(&now);
+		return now;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline u64 burn_units(u64 ns)
+{
+	return use_tsc ? ns_to_tsc(&tsc_scale, ns) : ns;
+}
+
+static inline u64 burn_to_ns(u64 units)
+{
+	return use_tsc ? tsc_to_ns(&tsc_scale, units) : units;
+}
+
+/**
+ * run_burn - burn the CPU for a given time
+ * @data: The sched_data descriptor
+ * @burn_ns: The time to burn in nanoseconds
+ *
+ * Returns the time in microseconds it took.
+ */
+static u64 run_burn(struct sched_data *data, u64 burn_ns)
+{
+	u64 start = get_time_us();
+	u64 begin, end, now;
+	u64 chunks = 0;
+	u64 over;
+
+	begin = burn_clock();
+	end = begin + burn_units(burn_ns);
+	do {
+		prime_loops(data, data->chunk);
+		chunks++;
+		now = burn_clock();
+	} while (now < end);
+
+	over = burn_to_ns(now - end);
+	if (over > data->max_overshoot_ns)
+		data->max_overshoot_ns = over;
+
+	/* Recalibrate for the next period */
+	data->chunk = data->chunk * chunks * burn_units(BURN_CHECK_NS) /
+		(now - begin);
+	if (!data->chunk)
+		data->chunk = 1;
+
+	return get_time_us() - start;
 }
 
 /* Helper function for read_ctx_switchs */
@@ -1202,7 +1307,10 @@ static u64 do_runtime(long tid, struct sched_data *data, u64 period)
 		     now, now - period, period, next_period);
 
 	/* Run the simulate task (loops) */
-	time = run_loops(data, data->loops_per_period);
+	if (data->burn_ns)
+		time = run_burn(data, data->burn_ns);
+	else
+		time = run_loops(data, data->loops_per_period);
 
 	end = get_time_us();
 
@@ -1303,9 +1411,14 @@ void *run_deadline(void *data)
 	attr.sched_runtime = sched_data->runtime_us * 1000;
 	attr.sched_deadline = sched_data->deadline_us * 1000;
 
-	printf("thread[%d] runtime=%lldus deadline=%lldus loops=%lld\n",
-	       gettid(), sched_data->runtime_us,
-	       sched_data->deadline_us, sched_data->loops_per_period);
+	if (sched_data->burn_ns)
+		printf("thread[%d] runtime=%lldus deadline=%lldus burn=%lldus\n",
+		       gettid(), sched_data->runtime_us,
+		       sched_data->deadline_us, sched_data->burn_ns / 1000);
+	else
+		printf("thread[%d] runtime=%lldus deadline=%lldus loops=%lld\n",
+		       gettid(), sched_data->runtime_us,
+		       sched_data->deadline_us, sched_data->loops_per_period);
 
 	pthread_barrier_wait(&barrier);
 
@@ -1739,133 +1852,88 @@ static u64 calculate_loops_per_ms(u64 *overhead)
 	return loops;
 }
 
-int main(int argc, char **argv)
+/* Parameters of the runs, set up by main() */
+static unsigned int interval = 1000;
+static unsigned int step = 500;
+static int run_percent = 100;
+static int rt_task;
+static const char *setcpu;
+static char *allcpu_buf;
+static int all_cpus = 1;
+static int use_loops;
+static int duration;
+static u64 loops_per_ms;
+static u64 loop_overhead;
+
+/**
+ * struct run_result - the outcome of one run_test()
+ * @admission: Set if sched_setattr() refused a thread
+ * @missed_deadlines: The missed deadlines of all threads
+ * @missed_periods: The missed periods of all threads
+ */
+struct run_result {
+	int admission;
+	int missed_deadlines;
+	int missed_periods;
+};
+
+static void print_thread(struct sched_data *sd)
+{
+	printf("\n[%d]\n", sd->tid);
+	printf("missed deadlines  = %d\n", sd->missed_deadlines);
+	printf("missed periods    = %d\n", sd->missed_periods);
+	printf("Total adjustments = %lld us\n", sd->total_adjust);
+	printf("# adjustments = %lld avg: %lld us\n",
+	       sd->nr_adjust, sd->nr_adjust ?
+	       sd->total_adjust / sd->nr_adjust : 0);
+	printf("deadline   : %lld us\n", sd->deadline_us);
+	printf("runtime    : %lld us\n", sd->runtime_us);
+	printf("nr_periods : %lld\n", sd->nr_periods);
+	printf("max_time: %lldus", sd->max_time);
+	printf("\tmin_time: %lldus", sd->min_time);
+	printf("\tavg_time: %lldus\n", sd->nr_periods ?
+	       sd->total_time / sd->nr_periods : 0);
+	if (sd->burn_ns)
+		printf("burn chunk: %lld loops\tmax overshoot: %lldns\n",
+		       sd->chunk, sd->max_overshoot_ns);
+	printf("ctx switches vol:%d nonvol:%d migration:%d\n",
+	       sd->vol, sd->nonvol, sd->migrate);
+	printf("highes prime: %lld\n", sd->prime);
+	printf("\n");
+}
+
+/**
+ * run_test - run one set of deadline threads
+ * @nr_threads: The number of deadline threads
+ * @percent: The bandwidth of each thread in percent of its period
+ * @seconds: How long to let the threads run
+ * @verbose: Print the results of every thread
+ * @result: Output of the summed up misses
+ *
+ * The threads get deadlines of interval, interval + step, ... and are
+ * moved into the cpuset of setcpu if it is not all CPUs.
+ *
+ * Returns 0, or -1 without starting the threads if the run time of a
+ * thread is too short to be tested.
+ */
+static int run_test(int nr_threads, int percent, int seconds, int verbose,
+		     struct run_result *result)
 {
 	struct sched_data *sched_data;
 	struct sched_data *sd;
-	struct sched_data rt_sched_data;
+	struct sched_data rt_sched_data = { };
+	static int teardown_set;
 	const char *res;
-	const char *setcpu = NULL;
-	char *setcpu_buf = NULL;
-	char *allcpu_buf = NULL;
 	pthread_t *thread;
 	pthread_t rt_thread;
-	unsigned int interval = 1000;
-	unsigned int step = 500;
+	unsigned int intv;
 	u64 loop_time;
-	u64 loops;
 	u64 runtime;
-	u64 overhead;
 	u64 start_period;
 	u64 end_period;
-	int nr_cpus;
-	int all_cpus = 1;
-	int run_percent = 100;
-	int percent = 80;
-	int rt_task = 0;
 	int i;
-	int c;
 
-	cpu_count = sysconf(_SC_NPROCESSORS_CONF);
-	if (cpu_count < 1) {
-		fprintf(stderr, "Can not calculate number of CPUS\n");
-		exit(-1);
-	}
-
-	while ((c = getopt(argc, argv, "+hbr:c:i:p:P:t:s:")) >= 0) {
-		switch (c) {
-		case 'b':
-			all_cpus = 0;
-			break;
-		case 'c':
-			all_cpus = 0;
-			setcpu = optarg;
-			break;
-		case 'i':
-			interval = atoi(optarg);
-			break;
-		case 'p':
-			percent = atoi(optarg);
-			break;
-		case 'P':
-			run_percent = atoi(optarg);
-			break;
-		case 's':
-			step = atoi(optarg);
-			break;
-		case 't':
-			nr_threads = atoi(optarg);
-			break;
-		case 'r':
-			rt_task = atoi(optarg);
-			break;
-		case 'h':
-			usage(0);
-			break;
-		default:
-			usage(1);
-		}
-	}
-
-	if (rt_task < 0 || rt_task > 98) {
-		fprintf(stderr, "RT task can only be from 1 to 98\n");
-		exit(-1);
-	}
-
-	if (percent < 1 || percent > 100 || run_percent < 1 || run_percent > 100) {
-		fprintf(stderr, "Percent must be between 1 and 100\n");
-		exit(-1);
-	}
-
-	if (nr_threads < 1) {
-		fprintf(stderr, "The number of threads must be at least 1\n");
-		exit(-1);
-	}
-
-	if (setcpu) {
-		nr_cpus = calc_nr_cpus(setcpu, &setcpu_buf);
-		if (nr_cpus < 0) {
-			fprintf(stderr, "Invalid cpu input '%s'\n", setcpu);
-			exit(-1);
-		}
-	} else
-		nr_cpus = 1;
-
-	if (all_cpus)
-		nr_cpus = cpu_count;
-
-	if (cpu_count == nr_cpus)
-		all_cpus = 1;
-
-	/* -b has us bind to the last CPU. */
-	if (!all_cpus && !setcpu) {
-		setcpu_buf = malloc(12);
-		if (!setcpu_buf) {
-			perror("malloc");
-			exit(-1);
-		}
-		sprintf(setcpu_buf, "%d", cpu_count - 1);
-		setcpu = setcpu_buf;
-	}
-
-	/*
-	 * Now the amount of bandwidth each tasks takes will be
-	 * percent * nr_cpus / nr_threads. Now if nr_threads is
-	 * But the amount of any one thread can not be more than
-	 * 90 of the CPUs.
-	 */
-	percent = (percent * nr_cpus) / nr_threads;
-	if (percent > 90)
-		percent = 90;
-
-	cpusetp = CPU_ALLOC(cpu_count);
-	cpuset_size = CPU_ALLOC_SIZE(cpu_count);
-	if (!cpusetp) {
-		perror("allocating cpuset");
-		exit(-1);
-	}
-
-	setup_ftrace_marker();
+	memset(result, 0, sizeof(*result));
 
 	thread = calloc(nr_threads, sizeof(*thread));
 	sched_data = calloc(nr_threads, sizeof(*sched_data));
@@ -1874,28 +1942,12 @@ int main(int argc, char **argv)
 		exit(-1);
 	}
 
-	if (mlockall(MCL_CURRENT|MCL_FUTURE) == -1)
-		perror("mlockall");
-
-	/*
-	 * Run at prio 99 bound to the last CPU, and try to calculate
-	 * the time it takes to run the loops.
-	 */
+	/* The tests below must also not be preempted */
 	set_prio(99);
 	bind_cpu(cpu_count - 1);
 
-	loops = calculate_loops_per_ms(&overhead);
-
-	printf("Setup:\n");
-	printf(" percent per task:%d", percent);
-	if (run_percent < 100)
-		printf(" run-percent:%d", run_percent);
-	printf(" nr_cpus:%d", nr_cpus);
-	if (setcpu)
-		printf(" (%s)", setcpu);
-	printf(" loops:%lld overhead:%lldus\n", loops, overhead);
-
  again:
+	intv = interval;
 	/* Set up the data while sill in SCHED_FIFO */
 	for (i = 0; i < nr_threads; i++) {
 		sd = &sched_data[i];
@@ -1903,13 +1955,13 @@ int main(int argc, char **argv)
 		 * Interval is the deadline/period
 		 * The runtime is the percentage of that period.
 		 */
-		runtime = interval * percent / 100;
-		if (runtime < overhead) {
+		runtime = intv * percent / 100;
+		if (runtime < loop_overhead) {
 			fprintf(stderr, "Run time too short: %lld us\n",
 				runtime);
 			fprintf(stderr, "Read context takes %lld us\n",
-				overhead);
-			exit(-1);
+				loop_overhead);
+			goto out_short;
 		}
 		if (runtime < 2000) {
 			/*
@@ -1919,21 +1971,27 @@ int main(int argc, char **argv)
 			if (!setup_hr_tick()) {
 				fprintf(stderr, "For less that 2ms run times, you need to\n"
 					"have HRTICK enabled in debugfs/sched_features\n");
-				exit(-1);
+				goto out_short;
 			}
 		}
 		sd->runtime_us = runtime;
 		/* Account for the reading of context switches */
-		runtime -= overhead;
+		runtime -= loop_overhead;
 		/*
 		 * loops is # of loops per ms, convert to us and
 		 * take 5% off of it.
 		 *  loops * %run_percent / 1000
 		 */
 		loop_time = runtime * run_percent / 100;
-		sd->loops_per_period = loop_time * loops / 1000;
+		sd->loops_per_period = loop_time * loops_per_ms / 1000;
+		if (!use_loops) {
+			sd->burn_ns = loop_time * 1000;
+			sd->chunk = loops_per_ms * BURN_CHECK_NS / 1000000;
+			if (!sd->chunk)
+				sd->chunk = 1;
+		}
 
-		sd->deadline_us = interval;
+		sd->deadline_us = intv;
 
 		/* Make sure that we can make our deadlines */
 		start_period = get_time_us();
@@ -1942,15 +2000,22 @@ int main(int argc, char **argv)
 		if (end_period - start_period > sd->runtime_us) {
 			printf("Failed to perform task within runtime: Missed by %lld us\n",
 				end_period - start_period - sd->runtime_us);
-			overhead += end_period - start_period - sd->runtime_us;
-			printf("New overhead=%lldus\n", overhead);
+			loop_overhead += end_period - start_period - sd->runtime_us;
+			printf("New overhead=%lldus\n", loop_overhead);
 			goto again;
 		}
 
 		printf("  Tested at %lldus of %lldus\n",
 		       end_period - start_period, sd->runtime_us);
 
-		interval += step;
+		/* The test run does not count */
+		sd->missed_deadlines = sd->missed_periods = 0;
+		sd->total_adjust = sd->nr_adjust = 0;
+		sd->max_time = sd->min_time = sd->total_time = 0;
+		sd->nr_periods = 0;
+		sd->max_overshoot_ns = 0;
+
+		intv += step;
 	}
 
 	set_prio(0);
@@ -1980,9 +2045,13 @@ int main(int argc, char **argv)
 	if (!all_cpus) {
 		int *pids;
 
-		atexit(teardown);
+		if (!teardown_set) {
+			atexit(teardown);
+			teardown_set = 1;
+		}
 
-		make_other_cpu_list(setcpu, &allcpu_buf);
+		if (!allcpu_buf)
+			make_other_cpu_list(setcpu, &allcpu_buf);
 
 		res = make_cpuset(CPUSET_ALL, allcpu_buf, "0",
 				  CPUSET_FL_SET_LOADBALANCE |
@@ -2026,8 +2095,9 @@ int main(int argc, char **argv)
 
 	pthread_barrier_wait(&barrier);
 
+	/* A thread that was not admitted did set fail */
 	if (!fail)
-		sleep(10);
+		sleep(seconds);
 
 	done = 1;
 	if (rt_task) {
@@ -2043,33 +2113,279 @@ int main(int argc, char **argv)
 		res = join_thread(&thread[i]);
 		if (res) {
 			printf("Thread %d failed: %s\n", i, res);
+			result->admission = 1;
 			continue;
 		}
 
-		printf("\n[%d]\n", sd->tid);
-		printf("missed deadlines  = %d\n", sd->missed_deadlines);
-		printf("missed periods    = %d\n", sd->missed_periods);
-		printf("Total adjustments = %lld us\n", sd->total_adjust);
-		printf("# adjustments = %lld avg: %lld us\n",
-		       sd->nr_adjust, sd->total_adjust / sd->nr_adjust);
-		printf("deadline   : %lld us\n", sd->deadline_us);
-		printf("runtime    : %lld us\n", sd->runtime_us);
-		printf("nr_periods : %lld\n", sd->nr_periods);
-		printf("max_time: %lldus", sd->max_time);
-		printf("\tmin_time: %lldus", sd->min_time);
-		printf("\tavg_time: %lldus\n", sd->total_time / sd->nr_periods);
-		printf("ctx switches vol:%d nonvol:%d migration:%d\n",
-		       sd->vol, sd->nonvol, sd->migrate);
-		printf("highes prime: %lld\n", sd->prime);
-		printf("\n");
+		result->missed_deadlines += sd->missed_deadlines;
+		result->missed_periods += sd->missed_periods;
+
+		if (verbose)
+			print_thread(sd);
 	}
 
-	if (setcpu_buf)
-		free(setcpu_buf);
+	pthread_barrier_destroy(&barrier);
+	done = 0;
+	fail = 0;
+
 	free(thread);
 	free(sched_data);
+	return 0;
 
-	CPU_FREE(cpusetp);
+ out_short:
+	set_prio(0);
+	unbind_cpu();
+	free(thread);
+	free(sched_data);
+	return -1;
+}
+
+/* Per thread utilization steps of search_capacity(), in percent */
+#define SEARCH_STEP	10
+#define SEARCH_MAX	90
 
+/**
+ * search_capacity - find the deadline bandwidth the system sustains
+ * @max_threads: The largest number of deadline threads to try
+ *
+ * For 1 to @max_threads threads, raise the utilization of every thread
+ * in SEARCH_STEP steps until a thread is not admitted or a deadline or
+ * period is missed. The last good step is the bandwidth the system can
+ * sustain with this number of threads. Steps whose run time is too
+ * short to be tested are skipped. Stops when no step passes.
+ *
+ * Returns 0 if some bandwidth could be sustained at all.
+ */
+static int search_capacity(int max_threads)
+{
+	struct run_result result;
+	int best[max_threads + 1];
+	const char *limit[max_threads + 1];
+	int best_threads = 0;
+	int n, pct;
+
+	for (n = 1; n <= max_threads; n++) {
+		best[n] = 0;
+		limit[n] = "none";
+		for (pct = SEARCH_STEP; pct <= SEARCH_MAX; pct += SEARCH_STEP) {
+			printf("Search: threads:%d utilization:%d%%\n", n, pct);
+			if (run_test(n, pct, duration, 0, &result)) {
+				if (!best[n])
+					limit[n] = "run time";
+				continue;
+			}
+			if (result.admission) {
+				limit[n] = "admission";
+				break;
+			}
+			if (result.missed_deadlines || result.missed_periods) {
+				printf("Search: missed deadlines:%d periods:%d\n",
+				       result.missed_deadlines,
+				       result.missed_periods);
+				limit[n] = "missed deadline";
+				break;
+			}
+			best[n] = pct;
+			limit[n] = "none";
+		}
+		if (!best[n])
+			break;
+		if (!best_threads || best[n] * n > best[best_threads] * best_threads)
+			best_threads = n;
+	}
+	if (n > max_threads)
+		n = max_threads;
+
+	printf("\nCapacity:\n");
+	printf(" threads  utilization  bandwidth  limit\n");
+	for (max_threads = n, n = 1; n <= max_threads; n++)
+		printf(" %7d  %10d%%  %9.2f  %s\n", n, best[n],
+		       best[n] * n / 100.0, limit[n]);
+
+	if (!best_threads) {
+		printf("No deadline bandwidth could be sustained\n");
+		return -1;
+	}
+	printf("Sustained %.2f CPUs of deadline bandwidth with %d threads\n",
+	       best[best_threads] * best_threads / 100.0, best_threads);
 	return 0;
 }
+
+int main(int argc, char **argv)
+{
+	struct run_result result;
+	char *setcpu_buf = NULL;
+	int nr_cpus;
+	int percent = 80;
+	int search = 0;
+	int threads_set = 0;
+	int ret = 0;
+	int c;
+
+	cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+	if (cpu_count < 1) {
+		fprintf(stderr, "Can not calculate number of CPUS\n");
+		exit(-1);
+	}
+
+	while ((c = getopt(argc, argv, "+hbr:c:D:i:Lp:P:t:s:S")) >= 0) {
+		switch (c) {
+		case 'b':
+			all_cpus = 0;
+			break;
+		case 'c':
+			all_cpus = 0;
+			setcpu = optarg;
+			break;
+		case 'D':
+			duration = parse_time_string(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'L':
+			use_loops = 1;
+			break;
+		case 'p':
+			percent = atoi(optarg);
+			break;
+		case 'P':
+			run_percent = atoi(optarg);
+			break;
+		case 's':
+			step = atoi(optarg);
+			break;
+		case 'S':
+			search = 1;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			threads_set = 1;
+			break;
+		case 'r':
+			rt_task = atoi(optarg);
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+
+	if (rt_task < 0 || rt_task > 98) {
+		fprintf(stderr, "RT task can only be from 1 to 98\n");
+		exit(-1);
+	}
+
+	if (percent < 1 || percent > 100 || run_percent < 1 || run_percent > 100) {
+		fprintf(stderr, "Percent must be between 1 and 100\n");
+		exit(-1);
+	}
+
+	if (nr_threads < 1) {
+		fprintf(stderr, "The number of threads must be at least 1\n");
+		exit(-1);
+	}
+
+	if (duration <= 0)
+		duration = search ? 2 : 10;
+
+	if (setcpu) {
+		nr_cpus = calc_nr_cpus(setcpu, &setcpu_buf);
+		if (nr_cpus < 0) {
+			fprintf(stderr, "Invalid cpu input '%s'\n", setcpu);
+			exit(-1);
+		}
+	} else
+		nr_cpus = 1;
+
+	if (all_cpus)
+		nr_cpus = cpu_count;
+
+	if (cpu_count == nr_cpus)
+		all_cpus = 1;
+
+	/* -b has us bind to the last CPU. */
+	if (!all_cpus && !setcpu) {
+		setcpu_buf = malloc(12);
+		if (!setcpu_buf) {
+			perror("malloc");
+			exit(-1);
+		}
+		sprintf(setcpu_buf, "%d", cpu_count - 1);
+		setcpu = setcpu_buf;
+	}
+
+	if (search && !threads_set)
+		nr_threads = nr_cpus * 2;
+
+	/*
+	 * Now the amount of bandwidth each tasks takes will be
+	 * percent * nr_cpus / nr_threads. Now if nr_threads is
+	 * But the amount of any one thread can not be more than
+	 * 90 of the CPUs.
+	 */
+	percent = (percent * nr_cpus) / nr_threads;
+	if (percent > 90)
+		percent = 90;
+
+	cpusetp = CPU_ALLOC(cpu_count);
+	cpuset_size = CPU_ALLOC_SIZE(cpu_count);
+	if (!cpusetp) {
+		perror("allocating cpuset");
+		exit(-1);
+	}
+
+	setup_ftrace_marker();
+
+	if (mlockall(MCL_CURRENT|MCL_FUTURE) == -1)
+		perror("mlockall");
+
+	/*
+	 * Run at prio 99 bound to the last CPU, and try to calculate
+	 * the time it takes to run the loops.
+	 */
+	set_prio(99);
+	bind_cpu(cpu_count - 1);
+
+	loops_per_ms = calculate_loops_per_ms(&loop_overhead);
+
+#ifndef FRC_MISSING
+	if (!use_loops && tsc_is_stable() &&
+	    !tsc_calibrate(&tsc_scale, CLOCK_MONOTONIC_RAW, TSC_CALIBRATE_MS))
+		use_tsc = 1;
+#endif
+
+	printf("Setup:\n");
+	if (!search)
+		printf(" percent per task:%d", percent);
+	if (run_percent < 100)
+		printf(" run-percent:%d", run_percent);
+	printf(" nr_cpus:%d", nr_cpus);
+	if (setcpu)
+		printf(" (%s)", setcpu);
+	printf(" loops:%lld overhead:%lldus\n", loops_per_ms, loop_overhead);
+	if (use_loops)
+		printf(" burn: fixed loops\n");
+	else if (use_tsc)
+		printf(" burn: cycle counter at %.3f MHz\n", tsc_scale.hz / 1e6);
+	else
+		printf(" burn: clock_gettime\n");
+
+	if (search) {
+		ret = search_capacity(nr_threads);
+	} else {
+		ret = run_test(nr_threads, percent, duration, 1, &result);
+		if (result.admission)
+			ret = -1;
+	}
+
+	if (setcpu_buf)
+		free(setcpu_buf);
+	free(allcpu_buf);
+
+	CPU_FREE(cpusetp);
+
+	return ret;
+}
@@ -27,7 +27,9 @@
 #include <linux/unistd.h>
 
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/mman.h>
@@ -43,7 +45,9 @@
 struct thread_param {
 	int id;
 	int prio;
-	int signal;
+	int signal;		/* signal the thread waits for */
+	sigset_t sigset;
+	int sfd;
 	unsigned long max_cycles;
 	struct thread_stat *stats;
 	int bufmsk;
@@ -60,15 +64,276 @@ struct thread_stat {
 	double avg;
 	long *values;
 	pthread_t thread;
-	pthread_t tothread;
 	int threadstarted;
 	int tid;
 	int interrupted;
+	uint64_t stamp;		/* CLOCK_MONOTONIC ns of the last send */
+};
+
+/*
+ * How a signal travels from one thread to the next. kill, signalfd and
+ * timedwait send with pthread_kill() to the receiving thread; queue and
+ * pidfd send a process directed signal with a value, every receiver
+ * then waits for a signal number of its own.
+ */
+enum {
+	MECH_KILL,
+	MECH_QUEUE,
+	MECH_SIGNALFD,
+	MECH_TIMEDWAIT,
+	MECH_PIDFD,
+};
+
+static const char * const mech_names[] = {
+	"kill", "queue", "signalfd", "timedwait", "pidfd"
+};
+
+/*
+ * ring:   thread N signals thread N+1, the last one signals thread 0.
+ * fanout: thread 0 signals all others at once and waits for their
+ *         replies, its own latency is the time until the last reply.
+ * fanin:  all other threads signal thread 0 concurrently.
+ */
+enum {
+	TOPO_RING,
+	TOPO_FANOUT,
+	TOPO_FANIN,
+};
+
+static const char * const topo_names[] = {
+	"ring", "fanout", "fanin"
 };
 
 static int shutdown;
 static int tracelimit;
+static int mechanism = MECH_KILL;
+static int topology = TOPO_RING;
+static int holdoff = 10000;
+static int burst = 16;
+static int num_threads = 2;
+static pid_t pid;
+static int pidfd = -1;
+static struct thread_param *tpar;
+static pthread_barrier_t start_barrier;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* The ring with pthread_kill() keeps the classic SIGUSR1 */
+static int signo(int id)
+{
+	if (topology == TOPO_RING && mechanism != MECH_QUEUE &&
+	    mechanism != MECH_PIDFD)
+		return SIGUSR1;
+	return SIGRTMIN + id;
+}
+
+static int pidfd_send(int sig, int from)
+{
+#ifdef __NR_pidfd_send_signal
+	siginfo_t info;
+
+	memset(&info, 0, sizeof(info));
+	info.si_signo = sig;
+	info.si_code = SI_QUEUE;
+	info.si_pid = pid;
+	info.si_uid = getuid();
+	info.si_value.sival_int = from;
+	return syscall(__NR_pidfd_send_signal, pidfd, sig, &info, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int pidfd_init(void)
+{
+#ifdef __NR_pidfd_open
+	pidfd = syscall(__NR_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+#endif
+	return pidfd < 0 ? -1 : 0;
+}
+
+static void stamp(struct thread_param *par)
+{
+	__atomic_store_n(&par->stats->stamp, now_ns(), __ATOMIC_RELEASE);
+}
+
+/* Send the signal of par to thread to */
+static void send_signal(struct thread_param *par, int to)
+{
+	union sigval val = { .sival_int = par->id };
+	int sig = signo(topology == TOPO_FANIN ? par->id : to);
+
+	switch (mechanism) {
+	case MECH_QUEUE:
+		sigqueue(pid, sig, val);
+		break;
+	case MECH_PIDFD:
+		pidfd_send(sig, par->id);
+		break;
+	default:
+		pthread_kill(tpar[to].stats->thread, sig);
+		break;
+	}
+}
 
+/* Wait for the next signal, returns the signal number or -1 */
+static int wait_signal(struct thread_param *par)
+{
+	struct timespec timeout = { 0, 100000000 };
+	struct signalfd_siginfo fdsi;
+	siginfo_t info;
+	int sig;
+
+	switch (mechanism) {
+	case MECH_KILL:
+		if (sigwait(&par->sigset, &sig))
+			return -1;
+		break;
+	case MECH_SIGNALFD:
+		if (read(par->sfd, &fdsi, sizeof(fdsi)) != sizeof(fdsi))
+			return -1;
+		sig = fdsi.ssi_signo;
+		break;
+	case MECH_TIMEDWAIT:
+		do {
+			sig = sigtimedwait(&par->sigset, &info, &timeout);
+		} while (sig < 0 && errno == EAGAIN && !shutdown);
+		break;
+	default:
+		sig = sigwaitinfo(&par->sigset, &info);
+		break;
+	}
+	return shutdown ? -1 : sig;
+}
+
+/* Account the wakeup latency of par for a signal sent at sent */
+static int account(struct thread_param *par, uint64_t sent)
+{
+	struct thread_stat *stat = par->stats;
+	long diff = (now_ns() - sent) / 1000;
+
+	if (diff < stat->min)
+		stat->min = diff;
+	if (diff > stat->max)
+		stat->max = diff;
+	stat->avg += (double) diff;
+
+	if (!stat->interrupted && tracelimit && diff > tracelimit) {
+		stat->interrupted = 1;
+		shutdown++;
+	}
+	stat->act = diff;
+	stat->cycles++;
+
+	if (par->bufmsk)
+		stat->values[stat->cycles & par->bufmsk] = diff;
+
+	return par->max_cycles && par->max_cycles == stat->cycles;
+}
+
+/* Give the system a break after every burst of sends */
+static void hold_off(unsigned long count)
+{
+	if (holdoff && !(count % burst))
+		usleep(holdoff);
+}
+
+static void ring_loop(struct thread_param *par)
+{
+	int prev = (par->id + num_threads - 1) % num_threads;
+	int next = (par->id + 1) % num_threads;
+
+	if (!par->id) {
+		stamp(par);
+		send_signal(par, next);
+	}
+
+	while (!shutdown) {
+		if (wait_signal(par) < 0)
+			break;
+		/* Thread 0 ends the ring, the others keep it going until then */
+		if (account(par, tpar[prev].stats->stamp) && !par->id)
+			break;
+		if (!par->id)
+			hold_off(par->stats->cycles);
+		stamp(par);
+		send_signal(par, next);
+	}
+}
+
+static void fanout_loop(struct thread_param *par)
+{
+	struct thread_stat *hub = tpar[0].stats;
+	int i;
+
+	if (par->id) {
+		while (!shutdown) {
+			if (wait_signal(par) < 0)
+				break;
+			account(par, hub->stamp);
+			send_signal(par, 0);
+			if (par->max_cycles && par->stats->cycles >= par->max_cycles)
+				break;
+		}
+		return;
+	}
+
+	/* All workers measure from the start of the round */
+	while (!shutdown) {
+		stamp(par);
+		for (i = 1; i < num_threads; i++)
+			send_signal(par, i);
+		for (i = 1; i < num_threads; i++)
+			if (wait_signal(par) < 0)
+				return;
+		if (account(par, hub->stamp))
+			break;
+		hold_off(par->stats->cycles);
+	}
+}
+
+static void fanin_loop(struct thread_param *par)
+{
+	struct thread_stat *stat = par->stats;
+	unsigned long sent;
+	int sig;
+
+	if (!par->id) {
+		while (!shutdown) {
+			sig = wait_signal(par);
+			if (sig < 0)
+				break;
+			stat = tpar[sig - SIGRTMIN].stats;
+			account(par, stat->stamp);
+			/* Let the sender go on with the next signal */
+			__atomic_store_n(&stat->stamp, 0, __ATOMIC_RELEASE);
+			if (par->max_cycles &&
+			    par->stats->cycles >= par->max_cycles * (num_threads - 1))
+				break;
+		}
+		return;
+	}
+
+	for (sent = 0; !shutdown; sent++) {
+		if (par->max_cycles && sent >= par->max_cycles)
+			break;
+		if (sent)
+			hold_off(sent);
+		while (__atomic_load_n(&stat->stamp, __ATOMIC_ACQUIRE) && !shutdown)
+			sched_yield();
+		stamp(par);
+		send_signal(par, 0);
+	}
+}
 
 /*
  * signal thread
@@ -78,12 +343,8 @@ void *signalthread(void *param)
 {
 	struct thread_param *par = param;
 	struct sched_param schedp;
-	sigset_t sigset;
-	struct timespec before, after;
 	struct thread_stat *stat = par->stats;
 	int policy = par->prio ? SCHED_FIFO : SCHED_OTHER;
-	int stopped = 0;
-	int first = 1;
 	pthread_t thread;
 	cpu_set_t mask;
 
@@ -98,72 +359,27 @@ void *signalthread(void *param)
 			     par->cpu);
 	}
 
-	sigemptyset(&sigset);
-	sigaddset(&sigset, par->signal);
-	sigprocmask(SIG_BLOCK, &sigset, NULL);
-
 	memset(&schedp, 0, sizeof(schedp));
 	schedp.sched_priority = par->prio;
 	sched_setscheduler(0, policy, &schedp);
 
 	stat->threadstarted++;
 
-	clock_gettime(CLOCK_MONOTONIC, &before);
-
-	while (!shutdown) {
-		struct timespec now;
-		long diff;
-		int sigs;
-
-		if (sigwait(&sigset, &sigs) < 0)
-			goto out;
-
-		clock_gettime(CLOCK_MONOTONIC, &after);
-
-		/*
-		 * If it is the first thread, sleep after every 16
-		 * round trips.
-		 */
-		if (!par->id && !(stat->cycles & 0x0F))
-			usleep(10000);
-
-		/* Get current time */
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		pthread_kill(stat->tothread, SIGUSR1);
-
-		/* Skip the first cycle */
-		if (first) {
-			first = 0;
-			before = now;
-			continue;
-		}
-
-		diff = calcdiff(after, before);
-		before = now;
-
-		if (diff < stat->min)
-			stat->min = diff;
-		if (diff > stat->max)
-			stat->max = diff;
-		stat->avg += (double) diff;
-
-		if (!stopped && tracelimit && !par->id  && (diff > tracelimit)) {
-			stat->act = diff;
-			stat->interrupted = 1;
-			stopped++;
-			shutdown++;
-		}
-		stat->act = diff;
-		stat->cycles++;
+	/* Nobody sends before all threads are known */
+	pthread_barrier_wait(&start_barrier);
 
-		if (par->bufmsk)
-			stat->values[stat->cycles & par->bufmsk] = diff;
-
-		if (par->max_cycles && par->max_cycles == stat->cycles)
-			break;
+	switch (topology) {
+	case TOPO_RING:
+		ring_loop(par);
+		break;
+	case TOPO_FANOUT:
+		fanout_loop(par);
+		break;
+	case TOPO_FANIN:
+		fanin_loop(par);
+		break;
 	}
 
-out:
 	/* switch to normal */
 	schedp.sched_priority = 0;
 	sched_setscheduler(0, SCHED_OTHER, &schedp);
@@ -173,6 +389,16 @@ out:
 	return NULL;
 }
 
+static int parse_name(const char *name, const char * const *names, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (!strcmp(name, names[i]))
+			return i;
+	return -1;
+}
+
 
 /* Print usage information */
 static void display_help(int error)
@@ -183,16 +409,31 @@ static void display_help(int error)
 		"-a [NUM] --affinity        run thread #N on processor #N, if possible\n"
 		"                           with NUM pin all threads to the processor NUM\n"
 		"-b USEC  --breaktrace=USEC send break trace command when latency > USEC\n"
+		"         --burst=NUM       signals sent between two hold-offs, default=16\n"
 		"-D       --duration=TIME   specify a length for the test run.\n"
 		"                           Append 'm', 'h', or 'd' to specify minutes, hours or\n"
 		"                           days.\n"
 		"-h       --help            display usage information\n"
+		"         --holdoff=USEC    pause of the sender after every burst,\n"
+		"                           default=10000, 0 sends back to back\n"
 		"         --json=FILENAME   write final results into FILENAME, JSON formatted\n"
 		"-l LOOPS --loops=LOOPS     number of loops: default=0(endless)\n"
 		"-m       --mlockall        lock current and future memory allocations\n"
+		"         --mechanism=MECH  how signals are sent and waited for:\n"
+		"                           kill       pthread_kill() and sigwait() (default)\n"
+		"                           queue      rt_sigqueueinfo() and sigwaitinfo()\n"
+		"                           signalfd   pthread_kill() and read() of a signalfd\n"
+		"                           timedwait  pthread_kill() and sigtimedwait()\n"
+		"                           pidfd      pidfd_send_signal() and sigwaitinfo()\n"
+		"         --placement=POL   order the CPUs of the threads by topology, POL is\n"
+		"                           rr, core, nosmt, llc or cross-node\n"
 		"-p PRIO  --prio=PRIO       priority of highest prio thread\n"
 		"-q       --quiet           print a summary only on exit\n"
 		"-t NUM   --threads=NUM     number of threads: default=2\n"
+		"         --topology=TOPO   ring    each thread signals the next (default)\n"
+		"                           fanout  thread 0 signals all others and waits\n"
+		"                                   for their replies\n"
+		"                           fanin   all others signal thread 0\n"
 		"-v       --verbose         output values on stdout for statistics\n"
 		"                           format: n:c:v n=tasknum c=count v=value in us\n"
 		);
@@ -200,7 +441,6 @@ static void display_help(int error)
 }
 
 static int priority;
-static int num_threads = 2;
 static int max_cycles;
 static int duration;
 static int verbose;
@@ -210,13 +450,15 @@ static struct bitmask *affinity_mask = NULL;
 static int smp = 0;
 static int numa = 0;
 static int setaffinity = AFFINITY_UNSPECIFIED;
+static int placement = -1;
+static struct cpu_plan *cpu_plan;
 static char jsonfile[MAX_PATH];
 
 enum option_values {
-	OPT_AFFINITY=1, OPT_BREAKTRACE,
-	OPT_DURATION, OPT_HELP, OPT_JSON,
-	OPT_LOOPS, OPT_MLOCKALL, OPT_PRIORITY,
-	OPT_QUIET, OPT_SMP, OPT_THREADS, OPT_VERBOSE
+	OPT_AFFINITY=1, OPT_BREAKTRACE, OPT_BURST,
+	OPT_DURATION, OPT_HELP, OPT_HOLDOFF, OPT_JSON,
+	OPT_LOOPS, OPT_MECHANISM, OPT_MLOCKALL, OPT_PLACEMENT,
+	OPT_PRIORITY, OPT_QUIET, OPT_SMP, OPT_THREADS, OPT_TOPOLOGY, OPT_VERBOSE
 };
 
 /* Process commandline options */
@@ -231,15 +473,20 @@ static void process_options(int argc, char *argv[], unsigned int max_cpus)
 		static struct option long_options[] = {
 			{"affinity",	optional_argument,	NULL, OPT_AFFINITY},
 			{"breaktrace",	required_argument,	NULL, OPT_BREAKTRACE},
+			{"burst",	required_argument,	NULL, OPT_BURST},
 			{"duration",	required_argument,	NULL, OPT_DURATION},
 			{"help",	no_argument,		NULL, OPT_HELP},
+			{"holdoff",	required_argument,	NULL, OPT_HOLDOFF},
 			{"json",	required_argument,	NULL, OPT_JSON},
 			{"loops",	required_argument,	NULL, OPT_LOOPS},
+			{"mechanism",	required_argument,	NULL, OPT_MECHANISM},
 			{"mlockall",	no_argument,		NULL, OPT_MLOCKALL},
+			{"placement",	required_argument,	NULL, OPT_PLACEMENT},
 			{"priority",	required_argument,	NULL, OPT_PRIORITY},
 			{"quiet",	no_argument,		NULL, OPT_QUIET},
 			{"smp",		no_argument,		NULL, OPT_SMP},
 			{"threads",	required_argument,	NULL, OPT_THREADS},
+			{"topology",	required_argument,	NULL, OPT_TOPOLOGY},
 			{"verbose",	no_argument,		NULL, OPT_VERBOSE},
 			{NULL, 0, NULL, 0}
 		};
@@ -278,6 +525,9 @@ static void process_options(int argc, char *argv[], unsigned int max_cpus)
 		case 'b':
 			tracelimit = atoi(optarg);
 			break;
+		case OPT_BURST:
+			burst = atoi(optarg);
+			break;
 		case OPT_DURATION:
 		case 'D':
 			duration = parse_time_string(optarg);
@@ -287,6 +537,9 @@ static void process_options(int argc, char *argv[], unsigned int max_cpus)
 		case 'h':
 			display_help(0);
 			break;
+		case OPT_HOLDOFF:
+			holdoff = atoi(optarg);
+			break;
 		case OPT_JSON:
 			strncpy(jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
 			break;
@@ -294,10 +547,26 @@ static void process_options(int argc, char *argv[], unsigned int max_cpus)
 		case 'l':
 			max_cycles = atoi(optarg);
 			break;
+		case OPT_MECHANISM:
+			mechanism = parse_name(optarg, mech_names,
+					       ARRAY_SIZE(mech_names));
+			if (mechanism < 0) {
+				warn("unknown mechanism %s\n", optarg);
+				error = 1;
+			}
+			break;
 		case OPT_MLOCKALL:
 		case 'm':
 			lockall = 1;
 			break;
+		case OPT_PLACEMENT:
+			placement = cpu_plan_policy(optarg);
+			if (placement < 0) {
+				warn("invalid placement '%s', use one of "
+				     CPU_PLAN_POLICIES "\n", optarg);
+				error = 1;
+			}
+			break;
 		case OPT_PRIORITY:
 		case 'p':
 			priority = atoi(optarg);
@@ -318,6 +587,14 @@ static void process_options(int argc, char *argv[], unsigned int max_cpus)
 		case 't':
 			num_threads = atoi(optarg);
 			break;
+		case OPT_TOPOLOGY:
+			topology = parse_name(optarg, topo_names,
+					      ARRAY_SIZE(topo_names));
+			if (topology < 0) {
+				warn("unknown topology %s\n", optarg);
+				error = 1;
+			}
+			break;
 		case OPT_VERBOSE:
 		case 'v': verbose = 1;
 			break;
@@ -330,12 +607,31 @@ static void process_options(int argc, char *argv[], unsigned int max_cpus)
 	if (priority < 0 || priority > 99)
 		error = 1;
 
+	if (placement >= 0) {
+		cpu_plan = cpu_plan_create(placement, affinity_mask);
+		if (!cpu_plan) {
+			warn("no CPU left for placement %s\n",
+			     cpu_plan_name(placement));
+			error = 1;
+		}
+	}
+
 	if (num_threads == -1)
-		num_threads = get_available_cpus(affinity_mask);
+		num_threads = cpu_plan ? cpu_plan->nr_cpus :
+			get_available_cpus(affinity_mask);
 
 	if (num_threads < 2)
 		error = 1;
 
+	if (signo(0) != SIGUSR1 && num_threads > SIGRTMAX - SIGRTMIN + 1) {
+		warn("at most %d threads with this mechanism and topology\n",
+		     SIGRTMAX - SIGRTMIN + 1);
+		error = 1;
+	}
+
+	if (holdoff < 0 || burst < 1)
+		error = 1;
+
 	/* if smp wasn't requested, test for numa automatically */
 	if (!smp) {
 		numa = numa_initialize();
@@ -360,18 +656,28 @@ static void sighand(int sig)
 	shutdown = 1;
 }
 
+/* The senders of the fan-in take no samples of their own */
+static int measures(int id)
+{
+	return topology != TOPO_FANIN || !id;
+}
+
 static void print_stat(struct thread_param *par, int index, int verbose)
 {
 	struct thread_stat *stat = par->stats;
 
+	if (!measures(index))
+		return;
+
 	if (!verbose) {
 		if (quiet != 1) {
 			printf("T:%2d (%5d) P:%2d C:%7lu "
 			       "Min:%7ld Act:%5ld Avg:%5ld Max:%8ld\n",
 			       index, stat->tid, par->prio,
-			       stat->cycles, stat->min, stat->act,
-			       stat->cycles ?
-			       (long)(stat->avg/stat->cycles) : 0, stat->max);
+			       stat->cycles, stat->cycles ? stat->min : 0,
+			       stat->act, stat->cycles ?
+			       (long)(stat->avg/stat->cycles) : 0,
+			       stat->cycles ? stat->max : 0);
 		}
 	} else {
 		while (stat->cycles != stat->cyclesread) {
@@ -389,29 +695,48 @@ static void write_stats(FILE *f, void *data)
 	unsigned int i;
 
 	fprintf(f, "  \"num_threads\": %d,\n", num_threads);
+	fprintf(f, "  \"mechanism\": \"%s\",\n", mech_names[mechanism]);
+	fprintf(f, "  \"topology\": \"%s\",\n", topo_names[topology]);
+	fprintf(f, "  \"holdoff\": %d,\n", holdoff);
+	fprintf(f, "  \"burst\": %d,\n", burst);
 	fprintf(f, "  \"thread\": {\n");
 	for (i = 0; i < num_threads; i++) {
 		fprintf(f, "    \"%u\": {\n", i);
-		s = &par->stats[i];
+		s = par[i].stats;
 		fprintf(f, "      \"cycles\": %ld,\n", s->cycles);
-		fprintf(f, "      \"min\": %ld,\n", s->min);
-		fprintf(f, "      \"max\": %ld,\n", s->max);
-		fprintf(f, "      \"avg\": %.2f,\n", s->avg/s->cycles);
-		fprintf(f, "      \"cpu\": %d\n", par->cpu);
+		fprintf(f, "      \"min\": %ld,\n", s->cycles ? s->min : 0);
+		fprintf(f, "      \"max\": %ld,\n", s->cycles ? s->max : 0);
+		fprintf(f, "      \"avg\": %.2f,\n",
+			s->cycles ? s->avg/s->cycles : 0.0);
+		fprintf(f, "      \"cpu\": %d\n", par[i].cpu);
 		fprintf(f, "    }%s\n", i == num_threads - 1 ? "" : ",");
 
 	}
 	fprintf(f, "  }\n");
 }
 
+/* The signals thread id waits for */
+static void thread_sigset(int id, sigset_t *set)
+{
+	int i;
+
+	sigemptyset(set);
+	if (topology == TOPO_FANIN) {
+		for (i = 1; !id && i < num_threads; i++)
+			sigaddset(set, signo(i));
+	} else {
+		sigaddset(set, signo(id));
+	}
+}
+
 int main(int argc, char **argv)
 {
 	sigset_t sigset;
-	int signum = SIGUSR1;
 	struct thread_param *par;
 	struct thread_stat *stat;
+	unsigned long target;
 	int i, ret = -1;
-	int status, cpu;
+	int status, cpu, lines;
 	int max_cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
 	rt_init(argc, argv);
@@ -420,6 +745,10 @@ int main(int argc, char **argv)
 	if (check_privs())
 		exit(1);
 
+	pid = getpid();
+	if (mechanism == MECH_PIDFD && pidfd_init())
+		fatal("pidfd_open() failed: %s\n", strerror(errno));
+
 	/* lock all memory (prevent paging) */
 	if (lockall)
 		if (mlockall(MCL_CURRENT|MCL_FUTURE) == -1) {
@@ -437,8 +766,13 @@ int main(int argc, char **argv)
 			warn("Couldn't setaffinity in main thread: %s\n", strerror(errno));
 	}
 
+	/*
+	 * Process directed signals go to any thread which does not block
+	 * them, so all threads block all test signals from the start.
+	 */
 	sigemptyset(&sigset);
-	sigaddset(&sigset, signum);
+	for (i = 0; i < num_threads; i++)
+		sigaddset(&sigset, signo(i));
 	sigprocmask(SIG_BLOCK, &sigset, NULL);
 
 	signal(SIGINT, sighand);
@@ -454,15 +788,18 @@ int main(int argc, char **argv)
 	stat = calloc(num_threads, sizeof(struct thread_stat));
 	if (!stat)
 		goto outpar;
+	tpar = par;
 
-	for (i = 0; i < num_threads; i++) {
-		if (verbose) {
-			stat[i].values = calloc(VALBUF_SIZE, sizeof(long));
-			if (!stat[i].values)
-				goto outall;
-			par[i].bufmsk = VALBUF_SIZE - 1;
-		}
+	for (i = 0; verbose && i < num_threads; i++) {
+		stat[i].values = calloc(VALBUF_SIZE, sizeof(long));
+		if (!stat[i].values)
+			goto outall;
+		par[i].bufmsk = VALBUF_SIZE - 1;
+	}
 
+	pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+
+	for (i = 0; i < num_threads; i++) {
 		switch (setaffinity) {
 		case AFFINITY_UNSPECIFIED:
 			cpu = -1;
@@ -478,6 +815,8 @@ int main(int argc, char **argv)
 		default:
 			cpu = -1;
 		}
+		if (cpu_plan)
+			cpu = cpu_plan_cpu(cpu_plan, i);
 
 		par[i].id = i;
 		par[i].prio = priority;
@@ -485,7 +824,14 @@ int main(int argc, char **argv)
 		if (priority)
 			priority--;
 #endif
-		par[i].signal = signum;
+		thread_sigset(i, &par[i].sigset);
+		par[i].signal = topology == TOPO_FANIN ? signo(1) : signo(i);
+		par[i].sfd = -1;
+		if (mechanism == MECH_SIGNALFD) {
+			par[i].sfd = signalfd(-1, &par[i].sigset, SFD_CLOEXEC);
+			if (par[i].sfd < 0)
+				fatal("signalfd failed: %s\n", strerror(errno));
+		}
 		par[i].max_cycles = max_cycles;
 		par[i].stats = &stat[i];
 		par[i].cpu = cpu;
@@ -499,23 +845,13 @@ int main(int argc, char **argv)
 			fatal("failed to create thread %d: %s\n", i,
 			      strerror(status));
 	}
+	pthread_barrier_wait(&start_barrier);
 
-	while (!shutdown) {
-		int allstarted = 1;
-
-		for (i = 0; i < num_threads; i++) {
-			if (stat[i].threadstarted != 2)
-				allstarted = 0;
-		}
-		if (!allstarted)
-			continue;
-
-		for (i = 0; i < num_threads - 1; i++)
-			stat[i].tothread = stat[i+1].thread;
-		stat[i].tothread = stat[0].thread;
-		break;
-	}
-	pthread_kill(stat[0].thread, signum);
+	/* Thread 0 is representative, except for the workers of a fan-out */
+	lines = topology == TOPO_FANOUT ? num_threads : 1;
+	target = max_cycles;
+	if (topology == TOPO_FANIN)
+		target *= num_threads - 1;
 
 	while (!shutdown) {
 		char lavg[256];
@@ -529,15 +865,16 @@ int main(int argc, char **argv)
 			printf("%s          \n\n", lavg);
 		}
 
-		print_stat(&par[0], 0, verbose);
-		if (max_cycles && stat[0].cycles >= max_cycles)
+		for (i = 0; i < lines; i++)
+			print_stat(&par[i], i, verbose);
+		if (max_cycles && stat[0].cycles >= target)
 			allstopped++;
 
 		usleep(10000);
 		if (shutdown || allstopped)
 			break;
 		if (!verbose && !quiet)
-			printf("\033[%dA", 3);
+			printf("\033[%dA", lines + 2);
 	}
 	ret = 0;
  outall:
@@ -547,7 +884,7 @@ int main(int argc, char **argv)
 		quiet = 2;
 	for (i = 0; i < num_threads; i++) {
 		if (stat[i].threadstarted > 0)
-			pthread_kill(stat[i].thread, SIGUSR1);
+			pthread_kill(stat[i].thread, par[i].signal);
 		if (stat[i].interrupted)
 			printf("Thread %d exceeded trace limit.\n", i);
 		if (stat[i].threadstarted) {
@@ -556,6 +893,8 @@ int main(int argc, char **argv)
 		}
 		if (stat[i].values)
 			free(stat[i].values);
+		if (par[i].sfd >= 0)
+			close(par[i].sfd);
 	}
 	if (strlen(jsonfile) != 0)
 		rt_write_json(jsonfile, ret, write_stats, par);
@@ -563,6 +902,7 @@ int main(int argc, char **argv)
 	free(stat);
  outpar:
 	free(par);
+	cpu_plan_free(cpu_plan);
  out:
 	if (lockall)
 		munlockall();
@@ -22,6 +22,11 @@
  * The tracer waits on each PTRACE_SINGLESTEP with a waitpid(2)
  * and checks that waitpid's return values for correctness.
  *
+ * With --latency every PTRACE_SINGLESTEP / waitpid(2) round trip is
+ * timed with CLOCK_MONOTONIC into a histogram per pair, which lives in
+ * memory shared with main, and main reports the step rate and the
+ * latency percentiles once all pairs are done. --affinity and --per-cpu
+ * spread the pairs over the CPUs, a tracer and its tracee share a CPU.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,12 +36,18 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/ptrace.h>
+#include <sys/mman.h>
 
 #include "rt-utils.h"
+#include "rt-histogram.h"
+#include "rt-numa.h"
 
 /* do_wait return values */
 #define STATE_EXITED	1
@@ -71,16 +82,42 @@ static char jsonfile[MAX_PATH];
 
 static int got_sigchld;
 
-enum option_value { OPT_NFORKS=1, OPT_NITERS, OPT_HELP, OPT_JSON, OPT_QUIET };
+static int latency;
+static int per_cpu;
+static int setaffinity;
+static struct bitmask *affinity_mask;
+static struct cpu_plan *plan;
+
+/* written by the tracer of a pair, read by main once it has exited */
+struct pair_stat {
+	int cpu;
+	unsigned long steps;
+	uint64_t min, max;
+	double sum;
+	uint64_t start_ns, end_ns;
+	struct histogram hist;
+};
+static struct pair_stat *stats;
+
+static const double step_percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+
+enum option_value { OPT_NFORKS=1, OPT_NITERS, OPT_HELP, OPT_JSON, OPT_QUIET,
+		    OPT_AFFINITY, OPT_LATENCY, OPT_PERCPU };
 
 static void usage(int error)
 {
 	printf("ssdd V %1.2f\n", VERSION);
 	printf("Usage:\n"
 	       "ssdd <options>\n\n"
+	       "-a [LIST] --affinity[=LIST] spread the pairs over the CPUs in LIST,\n"
+	       "                           default all allowed CPUs\n"
 	       "-f       --forks=NUM       number of forks\n"
 	       "-h       --help            print this message\n"
 	       "         --json=FILENAME   write final results into FILENAME, JSON formatted\n"
+	       "         --latency         time every step round trip in ns, report the\n"
+	       "                           step rate and latency percentiles\n"
+	       "         --per-cpu=NUM     NUM pairs per CPU of the affinity, overrides\n"
+	       "                           --forks\n"
 	       "-q       --quiet           suppress running output\n"
 	       "-i       --iters=NUM       number of iterations\n"
 	       );
@@ -165,15 +202,147 @@ static void child_process(void)
 		;
 }
 
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record_step(struct pair_stat *st, uint64_t diff)
+{
+	if (diff < st->min)
+		st->min = diff;
+	if (diff > st->max)
+		st->max = diff;
+	st->sum += diff;
+	st->steps++;
+	hist_sample(&st->hist, diff);
+}
+
+/* One block for all pairs: the records, then the histogram buckets */
+static void alloc_stats(void)
+{
+	struct histogram hist;
+	size_t size;
+	char *buckets;
+	int i;
+
+	if (hist_init(&hist, HIST_DIGITS_DEFAULT, HIST_RANGE_BITS_NS)) {
+		printf("main: cannot set up the histograms\n");
+		exit(1);
+	}
+
+	size = nforks * (sizeof(*stats) + hist_size(&hist));
+	stats = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		printf("main: mmap returned errno %d\n", errno);
+		exit(1);
+	}
+
+	buckets = (char *)(stats + nforks);
+	for (i = 0; i < nforks; i++) {
+		stats[i].hist = hist;
+		stats[i].hist.buckets = (unsigned long *)
+			(buckets + i * hist_size(&hist));
+		stats[i].min = UINT64_MAX;
+		stats[i].cpu = -1;
+	}
+}
+
+static double steps_per_sec(unsigned long steps, uint64_t start, uint64_t end)
+{
+	return end > start ? steps * 1e9 / (end - start) : 0.0;
+}
+
+static void print_pair(const char *name, int cpu, struct pair_stat *st,
+		       double rate)
+{
+	uint64_t pct[ARRAY_SIZE(step_percentiles)];
+	unsigned int j;
+
+	hist_tail_percentiles(&st->hist, st->steps, st->max, step_percentiles,
+			      pct, ARRAY_SIZE(pct));
+	printf("%s", name);
+	if (cpu >= 0)
+		printf(" cpu %d", cpu);
+	printf(": steps %lu, %.0f steps/s, Min %llu, Avg %llu, Max %llu",
+	       st->steps, rate, (unsigned long long)st->min,
+	       (unsigned long long)(st->sum / st->steps + 0.5),
+	       (unsigned long long)st->max);
+	for (j = 0; j < ARRAY_SIZE(pct); j++)
+		printf(", P%g %llu", step_percentiles[j],
+		       (unsigned long long)pct[j]);
+	printf(" (ns)\n");
+}
+
+/*
+ * The pairs of all tests merged, the rate is over the time from the
+ * first pair starting to step to the last one finishing.
+ */
+static int sum_stats(struct pair_stat *total)
+{
+	struct pair_stat *st;
+	int i;
+
+	memset(total, 0, sizeof(*total));
+	total->hist = stats[0].hist;
+	total->hist.overflow = 0;
+	if (hist_alloc(&total->hist))
+		return -1;
+	total->min = UINT64_MAX;
+	total->start_ns = UINT64_MAX;
+	total->cpu = -1;
+
+	for (i = 0; i < nforks; i++) {
+		st = &stats[i];
+		if (!st->steps)
+			continue;
+		hist_merge(&total->hist, &st->hist);
+		if (st->min < total->min)
+			total->min = st->min;
+		if (st->max > total->max)
+			total->max = st->max;
+		if (st->start_ns < total->start_ns)
+			total->start_ns = st->start_ns;
+		if (st->end_ns > total->end_ns)
+			total->end_ns = st->end_ns;
+		total->sum += st->sum;
+		total->steps += st->steps;
+	}
+	return 0;
+}
+
 static int forktests(int testid)
 {
 	int i, status, ret_sig;
 	long pstatus;
 	pid_t child, wait_pid;
 	struct sigaction act, oact;
+	struct pair_stat *st = stats ? &stats[testid] : NULL;
+	uint64_t t = 0;
+	cpu_set_t mask;
+	int cpu;
 
 	parent = getpid();
 
+	/* before the fork, the tracee inherits the CPU */
+	if (plan) {
+		cpu = cpu_plan_cpu(plan, testid);
+		CPU_ZERO(&mask);
+		CPU_SET(cpu, &mask);
+		if (sched_setaffinity(0, sizeof(mask), &mask)) {
+			printf("forktest#%d/%d: EXITING, ERROR: "
+			       "cannot run on CPU %d, errno %d\n",
+			       testid, parent, cpu, errno);
+			exit(1);
+		}
+		if (st)
+			st->cpu = cpu;
+	}
+
 	child = fork();
 	if (child == -1) {
 		printf("forktest#%d/%d: EXITING, ERROR: "
@@ -239,7 +408,11 @@ static int forktests(int testid)
 	 * Generate 'nsteps' PTRACE_SINGLESTEPs, make sure they all actually
 	 * step the tracee.
 	 */
+	if (st)
+		st->start_ns = now_ns();
 	for (i = 0; i < nsteps; i++) {
+		if (st)
+			t = now_ns();
 		pstatus = ptrace(PTRACE_SINGLESTEP, child, NULL, NULL);
 
 		if (pstatus) {
@@ -251,6 +424,8 @@ static int forktests(int testid)
 		}
 
 		status = do_wait(&wait_pid, &ret_sig);
+		if (st)
+			record_step(st, now_ns() - t);
 		if (wait_pid != child) {
 			printf("forktest#%d/%d: EXITING, ERROR: "
 			       "wait on PTRACE_SINGLESTEP #%d: returned wrong pid %d, "
@@ -282,6 +457,8 @@ static int forktests(int testid)
 		}
 		got_sigchld = 0;
 	}
+	if (st)
+		st->end_ns = now_ns();
 
 	/* There is no need for the tracer to kill the tracee. It will
 	 * automatically exit when its owner, ie, us, exits.
@@ -291,11 +468,83 @@ static int forktests(int testid)
 	exit(0);
 }
 
+static void print_stats(void)
+{
+	struct pair_stat total;
+	char name[32];
+	int i;
+
+	for (i = 0; i < nforks && !quiet; i++) {
+		if (!stats[i].steps)
+			continue;
+		snprintf(name, sizeof(name), "#%d", i);
+		print_pair(name, stats[i].cpu, &stats[i],
+			   steps_per_sec(stats[i].steps, stats[i].start_ns,
+					 stats[i].end_ns));
+	}
+
+	if (sum_stats(&total) || !total.steps)
+		return;
+	print_pair("total", -1, &total,
+		   steps_per_sec(total.steps, total.start_ns, total.end_ns));
+	hist_free(&total.hist);
+}
+
+static void write_pair_json(FILE *f, struct pair_stat *st, double rate,
+			    int histogram)
+{
+	fprintf(f, "      \"cpu\": %d,\n", st->cpu);
+	fprintf(f, "      \"steps\": %lu,\n", st->steps);
+	fprintf(f, "      \"steps_per_sec\": %.2f,\n", rate);
+	if (histogram) {
+		fprintf(f, "      \"histogram\": ");
+		hist_print_json(f, &st->hist, 6);
+		fprintf(f, ",\n");
+	}
+	fprintf(f, "      \"percentiles\": ");
+	hist_print_percentiles_json(f, &st->hist, st->max, 6);
+	fprintf(f, ",\n");
+	fprintf(f, "      \"min\": %llu,\n",
+		st->steps ? (unsigned long long)st->min : 0);
+	fprintf(f, "      \"avg\": %.2f,\n",
+		st->steps ? st->sum / st->steps : 0.0);
+	fprintf(f, "      \"max\": %llu\n", (unsigned long long)st->max);
+}
+
+static void write_stats(FILE *f, void *data)
+{
+	struct pair_stat total;
+	int i;
+
+	fprintf(f, "  \"forks\": %d,\n", nforks);
+	fprintf(f, "  \"iters\": %d,\n", nsteps);
+	fprintf(f, "  \"resolution_in_ns\": 1,\n");
+	fprintf(f, "  \"thread\": {\n");
+	for (i = 0; i < nforks; i++) {
+		fprintf(f, "    \"%d\": {\n", i);
+		write_pair_json(f, &stats[i],
+				steps_per_sec(stats[i].steps, stats[i].start_ns,
+					      stats[i].end_ns), 0);
+		fprintf(f, "    }%s\n", i == nforks - 1 ? "" : ",");
+	}
+	fprintf(f, "  },\n");
+
+	fprintf(f, "  \"total\": {\n");
+	if (!sum_stats(&total)) {
+		write_pair_json(f, &total,
+				steps_per_sec(total.steps, total.start_ns,
+					      total.end_ns), 1);
+		hist_free(&total.hist);
+	}
+	fprintf(f, "  }\n");
+}
+
 int main(int argc, char **argv)
 {
 	int i, ret_sig, status;
 	pid_t child = 0, wait_pid;
 	int error = 0;
+	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
 
 	setbuf(stdout, NULL);
 
@@ -304,17 +553,31 @@ int main(int argc, char **argv)
 		int option_index = 0;
 
 		static struct option long_options[] = {
+			{"affinity",		optional_argument,	NULL, OPT_AFFINITY},
 			{"forks",		required_argument,	NULL, OPT_NFORKS},
 			{"help",		no_argument,		NULL, OPT_HELP},
 			{"json",		required_argument,	NULL, OPT_JSON},
+			{"latency",		no_argument,		NULL, OPT_LATENCY},
+			{"per-cpu",		required_argument,	NULL, OPT_PERCPU},
 			{"quiet",		no_argument,		NULL, OPT_QUIET},
 			{"iters",		required_argument,	NULL, OPT_NITERS},
 			{NULL, 0, NULL, 0},
 		};
-		int c = getopt_long(argc, argv, "f:hqi:", long_options, &option_index);
+		int c = getopt_long(argc, argv, "a::f:hqi:", long_options, &option_index);
 		if (c == -1)
 			break;
 		switch(c) {
+		case 'a':
+		case OPT_AFFINITY:
+			numa_initialize();
+			setaffinity = 1;
+			if (optarg &&
+			    (parse_cpumask(optarg, max_cpus, &affinity_mask) ||
+			     !affinity_mask)) {
+				printf("main: no usable CPUs in '%s'\n", optarg);
+				exit(1);
+			}
+			break;
 		case 'f':
 		case OPT_NFORKS:
 			nforks = atoi(optarg);
@@ -326,6 +589,13 @@ int main(int argc, char **argv)
 		case OPT_JSON:
 			strncpy(jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
 			break;
+		case OPT_LATENCY:
+			latency = 1;
+			break;
+		case OPT_PERCPU:
+			per_cpu = atoi(optarg);
+			setaffinity = 1;
+			break;
 		case OPT_QUIET:
 		case 'q':
 			quiet = 1;
@@ -340,6 +610,21 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (setaffinity) {
+		numa_initialize();
+		/* round robin, so that NUM pairs per CPU cover each CPU NUM times */
+		plan = cpu_plan_create(CPU_PLAN_RR, affinity_mask);
+		if (!plan || !plan->nr_cpus) {
+			printf("main: no CPUs to run the pairs on\n");
+			exit(1);
+		}
+		if (per_cpu > 0)
+			nforks = per_cpu * plan->nr_cpus;
+	}
+
+	if (latency)
+		alloc_stats();
+
 	if (!quiet) {
 		printf("#main : %d\n", getpid());
 		printf("#forks: %d\n", nforks);
@@ -373,8 +658,12 @@ int main(int argc, char **argv)
 		"One or more tests FAILED" :
 		"All tests PASSED");
 
+	if (latency)
+		print_stats();
+
 	if (strlen(jsonfile) != 0)
-		rt_write_json(jsonfile, error, NULL, NULL);
+		rt_write_json(jsonfile, error, latency ? write_stats : NULL,
+			      NULL);
 
 	exit(error);
 }
@@ -33,6 +33,8 @@
 #include "rt-utils.h"
 #include "rt-get_cpu.h"
 #include "rt-error.h"
+#include "rt-numa.h"
+#include "rt-ipc.h"
 
 #define SEM_WAIT_FOR_RECEIVER 0
 #define SEM_WAIT_FOR_SENDER 1
@@ -40,33 +42,11 @@
 #define SEM_LOCK -1
 #define SEM_UNLOCK 1
 
-enum {
-	AFFINITY_UNSPECIFIED,
-	AFFINITY_SPECIFIED,
-	AFFINITY_USEALL
-};
+#define SHM_NAME "/svsematest"
 
 struct params {
-	int num;
-	int num_threads;
-	int cpu;
-	int priority;
-	int affinity;
+	struct ipc_params ipc;
 	int semid;
-	int sender;
-	int samples;
-	int max_cycles;
-	int tracelimit;
-	int tid;
-	pid_t pid;
-	int shutdown;
-	int stopped;
-	struct timespec delay;
-	unsigned int mindiff, maxdiff;
-	double sumdiff;
-	struct timeval unblocked, received, diff;
-	pthread_t threadid;
-	struct params *neighbor;
 };
 
 static int mustfork;
@@ -75,139 +55,68 @@ static int wasforked_sender = -1;
 static int wasforked_threadno = -1;
 static int tracelimit;
 
-void *semathread(void *param)
+static int sem_op(struct ipc_params *par, unsigned short num, short op)
+{
+	struct sembuf sb = { num, op, 0 };
+
+	return semop(((struct params *)par)->semid, &sb, 1) != 0;
+}
+
+static int svsem_init(struct ipc_params *par)
 {
-	int mustgetcpu = 0;
-	struct params *par = param;
-	cpu_set_t mask;
-	int policy = SCHED_FIFO;
-	struct sched_param schedp;
-	struct sembuf sb = { 0, 0, 0};
 	sigset_t sigset;
 
 	sigemptyset(&sigset);
 	pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+	return 0;
+}
 
-	memset(&schedp, 0, sizeof(schedp));
-	schedp.sched_priority = par->priority;
-	sched_setscheduler(0, policy, &schedp);
-
-	if (par->cpu != -1) {
-		CPU_ZERO(&mask);
-		CPU_SET(par->cpu, &mask);
-		if (sched_setaffinity(0, sizeof(mask), &mask) == -1)
-			fatal("Could not set CPU affinity "
-			      "to CPU #%d\n", par->cpu);
-	} else {
-		int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
-
-		if (max_cpus > 1)
-			mustgetcpu = 1;
-		else
-			par->cpu = 0;
-	}
+/* Unlocking the semaphore: Start of latency measurement ... */
+static int svsem_send(struct ipc_params *par)
+{
+	return sem_op(par, SEM_WAIT_FOR_SENDER, SEM_UNLOCK);
+}
 
-	if (!wasforked)
-		par->tid = gettid();
-
-	while (!par->shutdown) {
-		if (par->sender) {
-			sb.sem_num = SEM_WAIT_FOR_SENDER;
-			sb.sem_op = SEM_UNLOCK;
-			/*
-			 * Unlocking the semaphore:
-			 *   Start of latency measurement ...
-			 */
-			gettimeofday(&par->unblocked, NULL);
-			semop(par->semid, &sb, 1);
-			par->samples++;
-			if (par->max_cycles && par->samples >= par->max_cycles)
-				par->shutdown = 1;
-
-			if (mustgetcpu)
-				par->cpu = get_cpu();
-
-			sb.sem_num = SEM_WAIT_FOR_RECEIVER;
-			sb.sem_op = SEM_LOCK;
-			semop(par->semid, &sb, 1);
-
-			sb.sem_num = SEM_WAIT_FOR_SENDER;
-			sb.sem_op = SEM_LOCK;
-			semop(par->semid, &sb, 1);
-		} else {
-			/* Receiver */
-			struct params *neighbor;
-
-			if (wasforked)
-				neighbor = par + par->num_threads;
-			else
-				neighbor = par->neighbor;
-
-			sb.sem_num = SEM_WAIT_FOR_SENDER;
-			sb.sem_op = SEM_LOCK;
-			semop(par->semid, &sb, 1);
-
-			/*
-			 * ... We got the lock:
-			 * End of latency measurement
-			 */
-			gettimeofday(&par->received, NULL);
-			par->samples++;
-			if (par->max_cycles && par->samples >= par->max_cycles)
-				par->shutdown = 1;
-
-			if (mustgetcpu)
-				par->cpu = get_cpu();
-
-			timersub(&par->received, &neighbor->unblocked,
-			    &par->diff);
-
-			if (par->diff.tv_usec < par->mindiff)
-				par->mindiff = par->diff.tv_usec;
-			if (par->diff.tv_usec > par->maxdiff)
-				par->maxdiff = par->diff.tv_usec;
-			par->sumdiff += (double) par->diff.tv_usec;
-			if (par->tracelimit && par->maxdiff > par->tracelimit) {
-				char tracing_enabled_file[MAX_PATH];
-
-				strcpy(tracing_enabled_file, get_debugfileprefix());
-				strcat(tracing_enabled_file, "tracing_on");
-				int tracing_enabled =
-				    open(tracing_enabled_file, O_WRONLY);
-				if (tracing_enabled >= 0) {
-					write(tracing_enabled, "0", 1);
-					close(tracing_enabled);
-				} else
-					fatal("Could not access %s\n",
-					      tracing_enabled_file);
-				par->shutdown = 1;
-				neighbor->shutdown = 1;
-			}
+static int svsem_sync(struct ipc_params *par)
+{
+	return sem_op(par, SEM_WAIT_FOR_RECEIVER, SEM_LOCK) ||
+		sem_op(par, SEM_WAIT_FOR_SENDER, SEM_LOCK);
+}
 
-			sb.sem_num = SEM_WAIT_FOR_RECEIVER;
-			sb.sem_op = SEM_UNLOCK;
-			semop(par->semid, &sb, 1);
+/* ... We got the lock: End of latency measurement */
+static int svsem_receive(struct ipc_params *par)
+{
+	return sem_op(par, SEM_WAIT_FOR_SENDER, SEM_LOCK);
+}
 
-			nanosleep(&par->delay, NULL);
+static int svsem_release(struct ipc_params *par)
+{
+	return sem_op(par, SEM_WAIT_FOR_RECEIVER, SEM_UNLOCK);
+}
 
-			sb.sem_num = SEM_WAIT_FOR_SENDER;
-			sb.sem_op = SEM_UNLOCK;
-			semop(par->semid, &sb, 1);
-		}
-	}
-	if (par->sender) {
-		sb.sem_num = SEM_WAIT_FOR_SENDER;
-		sb.sem_op = SEM_UNLOCK;
-		semop(par->semid, &sb, 1);
+static int svsem_ack(struct ipc_params *par)
+{
+	return sem_op(par, SEM_WAIT_FOR_SENDER, SEM_UNLOCK);
+}
 
-		sb.sem_num = SEM_WAIT_FOR_RECEIVER;
-		sb.sem_op = SEM_UNLOCK;
-		semop(par->semid, &sb, 1);
+static void svsem_exit(struct ipc_params *par)
+{
+	if (par->sender) {
+		sem_op(par, SEM_WAIT_FOR_SENDER, SEM_UNLOCK);
+		sem_op(par, SEM_WAIT_FOR_RECEIVER, SEM_UNLOCK);
 	}
-	par->stopped = 1;
-	return NULL;
 }
 
+static const struct ipc_ops svsem_ops = {
+	.init		= svsem_init,
+	.send		= svsem_send,
+	.sync		= svsem_sync,
+	.receive	= svsem_receive,
+	.release	= svsem_release,
+	.ack		= svsem_ack,
+	.exit		= svsem_exit,
+};
+
 
 union semun {
 	int		val;	/* Value for SETVAL */
@@ -231,10 +140,16 @@ static void display_help(int error)
 	       "-D       --duration=TIME   specify a length for the test run.\n"
 	       "                           Append 'm', 'h', or 'd' to specify minutes, hours or\n"
 	       "                           days.\n"
+	       "         --export=SPEC     serve live stats in OpenMetrics format on the Unix\n"
+	       "                           socket unix:PATH or on localhost:PORT\n"
 	       "-f [OPT] --fork[=OPT]      fork new processes instead of creating threads\n"
 	       "-i INTV  --interval=INTV   base interval of thread in us default=1000\n"
 	       "         --json=FILENAME   write final results into FILENAME, JSON formatted\n"
 	       "-l LOOPS --loops=LOOPS     number of loops: default=0(endless)\n"
+	       "-N       --nsecs           print results in ns instead of us (default us)\n"
+	       "         --placement=POL   order the CPUs of the threads by topology, POL is\n"
+	       "                           rr, core, nosmt, llc or cross-node; the two\n"
+	       "                           sides of a pair get consecutive CPUs\n"
 	       "-p PRIO  --prio=PRIO       priority\n"
 	       "-S       --smp             SMP testing: options -a -t and same priority\n"
 	       "                           of all threads\n"
@@ -257,12 +172,14 @@ static int distance = 500;
 static int smp;
 static int sameprio;
 static int quiet;
+static int use_nsecs;
 static char jsonfile[MAX_PATH];
+static char exportspec[MAX_PATH];
 
 enum option_value {
-	OPT_AFFINITY=1, OPT_BREAKTRACE, OPT_DISTANCE, OPT_DURATION,
+	OPT_AFFINITY=1, OPT_BREAKTRACE, OPT_DISTANCE, OPT_DURATION, OPT_EXPORT,
 	OPT_FORK, OPT_HELP, OPT_INTERVAL, OPT_JSON, OPT_LOOPS,
-	OPT_PRIORITY, OPT_QUIET, OPT_SMP, OPT_THREADS
+	OPT_NSECS, OPT_PLACEMENT, OPT_PRIORITY, OPT_QUIET, OPT_SMP, OPT_THREADS
 };
 
 static void process_options(int argc, char *argv[])
@@ -279,18 +196,21 @@ static void process_options(int argc, char *argv[])
 			{"breaktrace",	required_argument,	NULL, OPT_BREAKTRACE},
 			{"distance",	required_argument,	NULL, OPT_DISTANCE},
 			{"duration",	required_argument,	NULL, OPT_DURATION},
+			{"export",	required_argument,	NULL, OPT_EXPORT},
 			{"fork",	optional_argument,	NULL, OPT_FORK},
 			{"help",	no_argument,		NULL, OPT_HELP},
 			{"interval",	required_argument,	NULL, OPT_INTERVAL},
 			{"json",	required_argument,      NULL, OPT_JSON},
 			{"loops",	required_argument,	NULL, OPT_LOOPS},
+			{"nsecs",	no_argument,		NULL, OPT_NSECS},
+			{"placement",	required_argument,	NULL, OPT_PLACEMENT},
 			{"priority",	required_argument,	NULL, OPT_PRIORITY},
 			{"quiet",	no_argument,		NULL, OPT_QUIET},
 			{"smp",		no_argument,		NULL, OPT_SMP},
 			{"threads",	optional_argument,	NULL, OPT_THREADS},
 			{NULL, 0, NULL, 0}
 		};
-		int c = getopt_long (argc, argv, "a::b:d:D:f::hi:l:p:qSt::",
+		int c = getopt_long (argc, argv, "a::b:d:D:f::hi:l:Np:qSt::",
 			long_options, &option_index);
 		if (c == -1)
 			break;
@@ -343,6 +263,9 @@ static void process_options(int argc, char *argv[])
 		case 'i':
 			interval = atoi(optarg);
 			break;
+		case OPT_EXPORT:
+			strncpy(exportspec, optarg, strnlen(optarg, MAX_PATH-1));
+			break;
 		case OPT_JSON:
 			strncpy(jsonfile, optarg, strnlen(optarg, MAX_PATH-1));
 			break;
@@ -350,6 +273,17 @@ static void process_options(int argc, char *argv[])
 		case 'l':
 			max_cycles = atoi(optarg);
 			break;
+		case OPT_NSECS:
+		case 'N':
+			use_nsecs = 1;
+			break;
+		case OPT_PLACEMENT:
+			if (ipc_placement(optarg)) {
+				warn("invalid placement '%s', use one of "
+				     CPU_PLAN_POLICIES "\n", optarg);
+				error = 1;
+			}
+			break;
 		case OPT_PRIORITY:
 		case 'p':
 			priority = atoi(optarg);
@@ -421,85 +355,10 @@ static void sighand(int sig)
 	mustshutdown = 1;
 }
 
-struct params_stats {
-	struct params *receiver;
-	struct params *sender;
-};
-
-static void write_stats(FILE *f, void *data)
-{
-	struct params_stats *ps = data;
-	struct params *s, *r;
-	unsigned int i;
-
-	fprintf(f, "  \"num_threads\": %d,\n", num_threads);
-	fprintf(f, "  \"thread\": {\n");
-	for (i = 0; i < num_threads; i++) {
-		s = &ps->sender[i];
-		r = &ps->receiver[i];
-		fprintf(f, "    \"%u\": {\n", i);
-		fprintf(f, "      \"sender\": {\n");
-		fprintf(f, "        \"cpu\": %d,\n", s->cpu);
-		fprintf(f, "        \"priority\": %d,\n", s->priority);
-		fprintf(f, "        \"samples\": %d,\n", s->samples);
-		fprintf(f, "        \"interval\": %ld\n", r->delay.tv_nsec/1000);
-		fprintf(f, "      },\n");
-		fprintf(f, "      \"receiver\": {\n");
-		fprintf(f, "        \"cpu\": %d,\n", r->cpu);
-		fprintf(f, "        \"priority\": %d,\n", r->priority);
-		fprintf(f, "        \"min\": %d,\n", r->mindiff);
-		fprintf(f, "        \"avg\": %.2f,\n", r->sumdiff/r->samples);
-		fprintf(f, "        \"max\": %d\n", r->maxdiff);
-		fprintf(f, "      }\n");
-		fprintf(f, "    }%s\n", i == num_threads - 1 ? "" : ",");
-	}
-	fprintf(f, "  }\n");
-}
-
-static void print_stat(FILE *fp, struct params *receiver, struct params *sender,
-		       int verbose, int quiet)
-{
-	int i;
-
-	if (quiet)
-		return;
-
-	for (i = 0; i < num_threads; i++) {
-		int receiver_pid, sender_pid;
-
-		if (mustfork) {
-			receiver_pid = receiver[i].pid;
-			sender_pid = sender[i].pid;
-		} else {
-			receiver_pid = receiver[i].tid;
-			sender_pid = sender[i].tid;
-		}
-		printf("#%1d: ID%d, P%d, CPU%d, I%ld; #%1d: ID%d, P%d, CPU%d, Cycles %d\n",
-			i*2, receiver_pid, receiver[i].priority,
-			receiver[i].cpu, receiver[i].delay.tv_nsec /
-			1000, i*2+1, sender_pid, sender[i].priority,
-			sender[i].cpu, sender[i].samples);
-	}
-
-	for (i = 0; i < num_threads; i++) {
-		if (receiver[i].mindiff == -1)
-			printf("#%d -> #%d (not yet ready)\n",
-				i*2+1, i*2);
-		else
-			printf("#%d -> #%d, Min %4d, Cur %4d, Avg %4d, Max %4d\n",
-				i*2+1, i*2, receiver[i].mindiff,
-				(int) receiver[i].diff.tv_usec,
-				(int) ((receiver[i].sumdiff /
-						receiver[i].samples) + 0.5),
-				receiver[i].maxdiff);
-	}
-}
-
 int main(int argc, char *argv[])
 {
 	char *myfile;
-	int i, totalsize = 0;
-	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	int i;
 	int oldsamples = 1;
 	key_t key;
 	union semun args;
@@ -526,77 +385,49 @@ int main(int argc, char *argv[])
 	}
 
 	get_cpu_setup();
+	ipc_init(&svsem_ops, sizeof(struct params));
 
-	if (mustfork) {
-		int shmem;
-
-		/*
-		 * In fork mode (-f), the shared memory contains two
-		 * subsequent arrays, receiver[num_threads] and
-		 * sender[num_threads].
-		 */
-		totalsize = num_threads * sizeof(struct params) * 2;
-
-		shm_unlink("/sigwaittest");
-		shmem = shm_open("/sigwaittest", O_CREAT|O_EXCL|O_RDWR,
-		    S_IRUSR|S_IWUSR);
-		if (shmem < 0) {
-			fprintf(stderr, "Could not create shared memory\n");
-			return 1;
-		}
-		ftruncate(shmem, totalsize);
-		param = mmap(0, totalsize, PROT_READ|PROT_WRITE, MAP_SHARED,
-		    shmem, 0);
-		if (param == MAP_FAILED) {
-			fprintf(stderr, "Could not map shared memory\n");
-			close(shmem);
-			return 1;
-		}
-
-		receiver = (struct params *) param;
-		sender = receiver + num_threads;
-	} else if (wasforked) {
-		struct stat buf;
-		int shmem, totalsize, expect_totalsize;
+	if (wasforked) {
+		struct ipc_params *par;
 
 		if (wasforked_threadno == -1 || wasforked_sender == -1) {
 			fprintf(stderr, "Invalid fork option\n");
 			return 1;
 		}
-		shmem = shm_open("/sigwaittest", O_RDWR, S_IRUSR|S_IWUSR);
-		if (fstat(shmem, &buf)) {
-			fprintf(stderr,
-			    "Could not determine shared memory size\n");
-			close(shmem);
-			return 1;
-		}
-		totalsize = buf.st_size;
-		param = mmap(0, totalsize, PROT_READ|PROT_WRITE, MAP_SHARED,
-		    shmem, 0);
-		close(shmem);
-		if (param == MAP_FAILED) {
+		param = ipc_attach(SHM_NAME);
+		if (param == NULL) {
 			fprintf(stderr, "Could not map shared memory\n");
 			return 1;
 		}
-
-		receiver = (struct params *) param;
-		expect_totalsize = receiver->num_threads *
-		    sizeof(struct params) * 2;
-		if (totalsize != expect_totalsize) {
-			fprintf(stderr, "Memory size problem (expected %d, "
-			    "found %d\n", expect_totalsize, totalsize);
-			munmap(param, totalsize);
+		par = ipc_receiver(param, 0);
+		if (wasforked_threadno >= par->num_threads) {
+			fprintf(stderr, "Invalid fork option\n");
+			ipc_detach(param);
 			return 1;
 		}
-		sender = receiver + receiver->num_threads;
 		if (wasforked_sender)
-			semathread(sender + wasforked_threadno);
+			par = ipc_sender(param, wasforked_threadno);
 		else
-			semathread(receiver + wasforked_threadno);
-		munmap(param, totalsize);
+			par = ipc_receiver(param, wasforked_threadno);
+		ipc_thread(par);
+		ipc_detach(param);
 		return 0;
 	}
 
+	/*
+	 * In fork mode (-f), the pairs live in shared memory which the
+	 * children map after exec.
+	 */
+	param = ipc_alloc(num_threads, use_nsecs, mustfork ? SHM_NAME : NULL);
+	if (param == NULL) {
+		fprintf(stderr, mustfork ? "Could not create shared memory\n" :
+			"Could not allocate memory\n");
+		return 1;
+	}
+	if (*exportspec && ipc_export(param, "svsematest", exportspec))
+		fatal("failed to export stats on %s: %s\n", exportspec,
+		      strerror(errno));
+
 	signal(SIGINT, sighand);
 	signal(SIGTERM, sighand);
 	signal(SIGALRM, sighand);
@@ -607,13 +438,6 @@ int main(int argc, char *argv[])
 	if (duration)
 		alarm(duration);
 
-	if (!mustfork && !wasforked) {
-		receiver = calloc(num_threads, sizeof(struct params));
-		sender = calloc(num_threads, sizeof(struct params));
-		if (receiver == NULL || sender == NULL)
-			goto nomem;
-	}
-
 	launchdelay.tv_sec = 0;
 	launchdelay.tv_nsec = 10000000; /* 10 ms */
 
@@ -623,55 +447,44 @@ int main(int argc, char *argv[])
 	for (i = 0; i < num_threads; i++) {
 		struct sembuf sb = { 0, 0, 0};
 
-		receiver[i].mindiff = UINT_MAX;
-		receiver[i].maxdiff = 0;
-		receiver[i].sumdiff = 0.0;
+		receiver = (struct params *)ipc_receiver(param, i);
+		sender = (struct params *)ipc_sender(param, i);
 
 		if ((key = ftok(myfile, i)) == -1) {
 			perror("ftok");
 			goto nosem;
 		}
 
-		if ((receiver[i].semid = semget(key, 2, 0666 | IPC_CREAT)) == -1) {
+		if ((receiver->semid = semget(key, 2, 0666 | IPC_CREAT)) == -1) {
 			perror("semget");
 			goto nosem;
 		}
+		sender->semid = receiver->semid;
 
 		args.val = 1;
-		if (semctl(receiver[i].semid, SEM_WAIT_FOR_RECEIVER, SETVAL, args) == -1) {
+		if (semctl(receiver->semid, SEM_WAIT_FOR_RECEIVER, SETVAL, args) == -1) {
 			perror("semctl sema #0");
 			goto nosem;
 		}
 
-		if (semctl(receiver[i].semid, SEM_WAIT_FOR_SENDER, SETVAL, args) == -1) {
+		if (semctl(receiver->semid, SEM_WAIT_FOR_SENDER, SETVAL, args) == -1) {
 			perror("semctl sema #1");
 			goto nosem;
 		}
 
 		sb.sem_num = SEM_WAIT_FOR_RECEIVER;
 		sb.sem_op = SEM_LOCK;
-		semop(receiver[i].semid, &sb, 1);
+		semop(receiver->semid, &sb, 1);
 
 		sb.sem_num = SEM_WAIT_FOR_SENDER;
 		sb.sem_op = SEM_LOCK;
-		semop(receiver[i].semid, &sb, 1);
+		semop(receiver->semid, &sb, 1);
 
-		receiver[i].cpu = i;
-		switch (setaffinity) {
-		case AFFINITY_UNSPECIFIED: receiver[i].cpu = -1; break;
-		case AFFINITY_SPECIFIED: receiver[i].cpu = affinity; break;
-		case AFFINITY_USEALL: receiver[i].cpu = i % max_cpus; break;
-		}
-		receiver[i].priority = priority;
-		receiver[i].tracelimit = tracelimit;
+		ipc_pair_init(param, i, ipc_cpu(setaffinity, affinity, i),
+			      priority, interval, max_cycles, tracelimit);
 		if (priority > 1 && !sameprio)
 			priority--;
-		receiver[i].delay.tv_sec = interval / USEC_PER_SEC;
-		receiver[i].delay.tv_nsec = (interval % USEC_PER_SEC) * 1000;
 		interval += distance;
-		receiver[i].max_cycles = max_cycles;
-		receiver[i].sender = 0;
-		receiver[i].neighbor = &sender[i];
 		if (mustfork) {
 			pid_t pid = fork();
 			if (pid == -1) {
@@ -680,8 +493,7 @@ int main(int argc, char *argv[])
 			} else if (pid == 0) {
 				char *args[3];
 
-				receiver[i].num_threads = num_threads;
-				receiver[i].pid = getpid();
+				receiver->ipc.pid = getpid();
 				sprintf(f_opt, "-fr%d", i);
 				args[0] = argv[0];
 				args[1] = f_opt;
@@ -692,14 +504,11 @@ int main(int argc, char *argv[])
 				    "#%d\n", i);
 			}
 		} else
-			pthread_create(&receiver[i].threadid, NULL,
-			    semathread, &receiver[i]);
+			pthread_create(&receiver->ipc.threadid, NULL,
+			    ipc_thread, receiver);
 
 		nanosleep(&launchdelay, NULL);
 
-		memcpy(&sender[i], &receiver[i], sizeof(receiver[0]));
-		sender[i].sender = 1;
-		sender[i].neighbor = &receiver[i];
 		if (mustfork) {
 			pid_t pid = fork();
 			if (pid == -1) {
@@ -708,8 +517,7 @@ int main(int argc, char *argv[])
 			} else if (pid == 0) {
 				char *args[3];
 
-				sender[i].num_threads = num_threads;
-				sender[i].pid = getpid();
+				sender->ipc.pid = getpid();
 				sprintf(f_opt, "-fs%d", i);
 				args[0] = argv[0];
 				args[1] = f_opt;
@@ -720,17 +528,17 @@ int main(int argc, char *argv[])
 				    "#%d\n", i);
 			}
 		} else
-			pthread_create(&sender[i].threadid, NULL, semathread,
-			    &sender[i]);
+			pthread_create(&sender->ipc.threadid, NULL, ipc_thread,
+			    sender);
 	}
 
+	receiver = (struct params *)ipc_receiver(param, 0);
+
 	while (!mustshutdown) {
-		for (i = 0; i < num_threads; i++)
-			mustshutdown |= receiver[i].shutdown |
-			    sender[i].shutdown;
+		mustshutdown |= ipc_should_stop(param);
 
-		if (receiver[0].samples > oldsamples || mustshutdown) {
-			print_stat(stdout, receiver, sender, 0, quiet);
+		if (receiver->ipc.samples > oldsamples || mustshutdown) {
+			ipc_print_stat(param, quiet);
 			if (!quiet)
 				printf("\033[%dA", num_threads*2);
 		}
@@ -750,46 +558,44 @@ int main(int argc, char *argv[])
 	if (!quiet)
 		printf("\033[%dB", num_threads*2 + 2);
 	else
-		print_stat(stdout, receiver, sender, 0, 0);
+		ipc_print_stat(param, 0);
+	ipc_print_percentiles(param);
 
-	for (i = 0; i < num_threads; i++) {
-		receiver[i].shutdown = 1;
-		sender[i].shutdown = 1;
-	}
-	nanosleep(&receiver[0].delay, NULL);
+	ipc_stop(param);
+	nanosleep(&receiver->ipc.delay, NULL);
 
 	for (i = 0; i < num_threads; i++) {
-		if (!receiver[i].stopped) {
+		struct ipc_params *r = ipc_receiver(param, i);
+		struct ipc_params *s = ipc_sender(param, i);
+
+		if (!r->stopped) {
 			if (mustfork)
-				kill(receiver[i].pid, SIGTERM);
+				kill(r->pid, SIGTERM);
 			else
-				pthread_kill(receiver[i].threadid, SIGTERM);
+				pthread_kill(r->threadid, SIGTERM);
 		}
-		if (!sender[i].stopped) {
+		if (!s->stopped) {
 			if (mustfork)
-				kill(sender[i].pid, SIGTERM);
+				kill(s->pid, SIGTERM);
 			else
-				pthread_kill(sender[i].threadid, SIGTERM);
+				pthread_kill(s->threadid, SIGTERM);
 		}
 	}
 
-	if (strlen(jsonfile) != 0) {
-		struct params_stats ps = {
-			.receiver = receiver,
-			.sender = sender,
-		};
-		rt_write_json(jsonfile, 0, write_stats, &ps);
-	}
+	if (*exportspec)
+		ipc_export_stop();
 
-nosem:
-	for (i = 0; i < num_threads; i++)
-		semctl(receiver[i].semid, -1, IPC_RMID);
+	if (strlen(jsonfile) != 0)
+		rt_write_json(jsonfile, 0, ipc_write_stats, param);
 
-nomem:
-	if (mustfork) {
-		munmap(param, totalsize);
-		shm_unlink("/sigwaittest");
+nosem:
+	for (i = 0; i < num_threads; i++) {
+		receiver = (struct params *)ipc_receiver(param, i);
+		semctl(receiver->semid, -1, IPC_RMID);
 	}
 
+	if (mustfork)
+		ipc_free(param, SHM_NAME);
+
 	return 0;
 }